@@ -0,0 +1,242 @@
+/* Standalone driver of fuzz_parser.c for compilers without libFuzzer.
+ *
+ *   fuzz_parser file...        run given inputs (e.g. crashes, AFL queue)
+ *   fuzz_parser < file         run input from stdin
+ *   fuzz_parser -n N [-s seed] run N generated inputs
+ *
+ * Generated inputs are streams of valid RTU/ASCII query or response
+ * frames (exceptions included) mixed with garbage, unknown functions and
+ * random corruptions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "modbus.h"
+
+#define MAX_INPUT 8192
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static uint8_t input[MAX_INPUT];
+static uint32_t rng;
+
+static uint32_t
+next_rand(void)
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+/* Byte count and data */
+static size_t
+gen_data(uint8_t* buf)
+{
+  int count = next_rand() % 16 == 0 ? next_rand() % 256 : next_rand() % 16;
+
+  buf[0] = count;
+  for (int i = 0; i < count; i++)
+    buf[1 + i] = next_rand();
+  return 1 + count;
+}
+
+/* Binary query frame with valid CRC, return its length */
+static size_t
+gen_query(uint8_t* buf)
+{
+  static const uint8_t funcs[] = { 1, 2, 3, 4, 5, 6, 15, 16, 23 };
+  uint16_t crc;
+  size_t n = 0;
+
+  buf[n++] = next_rand();
+  buf[n++] = funcs[next_rand() % sizeof(funcs)];
+
+  /* Address and quantity or value, write address and quantity */
+  for (int i = buf[1] == 23 ? 8 : 4; i > 0; i--)
+    buf[n++] = next_rand();
+  if (buf[1] >= 15)
+    n += gen_data(buf + n);
+
+  crc = modbus_calc_crc(buf, n);
+  buf[n++] = crc & 0xFF;
+  buf[n++] = crc >> 8;
+  return n;
+}
+
+/* Binary response frame with valid CRC, return its length */
+static size_t
+gen_frame(uint8_t* buf)
+{
+  static const uint8_t funcs[] = { 1, 2, 3, 4, 5, 6, 15, 16, 23 };
+  uint16_t crc;
+  size_t n = 0;
+
+  buf[n++] = next_rand();
+  buf[n++] = funcs[next_rand() % sizeof(funcs)];
+  if (next_rand() % 8 == 0)
+    buf[1] |= 0x80; /* Exception */
+
+  switch (buf[1]) {
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 23:
+      n += gen_data(buf + n);
+      break;
+
+    case 5:
+    case 6:
+    case 15:
+    case 16:
+      for (int i = 0; i < 4; i++)
+        buf[n++] = next_rand();
+      break;
+
+    default:
+      buf[n++] = 1 + next_rand() % 4;
+      break;
+  }
+
+  crc = modbus_calc_crc(buf, n);
+  buf[n++] = crc & 0xFF;
+  buf[n++] = crc >> 8;
+  return n;
+}
+
+static size_t
+ascii_frame(uint8_t* out, const uint8_t* frame, size_t len)
+{
+  static const char digits[] = "0123456789ABCDEF";
+  size_t n = 0;
+  uint8_t lrc;
+
+  len -= 2; /* Drop CRC */
+  lrc = modbus_calc_lrc(frame, len);
+
+  out[n++] = ':';
+  for (size_t i = 0; i <= len; i++) {
+    uint8_t b = i < len ? frame[i] : lrc;
+    out[n++] = digits[b >> 4];
+    out[n++] = digits[b & 0xF];
+  }
+  out[n++] = '\r';
+  out[n++] = '\n';
+  return n;
+}
+
+static size_t
+gen_input(void)
+{
+  uint8_t frame[600];
+  uint8_t text[600];
+  size_t size = 6;
+  size_t len;
+  int ascii = next_rand() & 1;
+  int query = next_rand() & 1;
+  int nframes = 1 + next_rand() % 8;
+
+  input[0] = ascii | query << 1;
+  input[1] = next_rand() % 4 == 0 ? next_rand() % 64 : 0xFF;
+  for (int i = 2; i < 6; i++)
+    input[i] = next_rand();
+
+  for (int f = 0; f < nframes; f++) {
+    switch (next_rand() % 8) {
+      case 0:
+        /* Garbage */
+        len = next_rand() % 16;
+        for (size_t i = 0; i < len; i++)
+          frame[i] = ascii && next_rand() % 2
+                       ? "0123456789:\r\nG"[next_rand() % 14]
+                       : next_rand();
+        break;
+
+      case 1:
+        /* Unknown function */
+        frame[0] = next_rand();
+        frame[1] = next_rand() % 2 ? 0x7F - next_rand() % 8 : 0x80;
+        len = 2;
+        break;
+
+      default:
+        len = query ? gen_query(frame) : gen_frame(frame);
+        if (ascii) {
+          len = ascii_frame(text, frame, len);
+          memcpy(frame, text, len);
+        }
+        break;
+    }
+
+    /* Corrupt a few bytes */
+    if (len > 0 && next_rand() % 4 == 0) {
+      for (int i = next_rand() % 3; i >= 0; i--)
+        frame[next_rand() % len] ^= 1 << (next_rand() % 8);
+    }
+
+    if (size + len > MAX_INPUT)
+      break;
+    memcpy(input + size, frame, len);
+    size += len;
+  }
+
+  return size;
+}
+
+static int
+run_file(FILE* f)
+{
+  size_t size = fread(input, 1, sizeof(input), f);
+
+  LLVMFuzzerTestOneInput(input, size);
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned long n = 0;
+  unsigned long seed = 1;
+  FILE* f;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n count] [-s seed] [file...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (n > 0) {
+    rng = seed ? seed : 1;
+    for (unsigned long i = 0; i < n; i++)
+      LLVMFuzzerTestOneInput(input, gen_input());
+    printf("%lu inputs OK\n", n);
+    return 0;
+  }
+
+  if (optind == argc)
+    return run_file(stdin);
+
+  for (int i = optind; i < argc; i++) {
+    f = fopen(argv[i], "rb");
+    if (f == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    run_file(f);
+    fclose(f);
+  }
+
+  return 0;
+}
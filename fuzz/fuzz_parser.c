@@ -0,0 +1,870 @@
+/* Differential fuzzing target for the parser and CRC kernels.
+ *
+ * Input layout:
+ *   byte 0     bit 0: ASCII framing, bit 1: queries
+ *   byte 1     index of callback which returns non-zero, >= 64 for none
+ *   byte 2..5  seed of split points
+ *   byte 6..   stream of frames
+ *
+ * The stream is fed to modbus_parser_execute in random chunks, the parser
+ * is re-initialized after each completed or failed frame, like a real
+ * application does. The trace of callbacks (with parser fields) and
+ * consumed counts must be identical to a simple reference parser fed
+ * with the same chunks, and the callbacks must not depend on chunking.
+ * Every CRC kernel (single and batch) is compared with a bitwise
+ * reference, and RTU/TCP translation of the stream taken as one frame
+ * must round trip.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus.h"
+#include "modbus_gateway.h"
+
+#define MAX_INPUT 8192
+#define MAX_EVENTS (MAX_INPUT * 2 + 16)
+#define MAX_CALLS (MAX_INPUT + 16)
+
+enum event_id
+{
+  EV_SLAVE_ADDR,
+  EV_FUNCTION,
+  EV_ADDR,
+  EV_QTY,
+  EV_DATA_LEN,
+  EV_DATA_START,
+  EV_DATA_END,
+  EV_CRC_ERROR,
+  EV_COMPLETE,
+  EV_RESET
+};
+
+struct event
+{
+  uint8_t id;
+  uint8_t slave_addr;
+  uint8_t function;
+  uint8_t data_len;
+  uint16_t addr;
+  uint16_t qty;
+  uint16_t write_addr;
+  uint16_t frame_crc;
+  uint16_t calc_crc;
+  uint32_t data_hash;
+};
+
+struct call
+{
+  size_t nparsed;
+  int error;
+};
+
+struct trace
+{
+  size_t nevents;
+  size_t ncalls;
+  int ncallbacks;
+  int abort_at;
+  struct event events[MAX_EVENTS];
+  struct call calls[MAX_CALLS];
+};
+
+/* Parser state as seen by the callbacks */
+struct snapshot
+{
+  uint8_t slave_addr;
+  uint8_t function;
+  uint8_t data_len;
+  uint16_t addr;
+  uint16_t qty;
+  uint16_t write_addr;
+  uint16_t frame_crc;
+  uint16_t calc_crc;
+  const uint8_t* data;
+};
+
+static struct trace trace_split;
+static struct trace trace_ref;
+static struct trace trace_whole;
+
+static void
+fail(const char* what)
+{
+  fprintf(stderr, "fuzz_parser: %s\n", what);
+  abort();
+}
+
+static uint32_t
+hash(const uint8_t* p, size_t n)
+{
+  uint32_t h = 2166136261u;
+
+  while (n--)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+/* Record event, return non-zero if the callback must fail */
+static int
+record(struct trace* t, int id, const struct snapshot* s)
+{
+  struct event* e;
+
+  if (t->nevents == MAX_EVENTS)
+    fail("too many events");
+
+  e = &t->events[t->nevents++];
+  memset(e, 0, sizeof(*e));
+  e->id = id;
+
+  if (id == EV_RESET)
+    return 0;
+
+  e->slave_addr = s->slave_addr;
+  e->function = s->function;
+  e->data_len = s->data_len;
+  e->addr = s->addr;
+  e->qty = s->qty;
+  e->write_addr = s->write_addr;
+
+  if (id == EV_DATA_END)
+    e->data_hash = hash(s->data, s->data_len);
+
+  /* Intermediate CRC value is an implementation detail */
+  if (id == EV_CRC_ERROR || id == EV_COMPLETE) {
+    e->frame_crc = s->frame_crc;
+    e->calc_crc = s->calc_crc;
+  }
+
+  return t->ncallbacks++ == t->abort_at;
+}
+
+/*
+ * Reference implementations
+ */
+
+static uint16_t
+ref_crc_update(uint16_t crc, uint8_t b)
+{
+  crc ^= b;
+  for (int i = 0; i < 8; i++)
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  return crc;
+}
+
+static uint16_t
+ref_crc(const uint8_t* p, size_t n)
+{
+  uint16_t crc = 0xFFFF;
+
+  while (n--)
+    crc = ref_crc_update(crc, *p++);
+  return crc;
+}
+
+enum ref_role
+{
+  R_SLAVE,
+  R_FUNC,
+  R_LEN,
+  R_ADDR_HI,
+  R_ADDR_LO,
+  R_QTY_HI,
+  R_QTY_LO,
+  R_WADDR_HI,
+  R_WADDR_LO,
+  R_WQTY,
+  R_DATA,
+  R_CRC_LO,
+  R_CRC_HI
+};
+
+enum ref_layout
+{
+  L_UNKNOWN,
+  L_READ,         /* slave func count data[count] crc */
+  L_WRITE_SINGLE, /* slave func addr data[2] crc */
+  L_WRITE_MULTI,  /* slave func addr qty crc */
+  L_EXCEPTION,    /* slave func|0x80 data[1] crc */
+  L_WRITE_DATA,   /* slave func addr qty count data[count] crc */
+  L_READ_WRITE    /* slave func addr qty waddr wqty count data[count] crc */
+};
+
+struct ref_parser
+{
+  int ascii;
+  int query;
+  struct trace* trace;
+  struct snapshot s;
+
+  int pos;  /* Bytes of binary frame */
+  int fpos;   /* Position of the accepted function code */
+  int dstart; /* Position of data after function code */
+  int dlen;   /* Length of data phase */
+  enum ref_layout layout;
+  int error;
+  int complete;
+
+  int astate; /* 0 ':', 1 high digit, 2 low digit, 3 CR, 4 LF */
+  uint8_t nibble;
+  uint8_t sum;
+  uint8_t abuf[256];
+};
+
+static enum ref_layout
+ref_query_layout_of(uint8_t f)
+{
+  switch (f) {
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+      return L_WRITE_MULTI;
+    case 5:
+    case 6:
+      return L_WRITE_SINGLE;
+    case 15:
+    case 16:
+      return L_WRITE_DATA;
+    case 23:
+      return L_READ_WRITE;
+  }
+  return L_UNKNOWN;
+}
+
+static enum ref_layout
+ref_layout_of(uint8_t f)
+{
+  switch (f) {
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 23:
+      return L_READ;
+    case 5:
+    case 6:
+      return L_WRITE_SINGLE;
+    case 15:
+    case 16:
+      return L_WRITE_MULTI;
+  }
+  if (f & 0x80 && ref_layout_of(f & 0x7F) != L_UNKNOWN)
+    return L_EXCEPTION;
+  return L_UNKNOWN;
+}
+
+/* Role of k-th byte after function code in address and quantity
+ * fields
+ */
+static enum ref_role
+ref_header_role(int k)
+{
+  static const enum ref_role roles[] = {
+    R_FUNC,     R_ADDR_HI, R_ADDR_LO, R_QTY_HI, R_QTY_LO,
+    R_WADDR_HI, R_WADDR_LO, R_WQTY,   R_WQTY
+  };
+
+  return roles[k];
+}
+
+/* Role of next binary byte and its index inside data */
+static enum ref_role
+ref_role(const struct ref_parser* r, int* data_index)
+{
+  int k = r->pos - r->fpos;
+  int lenk;
+
+  if (r->pos == 0)
+    return R_SLAVE;
+  if (r->layout == L_UNKNOWN)
+    return R_FUNC;
+
+  switch (r->layout) {
+    case L_READ:
+    case L_WRITE_DATA:
+    case L_READ_WRITE:
+      /* Byte count follows the header fields */
+      lenk = r->layout == L_READ ? 1 : r->layout == L_WRITE_DATA ? 5 : 9;
+      if (k < lenk)
+        return ref_header_role(k);
+      if (k == lenk)
+        return R_LEN;
+      if (k <= lenk + r->dlen) {
+        *data_index = k - lenk - 1;
+        return R_DATA;
+      }
+      return k == lenk + 1 + r->dlen ? R_CRC_LO : R_CRC_HI;
+
+    case L_WRITE_SINGLE:
+      if (k == 1)
+        return R_ADDR_HI;
+      if (k == 2)
+        return R_ADDR_LO;
+      if (k <= 4) {
+        *data_index = k - 3;
+        return R_DATA;
+      }
+      return k == 5 ? R_CRC_LO : R_CRC_HI;
+
+    case L_EXCEPTION:
+      if (k == 1) {
+        *data_index = 0;
+        return R_DATA;
+      }
+      return k == 2 ? R_CRC_LO : R_CRC_HI;
+
+    default:
+      if (k == 1)
+        return R_ADDR_HI;
+      if (k == 2)
+        return R_ADDR_LO;
+      if (k == 3)
+        return R_QTY_HI;
+      if (k == 4)
+        return R_QTY_LO;
+      return k == 5 ? R_CRC_LO : R_CRC_HI;
+  }
+}
+
+static void
+ref_notify(struct ref_parser* r, int id)
+{
+  if (record(r->trace, id, &r->s))
+    r->error = 1;
+}
+
+static void
+ref_complete(struct ref_parser* r)
+{
+  r->complete = 1;
+  if (r->s.frame_crc != r->s.calc_crc) {
+    r->error = 1;
+    ref_notify(r, EV_CRC_ERROR);
+  }
+  ref_notify(r, EV_COMPLETE);
+}
+
+/* Binary byte, at points to it (to data buffer in ASCII framing) */
+static void
+ref_byte(struct ref_parser* r, enum ref_role role, const uint8_t* at)
+{
+  uint8_t b = *at;
+
+  if (!r->ascii && role < R_CRC_LO)
+    r->s.calc_crc = ref_crc_update(r->s.calc_crc, b);
+
+  switch (role) {
+    case R_SLAVE:
+      r->s.slave_addr = b;
+      r->pos++;
+      ref_notify(r, EV_SLAVE_ADDR);
+      break;
+
+    case R_FUNC:
+      r->s.function = b;
+      r->layout = r->query ? ref_query_layout_of(b) : ref_layout_of(b);
+      r->fpos = r->pos++;
+      if (r->layout == L_EXCEPTION) {
+        r->s.data_len = 1;
+        r->dlen = 1;
+        r->dstart = 1;
+      }
+      ref_notify(r, EV_FUNCTION);
+      if (r->layout == L_UNKNOWN)
+        r->error = 1;
+      break;
+
+    case R_LEN:
+      r->s.data_len = b;
+      r->pos++;
+      if (b == 0) {
+        r->error = 1; /* No data field */
+        break;
+      }
+      r->dlen = b;
+      r->dstart = r->pos - r->fpos;
+      ref_notify(r, EV_DATA_LEN);
+      break;
+
+    case R_ADDR_HI:
+      r->s.addr = b << 8;
+      r->pos++;
+      break;
+
+    case R_ADDR_LO:
+      r->s.addr += b;
+      r->pos++;
+      if (r->layout == L_WRITE_SINGLE) {
+        r->s.data_len = 2;
+        r->dlen = 2;
+        r->dstart = 3;
+      }
+      ref_notify(r, EV_ADDR);
+      break;
+
+    case R_QTY_HI:
+      r->s.qty = b << 8;
+      r->pos++;
+      break;
+
+    case R_QTY_LO:
+      r->s.qty += b;
+      r->pos++;
+      ref_notify(r, EV_QTY);
+      break;
+
+    case R_WADDR_HI:
+      r->s.write_addr = b << 8;
+      r->pos++;
+      break;
+
+    case R_WADDR_LO:
+      r->s.write_addr += b;
+      r->pos++;
+      break;
+
+    case R_WQTY:
+      r->pos++; /* Follows from byte count */
+      break;
+
+    case R_DATA: {
+      int first = (r->pos - r->fpos) == r->dstart;
+      int last = (r->pos - r->fpos) == r->dstart + r->dlen - 1;
+
+      if (first) {
+        r->s.data = at;
+        ref_notify(r, EV_DATA_START);
+      }
+      r->pos++;
+      if (last)
+        ref_notify(r, EV_DATA_END);
+    } break;
+
+    case R_CRC_LO:
+      r->s.frame_crc = b;
+      r->pos++;
+      break;
+
+    case R_CRC_HI:
+      r->s.frame_crc += b << 8;
+      r->pos++;
+      ref_complete(r);
+      break;
+  }
+}
+
+static int
+ref_hex(uint8_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+static void
+ref_ascii_byte(struct ref_parser* r, uint8_t b)
+{
+  int index = 0;
+  enum ref_role role = ref_role(r, &index);
+
+  if (role == R_CRC_LO) {
+    r->s.frame_crc = b;
+    r->s.calc_crc = (uint8_t)-r->sum;
+    r->astate = 3;
+    return;
+  }
+
+  r->sum += b;
+  r->abuf[index] = b;
+  ref_byte(r, role, &r->abuf[index]);
+}
+
+/* Consume single character of ASCII stream, return 0 if it's rejected */
+static int
+ref_ascii_char(struct ref_parser* r, uint8_t c)
+{
+  int v;
+
+  switch (r->astate) {
+    case 0:
+      if (c == ':')
+        r->astate = 1;
+      return 1;
+
+    case 1:
+    case 2:
+      v = ref_hex(c);
+      if (v < 0) {
+        r->error = 1;
+        return 0;
+      }
+      if (r->astate == 1) {
+        r->nibble = v;
+        r->astate = 2;
+      } else {
+        r->astate = 1;
+        ref_ascii_byte(r, (r->nibble << 4) | v);
+      }
+      return 1;
+
+    case 3:
+      if (c != '\r') {
+        r->error = 1;
+        return 0;
+      }
+      r->astate = 4;
+      return 1;
+
+    default:
+      if (c != '\n') {
+        r->error = 1;
+        return 0;
+      }
+      ref_complete(r);
+      return 1;
+  }
+}
+
+static void
+ref_init(struct ref_parser* r, int ascii, int query, struct trace* t)
+{
+  memset(r, 0, sizeof(*r));
+  r->ascii = ascii;
+  r->query = query;
+  r->trace = t;
+  r->s.calc_crc = ascii ? 0 : 0xFFFF;
+}
+
+static size_t
+ref_execute(struct ref_parser* r, const uint8_t* data, size_t len)
+{
+  size_t n;
+  int index;
+
+  for (n = 0; n < len; n++) {
+    if (r->error || r->complete)
+      break;
+
+    if (r->ascii) {
+      if (!ref_ascii_char(r, data[n]))
+        break;
+    } else {
+      ref_byte(r, ref_role(r, &index), &data[n]);
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Parser under test
+ */
+
+static void
+snapshot_of(const modbus_parser* p, struct snapshot* s)
+{
+  s->slave_addr = p->slave_addr;
+  s->function = p->function;
+  s->data_len = p->data_len;
+  s->addr = p->addr;
+  s->qty = p->qty;
+  s->write_addr = p->write_addr;
+  s->frame_crc = p->frame_crc;
+  s->calc_crc = p->calc_crc;
+  s->data = p->data;
+
+  /* Input is a single buffer, however it's split */
+  if (p->data_wrap != NULL)
+    fail("data_wrap set for contiguous input");
+}
+
+#define FUZZ_CB(NAME, ID)                                                      \
+  static int on_##NAME(modbus_parser* p)                                       \
+  {                                                                            \
+    struct snapshot s;                                                         \
+    snapshot_of(p, &s);                                                        \
+    return record(p->arg, ID, &s);                                             \
+  }
+
+FUZZ_CB(slave_addr, EV_SLAVE_ADDR)
+FUZZ_CB(function, EV_FUNCTION)
+FUZZ_CB(addr, EV_ADDR)
+FUZZ_CB(qty, EV_QTY)
+FUZZ_CB(data_len, EV_DATA_LEN)
+FUZZ_CB(data_start, EV_DATA_START)
+FUZZ_CB(data_end, EV_DATA_END)
+FUZZ_CB(crc_error, EV_CRC_ERROR)
+FUZZ_CB(complete, EV_COMPLETE)
+
+static const modbus_parser_settings fuzz_settings = {
+  .on_slave_addr = on_slave_addr,
+  .on_function = on_function,
+  .on_addr = on_addr,
+  .on_qty = on_qty,
+  .on_data_len = on_data_len,
+  .on_data_start = on_data_start,
+  .on_data_end = on_data_end,
+  .on_crc_error = on_crc_error,
+  .on_complete = on_complete,
+};
+
+static uint32_t
+next_rand(uint32_t* state)
+{
+  /* xorshift32 */
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static size_t
+next_chunk(uint32_t* state, size_t remaining, int whole)
+{
+  size_t n;
+
+  if (whole)
+    return remaining;
+
+  n = next_rand(state);
+  n = (n & 7) == 0 ? remaining : 1 + (n >> 3) % 24;
+  return n < remaining ? n : remaining;
+}
+
+static void
+trace_init(struct trace* t, int abort_at)
+{
+  t->nevents = 0;
+  t->ncalls = 0;
+  t->ncallbacks = 0;
+  t->abort_at = abort_at;
+}
+
+static void
+trace_call(struct trace* t, size_t nparsed, int error)
+{
+  if (t->ncalls == MAX_CALLS)
+    fail("too many calls");
+  t->calls[t->ncalls].nparsed = nparsed;
+  t->calls[t->ncalls].error = error;
+  t->ncalls++;
+}
+
+static void
+run_parser(struct trace* t,
+           int ascii,
+           int query,
+           uint32_t seed,
+           int whole,
+           const uint8_t* data,
+           size_t len)
+{
+  enum modbus_parser_type type = query ? MODBUS_QUERY : MODBUS_RESPONSE;
+  enum modbus_framing framing =
+    ascii ? MODBUS_FRAMING_ASCII : MODBUS_FRAMING_RTU;
+  modbus_parser parser = { 0 };
+  size_t pos = 0;
+  size_t n;
+  int done;
+
+  parser.arg = t;
+  modbus_parser_init_framing(&parser, type, framing);
+
+  while (pos < len) {
+    n = modbus_parser_execute(
+      &parser, &fuzz_settings, data + pos, next_chunk(&seed, len - pos, whole));
+    trace_call(t, n, parser.errno != 0);
+    pos += n;
+
+    done = parser.state == s_complete || parser.errno != 0;
+    if (n == 0 && !done)
+      fail("parser made no progress");
+
+    if (done) {
+      record(t, EV_RESET, NULL);
+      modbus_parser_init_framing(&parser, type, framing);
+    }
+  }
+}
+
+static void
+run_ref(struct trace* t,
+        int ascii,
+        int query,
+        uint32_t seed,
+        const uint8_t* data,
+        size_t len)
+{
+  static struct ref_parser r;
+  size_t pos = 0;
+  size_t n;
+  int done;
+
+  ref_init(&r, ascii, query, t);
+
+  while (pos < len) {
+    n = ref_execute(&r, data + pos, next_chunk(&seed, len - pos, 0));
+    trace_call(t, n, r.error);
+    pos += n;
+
+    done = r.complete || r.error;
+    if (n == 0 && !done)
+      fail("reference made no progress");
+
+    if (done) {
+      record(t, EV_RESET, NULL);
+      ref_init(&r, ascii, query, t);
+    }
+  }
+}
+
+static void
+compare_events(const struct trace* a, const struct trace* b, const char* what)
+{
+  if (a->nevents != b->nevents)
+    fail(what);
+
+  for (size_t i = 0; i < a->nevents; i++) {
+    if (memcmp(&a->events[i], &b->events[i], sizeof(struct event)) != 0) {
+      fprintf(stderr,
+              "event %d: id %d/%d slave %d/%d func %d/%d\n",
+              (int)i,
+              a->events[i].id,
+              b->events[i].id,
+              a->events[i].slave_addr,
+              b->events[i].slave_addr,
+              a->events[i].function,
+              b->events[i].function);
+      fail(what);
+    }
+  }
+}
+
+static void
+check_crc(const uint8_t* data, size_t len)
+{
+  const uint8_t* spans[16] = { 0 };
+  size_t sizes[16] = { 0 };
+  uint16_t crcs[16];
+  size_t nspans;
+  uint16_t crc;
+  uint8_t lrc;
+
+  /* Every start offset, to catch alignment dependent paths */
+  for (size_t off = 0; off < len && off < 16; off++) {
+    if (modbus_calc_crc(data + off, len - off) != ref_crc(data + off, len - off))
+      fail("modbus_calc_crc mismatch");
+  }
+
+  /* Batch of overlapping spans, lengths vary inside a group of lanes */
+  nspans = len < 16 ? len : 16;
+  for (size_t i = 0; i < nspans; i++) {
+    spans[i] = data + i;
+    sizes[i] = (len - i) >> (i % 3);
+  }
+  modbus_calc_crc_batch(spans, sizes, crcs, nspans);
+  for (size_t i = 0; i < nspans; i++) {
+    if (crcs[i] != ref_crc(spans[i], sizes[i]))
+      fail("modbus_calc_crc_batch mismatch");
+  }
+
+  crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++)
+    modbus_crc_update(&crc, data[i]);
+  if (crc != ref_crc(data, len))
+    fail("modbus_crc_update mismatch");
+
+  lrc = 0;
+  for (size_t i = 0; i < len; i++)
+    lrc += data[i];
+  if (modbus_calc_lrc(data, len) != (uint8_t)-lrc)
+    fail("modbus_calc_lrc mismatch");
+}
+
+/* Input as unit id + PDU: RTU -> TCP -> RTU must give back the same
+ * frame
+ */
+static void
+check_gateway(const uint8_t* data, size_t len, uint16_t tid)
+{
+  uint8_t buf[MODBUS_TCP_HEADROOM + 256];
+  uint8_t* rtu = buf + MODBUS_TCP_HEADROOM;
+  uint16_t crc;
+  uint16_t out_tid;
+  int n;
+
+  if (len < 2 || len > 254)
+    return;
+
+  crc = ref_crc(data, len);
+  memcpy(rtu, data, len);
+  rtu[len] = crc & 0xFF;
+  rtu[len + 1] = crc >> 8;
+
+  n = modbus_rtu_to_tcp(rtu, len + 2, tid);
+  if (n != MODBUS_TCP_HEADROOM + len)
+    fail("modbus_rtu_to_tcp rejected valid frame");
+
+  memset(rtu + len, 0, 2);
+  if (modbus_tcp_to_rtu(buf, n, sizeof(buf), &out_tid) != len + 2 ||
+      out_tid != tid)
+    fail("modbus_tcp_to_rtu rejected valid frame");
+  if (memcmp(rtu, data, len) != 0 || rtu[len] != (crc & 0xFF) ||
+      rtu[len + 1] != crc >> 8)
+    fail("gateway round trip changed frame");
+
+  /* Any corrupted byte is caught by CRC */
+  rtu[len / 2] ^= 0x01;
+  if (modbus_rtu_to_tcp(rtu, len + 2, tid) != -1)
+    fail("modbus_rtu_to_tcp accepted bad CRC");
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  int ascii;
+  int query;
+  int abort_at;
+  uint32_t seed;
+
+  if (size < 6 || size > MAX_INPUT)
+    return 0;
+
+  ascii = data[0] & 1;
+  query = (data[0] >> 1) & 1;
+  abort_at = data[1] < 64 ? data[1] : -1;
+  seed = data[2] | data[3] << 8 | data[4] << 16 | (uint32_t)data[5] << 24;
+  if (seed == 0)
+    seed = 1;
+  data += 6;
+  size -= 6;
+
+  check_crc(data, size);
+  check_gateway(data, size, seed);
+
+  trace_init(&trace_split, abort_at);
+  run_parser(&trace_split, ascii, query, seed, 0, data, size);
+
+  trace_init(&trace_ref, abort_at);
+  run_ref(&trace_ref, ascii, query, seed, data, size);
+
+  compare_events(&trace_split, &trace_ref, "trace differs from reference");
+  if (trace_split.ncalls != trace_ref.ncalls ||
+      memcmp(trace_split.calls,
+             trace_ref.calls,
+             trace_split.ncalls * sizeof(struct call)) != 0)
+    fail("consumed counts differ from reference");
+
+  trace_init(&trace_whole, abort_at);
+  run_parser(&trace_whole, ascii, query, seed, 1, data, size);
+
+  compare_events(&trace_split, &trace_whole, "trace depends on chunking");
+
+  return 0;
+}
@@ -9,11 +9,24 @@
 #define MODBUS_PARSER_VERSION_MINOR 1
 #define MODBUS_PARSER_VERSION_PATCH 0
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define MODBUS_COIL_HIGH 0xFF00
 #define MODBUS_COIL_LOW 0x0000
 
 #define MODBUS_COILS_BYTE_LEN(qty) ((qty / 8) + ((qty % 8) > 0))
 
+/* Store big-endian word v at p, return p + 2 */
+static inline uint8_t*
+modbus_put_word(uint8_t* p, uint16_t v)
+{
+  *p++ = v >> 8;
+  *p++ = v & 0xFF;
+  return p;
+}
+
 typedef struct modbus_parser modbus_parser;
 typedef struct modbus_parser_settings modbus_parser_settings;
 
@@ -26,23 +39,87 @@ enum modbus_parser_type
   MODBUS_RESPONSE
 };
 
+enum modbus_framing
+{
+  MODBUS_FRAMING_RTU,
+  MODBUS_FRAMING_ASCII,
+  MODBUS_FRAMING_TCP /* MBAP header, unit id in slave_addr, no CRC */
+};
+
+/* Layout of frame after function code. Fields go in this order, each
+ * one is present if its flag is set.
+ */
+#define MODBUS_LAYOUT_ADDR 0x01   /* Address */
+#define MODBUS_LAYOUT_QTY 0x02    /* Quantity */
+#define MODBUS_LAYOUT_WRITE 0x04  /* Write address and write quantity */
+#define MODBUS_LAYOUT_VALUE 0x08  /* Single data word */
+#define MODBUS_LAYOUT_BYTES 0x10  /* Byte count and data */
+#define MODBUS_LAYOUT_PACKED 0x20 /* Data are bits, byte count from qty */
+#define MODBUS_LAYOUT_CODE 0x40   /* Exception code, single data byte */
+
+#define MODBUS_LAYOUT_RANGE (MODBUS_LAYOUT_ADDR | MODBUS_LAYOUT_QTY)
+#define MODBUS_LAYOUT_SINGLE (MODBUS_LAYOUT_ADDR | MODBUS_LAYOUT_VALUE)
+#define MODBUS_LAYOUT_REGS MODBUS_LAYOUT_BYTES
+#define MODBUS_LAYOUT_BITS (MODBUS_LAYOUT_BYTES | MODBUS_LAYOUT_PACKED)
+#define MODBUS_LAYOUT_WRITE_REGS (MODBUS_LAYOUT_RANGE | MODBUS_LAYOUT_REGS)
+#define MODBUS_LAYOUT_WRITE_BITS (MODBUS_LAYOUT_RANGE | MODBUS_LAYOUT_BITS)
+#define MODBUS_LAYOUT_READ_WRITE                                               \
+  (MODBUS_LAYOUT_RANGE | MODBUS_LAYOUT_WRITE | MODBUS_LAYOUT_REGS)
+
+/* Function code, name, description, layout of query and of response.
+ * Parser, generator and modbus_frame_len are driven by the layouts, a
+ * function with one of them is supported by adding a line here.
+ */
 #define MODBUS_FUNC_MAP(XX)                                                    \
-  XX(1, READ_COILS, "Read Coils")                                              \
-  XX(2, READ_DISCRETE_IN, "Read Discrete Inputs")                              \
-  XX(3, READ_HOLD_REG, "Read Holding Register")                                \
-  XX(4, READ_IN_REG, "Read Input Register")                                    \
-  XX(5, WRITE_COIL, "Wire Single Coil")                                        \
-  XX(6, WRITE_REG, "Write Single Register")                                    \
-  XX(15, WRITE_COILS, "Write Multiple Coils")                                  \
-  XX(16, WRITE_REGS, "Write Miltiple Registers")
+  XX(1, READ_COILS, "Read Coils", RANGE, BITS)                                 \
+  XX(2, READ_DISCRETE_IN, "Read Discrete Inputs", RANGE, BITS)                 \
+  XX(3, READ_HOLD_REG, "Read Holding Register", RANGE, REGS)                   \
+  XX(4, READ_IN_REG, "Read Input Register", RANGE, REGS)                       \
+  XX(5, WRITE_COIL, "Wire Single Coil", SINGLE, SINGLE)                        \
+  XX(6, WRITE_REG, "Write Single Register", SINGLE, SINGLE)                    \
+  XX(15, WRITE_COILS, "Write Multiple Coils", WRITE_BITS, RANGE)               \
+  XX(16, WRITE_REGS, "Write Miltiple Registers", WRITE_REGS, RANGE)            \
+  XX(23, READ_WRITE_REGS, "Read/Write Multiple Registers", READ_WRITE, REGS)
+
+/* Exception response: function code with this bit set and exception
+ * code. Recognized for functions of MODBUS_FUNC_MAP.
+ */
+#define MODBUS_EXCEPTION_BIT 0x80
+
+enum modbus_exception
+{
+  MODBUS_EXC_ILLEGAL_FUNCTION = 1,
+  MODBUS_EXC_ILLEGAL_DATA_ADDRESS = 2,
+  MODBUS_EXC_ILLEGAL_DATA_VALUE = 3,
+  MODBUS_EXC_SERVER_DEVICE_FAILURE = 4,
+  MODBUS_EXC_ACKNOWLEDGE = 5,
+  MODBUS_EXC_SERVER_DEVICE_BUSY = 6,
+  MODBUS_EXC_GATEWAY_PATH_UNAVAILABLE = 10,
+  MODBUS_EXC_GATEWAY_TARGET_FAILED = 11
+};
 
 enum modbus_func
 {
-#define XX(num, name, string) MODBUS_FUNC_##name = num,
+#define XX(num, name, string, query, response) MODBUS_FUNC_##name = num,
   MODBUS_FUNC_MAP(XX)
 #undef XX
 };
 
+/* Data tables of a slave */
+enum modbus_table
+{
+  MODBUS_TABLE_COILS,
+  MODBUS_TABLE_DISCRETE_IN,
+  MODBUS_TABLE_HOLD_REG,
+  MODBUS_TABLE_IN_REG
+};
+
+/* Bytes of count items of table in wire format: big-endian registers,
+ * bits packed least significant first
+ */
+#define MODBUS_TABLE_DATA_SIZE(table, count)                                   \
+  ((table) <= MODBUS_TABLE_DISCRETE_IN ? ((count) + 7) / 8 : (count)*2)
+
 /*
 #define MODBUS_ERRNO_MAP(XX)    \
   XX(CB_slave_addr, "the on_slave_addr callback failed")  \
@@ -64,11 +141,7 @@ enum modbus_parser_state
   s_func,
   s_len,
 
-  /* For Single reads */
-  s_single_addr_hi,
-  s_single_addr_lo,
-
-  /* For Multiplie reads */
+  /* Address */
   s_start_addr_hi,
   s_start_addr_lo,
 
@@ -76,13 +149,13 @@ enum modbus_parser_state
   s_qty_hi,
   s_qty_lo,
 
-  /* For Single reads */
-  /*
-  s_single_data_hi,
-  s_single_data_lo,
-  */
+  /* Write part of READ_WRITE_REGS query */
+  s_write_addr_hi,
+  s_write_addr_lo,
+  s_write_qty_hi,
+  s_write_qty_lo,
 
-  /* For Multiple reads */
+  /* Data, after byte count or of fixed length */
   s_data,
 
   /* NOTE: Don't edit order of these three elements,
@@ -93,28 +166,146 @@ enum modbus_parser_state
   s_complete
 };
 
+/* Character level states of ASCII framing. Decoded bytes are fed to the
+ * same state machine as RTU, LRC is checked instead of CRC.
+ */
+enum modbus_ascii_state
+{
+  s_ascii_start = 0, /* Waiting for ':' */
+  s_ascii_hi,        /* High nibble of next byte */
+  s_ascii_lo,        /* Low nibble of next byte */
+  s_ascii_cr,
+  s_ascii_lf
+};
+
+/* Maximum number of data bytes in a frame, limited by one-byte length */
+#define MODBUS_MAX_DATA_LEN 255
+
+/* Protocol limits of quantity, so that PDU fits into 253 bytes */
+#define MODBUS_MAX_READ_BITS 2000
+#define MODBUS_MAX_READ_REGS 125
+#define MODBUS_MAX_WRITE_BITS 1968
+#define MODBUS_MAX_WRITE_REGS 123
+#define MODBUS_MAX_RW_WRITE_REGS 121 /* Write part of READ_WRITE_REGS */
+
+#ifdef MODBUS_PARSER_STATS
+/* Parser counters, compiled in with MODBUS_PARSER_STATS.
+ * Attach to parser->stats, it's preserved by modbus_parser_init like arg,
+ * so it must be NULL or valid before the first init. Only one parser
+ * (thread) may update it, other threads read it with
+ * modbus_parser_stats_snapshot.
+ */
+struct modbus_parser_stats
+{
+  uint32_t seq; /* Odd while parser is updating counters */
+  uint64_t bytes;
+  uint64_t frames[256]; /* Completed frames per function code */
+  uint64_t crc_errors;
+  uint64_t resyncs;         /* Garbage skipped before start of frame */
+  uint64_t callback_aborts; /* Callbacks returned non-zero */
+  uint64_t carryovers;      /* Returned in the middle of a frame */
+};
+#endif
+
+#ifdef MODBUS_PARSER_PROFILE
+/* Callbacks, in order of modbus_parser_settings members */
+enum modbus_cb_type
+{
+  MODBUS_CB_SLAVE_ADDR,
+  MODBUS_CB_FUNCTION,
+  MODBUS_CB_ADDR,
+  MODBUS_CB_QTY,
+  MODBUS_CB_DATA_LEN,
+  MODBUS_CB_DATA_START,
+  MODBUS_CB_DATA_END,
+  MODBUS_CB_CRC_ERROR,
+  MODBUS_CB_COMPLETE,
+  MODBUS_CB_COUNT
+};
+
+/* Time spent in callbacks vs the parser, compiled in with
+ * MODBUS_PARSER_PROFILE. Attached to parser->profile like stats, and
+ * read by other threads with modbus_parser_profile_snapshot.
+ *
+ * Execute calls and callbacks are counted, and one in about interval of
+ * them (at random distances, so samples don't lock onto a pattern of
+ * calls) is timed: execute calls as a whole, callbacks by type and by
+ * function code of the frame (0 before on_function). Time of all calls
+ * of a kind is estimated as cycles * calls / samples, the parser's own
+ * time is that of execute calls minus the callbacks. Ticks are TSC
+ * cycles on x86, nanoseconds elsewhere.
+ *
+ * Only samples update seq, a snapshot has consistent samples and cycles;
+ * counts of calls may be a few calls apart.
+ */
+struct modbus_parser_profile
+{
+  uint32_t seq; /* Odd while parser is updating samples */
+  uint32_t interval;
+  uint32_t countdown;
+  uint32_t rng;
+  uint64_t executes;
+  uint64_t execute_samples;
+  uint64_t execute_cycles;
+  uint64_t calls[MODBUS_CB_COUNT];
+  uint64_t samples[MODBUS_CB_COUNT];
+  uint64_t cycles[MODBUS_CB_COUNT];
+  uint64_t func_samples[256];
+  uint64_t func_cycles[256];
+};
+#endif
+
 struct modbus_parser
 {
   /* PRIVATE */
   enum modbus_parser_type type;
   enum modbus_parser_state state;
+  enum modbus_framing framing;
+  enum modbus_ascii_state ascii_state;
+  uint8_t ascii_nibble;
   uint8_t data_cnt;
   uint8_t frame_start;
-  uint16_t frame_crc; /* CRC inside frame */
-  uint16_t calc_crc;  /* Calculated CRC */
+  uint16_t frame_crc; /* CRC inside frame (LRC in ASCII framing) */
+  uint16_t calc_crc;  /* Calculated CRC (LRC in ASCII framing) */
+  uint8_t mbap_cnt;   /* Received bytes of MBAP header (TCP framing) */
+  uint16_t mbap_left; /* Bytes of frame left, as told by MBAP header */
+  uint8_t layout;     /* Descriptor of function layout */
+
+  /* Decoded data of ASCII frames, parser->data points here.
+   * One extra byte, because it's indexed by uint8_t data_cnt.
+   */
+  uint8_t ascii_data[MODBUS_MAX_DATA_LEN + 1];
 
   /* READ-ONLY */
   uint8_t slave_addr;
+  /* MODBUS_EXCEPTION_BIT is set in exception response, the exception
+   * code is the single byte of data
+   */
   enum modbus_func function;
   uint16_t addr;
   uint16_t qty;
+  uint16_t write_addr;     /* READ_WRITE_REGS query, data is written */
+  uint16_t transaction_id; /* TCP framing */
   uint8_t data_len;
   const uint8_t* data;
+  /* Data split between two execute calls with non-adjacent buffers (e.g.
+   * wrap of a ring buffer): data holds data_len - data_wrap_len bytes and
+   * the rest is at data_wrap. NULL if data is contiguous. Only one such
+   * split is tracked.
+   */
+  const uint8_t* data_wrap;
+  uint8_t data_wrap_len;
   // bool crc_error;
   uint16_t errno;
 
   /* PUBLIC */
   void* arg;
+#ifdef MODBUS_PARSER_STATS
+  struct modbus_parser_stats* stats;
+#endif
+#ifdef MODBUS_PARSER_PROFILE
+  struct modbus_parser_profile* profile;
+#endif
 };
 
 struct modbus_parser_settings
@@ -136,7 +327,7 @@ struct modbus_query
   enum modbus_func function;
 
   /* Address of register or coil. For MULTIPLE commands act as
-   * Starting-Address
+   * Starting-Address. For READ_WRITE_REGS it's the read address.
    */
   uint16_t addr;
 
@@ -154,10 +345,20 @@ struct modbus_query
    * with generator function.
    */
   uint8_t data_len;
+
+  /* Write address of READ_WRITE_REGS, data and data_len are written */
+  uint16_t write_addr;
 };
 
 void modbus_parser_init(modbus_parser* parser, enum modbus_parser_type t);
 
+/* Same as modbus_parser_init, but selects framing of the stream.
+ * modbus_parser_init uses MODBUS_FRAMING_RTU.
+ */
+void modbus_parser_init_framing(modbus_parser* parser,
+                                enum modbus_parser_type t,
+                                enum modbus_framing f);
+
 /* Initialize http_parser_settings members to 0
  */
 void modbus_parser_settings_init(modbus_parser_settings* settings);
@@ -169,11 +370,95 @@ size_t modbus_parser_execute(modbus_parser* parser,
                              const uint8_t* data,
                              size_t len);
 
+#ifdef MODBUS_PARSER_STATS
+/* Copy consistent snapshot of counters, without locking the parser */
+void modbus_parser_stats_snapshot(const struct modbus_parser_stats* stats,
+                                  struct modbus_parser_stats* out);
+#endif
+
+#ifdef MODBUS_PARSER_PROFILE
+/* Zero profile and time one in interval calls (0 is 1) */
+void modbus_parser_profile_init(struct modbus_parser_profile* profile,
+                                uint32_t interval);
+
+/* Copy consistent snapshot of profile, without locking the parser */
+void modbus_parser_profile_snapshot(
+  const struct modbus_parser_profile* profile,
+  struct modbus_parser_profile* out);
+#endif
+
+/* Return length of RTU frame which starts at data, without parsing it.
+ * Return 0 if more bytes are needed to know the length and -1 if frame
+ * is not valid (unknown function or byte count of 0, which the parser
+ * rejects too).
+ */
+int modbus_frame_len(enum modbus_parser_type t,
+                     const uint8_t* data,
+                     size_t len);
+
+/* Return table (enum modbus_table) read or written by function f, -1 if
+ * it doesn't access one
+ */
+int modbus_func_table(enum modbus_func f);
+
+/* Items of a data table carried by a response */
+struct modbus_response_items
+{
+  enum modbus_table table;
+  uint16_t addr;
+  uint16_t count;
+  const uint8_t* data; /* In wire format, see MODBUS_TABLE_DATA_SIZE */
+  uint8_t buf[MODBUS_MAX_DATA_LEN + 1]; /* Joined data, coil of FC 5 */
+};
+
+/* Decode the response the parser has just completed into the items it
+ * carries, e.g. to update an image of the slave's tables. Read
+ * responses don't carry the address, it's taken from the query q with
+ * quantity. Single write responses echo the written value; multiple
+ * write responses carry no data. Data split by a ring buffer
+ * (data_wrap) is joined into items->buf. Return 1 if items are set, 0
+ * if the response carries none and -1 if it doesn't match the query.
+ */
+int modbus_response_items(const modbus_parser* parser,
+                          const struct modbus_query* q,
+                          struct modbus_response_items* items);
+
 /* Generate ready-to-send query and place it to buf array.
  * In success, return size of encoded message, otherwise return negative value
  */
 int modbus_gen_query(struct modbus_query* q, uint8_t* buf, size_t sz);
 
+/* Same as modbus_gen_query, but encodes query in ASCII framing
+ * (':' + hex digits + LRC + CR/LF).
+ */
+int modbus_gen_query_ascii(struct modbus_query* q, uint8_t* buf, size_t sz);
+
+/* Expand binary frame of n bytes at buf (without CRC) in place into
+ * ASCII framing. sz is size of buf. Return length of ASCII frame or -1
+ * if it doesn't fit.
+ */
+int modbus_frame_ascii(uint8_t* buf, size_t n, size_t sz);
+
+/* Add envelope of framing f to binary frame (slave address and PDU) of
+ * n bytes: CRC in RTU, ASCII framing with LRC, MBAP header with
+ * transaction_id in TCP. In TCP framing the frame is at buf + 6, after
+ * room for the header, otherwise at buf. sz is size of buf. Return
+ * length of the frame at buf or -1 if it doesn't fit.
+ */
+int modbus_frame_seal(enum modbus_framing f,
+                      uint16_t transaction_id,
+                      uint8_t* buf,
+                      size_t n,
+                      size_t sz);
+
+/* Same as modbus_gen_query, but encodes query in TCP framing, with MBAP
+ * header carrying transaction_id and slave_addr as unit identifier.
+ */
+int modbus_gen_query_tcp(struct modbus_query* q,
+                         uint16_t transaction_id,
+                         uint8_t* buf,
+                         size_t sz);
+
 void modbus_query_init(struct modbus_query* q);
 
 const char* modbus_func_str(enum modbus_func f);
@@ -181,9 +466,26 @@ const char* modbus_func_str(enum modbus_func f);
 /* Calculate CRC from array of bytes */
 uint16_t modbus_calc_crc(const uint8_t* data, size_t sz);
 
+/* Calculate CRC of n independent arrays, data[i] of sz[i] bytes, into
+ * crc[i]. Faster than one by one for many short frames, they are
+ * processed four at a time. CRC of a frame with its CRC included is 0,
+ * so received frames are checked by passing their whole length.
+ */
+void modbus_calc_crc_batch(const uint8_t* const* data,
+                           const size_t* sz,
+                           uint16_t* crc,
+                           size_t n);
+
 /* Update CRC with single byte, useful for calculating
  * CRC from streming bytes
  */
 void modbus_crc_update(uint16_t* crc, uint8_t data);
 
+/* Calculate LRC (ASCII framing checksum) from array of bytes */
+uint8_t modbus_calc_lrc(const uint8_t* data, size_t sz);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
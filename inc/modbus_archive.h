@@ -0,0 +1,155 @@
+#ifndef MODBUS_ARCHIVE_H_
+#define MODBUS_ARCHIVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Compressed archive of polled register and coil values.
+ *
+ * A series is a range of items of one table of one slave, as read by a
+ * poll query. Each sample of a series (all its items at a timestamp) is
+ * coded against the previous sample of the same series:
+ *
+ *   - timestamp as delta of delta, 1 bit for a regular poll period
+ *   - 1 bit if no item changed
+ *   - register as zigzag delta: 1 bit if same, else 4 bits of length
+ *     and the delta, so a noisy analog value costs 6-10 bits
+ *   - coils and discrete inputs as a packed bitmap, if any changed
+ *
+ * Samples go to blocks of fixed size, the bit stream of a block is
+ * decodable on its own: the first sample of a series in a block carries
+ * its definition, full timestamp and raw values. A block is written out
+ * when the next sample may not fit, so memory is the block buffer and
+ * the series supplied by the caller. Nothing is allocated. Since every
+ * block repeats definitions and raw values, it should hold many samples
+ * of each series: e.g. 64 KB blocks give 12x for 64 series of 20
+ * registers changing by small steps, 4 KB blocks only 1.6x.
+ *
+ *   block   := header bits
+ *   header  := "MBAR" u8:version u8:id_bits u16:0 u32:seq u32:nsamples
+ *   sample  := id[id_bits] (define | update)
+ *   define  := slave[8] table[2] addr[16] count[11] ts[64] raw values
+ *   update  := dod 0 | dod 1 item*
+ *
+ * Header integers are little-endian, bits are stored most significant
+ * first. Timestamps are opaque unsigned values chosen by the caller, like
+ * in the capture format.
+ */
+
+#define MODBUS_ARCHIVE_VERSION 1
+
+/* Smallest block holding a sample of the largest series */
+#define MODBUS_ARCHIVE_MIN_BLOCK 512
+
+/* Bytes of values of a series: 125 registers or 2000 bits */
+#define MODBUS_ARCHIVE_MAX_DATA 250
+
+/* Write len bytes, return 0 on success */
+typedef int (*modbus_archive_write_cb)(void* arg, const void* buf, size_t len);
+
+struct modbus_archive_series;
+
+/* Called for every decoded sample, values are in s->data. Return
+ * non-zero to stop decoding.
+ */
+typedef int (*modbus_archive_sample_cb)(void* arg,
+                                        const struct modbus_archive_series* s,
+                                        uint64_t ts);
+
+struct modbus_archive_series
+{
+  /* PRIVATE */
+  uint32_t block; /* Sequence number of block where it's defined */
+  uint64_t prev_ts;
+  uint64_t prev_delta;
+
+  /* READ-ONLY */
+  uint8_t slave_addr;
+  enum modbus_table table;
+  uint16_t addr;
+  uint16_t count;
+  /* Last values, in wire format (big-endian registers or packed bits) */
+  uint8_t data[MODBUS_ARCHIVE_MAX_DATA];
+};
+
+struct modbus_archive_writer
+{
+  /* PRIVATE */
+  modbus_archive_write_cb write;
+  void* arg;
+  struct modbus_archive_series* series;
+  size_t nseries;
+  uint8_t* block;
+  size_t block_size;
+  size_t bits; /* Used bits of block body */
+  uint32_t seq;
+  uint32_t nsamples;
+  uint8_t id_bits;
+
+  /* READ-ONLY */
+  uint64_t raw_bytes; /* Values fed to the writer */
+  uint64_t out_bytes; /* Blocks written */
+};
+
+/* Initialize series of count items starting at addr. count is limited
+ * by read quantity limits of the table.
+ * Return -1 if it's out of limits.
+ */
+int modbus_archive_series_init(struct modbus_archive_series* s,
+                               uint8_t slave_addr,
+                               enum modbus_table table,
+                               uint16_t addr,
+                               uint16_t count);
+
+/* Initialize writer of nseries series (initialized by
+ * modbus_archive_series_init) into blocks of block_size bytes, at least
+ * MODBUS_ARCHIVE_MIN_BLOCK. Return 0 on success.
+ */
+int modbus_archive_writer_init(struct modbus_archive_writer* w,
+                               modbus_archive_write_cb write,
+                               void* arg,
+                               struct modbus_archive_series* series,
+                               size_t nseries,
+                               uint8_t* block,
+                               size_t block_size);
+
+/* Append sample of series[index]. data holds its values in wire format,
+ * MODBUS_TABLE_DATA_SIZE(table, count) bytes. Return 0 on success,
+ * -1 if index is out of range or writing of a full block failed.
+ */
+int modbus_archive_write(struct modbus_archive_writer* w,
+                         size_t index,
+                         uint64_t ts,
+                         const uint8_t* data);
+
+/* Append sample from the read response the parser has just completed,
+ * typically from on_complete. The series is found by slave, table and
+ * by address and quantity of query q. Other responses are ignored.
+ * Return 0 on success and -1 if there is no such series, response
+ * doesn't match the query or writing failed.
+ */
+int modbus_archive_write_response(struct modbus_archive_writer* w,
+                                  uint64_t ts,
+                                  const modbus_parser* parser,
+                                  const struct modbus_query* q);
+
+/* Write out the current block, if it has any samples. Unused rest of
+ * block is zero. Return 0 on success.
+ */
+int modbus_archive_flush(struct modbus_archive_writer* w);
+
+/* Decode block of size bytes, calling cb for each sample. series is
+ * decoder state, at least as many as series of the writer. Return
+ * number of decoded samples (up to the one where cb asked to stop), or
+ * -1 if block is corrupted.
+ */
+int modbus_archive_decode(const uint8_t* block,
+                          size_t size,
+                          struct modbus_archive_series* series,
+                          size_t nseries,
+                          modbus_archive_sample_cb cb,
+                          void* arg);
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef MODBUS_CAPTURE_H_
+#define MODBUS_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Compact capture format for RTU frames with seek index.
+ *
+ * All integers are little-endian.
+ *
+ *   file    := header record* index trailer
+ *   header  := "MBCP" u8:version u8[3]:reserved
+ *   record  := sync | frame
+ *   sync    := u8:MODBUS_CAPTURE_SYNC u64:ts
+ *   frame   := u8:tag varint:dts varint:len u8[len]
+ *   index   := entry*
+ *   entry   := u64:ts_min u64:ts_max u64:offset u32:nframes u8[32]:slaves
+ *   trailer := u64:index_offset u32:nentries "MBCI"
+ *
+ * Timestamps are opaque unsigned values chosen by the caller (tools use
+ * microseconds) and should be monotonic for seeking to work. dts is
+ * zigzag encoded difference from previous frame, or from sync record
+ * which starts each segment. Each index entry describes one segment:
+ * its time range, offset of its sync record and bitmap of slave
+ * addresses inside it, so readers can jump to a time range or skip
+ * segments without a given slave.
+ *
+ * Like the parser, writer and reader don't do I/O themselves, it's done
+ * through callbacks.
+ */
+
+#define MODBUS_CAPTURE_VERSION 1
+
+/* Largest frame accepted by the parser: header + 255 data bytes + CRC */
+#define MODBUS_CAPTURE_MAX_FRAME 260
+
+#define MODBUS_CAPTURE_SYNC 0xA5
+#define MODBUS_CAPTURE_FRAME 0x01
+#define MODBUS_CAPTURE_FRAME_CRC_ERROR 0x02
+
+#define MODBUS_CAPTURE_ENTRY_SIZE 60
+#define MODBUS_CAPTURE_TRAILER_SIZE 16
+
+/* Write len bytes, return 0 on success */
+typedef int (*modbus_capture_write_cb)(void* arg, const void* buf, size_t len);
+
+/* Read exactly len bytes at offset, return 0 on success */
+typedef int (*modbus_capture_read_cb)(void* arg,
+                                      uint64_t offset,
+                                      void* buf,
+                                      size_t len);
+
+struct modbus_capture_index_entry
+{
+  uint64_t ts_min;
+  uint64_t ts_max;
+  uint64_t offset; /* Offset of sync record */
+  uint32_t nframes;
+  uint8_t slaves[32]; /* Bitmap of slave addresses */
+};
+
+struct modbus_capture_frame
+{
+  uint64_t ts;
+  uint8_t tag;
+  uint16_t len;
+  uint8_t data[MODBUS_CAPTURE_MAX_FRAME];
+};
+
+struct modbus_capture_writer
+{
+  /* PRIVATE */
+  modbus_capture_write_cb write;
+  void* arg;
+  uint64_t offset;
+  uint64_t prev_ts;
+  uint32_t segment_frames;
+  int error;
+
+  /* Index is kept in caller memory. When it's full, adjacent entries are
+   * merged and segments become twice longer, so memory stays bounded.
+   */
+  struct modbus_capture_index_entry* index;
+  size_t index_cap;
+  size_t index_len;
+
+  /* Frame being assembled by modbus_capture_execute */
+  uint16_t frame_len;
+  uint8_t frame[MODBUS_CAPTURE_MAX_FRAME];
+};
+
+struct modbus_capture_reader
+{
+  /* PRIVATE */
+  modbus_capture_read_cb read;
+  void* arg;
+  uint64_t data_end; /* End of records (start of index) */
+  struct modbus_capture_index_entry* index;
+  size_t index_len;
+
+  uint64_t pos;
+  uint64_t prev_ts;
+  uint64_t ts_from;
+  uint64_t ts_to;
+  int slave;    /* Slave filter, -1 for all */
+  size_t entry; /* Index entry containing pos */
+
+  uint64_t buf_off;
+  size_t buf_len;
+  uint8_t buf[1024];
+};
+
+/* Initialize writer and write file header. index must hold at least two
+ * entries. segment_frames is initial number of frames per index entry.
+ * Return 0 on success.
+ */
+int modbus_capture_writer_init(struct modbus_capture_writer* w,
+                               modbus_capture_write_cb write,
+                               void* arg,
+                               struct modbus_capture_index_entry* index,
+                               size_t index_cap,
+                               uint32_t segment_frames);
+
+/* Append a complete frame. tag is MODBUS_CAPTURE_FRAME or
+ * MODBUS_CAPTURE_FRAME_CRC_ERROR. Return 0 on success.
+ */
+int modbus_capture_write_frame(struct modbus_capture_writer* w,
+                               uint64_t ts,
+                               uint8_t tag,
+                               const uint8_t* frame,
+                               size_t len);
+
+/* Run modbus_parser_execute on data and log the frame when the parser
+ * completes it, frames may be split between calls. Parser must use RTU
+ * framing and be re-initialized after each frame as usual.
+ * Return number of parsed bytes.
+ */
+size_t modbus_capture_execute(struct modbus_capture_writer* w,
+                              modbus_parser* parser,
+                              const modbus_parser_settings* settings,
+                              uint64_t ts,
+                              const uint8_t* data,
+                              size_t len);
+
+/* Write index and trailer. Return 0 on success. */
+int modbus_capture_writer_close(struct modbus_capture_writer* w);
+
+/* Open capture of given size and load its index into caller memory.
+ * Files without index (e.g. writer didn't close) are still readable,
+ * but seeking has to scan records. Return 0 on success, negative value
+ * if file is not a capture or index doesn't fit.
+ */
+int modbus_capture_reader_open(struct modbus_capture_reader* r,
+                               modbus_capture_read_cb read,
+                               void* arg,
+                               uint64_t size,
+                               struct modbus_capture_index_entry* index,
+                               size_t index_cap);
+
+/* Select frames with ts_from <= ts <= ts_to and, if slave is not -1, of
+ * given slave address. Reading continues from the first segment which
+ * may contain such frames. Return -1 if slave is not -1 or 0 - 255.
+ */
+int modbus_capture_seek(struct modbus_capture_reader* r,
+                        uint64_t ts_from,
+                        uint64_t ts_to,
+                        int slave);
+
+/* Read next selected frame. Return 1 if frame is read, 0 at end of
+ * selection and negative value on error.
+ */
+int modbus_capture_next(struct modbus_capture_reader* r,
+                        struct modbus_capture_frame* frame);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef MODBUS_CONVERT_H_
+#define MODBUS_CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Conversion of register payloads to engineering values.
+ *
+ * A payload (e.g. parser->data of a read response) is described by a
+ * table of descriptors, each one covering a run of values of the same
+ * type and word order. Runs are converted by loops specialized for every
+ * type and order, which the compiler can vectorize, so a table with a
+ * few long runs converts a whole response in one pass.
+ *
+ * Values are converted either to double, value = raw * scale + offset,
+ * or to fixed point int64_t, value = (raw * mul >> shift) + offset, for
+ * targets without an FPU and for 64-bit counters which double can't hold
+ * exactly.
+ */
+
+enum modbus_conv_type
+{
+  MODBUS_CONV_SKIP, /* count registers, no output */
+  MODBUS_CONV_U16,
+  MODBUS_CONV_I16,
+  MODBUS_CONV_U32,
+  MODBUS_CONV_I32,
+  MODBUS_CONV_F32,
+  MODBUS_CONV_U64,
+  MODBUS_CONV_I64,
+  MODBUS_CONV_F64
+};
+
+/* Order of bytes on the wire, A is the most significant one. For 64-bit
+ * values word swap reverses all four registers.
+ */
+enum modbus_word_order
+{
+  MODBUS_ORDER_ABCD, /* Big-endian, Modbus default */
+  MODBUS_ORDER_CDAB, /* Word swapped */
+  MODBUS_ORDER_BADC, /* Byte swapped */
+  MODBUS_ORDER_DCBA  /* Little-endian */
+};
+
+struct modbus_conv_desc
+{
+  uint8_t type;   /* enum modbus_conv_type */
+  uint8_t order;  /* enum modbus_word_order */
+  uint16_t count; /* Number of values */
+  double scale;
+  double offset;
+};
+
+/* Fixed point, value = ((raw * mul) >> shift) + offset. E.g. raw in
+ * tenths of a unit to Q16.16 is mul 6554 (65536 / 10), shift 0. The
+ * shift rounds down. raw * mul always fits into int64_t for 16 and
+ * 32-bit types; 64-bit values are exact with mul 1 and shift 0, U64
+ * ones above INT64_MAX come out as their uint64_t bit pattern, and the
+ * offset is added modulo 2^64. Floats are multiplied by mul and
+ * truncated before the shift; NaN is INT64_MIN, infinities and values
+ * out of int64_t range saturate to INT64_MIN/INT64_MAX.
+ */
+struct modbus_conv_fixed
+{
+  uint8_t type;  /* enum modbus_conv_type */
+  uint8_t order; /* enum modbus_word_order */
+  uint8_t shift;
+  uint16_t count; /* Number of values */
+  int32_t mul;
+  int64_t offset;
+};
+
+/* Number of registers of a value of type t */
+int modbus_conv_width(enum modbus_conv_type t);
+
+/* Convert payload of len bytes according to ndesc descriptors into out.
+ * Conversion stops at the end of the payload, a value which doesn't
+ * fit entirely is not converted. Return number of values stored.
+ */
+size_t modbus_convert(const struct modbus_conv_desc* desc,
+                      size_t ndesc,
+                      const uint8_t* data,
+                      size_t len,
+                      double* out);
+
+/* Same as modbus_convert, for data of the response the parser has just
+ * completed (data wrapped around a ring buffer included).
+ */
+size_t modbus_convert_response(const struct modbus_conv_desc* desc,
+                               size_t ndesc,
+                               const modbus_parser* parser,
+                               double* out);
+
+/* Return 0 if every descriptor of the table has known type and order
+ * and shift below 64, -1 otherwise. modbus_convert_fixed doesn't check
+ * descriptors, call it once when the table is built.
+ */
+int modbus_conv_fixed_check(const struct modbus_conv_fixed* desc,
+                            size_t ndesc);
+
+/* Same as modbus_convert, to fixed point */
+size_t modbus_convert_fixed(const struct modbus_conv_fixed* desc,
+                            size_t ndesc,
+                            const uint8_t* data,
+                            size_t len,
+                            int64_t* out);
+
+/* Same as modbus_convert_response, to fixed point */
+size_t modbus_convert_fixed_response(const struct modbus_conv_fixed* desc,
+                                     size_t ndesc,
+                                     const modbus_parser* parser,
+                                     int64_t* out);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MODBUS_DEMUX_H_
+#define MODBUS_DEMUX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Demultiplexer of a shared RTU bus, keyed on the slave address byte
+ * which starts every frame.
+ *
+ * A direct 256-entry table holds parser settings and context (parser
+ * arg) of each slave of interest. Frames of such a slave are parsed with
+ * its settings; frames of other slaves are skipped by their length
+ * (modbus_frame_len), without CRC and without callbacks, so sniffing a
+ * bus with hundreds of slaves costs little more than the ones watched.
+ * Bytes which don't start a frame of a known function, of watched
+ * slaves too, are skipped one at a time until a frame starts, like
+ * resync in modbus_replay.h.
+ *
+ * Broadcast: a query to address 0 is addressed to every slave, it's
+ * parsed once and each callback is called for every slave in the table,
+ * with its arg; slave_addr of the parser tells it's a broadcast. Slaves
+ * don't reply to broadcasts, so address 0 in a stream of responses is
+ * not a frame and is skipped. Stream may be fed in chunks of any size.
+ */
+
+struct modbus_demux_slave
+{
+  const modbus_parser_settings* settings; /* NULL = skip its frames */
+  void* arg;
+};
+
+struct modbus_demux
+{
+  /* PRIVATE */
+  modbus_parser parser;
+  modbus_parser_settings broadcast; /* Calls callbacks of all slaves */
+  struct modbus_demux_slave slaves[256];
+  const modbus_parser_settings* settings; /* Of frame being parsed */
+  uint32_t skip;                          /* Bytes left of skipped frame */
+  uint8_t head[16]; /* Start of skipped frame, until its length is known */
+  uint8_t head_len;
+
+  /* READ-ONLY */
+  enum modbus_parser_type type;
+  uint64_t frames;     /* Parsed by a slave's settings */
+  uint64_t broadcasts; /* Queries to address 0 */
+  uint64_t skipped;    /* Frames of other slaves */
+  uint64_t skipped_bytes;
+  uint64_t resyncs; /* Bytes which don't start a frame */
+};
+
+/* Initialize demux of queries or responses, with no slaves */
+void modbus_demux_init(struct modbus_demux* d, enum modbus_parser_type t);
+
+/* Parse frames of slave_addr (1 - 255) with settings, parser->arg is
+ * arg in callbacks. NULL settings skip its frames again.
+ */
+void modbus_demux_attach(struct modbus_demux* d,
+                         uint8_t slave_addr,
+                         const modbus_parser_settings* settings,
+                         void* arg);
+
+/* Feed len bytes of the stream. Return number of frames completed
+ * (parsed or skipped) in this call.
+ */
+size_t modbus_demux_execute(struct modbus_demux* d,
+                            const uint8_t* data,
+                            size_t len);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef MODBUS_GATEWAY_H_
+#define MODBUS_GATEWAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* In place translation between TCP and RTU framing, for gateways.
+ *
+ * Both framings carry the same unit id (slave address) and PDU, only
+ * the envelope differs: MBAP header in front for TCP, CRC behind for
+ * RTU. Frames are rewritten in the buffer they were received in, the
+ * PDU is never moved or copied and the CRC is computed once, by the
+ * bulk CRC path:
+ *
+ *   TCP:   [tid][0][len][unit][PDU]
+ *   RTU:               [unit][PDU][crc]
+ *
+ * So a TCP frame needs 2 spare bytes after it, and an RTU frame needs
+ * MODBUS_TCP_HEADROOM spare bytes in front of it (e.g. receive RTU at
+ * buf + MODBUS_TCP_HEADROOM).
+ */
+
+#define MODBUS_TCP_HEADROOM 6
+
+/* Turn TCP frame of len bytes at buf into RTU frame at buf + 6. sz is
+ * size of buf, it must be at least len + 2. MBAP header is checked
+ * (protocol id, length) and its transaction id is stored to
+ * *transaction_id. Return length of RTU frame or -1.
+ */
+int modbus_tcp_to_rtu(uint8_t* buf,
+                      size_t len,
+                      size_t sz,
+                      uint16_t* transaction_id);
+
+/* Turn RTU frame of len bytes at buf into TCP frame at
+ * buf - MODBUS_TCP_HEADROOM, with given transaction id. Return length of
+ * TCP frame, or -1 if CRC is wrong or frame is too short.
+ */
+int modbus_rtu_to_tcp(uint8_t* buf, size_t len, uint16_t transaction_id);
+
+#endif
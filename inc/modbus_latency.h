@@ -0,0 +1,89 @@
+#ifndef MODBUS_LATENCY_H_
+#define MODBUS_LATENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Request/response round trip latency histograms.
+ *
+ * Timestamps are supplied by the caller, in any unit (e.g. microseconds).
+ * Histograms are log-linear, like HDR histograms: values below 16 have
+ * their own bucket, above that each power of two is split into 8
+ * buckets, so relative error is below 12.5%. Values of
+ * 2^(MODBUS_LATENCY_MAX_EXP + 1) and above go to an extra overflow
+ * bucket, the last one.
+ */
+
+#ifndef MODBUS_LATENCY_MAX_EXP
+#define MODBUS_LATENCY_MAX_EXP 31
+#endif
+
+#define MODBUS_LATENCY_BUCKETS (16 + (MODBUS_LATENCY_MAX_EXP - 3) * 8 + 1)
+
+/* Histograms are kept per slave address and per function code */
+#define MODBUS_LATENCY_SLAVES 256
+#define MODBUS_LATENCY_FUNCS 128
+
+struct modbus_latency_hist
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint32_t buckets[MODBUS_LATENCY_BUCKETS];
+};
+
+struct modbus_latency
+{
+  /* PRIVATE */
+  struct modbus_latency_hist* slaves; /* MODBUS_LATENCY_SLAVES or NULL */
+  struct modbus_latency_hist* funcs;  /* MODBUS_LATENCY_FUNCS or NULL */
+
+  /* Outstanding query per slave */
+  uint64_t sent_ts[256];
+  uint8_t sent_func[256];
+  uint8_t pending[256 / 8];
+};
+
+void modbus_latency_hist_init(struct modbus_latency_hist* h);
+
+void modbus_latency_hist_record(struct modbus_latency_hist* h, uint64_t v);
+
+/* Add samples of src to dst */
+void modbus_latency_hist_merge(struct modbus_latency_hist* dst,
+                               const struct modbus_latency_hist* src);
+
+/* Return value at quantile q (0.0 - 1.0), rounded up to the end of its
+ * bucket but never above the largest recorded value. Return 0 for empty
+ * histogram.
+ */
+uint64_t modbus_latency_hist_quantile(const struct modbus_latency_hist* h,
+                                      double q);
+
+/* Initialize tracker with caller memory for histograms. Either of them
+ * may be NULL if it's not needed.
+ */
+void modbus_latency_init(struct modbus_latency* l,
+                         struct modbus_latency_hist* slaves,
+                         struct modbus_latency_hist* funcs);
+
+/* Note a query sent to slave at ts. A previous outstanding query of the
+ * same slave is forgotten (e.g. it timed out).
+ */
+void modbus_latency_query(struct modbus_latency* l,
+                          uint8_t slave,
+                          uint8_t function,
+                          uint64_t ts);
+
+/* Record round trip of a response completed at ts, typically called from
+ * on_complete. Function code of the response is matched with the query,
+ * exception responses included. Return the latency, or -1 if there is no
+ * matching outstanding query.
+ */
+int64_t modbus_latency_response(struct modbus_latency* l,
+                                const modbus_parser* parser,
+                                uint64_t ts);
+
+#endif
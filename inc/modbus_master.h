@@ -0,0 +1,124 @@
+#ifndef MODBUS_MASTER_H_
+#define MODBUS_MASTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+#include "modbus_poll.h"
+#include "modbus_writeq.h"
+
+/* Multi-line RTU master engine.
+ *
+ * Drives many serial lines from one thread without doing any I/O: the
+ * host event loop passes received bytes and the current time in, and
+ * takes queries to be written out. Every line has its own response
+ * parser and a single outstanding transaction. Queries come from the
+ * poll scheduler and the write queue attached to the line, a pending
+ * register write is combined with a holding register read when
+ * possible.
+ *
+ * A typical loop:
+ *
+ *   for (;;) {
+ *     wait for readable lines, at most until modbus_master_timer(m, now)
+ *     for every readable line i: modbus_master_rx(m, i, buf, n, now)
+ *     for every line i: if (modbus_master_tx(m, i, now, &q) > 0) write it
+ *   }
+ *
+ * Time is in any unit the caller chooses, the same as poll periods and
+ * write deadlines.
+ */
+
+struct modbus_master;
+
+/* Transaction of line is finished. parser is the completed response
+ * (parser->errno is set on CRC error), or NULL if it timed out. Data of
+ * the response is valid only during the call.
+ */
+typedef void (*modbus_master_cb)(struct modbus_master* m,
+                                 size_t line,
+                                 const modbus_parser* parser);
+
+enum modbus_master_state
+{
+  MODBUS_MASTER_IDLE,
+  MODBUS_MASTER_WAIT,       /* Waiting for response */
+  MODBUS_MASTER_TURNAROUND, /* Silent interval before the next query */
+};
+
+struct modbus_master_line
+{
+  /* PRIVATE */
+  modbus_parser parser;
+  enum modbus_master_state state;
+  uint64_t deadline; /* Of response or of turnaround */
+  struct modbus_poll_request* deferred; /* Read which gave way to a write */
+  uint8_t tx[256];
+
+  /* READ-ONLY */
+  struct modbus_query query; /* Query of the current transaction */
+
+  /* PUBLIC */
+  struct modbus_poll_sched* poll; /* Source of reads, may be NULL */
+  struct modbus_writeq* writeq;   /* Source of writes, may be NULL */
+  void* arg;
+};
+
+struct modbus_master
+{
+  /* PRIVATE */
+  struct modbus_master_line* lines;
+  size_t nlines;
+
+  /* PUBLIC */
+  uint32_t timeout;    /* From query sent to response completed */
+  uint32_t gap;        /* Between response and the next query */
+  uint32_t turnaround; /* After broadcast, defaults to timeout */
+  modbus_master_cb on_done; /* May be NULL */
+  void* arg;
+};
+
+/* Initialize engine with nlines lines supplied by the caller. All lines
+ * start idle with no sources attached.
+ */
+void modbus_master_init(struct modbus_master* m,
+                        struct modbus_master_line* lines,
+                        size_t nlines,
+                        uint32_t timeout,
+                        uint32_t gap);
+
+/* Return the next query of line to be written, or 0 if the line is busy
+ * or nothing is due. Query is stored in *buf, which stays valid until
+ * the next call for the same line. Call it right after modbus_master_rx
+ * finishes a transaction to keep the line busy back to back.
+ */
+int modbus_master_tx(struct modbus_master* m,
+                     size_t line,
+                     uint64_t now,
+                     const uint8_t** buf);
+
+/* Query of line has actually left the transmitter (e.g. after tcdrain).
+ * Optional, restarts the response timeout so it doesn't have to cover
+ * transmission time of long queries.
+ */
+void modbus_master_sent(struct modbus_master* m, size_t line, uint64_t now);
+
+/* Feed bytes received on line. Bytes outside of a transaction and
+ * responses of other slaves or functions (e.g. late response to a
+ * query which timed out) are dropped. Return 1 if the transaction of
+ * the line has finished, 0 otherwise.
+ */
+int modbus_master_rx(struct modbus_master* m,
+                     size_t line,
+                     const uint8_t* data,
+                     size_t len,
+                     uint64_t now);
+
+/* Expire transactions of all lines which timed out at now. Return the
+ * time of the next event on any line (timeout, end of turnaround or a
+ * due query), UINT64_MAX if there is none.
+ */
+uint64_t modbus_master_timer(struct modbus_master* m, uint64_t now);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef MODBUS_POLL_H_
+#define MODBUS_POLL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Poll planner and scheduler.
+ *
+ * The planner turns a list of points (registers or coils the
+ * application wants to read periodically) into as few read queries as
+ * possible: points of the same slave, function and period are merged
+ * when the gap between them is at most the given tolerance and the
+ * result stays within protocol limits. The scheduler then hands out
+ * the query which is due next. Queries are plain modbus_query, ready
+ * for modbus_gen_query; the same query can be given to
+ * modbus_regcache_update_response with the response.
+ *
+ * Time is in any unit the caller chooses, the same as period.
+ */
+
+struct modbus_poll_point
+{
+  uint8_t slave_addr;
+  enum modbus_func function; /* One of the read functions */
+  uint16_t addr;
+  uint16_t count;
+  uint32_t period;
+};
+
+struct modbus_poll_request
+{
+  struct modbus_query query;
+  uint32_t period;
+  uint64_t next_due;
+};
+
+struct modbus_poll_sched
+{
+  /* PRIVATE */
+  struct modbus_poll_request* reqs;
+  size_t n;
+};
+
+/* Build requests for n points into out (cap entries). Points are sorted
+ * in place. gap is number of unused registers (or coils) which may be
+ * read to merge two points. Return number of requests, or -1 if cap is
+ * too small or a point has invalid function, zero count, range past
+ * address 0xFFFF or zero period.
+ */
+int modbus_poll_plan(struct modbus_poll_point* points,
+                     size_t n,
+                     uint16_t gap,
+                     struct modbus_poll_request* out,
+                     size_t cap);
+
+/* Schedule n requests, all of them are due at now */
+void modbus_poll_sched_init(struct modbus_poll_sched* s,
+                            struct modbus_poll_request* reqs,
+                            size_t n,
+                            uint64_t now);
+
+/* Return the most overdue request which is due at now and move it to
+ * its next period, or NULL if nothing is due. A request which fell
+ * behind by more than a period is not polled repeatedly to catch up.
+ */
+struct modbus_poll_request* modbus_poll_next(struct modbus_poll_sched* s,
+                                             uint64_t now);
+
+/* Return time of the earliest due request, UINT64_MAX if there is none */
+uint64_t modbus_poll_next_due(const struct modbus_poll_sched* s);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef MODBUS_QUEUE_H_
+#define MODBUS_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Bounded lock-free multi-producer/multi-consumer queue of parsed frames.
+ *
+ * Intended for handing frames from parser threads (e.g. from on_complete)
+ * to worker threads. Records are fixed-size and live in cells supplied
+ * by the caller, nothing is allocated. Each cell carries a sequence
+ * number (D. Vyukov's bounded MPMC queue), so producers and consumers
+ * only contend on their own position counter.
+ */
+
+/* Largest PDU is 253 bytes: function code, byte count and 251 bytes, or
+ * function code, address and 250 bytes. 252 covers data of any valid
+ * frame.
+ */
+#define MODBUS_QUEUE_MAX_DATA 252
+
+struct modbus_queue_frame
+{
+  uint8_t slave_addr;
+  uint8_t function;
+  uint16_t addr;
+  uint16_t qty;
+  uint16_t data_len;
+  uint8_t data[MODBUS_QUEUE_MAX_DATA];
+};
+
+struct modbus_queue_cell
+{
+  /* PRIVATE */
+  size_t seq;
+  struct modbus_queue_frame frame;
+};
+
+struct modbus_queue
+{
+  /* PRIVATE */
+  struct modbus_queue_cell* cells;
+  size_t mask;
+
+  /* On separate cache lines, written by producers and consumers */
+  _Alignas(64) size_t enqueue_pos;
+  _Alignas(64) size_t dequeue_pos;
+};
+
+/* Initialize queue over caller array of cells, size must be a power of
+ * two (at least 2). Return 0 on success.
+ */
+int modbus_queue_init(struct modbus_queue* q,
+                      struct modbus_queue_cell* cells,
+                      size_t size);
+
+/* Enqueue copy of frame. Return 0 on success, -1 if the queue is full
+ * or data is too long.
+ */
+int modbus_queue_push(struct modbus_queue* q,
+                      const struct modbus_queue_frame* frame);
+
+/* Enqueue fields of the frame the parser has just completed, typically
+ * from on_complete. Data is copied directly into the cell, including
+ * the part at parser->data_wrap. Return values are the same as
+ * modbus_queue_push.
+ */
+int modbus_queue_push_parser(struct modbus_queue* q,
+                             const modbus_parser* parser);
+
+/* Dequeue up to max frames into out, claiming them at once. Return
+ * number of dequeued frames, 0 if the queue is empty.
+ */
+size_t modbus_queue_pop(struct modbus_queue* q,
+                        struct modbus_queue_frame* out,
+                        size_t max);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef MODBUS_REGCACHE_H_
+#define MODBUS_REGCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Register image cache with change detection.
+ *
+ * The cache is a set of blocks, each covering a range of registers or
+ * coils of one table of one slave. Parsed responses are written into the
+ * blocks in place; only registers which differ from the cached value are
+ * reported, through a callback per changed range and a dirty bitmap per
+ * block. Unchanged data is skipped with wide compares, so polling static
+ * registers costs little more than a memcmp.
+ *
+ * Registers are kept as on the wire (big-endian), coils and discrete
+ * inputs are packed, least significant bit first. All memory is supplied
+ * by the caller.
+ */
+
+/* uint64_t words of dirty bitmap of a block */
+#define MODBUS_REGCACHE_DIRTY_WORDS(count) (((count) + 63) / 64)
+
+#define MODBUS_REGCACHE_BUCKETS 64
+
+struct modbus_regcache_block;
+
+/* Called for every range of changed items, after the cache is updated */
+typedef void (*modbus_regcache_cb)(void* arg,
+                                   const struct modbus_regcache_block* b,
+                                   uint16_t addr,
+                                   uint16_t count);
+
+struct modbus_regcache_block
+{
+  /* PRIVATE */
+  struct modbus_regcache_block* next;
+
+  /* READ-ONLY */
+  uint8_t slave_addr;
+  enum modbus_table table;
+  uint16_t addr;
+  uint16_t count;
+  uint8_t* data;
+  uint64_t* dirty; /* Bit per item, set when it changes */
+};
+
+struct modbus_regcache
+{
+  /* PRIVATE */
+  struct modbus_regcache_block* buckets[MODBUS_REGCACHE_BUCKETS];
+
+  /* PUBLIC */
+  modbus_regcache_cb on_change; /* May be NULL */
+  void* arg;
+};
+
+void modbus_regcache_init(struct modbus_regcache* c);
+
+/* Initialize block of count items starting at addr. data and dirty must
+ * hold MODBUS_TABLE_DATA_SIZE and MODBUS_REGCACHE_DIRTY_WORDS. Data
+ * is zeroed and all items start dirty, so the first collection sees the
+ * whole image.
+ */
+void modbus_regcache_block_init(struct modbus_regcache_block* b,
+                                uint8_t slave_addr,
+                                enum modbus_table table,
+                                uint16_t addr,
+                                uint16_t count,
+                                uint8_t* data,
+                                uint64_t* dirty);
+
+/* Add block to the cache. Return -1 if it overlaps an existing one. */
+int modbus_regcache_add(struct modbus_regcache* c,
+                        struct modbus_regcache_block* b);
+
+/* Find block which contains addr, NULL if there is none */
+struct modbus_regcache_block* modbus_regcache_find(struct modbus_regcache* c,
+                                                   uint8_t slave_addr,
+                                                   enum modbus_table table,
+                                                   uint16_t addr);
+
+/* Write count items starting at addr, in wire format (big-endian
+ * registers or packed bits). Items outside of cached blocks are
+ * ignored. Return number of changed items.
+ */
+int modbus_regcache_update(struct modbus_regcache* c,
+                           uint8_t slave_addr,
+                           enum modbus_table table,
+                           uint16_t addr,
+                           const uint8_t* data,
+                           uint16_t count);
+
+/* Write data of the response the parser has just completed, typically
+ * from on_complete, as decoded by modbus_response_items: reads and
+ * single writes update the cache, multiple write responses carry no
+ * data and are ignored. Return number of changed items, or -1 if the
+ * response doesn't match the query q.
+ */
+int modbus_regcache_update_response(struct modbus_regcache* c,
+                                    const modbus_parser* parser,
+                                    const struct modbus_query* q);
+
+/* Find next range of dirty items at or after *addr and clear it. Return
+ * 0 if there are no more, otherwise set *addr and *count to the range.
+ */
+int modbus_regcache_next_dirty(struct modbus_regcache_block* b,
+                               uint16_t* addr,
+                               uint16_t* count);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef MODBUS_REPLAY_H_
+#define MODBUS_REPLAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Offline analysis of recorded RTU traffic (stream of responses).
+ *
+ * Capture is split into chunks at validated frame boundaries, each chunk
+ * is parsed by a worker thread with its own modbus_parser, then
+ * statistics of all workers are merged.
+ *
+ * Unlike the parser itself, this part uses threads and mmap, so it's
+ * built as a separate library.
+ */
+
+struct modbus_replay_slave_stats
+{
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t crc_errors;
+};
+
+struct modbus_replay_stats
+{
+  uint64_t frames;
+  uint64_t bytes;      /* Bytes inside parsed frames */
+  uint64_t crc_errors;
+  uint64_t aborted;    /* Valid frames aborted by a callback */
+  uint64_t skipped;    /* Bytes skipped while looking for next frame */
+  uint64_t resyncs;
+  uint64_t func[256];  /* Frames per function code */
+  struct modbus_replay_slave_stats slave[256];
+};
+
+void modbus_replay_stats_init(struct modbus_replay_stats* stats);
+
+/* Add statistics of src to dst */
+void modbus_replay_stats_merge(struct modbus_replay_stats* dst,
+                               const struct modbus_replay_stats* src);
+
+/* Find first frame boundary at or after `from`. A boundary is start of a
+ * frame with valid CRC, followed either by end of data or by another
+ * frame with valid CRC. Return len if there is no boundary.
+ */
+size_t modbus_replay_sync(const uint8_t* data, size_t len, size_t from);
+
+/* Parse frames starting in [start, end) of data. Frames may extend past
+ * end, up to len. settings may be NULL; parser->arg is set to arg.
+ */
+void modbus_replay_parse(const uint8_t* data,
+                         size_t len,
+                         size_t start,
+                         size_t end,
+                         const modbus_parser_settings* settings,
+                         void* arg,
+                         struct modbus_replay_stats* stats);
+
+/* Split data between nthreads workers and merge their statistics into
+ * stats. Callbacks are called concurrently from worker threads.
+ * Return 0 on success, negative value on error.
+ */
+int modbus_replay_buffer(const uint8_t* data,
+                         size_t len,
+                         int nthreads,
+                         const modbus_parser_settings* settings,
+                         void* arg,
+                         struct modbus_replay_stats* stats);
+
+/* Same as modbus_replay_buffer, on memory-mapped file */
+int modbus_replay_file(const char* path,
+                       int nthreads,
+                       const modbus_parser_settings* settings,
+                       void* arg,
+                       struct modbus_replay_stats* stats);
+
+#endif
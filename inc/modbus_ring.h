@@ -0,0 +1,75 @@
+#ifndef MODBUS_RING_H_
+#define MODBUS_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Lock-free single-producer/single-consumer receive ring.
+ *
+ * Producer is typically an UART interrupt or DMA completion handler,
+ * consumer is the task which runs the parser. Neither side copies or
+ * locks: the producer writes into the ring (or lets DMA write into it)
+ * and commits, the consumer parses directly out of the ring.
+ *
+ * Data field of RTU or TCP frame is not released to the producer while
+ * the parser references it, i.e. until the parser is re-initialized, so
+ * parser->data stays valid after the frame is complete. When data field
+ * crosses end of the ring it's described by parser->data and
+ * parser->data_wrap, so on_data_end and users of data after the frame
+ * must check data_wrap: data holds data_len - data_wrap_len bytes, the
+ * rest is at data_wrap. Ring must be larger than the longest data field
+ * of the traffic plus CRC (258 bytes for any frame), otherwise the
+ * producer can be blocked forever.
+ */
+
+struct modbus_ring
+{
+  /* PRIVATE */
+  uint8_t* buf;
+  size_t mask;
+
+  /* Free running positions, masked on access */
+  size_t head; /* Written by producer */
+  size_t tail; /* Released by consumer */
+  size_t read; /* Parsed by consumer */
+};
+
+/* Initialize ring over buf, size must be a power of two. Return 0 on
+ * success.
+ */
+int modbus_ring_init(struct modbus_ring* r, uint8_t* buf, size_t size);
+
+/*
+ * Producer side
+ */
+
+/* Copy up to len bytes into the ring, return number of copied bytes */
+size_t modbus_ring_write(struct modbus_ring* r, const uint8_t* data, size_t len);
+
+/* Return contiguous free space at write position, e.g. to start DMA
+ * into it. *p is set to its start.
+ */
+size_t modbus_ring_write_span(struct modbus_ring* r, uint8_t** p);
+
+/* Publish n bytes written into the ring, e.g. by DMA */
+void modbus_ring_commit(struct modbus_ring* r, size_t n);
+
+/*
+ * Consumer side
+ */
+
+/* Execute the parser over received bytes, both spans if they wrap
+ * around. Like modbus_parser_execute, stops at end of frame or error,
+ * the caller re-initializes the parser and calls again. Return number
+ * of parsed bytes.
+ */
+size_t modbus_ring_execute(struct modbus_ring* r,
+                           modbus_parser* parser,
+                           const modbus_parser_settings* settings);
+
+/* Number of received bytes which are not parsed yet */
+size_t modbus_ring_pending(struct modbus_ring* r);
+
+#endif
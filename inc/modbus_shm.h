@@ -0,0 +1,131 @@
+#ifndef MODBUS_SHM_H_
+#define MODBUS_SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Register image in shared memory, for processes which want the latest
+ * values without asking the poller over IPC (HMI, historian, ...).
+ *
+ * The image is a memfd mapped by the writer, which updates it from the
+ * decode path, e.g. on_complete of its parser. Readers map the same fd
+ * read-only, received over a Unix socket (SCM_RIGHTS) or opened as
+ * /proc/<pid>/fd/<fd> of the writer. Layout is position independent:
+ *
+ *   header  := "MBSH" u32:version u32:nblocks u32:size pad to 64
+ *   block   := u32:seq u32:offset u8:slave u8:table u16:addr u16:count
+ *              u16:0 u64:updates pad to 64
+ *   data    := values of each block at its offset, 64 byte aligned
+ *
+ * Each block is guarded by its own seqlock: the writer makes seq odd,
+ * writes the values and makes it even again. Readers copy the values
+ * and retry if seq was odd or changed meanwhile, so a snapshot of a
+ * block is consistent and costs no syscall and no lock; the writer
+ * never waits for readers. Values are in wire format, registers
+ * big-endian and coils packed least significant bit first, as in
+ * modbus_regcache.h.
+ */
+
+#define MODBUS_SHM_VERSION 1
+
+/* Block of the image, as requested by the writer */
+struct modbus_shm_def
+{
+  uint8_t slave_addr;
+  enum modbus_table table;
+  uint16_t addr;
+  uint16_t count;
+};
+
+/* Header of the image, in shared memory */
+struct modbus_shm_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t nblocks;
+  uint32_t size;
+  uint8_t reserved[48];
+};
+
+/* Block of the image, in shared memory. A cache line each, so readers
+ * of one block don't slow down updates of another.
+ */
+struct modbus_shm_block
+{
+  uint32_t seq; /* Odd while being written */
+  uint32_t offset;
+  uint8_t slave_addr;
+  uint8_t table;
+  uint16_t addr;
+  uint16_t count;
+  uint16_t reserved;
+  uint64_t updates; /* Completed writes */
+  uint8_t pad[40];
+};
+
+struct modbus_shm
+{
+  /* PRIVATE */
+  uint8_t* base;
+  size_t size;
+
+  /* READ-ONLY */
+  int fd;
+  struct modbus_shm_block* blocks;
+  uint32_t nblocks;
+};
+
+/* Create image of n blocks in a new memfd named name and map it for
+ * writing. defs must be sorted by slave address, table and address and
+ * must not overlap. Block i of the image is defs[i], values start zero.
+ * Return 0 on success, -1 on bad defs or failed syscall (errno is set).
+ */
+int modbus_shm_create(struct modbus_shm* shm,
+                      const char* name,
+                      const struct modbus_shm_def* defs,
+                      size_t n);
+
+/* Map image of fd read-only. On success the fd is owned by shm.
+ * Return 0 on success, -1 if it's not an image or mapping failed.
+ */
+int modbus_shm_open(struct modbus_shm* shm, int fd);
+
+/* Unmap the image and close its fd */
+void modbus_shm_close(struct modbus_shm* shm);
+
+/* Index of block which contains addr, -1 if there is none */
+int modbus_shm_find(const struct modbus_shm* shm,
+                    uint8_t slave_addr,
+                    enum modbus_table table,
+                    uint16_t addr);
+
+/* Write count items starting at addr, in wire format. Items outside of
+ * blocks are ignored. Writer only. Return number of written items.
+ */
+int modbus_shm_update(struct modbus_shm* shm,
+                      uint8_t slave_addr,
+                      enum modbus_table table,
+                      uint16_t addr,
+                      const uint8_t* data,
+                      uint16_t count);
+
+/* Write data of the response the parser has just completed, typically
+ * from on_complete, as decoded by modbus_response_items (data split by
+ * a ring buffer included). Return number of written items, or -1 if
+ * the response doesn't match the query q.
+ */
+int modbus_shm_update_response(struct modbus_shm* shm,
+                               const modbus_parser* parser,
+                               const struct modbus_query* q);
+
+/* Current sequence of block, to check for a change without copying */
+uint32_t modbus_shm_seq(const struct modbus_shm* shm, int index);
+
+/* Copy consistent snapshot of values of block to out, which must hold
+ * MODBUS_TABLE_DATA_SIZE of the block. Return its sequence.
+ */
+uint32_t modbus_shm_read(const struct modbus_shm* shm, int index, uint8_t* out);
+
+#endif
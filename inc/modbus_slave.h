@@ -0,0 +1,84 @@
+#ifndef MODBUS_SLAVE_H_
+#define MODBUS_SLAVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Slave (server) side: register store and replies to parsed queries.
+ *
+ * A store holds the four data tables of a slave as flat arrays indexed
+ * by address, registers in wire format (big-endian) and coils packed
+ * least significant bit first, so reads and writes are a bounds check
+ * and a copy. Stores are attached to slave addresses, one store may
+ * serve any number of them (e.g. a test farm of identical devices).
+ *
+ * The reply is encoded straight into the output buffer, in framing of
+ * the parser: CRC for RTU, LRC for ASCII, MBAP header with the
+ * transaction id of the query for TCP. Bad quantities and addresses are
+ * answered with exceptions. Queries to address 0 in RTU and ASCII
+ * framing are broadcasts: writes are applied to every store and nothing
+ * is replied. In TCP framing unit id 0 is an address like any other.
+ */
+
+/* Longest reply: ASCII framing of 253 bytes PDU */
+#define MODBUS_SLAVE_REPLY_SIZE 512
+
+struct modbus_slave_store
+{
+  /* PUBLIC */
+  /* Items of each MODBUS_TABLE_, at addresses 0 .. count - 1. Function
+   * codes of a table with NULL data are answered with illegal function.
+   */
+  uint8_t* data[4];
+  uint32_t count[4];
+};
+
+struct modbus_slave
+{
+  /* PRIVATE */
+  struct modbus_slave_store* stores[256];
+
+  /* READ-ONLY */
+  uint64_t requests;
+  uint64_t exceptions;
+};
+
+void modbus_slave_store_init(struct modbus_slave_store* store);
+
+/* Serve table from data of MODBUS_TABLE_DATA_SIZE(table, count) bytes,
+ * count is at most 65536.
+ */
+void modbus_slave_store_table(struct modbus_slave_store* store,
+                              enum modbus_table table,
+                              uint8_t* data,
+                              uint32_t count);
+
+void modbus_slave_init(struct modbus_slave* slave);
+
+/* Answer queries to slave_addr from store, NULL to stop answering */
+void modbus_slave_attach(struct modbus_slave* slave,
+                         uint8_t slave_addr,
+                         struct modbus_slave_store* store);
+
+/* Execute query the parser has just completed and encode reply to buf
+ * of sz bytes (MODBUS_SLAVE_REPLY_SIZE is always enough). Return length
+ * of the reply, 0 if there is no reply (unknown slave or broadcast), or
+ * -1 if the query is not complete or buf is too small.
+ */
+int modbus_slave_reply(struct modbus_slave* slave,
+                       const modbus_parser* parser,
+                       uint8_t* buf,
+                       size_t sz);
+
+/* Encode exception reply to the query of parser, which only needs to
+ * have slave address and function parsed (e.g. unknown function).
+ * Return length of the reply or -1 if buf is too small.
+ */
+int modbus_slave_exception(const modbus_parser* parser,
+                           enum modbus_exception code,
+                           uint8_t* buf,
+                           size_t sz);
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef MODBUS_STATIC_HPP_
+#define MODBUS_STATIC_HPP_
+
+#include "modbus.h"
+
+/* Compile-time encoding of RTU queries, C++14.
+ *
+ * Queries known at build time (e.g. a static poll table) are encoded by
+ * the compiler, CRC included, and go to read-only data: nothing runs at
+ * startup and firmware images carry ready-to-send frames. CRC is the
+ * table algorithm of modbus_calc_crc, with the table computed by the
+ * compiler too. Invalid quantity or unknown function is a compile error
+ * in constant expressions.
+ *
+ *   static constexpr auto poll =
+ *     modbus::read_query(0x11, MODBUS_FUNC_READ_HOLD_REG, 0x006B, 3);
+ *   write(fd, poll.bytes, poll.size());
+ *
+ * A frame is a plain array of bytes, C code can use frames defined in a
+ * C++ file:
+ *
+ *   extern "C" const modbus::frame<8> poll_temp = modbus::read_query(...);
+ *   extern const uint8_t poll_temp[8];   (in C)
+ */
+
+namespace modbus {
+
+template<size_t N>
+struct frame
+{
+  uint8_t bytes[N];
+
+  static constexpr size_t size() { return N; }
+};
+
+namespace detail {
+
+struct crc_table_t
+{
+  uint16_t v[256];
+};
+
+constexpr crc_table_t
+make_crc_table()
+{
+  crc_table_t t{};
+
+  for (unsigned i = 0; i < 256; i++) {
+    uint16_t crc = i;
+    for (int k = 0; k < 8; k++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    t.v[i] = crc;
+  }
+  return t;
+}
+
+constexpr crc_table_t crc_table = make_crc_table();
+
+/* Not defined: reaching it in a constant expression fails compilation */
+void invalid_query();
+
+template<size_t N>
+constexpr void
+put_word(frame<N>& f, size_t at, uint16_t v)
+{
+  f.bytes[at] = v >> 8;
+  f.bytes[at + 1] = v & 0xFF;
+}
+
+} // namespace detail
+
+/* Same as modbus_calc_crc */
+constexpr uint16_t
+crc16(const uint8_t* data, size_t sz)
+{
+  uint16_t crc = 0xFFFF;
+
+  while (sz--)
+    crc = (crc >> 8) ^ detail::crc_table.v[(*data++ ^ crc) & 0xFF];
+  return crc;
+}
+
+namespace detail {
+
+/* Append CRC to the last two bytes */
+template<size_t N>
+constexpr frame<N>
+seal(frame<N> f)
+{
+  uint16_t crc = crc16(f.bytes, N - 2);
+
+  f.bytes[N - 2] = crc & 0xFF;
+  f.bytes[N - 1] = crc >> 8;
+  return f;
+}
+
+template<size_t N>
+constexpr frame<N>
+header(uint8_t slave_addr, enum modbus_func function, uint16_t addr)
+{
+  frame<N> f{};
+
+  f.bytes[0] = slave_addr;
+  f.bytes[1] = function;
+  put_word(f, 2, addr);
+  return f;
+}
+
+} // namespace detail
+
+/* READ_COILS, READ_DISCRETE_IN, READ_HOLD_REG or READ_IN_REG */
+constexpr frame<8>
+read_query(uint8_t slave_addr,
+           enum modbus_func function,
+           uint16_t addr,
+           uint16_t qty)
+{
+  frame<8> f = detail::header<8>(slave_addr, function, addr);
+  uint16_t limit = 0;
+
+  switch (function) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      limit = MODBUS_MAX_READ_BITS;
+      break;
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+      limit = MODBUS_MAX_READ_REGS;
+      break;
+    default:
+      break;
+  }
+  if (qty == 0 || qty > limit)
+    detail::invalid_query();
+
+  detail::put_word(f, 4, qty);
+  return detail::seal(f);
+}
+
+constexpr frame<8>
+write_reg_query(uint8_t slave_addr, uint16_t addr, uint16_t value)
+{
+  frame<8> f = detail::header<8>(slave_addr, MODBUS_FUNC_WRITE_REG, addr);
+
+  detail::put_word(f, 4, value);
+  return detail::seal(f);
+}
+
+constexpr frame<8>
+write_coil_query(uint8_t slave_addr, uint16_t addr, bool value)
+{
+  frame<8> f = detail::header<8>(slave_addr, MODBUS_FUNC_WRITE_COIL, addr);
+
+  detail::put_word(f, 4, value ? MODBUS_COIL_HIGH : MODBUS_COIL_LOW);
+  return detail::seal(f);
+}
+
+template<size_t N>
+constexpr frame<9 + 2 * N>
+write_regs_query(uint8_t slave_addr,
+                 uint16_t addr,
+                 const uint16_t (&values)[N])
+{
+  static_assert(N <= MODBUS_MAX_WRITE_REGS, "too many registers");
+  frame<9 + 2 * N> f =
+    detail::header<9 + 2 * N>(slave_addr, MODBUS_FUNC_WRITE_REGS, addr);
+
+  detail::put_word(f, 4, N);
+  f.bytes[6] = 2 * N;
+  for (size_t i = 0; i < N; i++)
+    detail::put_word(f, 7 + 2 * i, values[i]);
+  return detail::seal(f);
+}
+
+/* Coils are packed least significant bit first, as on the wire */
+template<size_t N>
+constexpr frame<9 + (N + 7) / 8>
+write_coils_query(uint8_t slave_addr, uint16_t addr, const bool (&values)[N])
+{
+  static_assert(N <= MODBUS_MAX_WRITE_BITS, "too many coils");
+  frame<9 + (N + 7) / 8> f =
+    detail::header<9 + (N + 7) / 8>(slave_addr, MODBUS_FUNC_WRITE_COILS, addr);
+
+  detail::put_word(f, 4, N);
+  f.bytes[6] = (N + 7) / 8;
+  for (size_t i = 0; i < N; i++)
+    f.bytes[7 + i / 8] |= values[i] << (i % 8);
+  return detail::seal(f);
+}
+
+} // namespace modbus
+
+#endif
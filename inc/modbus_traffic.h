@@ -0,0 +1,87 @@
+#ifndef MODBUS_TRAFFIC_H_
+#define MODBUS_TRAFFIC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Deterministic generator of realistic Modbus traffic, for benchmarks
+ * and tests which need more than a few hand-made frames.
+ *
+ * A generator produces a stream of query or response frames of one
+ * framing: mixed function codes weighted like a polling master (mostly
+ * register reads), random slaves, addresses and quantities, exception
+ * responses, and impairments of a noisy line: frames with a bad CRC (LRC
+ * in ASCII) and frames with a dropped byte. The same seed and config give
+ * the same stream on every platform, so a corpus written once (e.g. by
+ * mbtrafgen) or regenerated on the fly gives repeatable measurements.
+ *
+ * Rates are in parts per million of frames. Counters tell how many
+ * frames of each kind were generated, to be compared with what a parser
+ * reports. TCP framing has no checksum and runs over a reliable stream,
+ * CRC error and drop rates are ignored.
+ */
+
+/* Longest generated frame: ASCII framing of 253 bytes PDU */
+#define MODBUS_TRAFFIC_MAX_FRAME 520
+
+struct modbus_traffic_config
+{
+  enum modbus_parser_type type; /* Queries or responses */
+  enum modbus_framing framing;
+  uint32_t seed;
+
+  /* Relative weight of each function code, 0 = never. Defaults to a
+   * polling mix: FC 3 and 4 most, then coils, then writes.
+   */
+  uint16_t weight[MODBUS_FUNC_READ_WRITE_REGS + 1];
+
+  uint8_t nslaves;  /* Slave addresses 1 .. nslaves */
+  uint16_t max_qty; /* Registers per frame, 16x as many coils */
+
+  uint32_t exception_ppm; /* Responses only */
+  uint32_t crc_error_ppm;
+  uint32_t drop_ppm;
+};
+
+struct modbus_traffic
+{
+  /* PRIVATE */
+  struct modbus_traffic_config config;
+  uint32_t rng;
+  uint32_t total_weight;
+  uint16_t transaction_id;
+  uint8_t pending[MODBUS_TRAFFIC_MAX_FRAME]; /* Didn't fit into buf */
+  uint16_t pending_len;
+
+  /* READ-ONLY */
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t exceptions;
+  uint64_t crc_errors;
+  uint64_t drops;
+};
+
+/* Defaults: RTU responses of 16 slaves, up to 32 registers, no
+ * exceptions and no impairments, seed 1.
+ */
+void modbus_traffic_config_init(struct modbus_traffic_config* config);
+
+/* Config is copied. Return -1 if all weights are 0 or a weight is given
+ * to a function other than FC 1-6, 15, 16 and 23.
+ */
+int modbus_traffic_init(struct modbus_traffic* t,
+                        const struct modbus_traffic_config* config);
+
+/* Generate next frame to buf of sz bytes. Return its length, or -1 if
+ * it doesn't fit (MODBUS_TRAFFIC_MAX_FRAME is always enough); the frame
+ * is kept for the next call, so the stream doesn't depend on sizes of
+ * buffers.
+ */
+int modbus_traffic_next(struct modbus_traffic* t, uint8_t* buf, size_t sz);
+
+/* Fill buf with as many whole frames as fit, return number of bytes */
+size_t modbus_traffic_fill(struct modbus_traffic* t, uint8_t* buf, size_t sz);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef MODBUS_WRITEQ_H_
+#define MODBUS_WRITEQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/* Write combining queue.
+ *
+ * Single register and coil writes of the application are kept pending
+ * until their deadline. Writes to adjacent or overlapping addresses of
+ * the same slave are merged (the latest value wins), so a burst turns
+ * into a single WRITE_REGS/WRITE_COILS query. A pending register write
+ * can also ride along with a holding register read as READ_WRITE_REGS
+ * (FC 23), ahead of its deadline.
+ *
+ * Memory for pending writes is supplied by the caller, one slot per
+ * query being combined.
+ */
+
+struct modbus_writeq_slot
+{
+  /* PRIVATE */
+  bool used;
+  uint8_t slave_addr;
+  enum modbus_table table; /* COILS or HOLD_REG */
+  uint16_t addr;
+  uint16_t count;
+  uint64_t deadline;
+  union
+  {
+    uint16_t regs[MODBUS_MAX_WRITE_REGS];
+    uint8_t bits[(MODBUS_MAX_WRITE_BITS + 7) / 8];
+  };
+};
+
+struct modbus_writeq
+{
+  /* PRIVATE */
+  struct modbus_writeq_slot* slots;
+  size_t nslots;
+
+  /* Data of the last flushed query */
+  uint16_t out[MODBUS_MAX_WRITE_REGS];
+};
+
+void modbus_writeq_init(struct modbus_writeq* w,
+                        struct modbus_writeq_slot* slots,
+                        size_t nslots);
+
+/* Queue write of a holding register, to be sent not later than
+ * deadline. Return -1 if there is no free slot, flush and retry.
+ */
+int modbus_writeq_reg(struct modbus_writeq* w,
+                      uint8_t slave_addr,
+                      uint16_t addr,
+                      uint16_t value,
+                      uint64_t deadline);
+
+/* Same as modbus_writeq_reg for a coil */
+int modbus_writeq_coil(struct modbus_writeq* w,
+                       uint8_t slave_addr,
+                       uint16_t addr,
+                       bool value,
+                       uint64_t deadline);
+
+/* Encode the next write into buf with modbus_gen_query and remove it
+ * from the queue. Writes which are due at now go first, earliest
+ * deadline first. If read is not NULL (a query about to be sent), a
+ * pending register write of the same slave is combined with it into
+ * READ_WRITE_REGS even if it's not due yet.
+ *
+ * The encoded query is stored to q, its data stays valid until the next
+ * flush. q->function tells if read was combined. Return length of the
+ * query, 0 if nothing is due or negative if buf is too small.
+ */
+int modbus_writeq_flush(struct modbus_writeq* w,
+                        uint64_t now,
+                        const struct modbus_query* read,
+                        struct modbus_query* q,
+                        uint8_t* buf,
+                        size_t sz);
+
+/* Return the earliest deadline, UINT64_MAX if nothing is pending */
+uint64_t modbus_writeq_next_due(const struct modbus_writeq* w);
+
+#endif
@@ -1,7 +1,16 @@
+#include <stddef.h>
 #include <string.h>
 
 #include "modbus.h"
 
+#ifdef MODBUS_PARSER_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
 static const uint16_t crc_table[] = {
   0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241, 0XC601,
   0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440, 0XCC01, 0X0CC0,
@@ -34,24 +43,290 @@ static const uint16_t crc_table[] = {
   0X4100, 0X81C1, 0X8081, 0X4040
 };
 
+/* Tables for slicing by 4, crc_slice[k][i] is CRC of byte i followed by
+ * k + 1 zero bytes; crc_table is the one with no zero bytes
+ */
+static const uint16_t crc_slice[3][256] = {
+  {
+    0X0000, 0X9001, 0X6001, 0XF000, 0XC002, 0X5003, 0XA003, 0X3002,
+    0XC007, 0X5006, 0XA006, 0X3007, 0X0005, 0X9004, 0X6004, 0XF005,
+    0XC00D, 0X500C, 0XA00C, 0X300D, 0X000F, 0X900E, 0X600E, 0XF00F,
+    0X000A, 0X900B, 0X600B, 0XF00A, 0XC008, 0X5009, 0XA009, 0X3008,
+    0XC019, 0X5018, 0XA018, 0X3019, 0X001B, 0X901A, 0X601A, 0XF01B,
+    0X001E, 0X901F, 0X601F, 0XF01E, 0XC01C, 0X501D, 0XA01D, 0X301C,
+    0X0014, 0X9015, 0X6015, 0XF014, 0XC016, 0X5017, 0XA017, 0X3016,
+    0XC013, 0X5012, 0XA012, 0X3013, 0X0011, 0X9010, 0X6010, 0XF011,
+    0XC031, 0X5030, 0XA030, 0X3031, 0X0033, 0X9032, 0X6032, 0XF033,
+    0X0036, 0X9037, 0X6037, 0XF036, 0XC034, 0X5035, 0XA035, 0X3034,
+    0X003C, 0X903D, 0X603D, 0XF03C, 0XC03E, 0X503F, 0XA03F, 0X303E,
+    0XC03B, 0X503A, 0XA03A, 0X303B, 0X0039, 0X9038, 0X6038, 0XF039,
+    0X0028, 0X9029, 0X6029, 0XF028, 0XC02A, 0X502B, 0XA02B, 0X302A,
+    0XC02F, 0X502E, 0XA02E, 0X302F, 0X002D, 0X902C, 0X602C, 0XF02D,
+    0XC025, 0X5024, 0XA024, 0X3025, 0X0027, 0X9026, 0X6026, 0XF027,
+    0X0022, 0X9023, 0X6023, 0XF022, 0XC020, 0X5021, 0XA021, 0X3020,
+    0XC061, 0X5060, 0XA060, 0X3061, 0X0063, 0X9062, 0X6062, 0XF063,
+    0X0066, 0X9067, 0X6067, 0XF066, 0XC064, 0X5065, 0XA065, 0X3064,
+    0X006C, 0X906D, 0X606D, 0XF06C, 0XC06E, 0X506F, 0XA06F, 0X306E,
+    0XC06B, 0X506A, 0XA06A, 0X306B, 0X0069, 0X9068, 0X6068, 0XF069,
+    0X0078, 0X9079, 0X6079, 0XF078, 0XC07A, 0X507B, 0XA07B, 0X307A,
+    0XC07F, 0X507E, 0XA07E, 0X307F, 0X007D, 0X907C, 0X607C, 0XF07D,
+    0XC075, 0X5074, 0XA074, 0X3075, 0X0077, 0X9076, 0X6076, 0XF077,
+    0X0072, 0X9073, 0X6073, 0XF072, 0XC070, 0X5071, 0XA071, 0X3070,
+    0X0050, 0X9051, 0X6051, 0XF050, 0XC052, 0X5053, 0XA053, 0X3052,
+    0XC057, 0X5056, 0XA056, 0X3057, 0X0055, 0X9054, 0X6054, 0XF055,
+    0XC05D, 0X505C, 0XA05C, 0X305D, 0X005F, 0X905E, 0X605E, 0XF05F,
+    0X005A, 0X905B, 0X605B, 0XF05A, 0XC058, 0X5059, 0XA059, 0X3058,
+    0XC049, 0X5048, 0XA048, 0X3049, 0X004B, 0X904A, 0X604A, 0XF04B,
+    0X004E, 0X904F, 0X604F, 0XF04E, 0XC04C, 0X504D, 0XA04D, 0X304C,
+    0X0044, 0X9045, 0X6045, 0XF044, 0XC046, 0X5047, 0XA047, 0X3046,
+    0XC043, 0X5042, 0XA042, 0X3043, 0X0041, 0X9040, 0X6040, 0XF041
+  },
+  {
+    0X0000, 0XC051, 0XC0A1, 0X00F0, 0XC141, 0X0110, 0X01E0, 0XC1B1,
+    0XC281, 0X02D0, 0X0220, 0XC271, 0X03C0, 0XC391, 0XC361, 0X0330,
+    0XC501, 0X0550, 0X05A0, 0XC5F1, 0X0440, 0XC411, 0XC4E1, 0X04B0,
+    0X0780, 0XC7D1, 0XC721, 0X0770, 0XC6C1, 0X0690, 0X0660, 0XC631,
+    0XCA01, 0X0A50, 0X0AA0, 0XCAF1, 0X0B40, 0XCB11, 0XCBE1, 0X0BB0,
+    0X0880, 0XC8D1, 0XC821, 0X0870, 0XC9C1, 0X0990, 0X0960, 0XC931,
+    0X0F00, 0XCF51, 0XCFA1, 0X0FF0, 0XCE41, 0X0E10, 0X0EE0, 0XCEB1,
+    0XCD81, 0X0DD0, 0X0D20, 0XCD71, 0X0CC0, 0XCC91, 0XCC61, 0X0C30,
+    0XD401, 0X1450, 0X14A0, 0XD4F1, 0X1540, 0XD511, 0XD5E1, 0X15B0,
+    0X1680, 0XD6D1, 0XD621, 0X1670, 0XD7C1, 0X1790, 0X1760, 0XD731,
+    0X1100, 0XD151, 0XD1A1, 0X11F0, 0XD041, 0X1010, 0X10E0, 0XD0B1,
+    0XD381, 0X13D0, 0X1320, 0XD371, 0X12C0, 0XD291, 0XD261, 0X1230,
+    0X1E00, 0XDE51, 0XDEA1, 0X1EF0, 0XDF41, 0X1F10, 0X1FE0, 0XDFB1,
+    0XDC81, 0X1CD0, 0X1C20, 0XDC71, 0X1DC0, 0XDD91, 0XDD61, 0X1D30,
+    0XDB01, 0X1B50, 0X1BA0, 0XDBF1, 0X1A40, 0XDA11, 0XDAE1, 0X1AB0,
+    0X1980, 0XD9D1, 0XD921, 0X1970, 0XD8C1, 0X1890, 0X1860, 0XD831,
+    0XE801, 0X2850, 0X28A0, 0XE8F1, 0X2940, 0XE911, 0XE9E1, 0X29B0,
+    0X2A80, 0XEAD1, 0XEA21, 0X2A70, 0XEBC1, 0X2B90, 0X2B60, 0XEB31,
+    0X2D00, 0XED51, 0XEDA1, 0X2DF0, 0XEC41, 0X2C10, 0X2CE0, 0XECB1,
+    0XEF81, 0X2FD0, 0X2F20, 0XEF71, 0X2EC0, 0XEE91, 0XEE61, 0X2E30,
+    0X2200, 0XE251, 0XE2A1, 0X22F0, 0XE341, 0X2310, 0X23E0, 0XE3B1,
+    0XE081, 0X20D0, 0X2020, 0XE071, 0X21C0, 0XE191, 0XE161, 0X2130,
+    0XE701, 0X2750, 0X27A0, 0XE7F1, 0X2640, 0XE611, 0XE6E1, 0X26B0,
+    0X2580, 0XE5D1, 0XE521, 0X2570, 0XE4C1, 0X2490, 0X2460, 0XE431,
+    0X3C00, 0XFC51, 0XFCA1, 0X3CF0, 0XFD41, 0X3D10, 0X3DE0, 0XFDB1,
+    0XFE81, 0X3ED0, 0X3E20, 0XFE71, 0X3FC0, 0XFF91, 0XFF61, 0X3F30,
+    0XF901, 0X3950, 0X39A0, 0XF9F1, 0X3840, 0XF811, 0XF8E1, 0X38B0,
+    0X3B80, 0XFBD1, 0XFB21, 0X3B70, 0XFAC1, 0X3A90, 0X3A60, 0XFA31,
+    0XF601, 0X3650, 0X36A0, 0XF6F1, 0X3740, 0XF711, 0XF7E1, 0X37B0,
+    0X3480, 0XF4D1, 0XF421, 0X3470, 0XF5C1, 0X3590, 0X3560, 0XF531,
+    0X3300, 0XF351, 0XF3A1, 0X33F0, 0XF241, 0X3210, 0X32E0, 0XF2B1,
+    0XF181, 0X31D0, 0X3120, 0XF171, 0X30C0, 0XF091, 0XF061, 0X3030
+  },
+  {
+    0X0000, 0XFC01, 0XB801, 0X4400, 0X3001, 0XCC00, 0X8800, 0X7401,
+    0X6002, 0X9C03, 0XD803, 0X2402, 0X5003, 0XAC02, 0XE802, 0X1403,
+    0XC004, 0X3C05, 0X7805, 0X8404, 0XF005, 0X0C04, 0X4804, 0XB405,
+    0XA006, 0X5C07, 0X1807, 0XE406, 0X9007, 0X6C06, 0X2806, 0XD407,
+    0XC00B, 0X3C0A, 0X780A, 0X840B, 0XF00A, 0X0C0B, 0X480B, 0XB40A,
+    0XA009, 0X5C08, 0X1808, 0XE409, 0X9008, 0X6C09, 0X2809, 0XD408,
+    0X000F, 0XFC0E, 0XB80E, 0X440F, 0X300E, 0XCC0F, 0X880F, 0X740E,
+    0X600D, 0X9C0C, 0XD80C, 0X240D, 0X500C, 0XAC0D, 0XE80D, 0X140C,
+    0XC015, 0X3C14, 0X7814, 0X8415, 0XF014, 0X0C15, 0X4815, 0XB414,
+    0XA017, 0X5C16, 0X1816, 0XE417, 0X9016, 0X6C17, 0X2817, 0XD416,
+    0X0011, 0XFC10, 0XB810, 0X4411, 0X3010, 0XCC11, 0X8811, 0X7410,
+    0X6013, 0X9C12, 0XD812, 0X2413, 0X5012, 0XAC13, 0XE813, 0X1412,
+    0X001E, 0XFC1F, 0XB81F, 0X441E, 0X301F, 0XCC1E, 0X881E, 0X741F,
+    0X601C, 0X9C1D, 0XD81D, 0X241C, 0X501D, 0XAC1C, 0XE81C, 0X141D,
+    0XC01A, 0X3C1B, 0X781B, 0X841A, 0XF01B, 0X0C1A, 0X481A, 0XB41B,
+    0XA018, 0X5C19, 0X1819, 0XE418, 0X9019, 0X6C18, 0X2818, 0XD419,
+    0XC029, 0X3C28, 0X7828, 0X8429, 0XF028, 0X0C29, 0X4829, 0XB428,
+    0XA02B, 0X5C2A, 0X182A, 0XE42B, 0X902A, 0X6C2B, 0X282B, 0XD42A,
+    0X002D, 0XFC2C, 0XB82C, 0X442D, 0X302C, 0XCC2D, 0X882D, 0X742C,
+    0X602F, 0X9C2E, 0XD82E, 0X242F, 0X502E, 0XAC2F, 0XE82F, 0X142E,
+    0X0022, 0XFC23, 0XB823, 0X4422, 0X3023, 0XCC22, 0X8822, 0X7423,
+    0X6020, 0X9C21, 0XD821, 0X2420, 0X5021, 0XAC20, 0XE820, 0X1421,
+    0XC026, 0X3C27, 0X7827, 0X8426, 0XF027, 0X0C26, 0X4826, 0XB427,
+    0XA024, 0X5C25, 0X1825, 0XE424, 0X9025, 0X6C24, 0X2824, 0XD425,
+    0X003C, 0XFC3D, 0XB83D, 0X443C, 0X303D, 0XCC3C, 0X883C, 0X743D,
+    0X603E, 0X9C3F, 0XD83F, 0X243E, 0X503F, 0XAC3E, 0XE83E, 0X143F,
+    0XC038, 0X3C39, 0X7839, 0X8438, 0XF039, 0X0C38, 0X4838, 0XB439,
+    0XA03A, 0X5C3B, 0X183B, 0XE43A, 0X903B, 0X6C3A, 0X283A, 0XD43B,
+    0XC037, 0X3C36, 0X7836, 0X8437, 0XF036, 0X0C37, 0X4837, 0XB436,
+    0XA035, 0X5C34, 0X1834, 0XE435, 0X9034, 0X6C35, 0X2835, 0XD434,
+    0X0033, 0XFC32, 0XB832, 0X4433, 0X3032, 0XCC33, 0X8833, 0X7432,
+    0X6031, 0X9C30, 0XD830, 0X2431, 0X5030, 0XAC31, 0XE831, 0X1430
+  }
+};
+
+/* Hex digit to nibble, 0x10 bit marks valid digits. Keeping the marker
+ * inside the value let us validate a pair of digits with a single AND.
+ */
+static const uint8_t hex_table[256] = {
+  ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+  ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+  ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E,
+  ['F'] = 0x1F, ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D,
+  ['e'] = 0x1E, ['f'] = 0x1F
+};
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+#ifdef MODBUS_PARSER_STATS
+#define STATS_ADD(FIELD, N)                                                    \
+  do {                                                                         \
+    if (parser->stats)                                                         \
+      parser->stats->FIELD += (N);                                             \
+  } while (0)
+
+/* Counters are written inside a seqlock, see modbus_parser_stats_snapshot */
+#define STATS_BEGIN()                                                          \
+  do {                                                                         \
+    if (parser->stats) {                                                       \
+      __atomic_store_n(                                                        \
+        &parser->stats->seq, parser->stats->seq + 1, __ATOMIC_RELAXED);        \
+      __atomic_thread_fence(__ATOMIC_RELEASE);                                 \
+    }                                                                          \
+  } while (0)
+
+#define STATS_END()                                                            \
+  do {                                                                         \
+    if (parser->stats)                                                         \
+      __atomic_store_n(                                                        \
+        &parser->stats->seq, parser->stats->seq + 1, __ATOMIC_RELEASE);        \
+  } while (0)
+#else
+#define STATS_ADD(FIELD, N)
+#define STATS_BEGIN()
+#define STATS_END()
+#endif
+
+#ifdef MODBUS_PARSER_PROFILE
+#define CB_INDEX(FOR)                                                          \
+  (offsetof(modbus_parser_settings, on_##FOR) / sizeof(modbus_cb))
+
+_Static_assert(CB_INDEX(complete) == MODBUS_CB_COMPLETE &&
+                 sizeof(modbus_parser_settings) ==
+                   MODBUS_CB_COUNT * sizeof(modbus_cb),
+               "modbus_cb_type follows modbus_parser_settings");
+
+static inline uint64_t
+profile_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Counter which snapshots read without the seqlock, never torn */
+#define PROFILE_COUNT(COUNTER)                                                 \
+  __atomic_store_n(&(COUNTER), (COUNTER) + 1, __ATOMIC_RELAXED)
+
+/* Return 1 if this call is the sampled one */
+static inline int
+profile_sample(struct modbus_parser_profile* p)
+{
+  if (--p->countdown > 0)
+    return 0;
+
+  /* Random distance to the next sample, 1 .. 2 * interval - 1, so the
+   * samples don't follow a fixed pattern of calls
+   */
+  p->rng ^= p->rng << 13;
+  p->rng ^= p->rng >> 17;
+  p->rng ^= p->rng << 5;
+  p->countdown = 1 + p->rng % (2 * p->interval - 1);
+  return 1;
+}
+
+/* Same seqlock as stats, around update of samples */
+static inline void
+profile_begin(struct modbus_parser_profile* p)
+{
+  __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+profile_end(struct modbus_parser_profile* p)
+{
+  __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Call callback, timing it if it's the sampled one */
+static int
+profile_call(modbus_parser* parser, modbus_cb cb, enum modbus_cb_type type)
+{
+  struct modbus_parser_profile* p = parser->profile;
+  uint8_t function = parser->function;
+  uint64_t start;
+  uint64_t cycles;
+  int rc;
+
+  if (p == NULL)
+    return cb(parser);
+
+  PROFILE_COUNT(p->calls[type]);
+  if (!profile_sample(p))
+    return cb(parser);
+
+  start = profile_now();
+  rc = cb(parser);
+  cycles = profile_now() - start;
+
+  profile_begin(p);
+  p->samples[type]++;
+  p->cycles[type] += cycles;
+  p->func_samples[function]++;
+  p->func_cycles[function] += cycles;
+  profile_end(p);
+  return rc;
+}
+
+#define CALLBACK_CALL(FOR)                                                     \
+  profile_call(parser, settings->on_##FOR, CB_INDEX(FOR))
+#else
+#define CALLBACK_CALL(FOR) settings->on_##FOR(parser)
+#endif
+
 #define CALLBACK_NOTIFY(FOR)                                                   \
   do {                                                                         \
     if (settings->on_##FOR) {                                                  \
-      if (settings->on_##FOR(parser) != 0) {                                   \
+      if (CALLBACK_CALL(FOR) != 0) {                                           \
         parser->errno = 1;                                                     \
+        STATS_ADD(callback_aborts, 1);                                         \
       }                                                                        \
     }                                                                          \
   } while (0)
 
 void
 modbus_parser_init(modbus_parser* parser, enum modbus_parser_type t)
+{
+  modbus_parser_init_framing(parser, t, MODBUS_FRAMING_RTU);
+}
+
+void
+modbus_parser_init_framing(modbus_parser* parser,
+                           enum modbus_parser_type t,
+                           enum modbus_framing f)
 {
   void* arg = parser->arg; /* preserve application data */
+#ifdef MODBUS_PARSER_STATS
+  struct modbus_parser_stats* stats = parser->stats;
+#endif
+#ifdef MODBUS_PARSER_PROFILE
+  struct modbus_parser_profile* profile = parser->profile;
+#endif
   memset(parser, 0, sizeof(*parser));
   parser->arg = arg;
+#ifdef MODBUS_PARSER_STATS
+  parser->stats = stats;
+#endif
+#ifdef MODBUS_PARSER_PROFILE
+  parser->profile = profile;
+#endif
   parser->type = t;
+  parser->framing = f;
   parser->state = s_slave_addr;
-  parser->calc_crc = 0xFFFF;
+  parser->ascii_state = s_ascii_start;
+  parser->calc_crc = (f == MODBUS_FRAMING_ASCII) ? 0 : 0xFFFF;
 }
 
 void
@@ -70,7 +345,7 @@ const char*
 modbus_func_str(enum modbus_func f)
 {
   switch (f) {
-#define XX(num, name, string)                                                  \
+#define XX(num, name, string, query, response)                                 \
   case MODBUS_FUNC_##name:                                                     \
     return string;
     MODBUS_FUNC_MAP(XX)
@@ -80,33 +355,109 @@ modbus_func_str(enum modbus_func f)
   }
 }
 
-/*
-static enum modbus_parser_state
-state_after_function(modbus_func f)
+/* Layout descriptors, generated from MODBUS_FUNC_MAP. A function code
+ * maps to an index in func_index, index 0 is an unknown function.
+ * Exception responses are recognized for known functions only, so that
+ * garbage doesn't pass for frames.
+ */
+enum func_index
 {
-  switch (f) {
-    case MODBUS_FUNC_READ_COILS:
-    case MODBUS_FUNC_READ_DISCRETE_IN:
-    case MODBUS_FUNC_READ_HOLD_REG:
-    case MODBUS_FUNC_READ_IN_REG:
-      return s_len;
+  FUNC_UNKNOWN,
+#define XX(num, name, string, query, response) FUNC_##name,
+  MODBUS_FUNC_MAP(XX)
+#undef XX
+  FUNC_EXCEPTION,
+  FUNC_COUNT
+};
 
-    case MODBUS_FUNC_WRITE_COIL:
-    case MODBUS_FUNC_WRITE_REG:
-      return s_single_addr_hi;
+static const uint8_t func_index[256] = {
+#define XX(num, name, string, query, response)                                 \
+  [num] = FUNC_##name, [num | MODBUS_EXCEPTION_BIT] = FUNC_EXCEPTION,
+  MODBUS_FUNC_MAP(XX)
+#undef XX
+};
 
-    case MODBUS_FUNC_WRITE_COILS:
-    case MODBUS_FUNC_WRITE_REGS:
-      return s_start_addr_hi;
+struct func_layout
+{
+  uint8_t layout;     /* MODBUS_LAYOUT_ flags, 0 if function is not valid */
+  uint8_t after_func; /* Next state after function code */
+  uint8_t after_addr; /* ... after address */
+  uint8_t after_qty;  /* ... after quantity */
+  uint8_t value_len;  /* Length of data without byte count */
+  uint8_t header;     /* Length of frame up to data, byte count included */
+};
+
+#define HAS(l, F) ((l) & MODBUS_LAYOUT_##F)
+#define VALUE_LEN(l) (HAS(l, VALUE) ? 2 : HAS(l, CODE) ? 1 : 0)
+#define AFTER_QTY(l)                                                           \
+  (HAS(l, WRITE)   ? s_write_addr_hi                                           \
+   : HAS(l, BYTES) ? s_len                                                     \
+   : VALUE_LEN(l)  ? s_data                                                    \
+                   : s_crc_lo)
+#define AFTER_ADDR(l) (HAS(l, QTY) ? s_qty_hi : AFTER_QTY(l))
+#define AFTER_FUNC(l) (HAS(l, ADDR) ? s_start_addr_hi : AFTER_ADDR(l))
+#define HEADER(l)                                                              \
+  (2 + (HAS(l, ADDR) ? 2 : 0) + (HAS(l, QTY) ? 2 : 0) +                        \
+   (HAS(l, WRITE) ? 4 : 0) + VALUE_LEN(l) + (HAS(l, BYTES) ? 1 : 0))
+#define LAYOUT(l)                                                              \
+  {                                                                            \
+    (l), AFTER_FUNC(l), AFTER_ADDR(l), AFTER_QTY(l), VALUE_LEN(l), HEADER(l)   \
+  }
+
+static const struct func_layout layouts[2][FUNC_COUNT] = {
+  [MODBUS_QUERY] = {
+#define XX(num, name, string, query, response)                                 \
+  [FUNC_##name] = LAYOUT(MODBUS_LAYOUT_##query),
+    MODBUS_FUNC_MAP(XX)
+#undef XX
+  },
+  [MODBUS_RESPONSE] = {
+#define XX(num, name, string, query, response)                                 \
+  [FUNC_##name] = LAYOUT(MODBUS_LAYOUT_##response),
+    MODBUS_FUNC_MAP(XX)
+#undef XX
+    [FUNC_EXCEPTION] = LAYOUT(MODBUS_LAYOUT_CODE),
+  },
+};
+
+static inline const struct func_layout*
+layout_of(const modbus_parser* parser)
+{
+  return &layouts[parser->type][parser->layout];
+}
+
+/* Move to the next field of layout. Data of fixed length has no byte
+ * count, its length comes from the layout.
+ */
+static inline void
+next_field(modbus_parser* parser, uint8_t state)
+{
+  parser->state = state;
+  if (state == s_data) {
+    parser->data_len = layout_of(parser)->value_len;
+    parser->data_cnt = 0;
   }
 }
-*/
 
-uint16_t
-modbus_calc_crc(const uint8_t* data, size_t sz)
+/* Four bytes of CRC with independent table lookups */
+static inline uint16_t
+crc_step4(uint16_t crc, const uint8_t* data)
+{
+  uint32_t x =
+    crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+
+  return crc_slice[2][x & 0xFF] ^ crc_slice[1][(x >> 8) & 0xFF] ^
+         crc_slice[0][(x >> 16) & 0xFF] ^ crc_table[x >> 24];
+}
+
+/* CRC of a span, four bytes per step, the tail byte by byte */
+static inline uint16_t
+crc_bulk(uint16_t crc, const uint8_t* data, size_t sz)
 {
   uint8_t tmp;
-  uint16_t crc = 0xFFFF;
+
+  for (; sz >= 4; sz -= 4, data += 4)
+    crc = crc_step4(crc, data);
 
   while (sz--) {
     tmp = *data++ ^ crc;
@@ -116,6 +467,54 @@ modbus_calc_crc(const uint8_t* data, size_t sz)
   return crc;
 }
 
+/* Four frames at once. Their CRC chains are independent, so lookups of
+ * one lane run while the others wait for theirs.
+ */
+static inline void
+crc_lanes4(const uint8_t* const* data, const size_t* sz, uint16_t* crc)
+{
+  uint16_t c0 = 0xFFFF, c1 = 0xFFFF, c2 = 0xFFFF, c3 = 0xFFFF;
+  size_t common = sz[0];
+  size_t k;
+
+  for (int i = 1; i < 4; i++) {
+    if (sz[i] < common)
+      common = sz[i];
+  }
+
+  for (k = 0; k + 4 <= common; k += 4) {
+    c0 = crc_step4(c0, data[0] + k);
+    c1 = crc_step4(c1, data[1] + k);
+    c2 = crc_step4(c2, data[2] + k);
+    c3 = crc_step4(c3, data[3] + k);
+  }
+
+  crc[0] = crc_bulk(c0, data[0] + k, sz[0] - k);
+  crc[1] = crc_bulk(c1, data[1] + k, sz[1] - k);
+  crc[2] = crc_bulk(c2, data[2] + k, sz[2] - k);
+  crc[3] = crc_bulk(c3, data[3] + k, sz[3] - k);
+}
+
+uint16_t
+modbus_calc_crc(const uint8_t* data, size_t sz)
+{
+  return crc_bulk(0xFFFF, data, sz);
+}
+
+void
+modbus_calc_crc_batch(const uint8_t* const* data,
+                      const size_t* sz,
+                      uint16_t* crc,
+                      size_t n)
+{
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    crc_lanes4(data + i, sz + i, crc + i);
+  for (; i < n; i++)
+    crc[i] = crc_bulk(0xFFFF, data[i], sz[i]);
+}
+
 void
 modbus_crc_update(uint16_t* crc, uint8_t data)
 {
@@ -126,145 +525,408 @@ modbus_crc_update(uint16_t* crc, uint8_t data)
   *crc ^= crc_table[tmp];
 }
 
-static size_t
-parse_query(modbus_parser* parser,
-            const modbus_parser_settings* settings,
-            const uint8_t* data,
-            size_t len)
+uint8_t
+modbus_calc_lrc(const uint8_t* data, size_t sz)
+{
+  uint8_t lrc = 0;
+
+  while (sz--)
+    lrc += *data++;
+  return -lrc;
+}
+
+/* Feed single byte to the state machine. Framing (checksum, end of
+ * frame) is handled by the caller. `data` must stay valid until end of
+ * frame, parser->data points to it. Fields after function code follow
+ * its layout, for queries or responses.
+ */
+static inline void
+parse_byte(modbus_parser* parser,
+           const modbus_parser_settings* settings,
+           const uint8_t* data)
+{
+  switch (parser->state) {
+    case s_slave_addr:
+      parser->slave_addr = *data;
+      parser->state = s_func;
+      CALLBACK_NOTIFY(slave_addr);
+      break;
+
+    case s_func:
+      parser->function = (enum modbus_func) * data;
+      parser->layout = func_index[*data];
+      next_field(parser, layout_of(parser)->after_func);
+      CALLBACK_NOTIFY(function);
+      if (layout_of(parser)->layout == 0)
+        parser->errno = 1; /* Unknown function */
+      break;
+
+    case s_len:
+      parser->data_len = *data;
+      if (parser->data_len == 0) {
+        parser->errno = 1; /* Byte count of 0, no data field */
+        break;
+      }
+      parser->state = s_data;
+      parser->data_cnt = 0;
+      CALLBACK_NOTIFY(data_len);
+      break;
+
+    case s_start_addr_hi:
+      parser->addr = (uint16_t)*data << 8;
+      parser->state = s_start_addr_lo;
+      break;
+
+    case s_start_addr_lo:
+      parser->addr += *data;
+      next_field(parser, layout_of(parser)->after_addr);
+      CALLBACK_NOTIFY(addr);
+      break;
+
+    case s_qty_hi:
+      parser->qty = (uint16_t)*data << 8;
+      parser->state = s_qty_lo;
+      break;
+
+    case s_qty_lo:
+      parser->qty += *data;
+      next_field(parser, layout_of(parser)->after_qty);
+      CALLBACK_NOTIFY(qty);
+      break;
+
+    case s_write_addr_hi:
+      parser->write_addr = (uint16_t)*data << 8;
+      parser->state = s_write_addr_lo;
+      break;
+
+    case s_write_addr_lo:
+      parser->write_addr += *data;
+      parser->state = s_write_qty_hi;
+      break;
+
+    /* Write quantity follows from byte count */
+    case s_write_qty_hi:
+      parser->state = s_write_qty_lo;
+      break;
+
+    case s_write_qty_lo:
+      parser->state = s_len;
+      break;
+
+    case s_data:
+      if (parser->data_cnt == 0) {
+        /* start of data */
+        parser->data = data;
+        CALLBACK_NOTIFY(data_start);
+      }
+
+      parser->data_cnt++;
+      if (parser->data_cnt == parser->data_len) {
+        /* end data */
+        CALLBACK_NOTIFY(data_end);
+        parser->state = s_crc_lo;
+      }
+      break;
+
+    case s_crc_lo:
+      parser->frame_crc = *data;
+      parser->state = s_crc_hi;
+      break;
+
+    case s_crc_hi: {
+      parser->frame_crc += (uint16_t)*data << 8;
+      parser->state = s_complete;
+      STATS_ADD(frames[parser->function & 0xFF], 1);
+      if (parser->frame_crc != parser->calc_crc) {
+        parser->errno = 1; /* TODO: assign right value */
+        STATS_ADD(crc_errors, 1);
+        CALLBACK_NOTIFY(crc_error);
+      }
+      CALLBACK_NOTIFY(complete);
+    } break;
+
+    default:
+      break;
+  }
+}
+
+/* Consume as much of data field as available in one step, return number
+ * of consumed bytes. Callbacks are the same as feeding bytes one by one
+ * to parse_byte.
+ */
+static inline size_t
+parse_data(modbus_parser* parser,
+           const modbus_parser_settings* settings,
+           const uint8_t* data,
+           size_t len)
 {
-  return 0;
+  size_t n = parser->data_len - parser->data_cnt;
+
+  if (n > len)
+    n = len;
+
+  if (parser->data_cnt == 0) {
+    /* start of data */
+    parser->data = data;
+    parser->data_wrap = NULL;
+    parser->data_wrap_len = 0;
+    CALLBACK_NOTIFY(data_start);
+    if (parser->errno != 0)
+      n = 1; /* Only the byte which triggered the callback */
+  } else if (parser->data_wrap == NULL &&
+             data != parser->data + parser->data_cnt) {
+    /* Continues in another buffer */
+    parser->data_wrap = data;
+  }
+
+  if (parser->framing == MODBUS_FRAMING_RTU)
+    parser->calc_crc = crc_bulk(parser->calc_crc, data, n);
+  parser->data_cnt += n;
+  if (parser->data_wrap != NULL)
+    parser->data_wrap_len += n;
+  if (parser->data_cnt == parser->data_len) {
+    /* end data */
+    CALLBACK_NOTIFY(data_end);
+    parser->state = s_crc_lo;
+  }
+
+  return n;
 }
 
 static size_t
-parse_response(modbus_parser* parser,
-               const modbus_parser_settings* settings,
-               const uint8_t* data,
-               size_t len)
+parse_rtu(modbus_parser* parser,
+          const modbus_parser_settings* settings,
+          const uint8_t* data,
+          size_t len)
 {
-  size_t nparsed = 0;
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
 
-  for (int i = 0; i < len; i++) {
+  while (p < end) {
     if (parser->errno != 0)
-      return nparsed;
+      break;
 
-    /* Update CRC value */
-    if (parser->state < s_crc_lo)
-      modbus_crc_update(&parser->calc_crc, *data);
+    if (parser->state == s_complete)
+      break;
 
-    switch (parser->state) {
-      case s_slave_addr:
-        parser->slave_addr = *data;
-        parser->state = s_func;
-        CALLBACK_NOTIFY(slave_addr);
-        break;
+    /* Header is parsed byte by byte, a partially received word stays in
+     * addr/qty between calls. Data goes in bulk, whatever the split is.
+     */
+    if (parser->state == s_data) {
+      p += parse_data(parser, settings, p, end - p);
+      continue;
+    }
 
-      case s_func:
-        parser->function = (enum modbus_func) * data;
-        switch (parser->function) {
-          case MODBUS_FUNC_READ_COILS:
-          case MODBUS_FUNC_READ_DISCRETE_IN:
-          case MODBUS_FUNC_READ_HOLD_REG:
-          case MODBUS_FUNC_READ_IN_REG:
-            parser->state = s_len;
-            break;
+    /* Update CRC value */
+    if (parser->state < s_crc_lo)
+      modbus_crc_update(&parser->calc_crc, *p);
 
-          case MODBUS_FUNC_WRITE_COIL:
-          case MODBUS_FUNC_WRITE_REG:
-            parser->state = s_single_addr_hi;
-            break;
+    parse_byte(parser, settings, p);
+    p++;
+  }
 
-          case MODBUS_FUNC_WRITE_COILS:
-          case MODBUS_FUNC_WRITE_REGS:
-            parser->state = s_start_addr_hi;
-            break;
-        }
-        CALLBACK_NOTIFY(function);
-        break;
+  return p - data;
+}
 
-      case s_len:
-        parser->data_len = *data;
-        parser->state = s_data;
-        parser->data_cnt = 0;
-        CALLBACK_NOTIFY(data_len);
-        break;
+/* Feed a byte decoded from ASCII frame. Data bytes are kept inside the
+ * parser, since input holds them as hex digits.
+ */
+static inline void
+parse_ascii_byte(modbus_parser* parser,
+                 const modbus_parser_settings* settings,
+                 uint8_t b)
+{
+  uint8_t* at = parser->ascii_data;
 
-      case s_single_addr_hi:
-        parser->addr = (uint16_t)*data << 8;
-        parser->state = s_single_addr_lo;
-        break;
+  if (parser->state == s_crc_lo) {
+    /* LRC takes place of CRC, end of frame is marked by CR/LF */
+    parser->frame_crc = b;
+    parser->calc_crc = (uint8_t)-parser->calc_crc;
+    parser->ascii_state = s_ascii_cr;
+    return;
+  }
 
-      case s_single_addr_lo:
-        parser->addr += *data;
-        parser->state = s_data;
-        parser->data_cnt = 0;
-        parser->data_len = 2;
-        CALLBACK_NOTIFY(addr);
-        break;
+  parser->calc_crc = (uint8_t)(parser->calc_crc + b);
+  if (parser->state == s_data)
+    at += parser->data_cnt;
+  *at = b;
+  parse_byte(parser, settings, at);
+}
 
-      case s_start_addr_hi:
-        parser->addr = (uint16_t)*data << 8;
-        parser->state = s_start_addr_lo;
-        break;
+static size_t
+parse_ascii(modbus_parser* parser,
+            const modbus_parser_settings* settings,
+            const uint8_t* data,
+            size_t len)
+{
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  bool skipped = false;
+  uint8_t hi, lo;
 
-      case s_start_addr_lo:
-        parser->addr += *data;
-        parser->state = s_qty_hi;
-        CALLBACK_NOTIFY(addr);
-        break;
+  while (p < end) {
+    if (parser->errno != 0)
+      break;
 
-      case s_qty_hi:
-        parser->qty = (uint16_t)*data << 8;
-        parser->state = s_qty_lo;
-        break;
+    if (parser->state == s_complete)
+      break;
 
-      case s_qty_lo:
-        parser->qty += *data;
-        parser->state = s_crc_lo;
-        CALLBACK_NOTIFY(qty);
+    switch (parser->ascii_state) {
+      case s_ascii_start:
+        /* Skip anything until start of frame */
+        if (*p++ == ':') {
+          parser->ascii_state = s_ascii_hi;
+          if (skipped)
+            STATS_ADD(resyncs, 1);
+        } else {
+          skipped = true;
+        }
         break;
 
-      case s_data:
-        if (parser->data_cnt == 0) {
-          /* start of data */
-          parser->data = data;
-          CALLBACK_NOTIFY(data_start);
+      case s_ascii_hi:
+        hi = hex_table[*p];
+        if (end - p >= 2 && (hi & (lo = hex_table[p[1]]) & 0x10)) {
+          /* Whole pair is available and valid, decode it without
+           * visiting s_ascii_lo
+           */
+          p += 2;
+          parse_ascii_byte(parser, settings, (uint8_t)(hi << 4) | (lo & 0x0F));
+        } else {
+          /* Same as byte-by-byte input, so the number of consumed
+           * characters doesn't depend on how the stream is split
+           */
+          if (!(hi & 0x10)) {
+            parser->errno = 1;
+            break;
+          }
+          p++;
+          parser->ascii_nibble = hi << 4;
+          parser->ascii_state = s_ascii_lo;
         }
+        break;
 
-        parser->data_cnt++;
-        if (parser->data_cnt == parser->data_len) {
-          /* end data */
-          CALLBACK_NOTIFY(data_end);
-          parser->state = s_crc_lo;
+      case s_ascii_lo:
+        lo = hex_table[*p];
+        if (!(lo & 0x10)) {
+          parser->errno = 1;
+          break;
         }
+        p++;
+        parser->ascii_state = s_ascii_hi;
+        parse_ascii_byte(parser, settings, parser->ascii_nibble | (lo & 0x0F));
         break;
 
-      case s_crc_lo:
-        parser->frame_crc = *data;
-        parser->state = s_crc_hi;
+      case s_ascii_cr:
+        if (*p != '\r') {
+          parser->errno = 1;
+          break;
+        }
+        p++;
+        parser->ascii_state = s_ascii_lf;
         break;
 
-      case s_crc_hi: {
-        parser->frame_crc += (uint16_t)*data << 8;
+      case s_ascii_lf:
+        if (*p != '\n') {
+          parser->errno = 1;
+          break;
+        }
+        p++;
         parser->state = s_complete;
+        STATS_ADD(frames[parser->function & 0xFF], 1);
         if (parser->frame_crc != parser->calc_crc) {
           parser->errno = 1; /* TODO: assign right value */
+          STATS_ADD(crc_errors, 1);
           CALLBACK_NOTIFY(crc_error);
         }
         CALLBACK_NOTIFY(complete);
-      } break;
+        break;
+    }
+  }
+
+  return p - data;
+}
 
-      case s_complete:
-        return nparsed;
+/* Byte of MBAP header: transaction id, protocol id (0) and length of
+ * the rest of frame, unit id included.
+ */
+static inline void
+parse_mbap(modbus_parser* parser, uint8_t b)
+{
+  switch (parser->mbap_cnt++) {
+    case 0:
+      parser->transaction_id = (uint16_t)b << 8;
+      break;
+    case 1:
+      parser->transaction_id += b;
+      break;
+    case 2:
+    case 3:
+      if (b != 0)
+        parser->errno = 1;
+      break;
+    case 4:
+      parser->mbap_left = (uint16_t)b << 8;
+      break;
+    case 5:
+      parser->mbap_left += b;
+      /* Unit id, function code and up to 253 bytes of PDU */
+      if (parser->mbap_left < 2 || parser->mbap_left > 254)
+        parser->errno = 1;
+      break;
+  }
+}
+
+static size_t
+parse_tcp(modbus_parser* parser,
+          const modbus_parser_settings* settings,
+          const uint8_t* data,
+          size_t len)
+{
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  size_t n;
 
-      default:
-        return 0;
+  while (p < end) {
+    if (parser->errno != 0)
+      break;
+
+    if (parser->state == s_complete)
+      break;
+
+    if (parser->mbap_cnt < 6) {
+      parse_mbap(parser, *p++);
+      continue;
     }
 
-    nparsed++;
-    data++;
+    /* Frame may not run past the length of MBAP header */
+    n = end - p < parser->mbap_left ? end - p : parser->mbap_left;
+    if (parser->state == s_data) {
+      n = parse_data(parser, settings, p, n);
+    } else {
+      parse_byte(parser, settings, p);
+      n = 1;
+    }
+    p += n;
+    parser->mbap_left -= n;
+
+    if (parser->errno != 0)
+      break;
+
+    if (parser->state == s_crc_lo) {
+      /* There is no CRC, end of layout is end of frame */
+      if (parser->mbap_left != 0) {
+        parser->errno = 1;
+        break;
+      }
+      parser->state = s_complete;
+      STATS_ADD(frames[parser->function & 0xFF], 1);
+      CALLBACK_NOTIFY(complete);
+    } else if (parser->mbap_left == 0) {
+      parser->errno = 1; /* Shorter than layout of function */
+    }
   }
 
-  return nparsed;
+  return p - data;
 }
 
 size_t
@@ -273,15 +935,194 @@ modbus_parser_execute(modbus_parser* parser,
                       const uint8_t* data,
                       size_t len)
 {
-  switch (parser->type) {
-    case MODBUS_QUERY:
-      return parse_query(parser, settings, data, len);
+  size_t nparsed = 0;
+#ifdef MODBUS_PARSER_PROFILE
+  struct modbus_parser_profile* profile = parser->profile;
+  uint64_t start = 0;
+  int sampled = 0;
+
+  if (profile) {
+    PROFILE_COUNT(profile->executes);
+    sampled = profile_sample(profile);
+    if (sampled)
+      start = profile_now();
+  }
+#endif
+
+  STATS_BEGIN();
+
+  switch (parser->framing) {
+    case MODBUS_FRAMING_ASCII:
+      nparsed = parse_ascii(parser, settings, data, len);
+      break;
+
+    case MODBUS_FRAMING_TCP:
+      nparsed = parse_tcp(parser, settings, data, len);
+      break;
+
+    default:
+      nparsed = parse_rtu(parser, settings, data, len);
+      break;
+  }
+
+  STATS_ADD(bytes, nparsed);
+  if (parser->errno == 0 && parser->state != s_complete &&
+      (parser->state != s_slave_addr || parser->ascii_state != s_ascii_start ||
+       parser->mbap_cnt != 0))
+    STATS_ADD(carryovers, 1);
+
+  STATS_END();
+
+#ifdef MODBUS_PARSER_PROFILE
+  if (sampled) {
+    profile_begin(profile);
+    profile->execute_samples++;
+    profile->execute_cycles += profile_now() - start;
+    profile_end(profile);
+  }
+#endif
+
+  return nparsed;
+}
+
+#ifdef MODBUS_PARSER_STATS
+void
+modbus_parser_stats_snapshot(const struct modbus_parser_stats* stats,
+                             struct modbus_parser_stats* out)
+{
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, stats, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&stats->seq, __ATOMIC_RELAXED));
+}
+#endif
+
+#ifdef MODBUS_PARSER_PROFILE
+void
+modbus_parser_profile_init(struct modbus_parser_profile* profile,
+                           uint32_t interval)
+{
+  memset(profile, 0, sizeof(*profile));
+  profile->interval = interval > 0 ? interval : 1;
+  profile->countdown = profile->interval;
+  profile->rng = 1;
+}
+
+void
+modbus_parser_profile_snapshot(const struct modbus_parser_profile* profile,
+                               struct modbus_parser_profile* out)
+{
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&profile->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, profile, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) ||
+           seq != __atomic_load_n(&profile->seq, __ATOMIC_RELAXED));
+}
+#endif
+
+int
+modbus_frame_len(enum modbus_parser_type t, const uint8_t* data, size_t len)
+{
+  const struct func_layout* l;
+
+  if (len < 2)
+    return 0;
+
+  l = &layouts[t][func_index[data[1]]];
+  if (l->layout == 0)
+    return -1;
+  if (!(l->layout & MODBUS_LAYOUT_BYTES))
+    return l->header + 2;
+  if (len < l->header)
+    return 0;
+  if (data[l->header - 1] == 0)
+    return -1;
+  return l->header + data[l->header - 1] + 2;
+}
+
+int
+modbus_func_table(enum modbus_func f)
+{
+  switch (f) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_WRITE_COIL:
+    case MODBUS_FUNC_WRITE_COILS:
+      return MODBUS_TABLE_COILS;
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      return MODBUS_TABLE_DISCRETE_IN;
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_WRITE_REG:
+    case MODBUS_FUNC_WRITE_REGS:
+    case MODBUS_FUNC_READ_WRITE_REGS:
+      return MODBUS_TABLE_HOLD_REG;
+    case MODBUS_FUNC_READ_IN_REG:
+      return MODBUS_TABLE_IN_REG;
+    default:
+      return -1;
+  }
+}
+
+int
+modbus_response_items(const modbus_parser* parser,
+                      const struct modbus_query* q,
+                      struct modbus_response_items* items)
+{
+  const uint8_t* data = parser->data;
+  size_t head;
+
+  /* Data split by the end of a ring buffer */
+  if (parser->data_wrap != NULL) {
+    head = parser->data_len - parser->data_wrap_len;
+    memcpy(items->buf, parser->data, head);
+    memcpy(items->buf + head, parser->data_wrap, parser->data_wrap_len);
+    data = items->buf;
+  }
+
+  switch (parser->function) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      if (q->function != parser->function ||
+          parser->data_len < MODBUS_COILS_BYTE_LEN(q->qty))
+        return -1;
+      items->addr = q->addr;
+      items->count = q->qty;
+      break;
+
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+    case MODBUS_FUNC_READ_WRITE_REGS:
+      /* Read part of READ_WRITE_REGS is done after the write */
+      if (q->function != parser->function || parser->data_len / 2 < q->qty)
+        return -1;
+      items->addr = q->addr;
+      items->count = q->qty;
+      break;
+
+    case MODBUS_FUNC_WRITE_COIL:
+      items->buf[0] = data[0] == (MODBUS_COIL_HIGH >> 8);
+      data = items->buf;
+      items->addr = parser->addr;
+      items->count = 1;
+      break;
 
-    case MODBUS_RESPONSE:
-      return parse_response(parser, settings, data, len);
+    case MODBUS_FUNC_WRITE_REG:
+      items->addr = parser->addr;
+      items->count = 1;
+      break;
+
+    default:
+      return 0;
   }
 
-  return 0;
+  items->table = modbus_func_table(parser->function);
+  items->data = data;
+  return 1;
 }
 
 /* Concatenate memory to Modbus Query */
@@ -298,15 +1139,15 @@ modbus_parser_execute(modbus_parser* parser,
 
 /* Concatenate single byte to Modbus Query */
 #define MBQ_CAT_BYTE(b)                                                        \
-  nwrite++;                                                                    \
   do {                                                                         \
+    nwrite++;                                                                  \
     if (nwrite > sz) {                                                         \
       return -1;                                                               \
     } else {                                                                   \
-      *buf = b;                                                                \
+      *buf = (b);                                                              \
       buf++;                                                                   \
     }                                                                          \
-  } while (0);
+  } while (0)
 
 /* Concatenate uint16_t as big-endian to modbus query.
  * Modbus uses big-endian for address and data items, except CRC
@@ -317,83 +1158,161 @@ modbus_parser_execute(modbus_parser* parser,
     if (nwrite > sz) {                                                         \
       return -1;                                                               \
     } else {                                                                   \
-      *buf++ = i >> 8;                                                         \
-      *buf++ = i & 0x00FF;                                                     \
+      *buf++ = (i) >> 8;                                                       \
+      *buf++ = (i)&0x00FF;                                                     \
     }                                                                          \
   } while (0)
 
 int
 modbus_gen_query(struct modbus_query* q, uint8_t* buf, size_t sz)
 {
+  const struct func_layout* l =
+    &layouts[MODBUS_QUERY][func_index[(uint8_t)q->function]];
   int nwrite = 0;
+  int nbyte;
+  int i;
+  uint16_t qty = q->qty;
   uint16_t crc;
   uint8_t* buf_start = buf;
 
+  /* Check input data */
+  if (l->layout == 0)
+    return -1;
+  if ((l->layout & (MODBUS_LAYOUT_VALUE | MODBUS_LAYOUT_BYTES)) &&
+      (q->data == NULL || q->data_len == 0))
+    return -1;
+  if ((l->layout & MODBUS_LAYOUT_VALUE) && q->data_len != 1)
+    return -1;
+
+  /* Quantity of written registers is given by data */
+  if ((l->layout & (MODBUS_LAYOUT_WRITE | MODBUS_LAYOUT_BITS)) ==
+      MODBUS_LAYOUT_REGS)
+    qty = q->data_len;
+
   MBQ_CAT_BYTE(q->slave_addr);
   MBQ_CAT_BYTE(q->function);
 
-  switch (q->function) {
-    case MODBUS_FUNC_READ_COILS:
-    case MODBUS_FUNC_READ_DISCRETE_IN:
-    case MODBUS_FUNC_READ_HOLD_REG:
-    case MODBUS_FUNC_READ_IN_REG:
-      MBQ_CAT_WORD(q->addr);
-      MBQ_CAT_WORD(q->qty);
-      break;
+  if (l->layout & MODBUS_LAYOUT_ADDR)
+    MBQ_CAT_WORD(q->addr);
+  if (l->layout & MODBUS_LAYOUT_QTY)
+    MBQ_CAT_WORD(qty);
+  if (l->layout & MODBUS_LAYOUT_WRITE) {
+    MBQ_CAT_WORD(q->write_addr);
+    MBQ_CAT_WORD(q->data_len);
+  }
+  if (l->layout & MODBUS_LAYOUT_VALUE)
+    MBQ_CAT_WORD(*q->data);
 
-    case MODBUS_FUNC_WRITE_COIL:
-    case MODBUS_FUNC_WRITE_REG:
-      MBQ_CAT_WORD(q->addr);
-      /* Check input data */
-      if (q->data == NULL || q->data_len != 1)
-        return -1;
+  if (l->layout & MODBUS_LAYOUT_PACKED) {
+    nbyte = MODBUS_COILS_BYTE_LEN(q->qty);
+    MBQ_CAT_BYTE(nbyte);
+    for (i = 0; nbyte >= 2; i++, nbyte -= 2)
+      MBQ_CAT_WORD(q->data[i]);
+    /* Odd number of bytes, last one from the last data item */
+    if (nbyte > 0)
+      MBQ_CAT_BYTE(q->data[i]);
+  } else if (l->layout & MODBUS_LAYOUT_BYTES) {
+    MBQ_CAT_BYTE(q->data_len * 2);
+    for (i = 0; i < q->data_len; i++)
+      MBQ_CAT_WORD(q->data[i]);
+  }
 
-      // MBQ_CAT_MEM(q->data, q->data_len);
-      MBQ_CAT_WORD(*q->data);
-      break;
+  crc = modbus_calc_crc(buf_start, nwrite);
+  /* CRC must be represent as little-endian */
+  MBQ_CAT_BYTE(crc & 0x00FF);
+  MBQ_CAT_BYTE(crc >> 8);
 
-    case MODBUS_FUNC_WRITE_COILS: {
-      int16_t nbyte = MODBUS_COILS_BYTE_LEN(q->qty);
-      /* Check input data */
-      if (q->data == NULL || q->data_len == 0)
-        return -1;
+  return nwrite;
+}
 
-      MBQ_CAT_WORD(q->addr);
-      MBQ_CAT_WORD(q->qty);
-      MBQ_CAT_BYTE(nbyte);
+int
+modbus_frame_ascii(uint8_t* buf, size_t n, size_t sz)
+{
+  uint8_t lrc = modbus_calc_lrc(buf, n);
+  /* ':' + two digits per byte (LRC included) + CR/LF */
+  size_t nwrite = 1 + (n + 1) * 2 + 2;
 
-      while (nbyte > 0) {
-        nbyte -= 2;
-        if (nbyte >= 0) {
-          MBQ_CAT_WORD(*q->data);
-        } else {
-          /* Write last byte, MSB of last register */
-          MBQ_CAT_BYTE(*q->data);
-        }
-        q->data++;
-      }
-      break;
-    }
+  if (nwrite > sz)
+    return -1;
 
-    case MODBUS_FUNC_WRITE_REGS:
-      /* Check input data */
-      if (q->data == NULL || q->data_len == 0)
+  /* Expand binary frame in place, from last byte backwards. Byte i goes
+   * to 1 + 2i, so it's never overwritten before being read.
+   */
+  buf[nwrite - 1] = '\n';
+  buf[nwrite - 2] = '\r';
+  buf[nwrite - 3] = hex_digits[lrc & 0x0F];
+  buf[nwrite - 4] = hex_digits[lrc >> 4];
+  for (int i = n - 1; i >= 0; i--) {
+    uint8_t b = buf[i];
+    buf[2 + 2 * i] = hex_digits[b & 0x0F];
+    buf[1 + 2 * i] = hex_digits[b >> 4];
+  }
+  buf[0] = ':';
+
+  return nwrite;
+}
+
+int
+modbus_frame_seal(enum modbus_framing f,
+                  uint16_t transaction_id,
+                  uint8_t* buf,
+                  size_t n,
+                  size_t sz)
+{
+  uint16_t crc;
+
+  switch (f) {
+    case MODBUS_FRAMING_TCP:
+      if (6 + n > sz)
         return -1;
+      modbus_put_word(buf, transaction_id);
+      modbus_put_word(buf + 2, 0); /* Protocol id */
+      modbus_put_word(buf + 4, n);
+      return 6 + n;
 
-      MBQ_CAT_WORD(q->addr);
-      MBQ_CAT_WORD(q->data_len);
-      MBQ_CAT_BYTE(q->data_len * 2);
+    case MODBUS_FRAMING_ASCII:
+      return modbus_frame_ascii(buf, n, sz);
 
-      for (int i = 0; i < q->data_len; i++) {
-        MBQ_CAT_WORD(*(q->data + i));
-      }
-      break;
+    default:
+      if (n + 2 > sz)
+        return -1;
+      crc = modbus_calc_crc(buf, n);
+      buf[n] = crc & 0xFF;
+      buf[n + 1] = crc >> 8;
+      return n + 2;
   }
+}
 
-  crc = modbus_calc_crc(buf_start, nwrite);
-  /* CRC must be represent as little-endian */
-  MBQ_CAT_BYTE(crc & 0x00FF);
-  MBQ_CAT_BYTE(crc >> 8);
+int
+modbus_gen_query_ascii(struct modbus_query* q, uint8_t* buf, size_t sz)
+{
+  int n;
 
-  return nwrite;
+  n = modbus_gen_query(q, buf, sz);
+  if (n < 0)
+    return n;
+
+  /* No CRC in ASCII framing */
+  return modbus_frame_ascii(buf, n - 2, sz);
+}
+
+int
+modbus_gen_query_tcp(struct modbus_query* q,
+                     uint16_t transaction_id,
+                     uint8_t* buf,
+                     size_t sz)
+{
+  uint8_t rtu[MODBUS_MAX_DATA_LEN + 9];
+  int n;
+
+  n = modbus_gen_query(q, rtu, sizeof(rtu));
+  if (n < 0)
+    return n;
+
+  n -= 2; /* Unit id and PDU, no CRC */
+  if (6 + n > sz)
+    return -1;
+
+  memcpy(buf + 6, rtu, n);
+  return modbus_frame_seal(MODBUS_FRAMING_TCP, transaction_id, buf, n, sz);
 }
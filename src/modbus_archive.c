@@ -0,0 +1,460 @@
+#include <string.h>
+
+#include "modbus_archive.h"
+
+static const uint8_t block_magic[4] = { 'M', 'B', 'A', 'R' };
+
+#define HEADER_SIZE 16
+
+/* slave, table, addr, count and full timestamp */
+#define DEFINE_BITS (8 + 2 + 16 + 11 + 64)
+
+/* Longest delta of delta code */
+#define DOD_BITS (4 + 64)
+
+/* Bit reader over block body */
+struct bit_reader
+{
+  const uint8_t* p;
+  size_t nbits;
+  size_t pos;
+  int error;
+};
+
+static void
+put_u32(uint8_t* p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+static uint32_t
+get_u32(const uint8_t* p)
+{
+  uint32_t v = 0;
+
+  for (int i = 0; i < 4; i++)
+    v |= (uint32_t)p[i] << (8 * i);
+  return v;
+}
+
+static inline int
+is_bits(enum modbus_table table)
+{
+  return table <= MODBUS_TABLE_DISCRETE_IN;
+}
+
+/* Append n low bits of v, most significant first. Block is zeroed. */
+static void
+put_bits(struct modbus_archive_writer* w, uint64_t v, int n)
+{
+  uint8_t* p = w->block + HEADER_SIZE;
+  int free;
+  int k;
+
+  while (n > 0) {
+    free = 8 - (w->bits & 7);
+    k = n < free ? n : free;
+    p[w->bits >> 3] |= ((v >> (n - k)) & ((1u << k) - 1)) << (free - k);
+    w->bits += k;
+    n -= k;
+  }
+}
+
+static uint64_t
+get_bits(struct bit_reader* r, int n)
+{
+  uint64_t v = 0;
+  int avail;
+  int k;
+
+  if (r->pos + n > r->nbits) {
+    r->error = 1;
+    return 0;
+  }
+
+  while (n > 0) {
+    avail = 8 - (r->pos & 7);
+    k = n < avail ? n : avail;
+    v = v << k | ((r->p[r->pos >> 3] >> (avail - k)) & ((1u << k) - 1));
+    r->pos += k;
+    n -= k;
+  }
+  return v;
+}
+
+/* Zigzag, so that small negative numbers have few significant bits */
+static inline uint64_t
+zigzag(uint64_t v)
+{
+  return v << 1 ^ (uint64_t)((int64_t)v >> 63);
+}
+
+static inline uint64_t
+unzigzag(uint64_t z)
+{
+  return z >> 1 ^ -(z & 1);
+}
+
+/* Number of significant bits of v, at least 1 */
+static inline int
+bit_len(uint64_t v)
+{
+  return v ? 64 - __builtin_clzll(v) : 1;
+}
+
+/* Delta of delta: 0 | 10 + 8 | 110 + 16 | 1110 + 32 | 1111 + 64 bits */
+static void
+put_dod(struct modbus_archive_writer* w, uint64_t dod)
+{
+  uint64_t z = zigzag(dod);
+
+  if (z == 0)
+    put_bits(w, 0, 1);
+  else if (z < (1u << 8))
+    put_bits(w, 0x2 << 8 | z, 10);
+  else if (z < (1u << 16))
+    put_bits(w, 0x6ull << 16 | z, 19);
+  else if (z < (1ull << 32))
+    put_bits(w, 0xEull << 32 | z, 36);
+  else {
+    put_bits(w, 0xF, 4);
+    put_bits(w, z, 64);
+  }
+}
+
+static uint64_t
+get_dod(struct bit_reader* r)
+{
+  static const int width[] = { 8, 16, 32, 64 };
+  int prefix = 0;
+
+  while (prefix < 4 && get_bits(r, 1))
+    prefix++;
+  if (prefix == 0)
+    return 0;
+  return unzigzag(get_bits(r, width[prefix - 1]));
+}
+
+/* Items of coil tables as packed bits, of register tables as words */
+static void
+put_raw(struct modbus_archive_writer* w,
+        const struct modbus_archive_series* s,
+        const uint8_t* data)
+{
+  if (is_bits(s->table)) {
+    for (int i = 0; i < s->count; i++)
+      put_bits(w, data[i / 8] >> (i % 8) & 1, 1);
+  } else {
+    for (int i = 0; i < s->count * 2; i++)
+      put_bits(w, data[i], 8);
+  }
+}
+
+static void
+get_raw(struct bit_reader* r, struct modbus_archive_series* s)
+{
+  if (is_bits(s->table)) {
+    memset(s->data, 0, MODBUS_TABLE_DATA_SIZE(s->table, s->count));
+    for (int i = 0; i < s->count; i++)
+      s->data[i / 8] |= get_bits(r, 1) << (i % 8);
+  } else {
+    for (int i = 0; i < s->count * 2; i++)
+      s->data[i] = get_bits(r, 8);
+  }
+}
+
+/* Upper bound of bits of a sample, defining or not */
+static size_t
+sample_bits(const struct modbus_archive_writer* w,
+            const struct modbus_archive_series* s)
+{
+  size_t items = is_bits(s->table) ? s->count : s->count * (1 + 4 + 16);
+
+  return w->id_bits + DEFINE_BITS + DOD_BITS + 1 + items;
+}
+
+static void
+start_block(struct modbus_archive_writer* w)
+{
+  memset(w->block, 0, w->block_size);
+  w->bits = 0;
+  w->nsamples = 0;
+}
+
+int
+modbus_archive_series_init(struct modbus_archive_series* s,
+                           uint8_t slave_addr,
+                           enum modbus_table table,
+                           uint16_t addr,
+                           uint16_t count)
+{
+  uint16_t limit =
+    is_bits(table) ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGS;
+
+  if (table > MODBUS_TABLE_IN_REG || count == 0 || count > limit)
+    return -1;
+
+  memset(s, 0, sizeof(*s));
+  s->slave_addr = slave_addr;
+  s->table = table;
+  s->addr = addr;
+  s->count = count;
+  return 0;
+}
+
+int
+modbus_archive_writer_init(struct modbus_archive_writer* w,
+                           modbus_archive_write_cb write,
+                           void* arg,
+                           struct modbus_archive_series* series,
+                           size_t nseries,
+                           uint8_t* block,
+                           size_t block_size)
+{
+  if (nseries == 0 || nseries > 0x10000 ||
+      block_size < MODBUS_ARCHIVE_MIN_BLOCK)
+    return -1;
+
+  memset(w, 0, sizeof(*w));
+  w->write = write;
+  w->arg = arg;
+  w->series = series;
+  w->nseries = nseries;
+  w->block = block;
+  w->block_size = block_size;
+  w->seq = 1; /* Series with block 0 are not defined anywhere */
+  while (((size_t)1 << w->id_bits) < nseries)
+    w->id_bits++;
+
+  for (size_t i = 0; i < nseries; i++)
+    series[i].block = 0;
+
+  start_block(w);
+  return 0;
+}
+
+int
+modbus_archive_write(struct modbus_archive_writer* w,
+                     size_t index,
+                     uint64_t ts,
+                     const uint8_t* data)
+{
+  struct modbus_archive_series* s;
+  uint8_t values[MODBUS_ARCHIVE_MAX_DATA];
+  uint16_t v, prev;
+  uint64_t delta;
+  size_t size;
+  int n;
+
+  if (index >= w->nseries)
+    return -1;
+
+  s = &w->series[index];
+  if (w->bits + sample_bits(w, s) > (w->block_size - HEADER_SIZE) * 8 &&
+      modbus_archive_flush(w) != 0)
+    return -1;
+
+  /* Padding bits of the last coil byte are not part of the value */
+  size = MODBUS_TABLE_DATA_SIZE(s->table, s->count);
+  memcpy(values, data, size);
+  if (is_bits(s->table) && s->count % 8)
+    values[size - 1] &= (1u << (s->count % 8)) - 1;
+
+  put_bits(w, index, w->id_bits);
+
+  if (s->block != w->seq) {
+    /* First sample in this block */
+    s->block = w->seq;
+    put_bits(w, s->slave_addr, 8);
+    put_bits(w, s->table, 2);
+    put_bits(w, s->addr, 16);
+    put_bits(w, s->count, 11);
+    put_bits(w, ts, 64);
+    put_raw(w, s, values);
+    s->prev_delta = 0;
+  } else {
+    delta = ts - s->prev_ts;
+    put_dod(w, delta - s->prev_delta);
+    s->prev_delta = delta;
+
+    if (memcmp(values, s->data, size) == 0) {
+      put_bits(w, 0, 1);
+    } else {
+      put_bits(w, 1, 1);
+      if (is_bits(s->table)) {
+        put_raw(w, s, values);
+      } else {
+        for (int i = 0; i < s->count; i++) {
+          v = values[2 * i] << 8 | values[2 * i + 1];
+          prev = s->data[2 * i] << 8 | s->data[2 * i + 1];
+          if (v == prev) {
+            put_bits(w, 0, 1);
+            continue;
+          }
+          delta = zigzag((int16_t)(v - prev)) & 0xFFFF;
+          n = bit_len(delta);
+          put_bits(w, 0x10 | (n - 1), 5);
+          put_bits(w, delta, n);
+        }
+      }
+    }
+  }
+
+  memcpy(s->data, values, size);
+  s->prev_ts = ts;
+  w->nsamples++;
+  w->raw_bytes += size;
+  return 0;
+}
+
+int
+modbus_archive_write_response(struct modbus_archive_writer* w,
+                              uint64_t ts,
+                              const modbus_parser* parser,
+                              const struct modbus_query* q)
+{
+  uint8_t buf[MODBUS_ARCHIVE_MAX_DATA];
+  const uint8_t* data = parser->data;
+  const struct modbus_archive_series* s;
+  int table;
+  size_t head;
+
+  /* Only responses of reads carry a series */
+  switch (parser->function) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+    case MODBUS_FUNC_READ_WRITE_REGS:
+      table = modbus_func_table(parser->function);
+      break;
+    default:
+      return 0;
+  }
+
+  if (q->function != parser->function ||
+      parser->data_len != MODBUS_TABLE_DATA_SIZE(table, q->qty) ||
+      parser->data_len > MODBUS_ARCHIVE_MAX_DATA)
+    return -1;
+
+  /* Data split by the end of a ring buffer */
+  if (parser->data_wrap != NULL) {
+    head = parser->data_len - parser->data_wrap_len;
+    memcpy(buf, parser->data, head);
+    memcpy(buf + head, parser->data_wrap, parser->data_wrap_len);
+    data = buf;
+  }
+
+  for (size_t i = 0; i < w->nseries; i++) {
+    s = &w->series[i];
+    if (s->slave_addr == parser->slave_addr && s->table == table &&
+        s->addr == q->addr && s->count == q->qty)
+      return modbus_archive_write(w, i, ts, data);
+  }
+
+  return -1;
+}
+
+int
+modbus_archive_flush(struct modbus_archive_writer* w)
+{
+  if (w->nsamples == 0)
+    return 0;
+
+  memcpy(w->block, block_magic, 4);
+  w->block[4] = MODBUS_ARCHIVE_VERSION;
+  w->block[5] = w->id_bits;
+  put_u32(w->block + 8, w->seq);
+  put_u32(w->block + 12, w->nsamples);
+
+  /* Block stays as it is if it can't be written, flush may be retried */
+  if (w->write(w->arg, w->block, w->block_size) != 0)
+    return -1;
+
+  w->out_bytes += w->block_size;
+  w->seq++;
+  start_block(w);
+  return 0;
+}
+
+int
+modbus_archive_decode(const uint8_t* block,
+                      size_t size,
+                      struct modbus_archive_series* series,
+                      size_t nseries,
+                      modbus_archive_sample_cb cb,
+                      void* arg)
+{
+  struct bit_reader r = { 0 };
+  struct modbus_archive_series* s;
+  uint32_t nsamples;
+  uint64_t id, ts, delta;
+  uint16_t v;
+  uint8_t slave_addr;
+  enum modbus_table table;
+  uint16_t addr;
+  uint16_t count;
+  int id_bits;
+  int n;
+
+  if (size < HEADER_SIZE || memcmp(block, block_magic, 4) != 0 ||
+      block[4] != MODBUS_ARCHIVE_VERSION || block[5] > 16)
+    return -1;
+
+  id_bits = block[5];
+  nsamples = get_u32(block + 12);
+  r.p = block + HEADER_SIZE;
+  r.nbits = (size - HEADER_SIZE) * 8;
+
+  for (size_t i = 0; i < nseries; i++)
+    series[i].block = 0;
+
+  for (uint32_t k = 0; k < nsamples; k++) {
+    id = get_bits(&r, id_bits);
+    if (id >= nseries)
+      return -1;
+    s = &series[id];
+
+    if (s->block == 0) {
+      slave_addr = get_bits(&r, 8);
+      table = get_bits(&r, 2);
+      addr = get_bits(&r, 16);
+      count = get_bits(&r, 11);
+      ts = get_bits(&r, 64);
+      if (modbus_archive_series_init(s, slave_addr, table, addr, count) != 0)
+        return -1;
+      s->block = 1;
+      get_raw(&r, s);
+    } else {
+      delta = s->prev_delta + get_dod(&r);
+      ts = s->prev_ts + delta;
+      s->prev_delta = delta;
+
+      if (get_bits(&r, 1)) {
+        if (is_bits(s->table)) {
+          get_raw(&r, s);
+        } else {
+          for (int i = 0; i < s->count; i++) {
+            if (!get_bits(&r, 1))
+              continue;
+            n = get_bits(&r, 4) + 1;
+            v = s->data[2 * i] << 8 | s->data[2 * i + 1];
+            v += unzigzag(get_bits(&r, n));
+            s->data[2 * i] = v >> 8;
+            s->data[2 * i + 1] = v & 0xFF;
+          }
+        }
+      }
+    }
+
+    if (r.error)
+      return -1;
+    s->prev_ts = ts;
+
+    if (cb != NULL && cb(arg, s, ts) != 0)
+      return k + 1;
+  }
+
+  return nsamples;
+}
@@ -0,0 +1,489 @@
+#include <string.h>
+
+#include "modbus_capture.h"
+
+static const uint8_t file_magic[4] = { 'M', 'B', 'C', 'P' };
+static const uint8_t index_magic[4] = { 'M', 'B', 'C', 'I' };
+
+#define HEADER_SIZE 8
+
+/* Tag + two varints, see get_varint() for their limits */
+#define FRAME_HDR_MAX (1 + 10 + 3)
+
+static void
+put_u32(uint8_t* p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+static void
+put_u64(uint8_t* p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    p[i] = v >> (8 * i);
+}
+
+static uint32_t
+get_u32(const uint8_t* p)
+{
+  uint32_t v = 0;
+
+  for (int i = 0; i < 4; i++)
+    v |= (uint32_t)p[i] << (8 * i);
+  return v;
+}
+
+static uint64_t
+get_u64(const uint8_t* p)
+{
+  uint64_t v = 0;
+
+  for (int i = 0; i < 8; i++)
+    v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+static size_t
+put_varint(uint8_t* p, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/* Decode varint of at most max bytes. Return number of used bytes, 0 if
+ * it's truncated or too long.
+ */
+static size_t
+get_varint(const uint8_t* p, size_t avail, size_t max, uint64_t* v)
+{
+  *v = 0;
+  for (size_t i = 0; i < avail && i < max; i++) {
+    *v |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+    if (!(p[i] & 0x80))
+      return i + 1;
+  }
+  return 0;
+}
+
+static uint64_t
+zigzag(uint64_t ts, uint64_t prev)
+{
+  int64_t d = (int64_t)(ts - prev);
+
+  return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+}
+
+static uint64_t
+unzigzag(uint64_t z, uint64_t prev)
+{
+  return prev + ((z >> 1) ^ -(z & 1));
+}
+
+static void
+put_entry(uint8_t* p, const struct modbus_capture_index_entry* e)
+{
+  put_u64(p, e->ts_min);
+  put_u64(p + 8, e->ts_max);
+  put_u64(p + 16, e->offset);
+  put_u32(p + 24, e->nframes);
+  memcpy(p + 28, e->slaves, sizeof(e->slaves));
+}
+
+static void
+get_entry(const uint8_t* p, struct modbus_capture_index_entry* e)
+{
+  e->ts_min = get_u64(p);
+  e->ts_max = get_u64(p + 8);
+  e->offset = get_u64(p + 16);
+  e->nframes = get_u32(p + 24);
+  memcpy(e->slaves, p + 28, sizeof(e->slaves));
+}
+
+static int
+writer_emit(struct modbus_capture_writer* w, const void* buf, size_t len)
+{
+  if (w->error)
+    return -1;
+
+  if (w->write(w->arg, buf, len) != 0) {
+    w->error = 1;
+    return -1;
+  }
+
+  w->offset += len;
+  return 0;
+}
+
+/* Merge adjacent pairs of entries, halving the index */
+static void
+writer_compact_index(struct modbus_capture_writer* w)
+{
+  struct modbus_capture_index_entry* a;
+  struct modbus_capture_index_entry* b;
+  size_t n = 0;
+
+  for (size_t i = 0; i < w->index_len; i += 2, n++) {
+    a = &w->index[i];
+    if (i + 1 < w->index_len) {
+      b = &w->index[i + 1];
+      if (b->ts_min < a->ts_min)
+        a->ts_min = b->ts_min;
+      if (b->ts_max > a->ts_max)
+        a->ts_max = b->ts_max;
+      a->nframes += b->nframes;
+      for (int j = 0; j < sizeof(a->slaves); j++)
+        a->slaves[j] |= b->slaves[j];
+    }
+    w->index[n] = *a;
+  }
+
+  w->index_len = n;
+  w->segment_frames *= 2;
+}
+
+int
+modbus_capture_writer_init(struct modbus_capture_writer* w,
+                           modbus_capture_write_cb write,
+                           void* arg,
+                           struct modbus_capture_index_entry* index,
+                           size_t index_cap,
+                           uint32_t segment_frames)
+{
+  uint8_t hdr[HEADER_SIZE] = { 0 };
+
+  if (index_cap < 2 || segment_frames == 0)
+    return -1;
+
+  memset(w, 0, sizeof(*w));
+  w->write = write;
+  w->arg = arg;
+  w->index = index;
+  w->index_cap = index_cap;
+  w->segment_frames = segment_frames;
+
+  memcpy(hdr, file_magic, sizeof(file_magic));
+  hdr[4] = MODBUS_CAPTURE_VERSION;
+  return writer_emit(w, hdr, sizeof(hdr));
+}
+
+int
+modbus_capture_write_frame(struct modbus_capture_writer* w,
+                           uint64_t ts,
+                           uint8_t tag,
+                           const uint8_t* frame,
+                           size_t len)
+{
+  struct modbus_capture_index_entry* e = NULL;
+  uint8_t hdr[FRAME_HDR_MAX];
+  size_t n = 0;
+
+  if (len == 0 || len > MODBUS_CAPTURE_MAX_FRAME)
+    return -1;
+
+  if (w->index_len > 0)
+    e = &w->index[w->index_len - 1];
+
+  if (e != NULL && e->nframes >= w->segment_frames &&
+      w->index_len == w->index_cap) {
+    writer_compact_index(w);
+    e = &w->index[w->index_len - 1];
+  }
+
+  if (e == NULL || e->nframes >= w->segment_frames) {
+    /* Start new segment */
+    e = &w->index[w->index_len++];
+    memset(e, 0, sizeof(*e));
+    e->offset = w->offset;
+    e->ts_min = e->ts_max = ts;
+
+    hdr[0] = MODBUS_CAPTURE_SYNC;
+    put_u64(hdr + 1, ts);
+    if (writer_emit(w, hdr, 9) != 0)
+      return -1;
+    w->prev_ts = ts;
+  }
+
+  hdr[n++] = tag;
+  n += put_varint(hdr + n, zigzag(ts, w->prev_ts));
+  n += put_varint(hdr + n, len);
+  if (writer_emit(w, hdr, n) != 0 || writer_emit(w, frame, len) != 0)
+    return -1;
+
+  w->prev_ts = ts;
+  e->nframes++;
+  if (ts < e->ts_min)
+    e->ts_min = ts;
+  if (ts > e->ts_max)
+    e->ts_max = ts;
+  e->slaves[frame[0] / 8] |= 1 << (frame[0] % 8);
+  return 0;
+}
+
+size_t
+modbus_capture_execute(struct modbus_capture_writer* w,
+                       modbus_parser* parser,
+                       const modbus_parser_settings* settings,
+                       uint64_t ts,
+                       const uint8_t* data,
+                       size_t len)
+{
+  size_t n = modbus_parser_execute(parser, settings, data, len);
+  size_t room = sizeof(w->frame) - w->frame_len;
+
+  memcpy(w->frame + w->frame_len, data, n < room ? n : room);
+  w->frame_len += n < room ? n : room;
+
+  if (n > 0 && parser->state == s_complete) {
+    modbus_capture_write_frame(w,
+                               ts,
+                               parser->frame_crc == parser->calc_crc
+                                 ? MODBUS_CAPTURE_FRAME
+                                 : MODBUS_CAPTURE_FRAME_CRC_ERROR,
+                               w->frame,
+                               w->frame_len);
+    w->frame_len = 0;
+  } else if (parser->errno != 0) {
+    /* Aborted by a callback, incomplete frame is not logged */
+    w->frame_len = 0;
+  }
+
+  return n;
+}
+
+int
+modbus_capture_writer_close(struct modbus_capture_writer* w)
+{
+  uint8_t buf[MODBUS_CAPTURE_ENTRY_SIZE];
+  uint64_t index_offset = w->offset;
+
+  for (size_t i = 0; i < w->index_len; i++) {
+    put_entry(buf, &w->index[i]);
+    if (writer_emit(w, buf, MODBUS_CAPTURE_ENTRY_SIZE) != 0)
+      return -1;
+  }
+
+  put_u64(buf, index_offset);
+  put_u32(buf + 8, w->index_len);
+  memcpy(buf + 12, index_magic, sizeof(index_magic));
+  return writer_emit(w, buf, MODBUS_CAPTURE_TRAILER_SIZE);
+}
+
+/* Make bytes [off, off + len) available, return pointer to them or NULL
+ * on read error or if they are past end of records.
+ */
+static const uint8_t*
+reader_fetch(struct modbus_capture_reader* r, uint64_t off, size_t len)
+{
+  size_t n = sizeof(r->buf);
+
+  if (off + len > r->data_end)
+    return NULL;
+
+  if (off >= r->buf_off && off + len <= r->buf_off + r->buf_len)
+    return r->buf + (off - r->buf_off);
+
+  if (off + n > r->data_end)
+    n = r->data_end - off;
+  if (r->read(r->arg, off, r->buf, n) != 0)
+    return NULL;
+
+  r->buf_off = off;
+  r->buf_len = n;
+  return r->buf;
+}
+
+int
+modbus_capture_reader_open(struct modbus_capture_reader* r,
+                           modbus_capture_read_cb read,
+                           void* arg,
+                           uint64_t size,
+                           struct modbus_capture_index_entry* index,
+                           size_t index_cap)
+{
+  uint8_t trailer[MODBUS_CAPTURE_TRAILER_SIZE];
+  const uint8_t* p;
+  uint64_t index_offset;
+  uint32_t nentries;
+
+  memset(r, 0, sizeof(*r));
+  r->read = read;
+  r->arg = arg;
+  r->index = index;
+  r->data_end = size;
+
+  p = reader_fetch(r, 0, HEADER_SIZE);
+  if (p == NULL || memcmp(p, file_magic, sizeof(file_magic)) != 0 ||
+      p[4] != MODBUS_CAPTURE_VERSION)
+    return -1;
+
+  if (size >= HEADER_SIZE + MODBUS_CAPTURE_TRAILER_SIZE &&
+      read(arg, size - sizeof(trailer), trailer, sizeof(trailer)) == 0 &&
+      memcmp(trailer + 12, index_magic, sizeof(index_magic)) == 0) {
+    index_offset = get_u64(trailer);
+    nentries = get_u32(trailer + 8);
+
+    if (index_offset + (uint64_t)nentries * MODBUS_CAPTURE_ENTRY_SIZE +
+          MODBUS_CAPTURE_TRAILER_SIZE ==
+        size) {
+      if (nentries > index_cap)
+        return -2;
+
+      r->data_end = size - MODBUS_CAPTURE_TRAILER_SIZE;
+      for (uint32_t i = 0; i < nentries; i++) {
+        p = reader_fetch(r,
+                         index_offset + i * MODBUS_CAPTURE_ENTRY_SIZE,
+                         MODBUS_CAPTURE_ENTRY_SIZE);
+        if (p == NULL)
+          return -1;
+        get_entry(p, &index[i]);
+      }
+      r->index_len = nentries;
+      r->data_end = index_offset;
+    }
+  }
+
+  modbus_capture_seek(r, 0, UINT64_MAX, -1);
+  return 0;
+}
+
+/* Move to the first segment, starting from r->entry, which may contain
+ * selected frames.
+ */
+static void
+reader_skip_segments(struct modbus_capture_reader* r)
+{
+  const struct modbus_capture_index_entry* e;
+
+  for (; r->entry < r->index_len; r->entry++) {
+    e = &r->index[r->entry];
+    if (e->ts_min > r->ts_to)
+      break;
+
+    if (e->ts_max >= r->ts_from &&
+        (r->slave < 0 || (e->slaves[r->slave / 8] & (1 << (r->slave % 8))))) {
+      r->pos = e->offset;
+      return;
+    }
+  }
+
+  r->pos = r->data_end;
+}
+
+int
+modbus_capture_seek(struct modbus_capture_reader* r,
+                    uint64_t ts_from,
+                    uint64_t ts_to,
+                    int slave)
+{
+  size_t lo = 0;
+  size_t hi = r->index_len;
+  size_t mid;
+
+  if (slave < -1 || slave > 255)
+    return -1;
+
+  r->ts_from = ts_from;
+  r->ts_to = ts_to;
+  r->slave = slave;
+  r->prev_ts = 0;
+  r->pos = HEADER_SIZE;
+
+  if (r->index_len == 0)
+    return 0;
+
+  /* First segment which ends at or after ts_from */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (r->index[mid].ts_max < ts_from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  r->entry = lo;
+  reader_skip_segments(r);
+  return 0;
+}
+
+int
+modbus_capture_next(struct modbus_capture_reader* r,
+                    struct modbus_capture_frame* frame)
+{
+  const uint8_t* p;
+  size_t avail;
+  size_t n;
+  size_t m;
+  uint64_t dts;
+  uint64_t len;
+
+  while (r->pos < r->data_end) {
+    if (r->entry + 1 < r->index_len &&
+        r->pos >= r->index[r->entry + 1].offset) {
+      /* Entering next segment */
+      r->entry++;
+      reader_skip_segments(r);
+      continue;
+    }
+
+    p = reader_fetch(r, r->pos, 1);
+    if (p == NULL)
+      return -1;
+
+    if (*p == MODBUS_CAPTURE_SYNC) {
+      p = reader_fetch(r, r->pos, 9);
+      if (p == NULL)
+        return -1;
+      r->prev_ts = get_u64(p + 1);
+      r->pos += 9;
+      continue;
+    }
+
+    if (*p != MODBUS_CAPTURE_FRAME && *p != MODBUS_CAPTURE_FRAME_CRC_ERROR)
+      return -1;
+
+    avail = r->data_end - r->pos;
+    if (avail > FRAME_HDR_MAX)
+      avail = FRAME_HDR_MAX;
+    p = reader_fetch(r, r->pos, avail);
+    if (p == NULL)
+      return -1;
+
+    n = get_varint(p + 1, avail - 1, 10, &dts);
+    if (n == 0)
+      return -1;
+    m = get_varint(p + 1 + n, avail - 1 - n, 3, &len);
+    if (m == 0 || len == 0 || len > MODBUS_CAPTURE_MAX_FRAME)
+      return -1;
+
+    frame->tag = *p;
+    frame->ts = unzigzag(dts, r->prev_ts);
+    frame->len = len;
+    r->prev_ts = frame->ts;
+
+    n += 1 + m;
+    p = reader_fetch(r, r->pos + n, len);
+    if (p == NULL)
+      return -1;
+    r->pos += n + len;
+
+    if (frame->ts > r->ts_to)
+      break;
+    if (frame->ts < r->ts_from)
+      continue;
+    if (r->slave >= 0 && p[0] != r->slave)
+      continue;
+
+    memcpy(frame->data, p, len);
+    return 1;
+  }
+
+  r->pos = r->data_end;
+  return 0;
+}
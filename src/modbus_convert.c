@@ -0,0 +1,322 @@
+#include <math.h>
+#include <string.h>
+
+#include "modbus_convert.h"
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+/* Wire index of k-th most significant byte of a w-byte value */
+ALWAYS_INLINE int
+byte_index(int w, int order, int k)
+{
+  switch (order) {
+    case MODBUS_ORDER_CDAB:
+      return (w / 2 - 1 - k / 2) * 2 + k % 2;
+    case MODBUS_ORDER_BADC:
+      return k / 2 * 2 + 1 - k % 2;
+    case MODBUS_ORDER_DCBA:
+      return w - 1 - k;
+    default:
+      return k;
+  }
+}
+
+/* With constant w and order it's a fixed shuffle of bytes */
+ALWAYS_INLINE uint64_t
+load(const uint8_t* p, int w, int order)
+{
+  uint64_t v = 0;
+
+  for (int k = 0; k < w; k++)
+    v = v << 8 | p[byte_index(w, order, k)];
+  return v;
+}
+
+ALWAYS_INLINE double
+as_f32(uint32_t v)
+{
+  float f;
+
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+ALWAYS_INLINE double
+as_f64(uint64_t v)
+{
+  double d;
+
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+/* Loop over run of n values, instantiated for every type and order */
+#define KERNEL(NAME, W, EXPR)                                                  \
+  ALWAYS_INLINE void NAME(const uint8_t* restrict p,                           \
+                          size_t n,                                            \
+                          double* restrict out,                                \
+                          double scale,                                        \
+                          double offset,                                       \
+                          int order)                                           \
+  {                                                                            \
+    uint64_t v;                                                                \
+                                                                               \
+    for (size_t i = 0; i < n; i++) {                                           \
+      v = load(p + i * (W), (W), order);                                       \
+      out[i] = (EXPR)*scale + offset;                                          \
+    }                                                                          \
+  }
+
+KERNEL(conv_u16, 2, (double)(uint16_t)v)
+KERNEL(conv_i16, 2, (double)(int16_t)v)
+KERNEL(conv_u32, 4, (double)(uint32_t)v)
+KERNEL(conv_i32, 4, (double)(int32_t)v)
+KERNEL(conv_f32, 4, as_f32(v))
+KERNEL(conv_u64, 8, (double)v)
+KERNEL(conv_i64, 8, (double)(int64_t)v)
+KERNEL(conv_f64, 8, as_f64(v))
+
+/* Float to int64_t, which is undefined for NaN and values out of range.
+ * NaN is INT64_MIN, infinities and values out of range saturate.
+ */
+ALWAYS_INLINE int64_t
+fixed_of(double x)
+{
+  if (isnan(x) || x < -0x1p63)
+    return INT64_MIN;
+  if (x >= 0x1p63)
+    return INT64_MAX;
+  return (int64_t)x;
+}
+
+/* Loop over run of n values to fixed point, EXPR is raw * mul. Offset
+ * is added modulo 2^64, like the products of 64-bit values.
+ */
+#define KERNEL_FIXED(NAME, W, EXPR)                                            \
+  ALWAYS_INLINE void NAME(const uint8_t* restrict p,                           \
+                          size_t n,                                            \
+                          int64_t* restrict out,                               \
+                          int64_t mul,                                         \
+                          int shift,                                           \
+                          int64_t offset,                                      \
+                          int order)                                           \
+  {                                                                            \
+    uint64_t v;                                                                \
+                                                                               \
+    for (size_t i = 0; i < n; i++) {                                           \
+      v = load(p + i * (W), (W), order);                                       \
+      out[i] = (int64_t)((uint64_t)((EXPR) >> shift) + (uint64_t)offset);      \
+    }                                                                          \
+  }
+
+KERNEL_FIXED(fixed_u16, 2, (int64_t)(uint16_t)v * mul)
+KERNEL_FIXED(fixed_i16, 2, (int64_t)(int16_t)v * mul)
+KERNEL_FIXED(fixed_u32, 4, (int64_t)(uint32_t)v * mul)
+KERNEL_FIXED(fixed_i32, 4, (int64_t)(int32_t)v * mul)
+KERNEL_FIXED(fixed_f32, 4, fixed_of(as_f32(v) * mul))
+KERNEL_FIXED(fixed_u64, 8, (int64_t)(v * (uint64_t)mul))
+KERNEL_FIXED(fixed_i64, 8, (int64_t)(v * (uint64_t)mul))
+KERNEL_FIXED(fixed_f64, 8, fixed_of(as_f64(v) * mul))
+
+/* Call kernel with order as a constant */
+#define DISPATCH_ORDER(KERN, ...)                                              \
+  switch (d->order) {                                                          \
+    case MODBUS_ORDER_ABCD:                                                    \
+      KERN(p, n, out, __VA_ARGS__, MODBUS_ORDER_ABCD);                         \
+      break;                                                                   \
+    case MODBUS_ORDER_CDAB:                                                    \
+      KERN(p, n, out, __VA_ARGS__, MODBUS_ORDER_CDAB);                         \
+      break;                                                                   \
+    case MODBUS_ORDER_BADC:                                                    \
+      KERN(p, n, out, __VA_ARGS__, MODBUS_ORDER_BADC);                         \
+      break;                                                                   \
+    default:                                                                   \
+      KERN(p, n, out, __VA_ARGS__, MODBUS_ORDER_DCBA);                         \
+      break;                                                                   \
+  }
+
+/* Call kernel PREFIX_type of the descriptor */
+#define DISPATCH_TYPE(PREFIX, ...)                                             \
+  switch (d->type) {                                                           \
+    case MODBUS_CONV_U16:                                                      \
+      DISPATCH_ORDER(PREFIX##_u16, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_I16:                                                      \
+      DISPATCH_ORDER(PREFIX##_i16, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_U32:                                                      \
+      DISPATCH_ORDER(PREFIX##_u32, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_I32:                                                      \
+      DISPATCH_ORDER(PREFIX##_i32, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_F32:                                                      \
+      DISPATCH_ORDER(PREFIX##_f32, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_U64:                                                      \
+      DISPATCH_ORDER(PREFIX##_u64, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_I64:                                                      \
+      DISPATCH_ORDER(PREFIX##_i64, __VA_ARGS__);                               \
+      break;                                                                   \
+    case MODBUS_CONV_F64:                                                      \
+      DISPATCH_ORDER(PREFIX##_f64, __VA_ARGS__);                               \
+      break;                                                                   \
+  }
+
+static void
+convert_run(const struct modbus_conv_desc* d,
+            const uint8_t* p,
+            size_t n,
+            double* out)
+{
+  DISPATCH_TYPE(conv, d->scale, d->offset);
+}
+
+static void
+convert_run_fixed(const struct modbus_conv_fixed* d,
+                  const uint8_t* p,
+                  size_t n,
+                  int64_t* out)
+{
+  DISPATCH_TYPE(fixed, d->mul, d->shift, d->offset);
+}
+
+/* Data of the response, joined into buf if it wraps around a ring */
+static const uint8_t*
+response_data(const modbus_parser* parser, uint8_t* buf, size_t* len)
+{
+  size_t head;
+
+  *len = parser->data_len;
+  if (parser->data_wrap == NULL)
+    return parser->data;
+
+  head = *len - parser->data_wrap_len;
+  memcpy(buf, parser->data, head);
+  memcpy(buf + head, parser->data_wrap, parser->data_wrap_len);
+  return buf;
+}
+
+int
+modbus_conv_width(enum modbus_conv_type t)
+{
+  switch (t) {
+    case MODBUS_CONV_SKIP:
+    case MODBUS_CONV_U16:
+    case MODBUS_CONV_I16:
+      return 1;
+    case MODBUS_CONV_U32:
+    case MODBUS_CONV_I32:
+    case MODBUS_CONV_F32:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+size_t
+modbus_convert(const struct modbus_conv_desc* desc,
+               size_t ndesc,
+               const uint8_t* data,
+               size_t len,
+               double* out)
+{
+  const struct modbus_conv_desc* d;
+  size_t nout = 0;
+  size_t size;
+  size_t n;
+
+  for (d = desc; d < desc + ndesc && len > 0; d++) {
+    size = modbus_conv_width(d->type) * 2;
+    n = len / size < d->count ? len / size : d->count;
+
+    if (d->type != MODBUS_CONV_SKIP) {
+      convert_run(d, data, n, out + nout);
+      nout += n;
+    }
+
+    data += n * size;
+    len -= n * size;
+    if (n < d->count)
+      break;
+  }
+
+  return nout;
+}
+
+int
+modbus_conv_fixed_check(const struct modbus_conv_fixed* desc, size_t ndesc)
+{
+  for (size_t i = 0; i < ndesc; i++) {
+    if (desc[i].type > MODBUS_CONV_F64 || desc[i].order > MODBUS_ORDER_DCBA ||
+        desc[i].shift > 63)
+      return -1;
+  }
+  return 0;
+}
+
+size_t
+modbus_convert_fixed(const struct modbus_conv_fixed* desc,
+                     size_t ndesc,
+                     const uint8_t* data,
+                     size_t len,
+                     int64_t* out)
+{
+  const struct modbus_conv_fixed* d;
+  size_t nout = 0;
+  size_t size;
+  size_t n;
+
+  for (d = desc; d < desc + ndesc && len > 0; d++) {
+    size = modbus_conv_width(d->type) * 2;
+    n = len / size < d->count ? len / size : d->count;
+
+    if (d->type != MODBUS_CONV_SKIP) {
+      convert_run_fixed(d, data, n, out + nout);
+      nout += n;
+    }
+
+    data += n * size;
+    len -= n * size;
+    if (n < d->count)
+      break;
+  }
+
+  return nout;
+}
+
+size_t
+modbus_convert_response(const struct modbus_conv_desc* desc,
+                        size_t ndesc,
+                        const modbus_parser* parser,
+                        double* out)
+{
+  uint8_t buf[256];
+  const uint8_t* data;
+  size_t len;
+
+  if (parser->data == NULL)
+    return 0;
+
+  /* Values may straddle the wrap, make data contiguous */
+  data = response_data(parser, buf, &len);
+  return modbus_convert(desc, ndesc, data, len, out);
+}
+
+size_t
+modbus_convert_fixed_response(const struct modbus_conv_fixed* desc,
+                              size_t ndesc,
+                              const modbus_parser* parser,
+                              int64_t* out)
+{
+  uint8_t buf[256];
+  const uint8_t* data;
+  size_t len;
+
+  if (parser->data == NULL)
+    return 0;
+
+  data = response_data(parser, buf, &len);
+  return modbus_convert_fixed(desc, ndesc, data, len, out);
+}
@@ -0,0 +1,206 @@
+#include <string.h>
+
+#include "modbus_demux.h"
+
+/* Call callback at offset of settings of every slave, for a broadcast */
+static int
+fan_out(modbus_parser* parser, size_t offset)
+{
+  struct modbus_demux* d =
+    (struct modbus_demux*)((char*)parser - offsetof(struct modbus_demux, parser));
+  const struct modbus_demux_slave* s;
+  modbus_cb cb;
+  int rc = 0;
+
+  for (int i = 1; i < 256; i++) {
+    s = &d->slaves[i];
+    if (s->settings == NULL)
+      continue;
+    memcpy(&cb, (const char*)s->settings + offset, sizeof(cb));
+    if (cb == NULL)
+      continue;
+    parser->arg = s->arg;
+    rc |= cb(parser);
+  }
+  return rc;
+}
+
+#define FAN_OUT(FOR)                                                           \
+  static int fan_out_##FOR(modbus_parser* parser)                              \
+  {                                                                            \
+    return fan_out(parser, offsetof(modbus_parser_settings, on_##FOR));        \
+  }
+
+FAN_OUT(slave_addr)
+FAN_OUT(function)
+FAN_OUT(addr)
+FAN_OUT(qty)
+FAN_OUT(data_len)
+FAN_OUT(data_start)
+FAN_OUT(data_end)
+FAN_OUT(crc_error)
+FAN_OUT(complete)
+
+void
+modbus_demux_init(struct modbus_demux* d, enum modbus_parser_type t)
+{
+  memset(d, 0, sizeof(*d));
+  d->type = t;
+  modbus_parser_init(&d->parser, t);
+
+  d->broadcast.on_slave_addr = fan_out_slave_addr;
+  d->broadcast.on_function = fan_out_function;
+  d->broadcast.on_addr = fan_out_addr;
+  d->broadcast.on_qty = fan_out_qty;
+  d->broadcast.on_data_len = fan_out_data_len;
+  d->broadcast.on_data_start = fan_out_data_start;
+  d->broadcast.on_data_end = fan_out_data_end;
+  d->broadcast.on_crc_error = fan_out_crc_error;
+  d->broadcast.on_complete = fan_out_complete;
+}
+
+void
+modbus_demux_attach(struct modbus_demux* d,
+                    uint8_t slave_addr,
+                    const modbus_parser_settings* settings,
+                    void* arg)
+{
+  if (slave_addr == 0)
+    return;
+
+  d->slaves[slave_addr].settings = settings;
+  d->slaves[slave_addr].arg = arg;
+}
+
+/* Return 1 if the parser failed at an unknown function code, i.e. the
+ * address byte didn't start a frame. The parser is past s_func unless
+ * on_slave_addr failed.
+ */
+static int
+unknown_function(const struct modbus_demux* d)
+{
+  uint8_t head[2] = { d->parser.slave_addr, d->parser.function };
+
+  return d->parser.errno != 0 && d->parser.state != s_func &&
+         modbus_frame_len(d->type, head, 2) < 0;
+}
+
+/* Start parsing frame of slave_addr, return 0 if it's to be skipped */
+static int
+start_frame(struct modbus_demux* d, uint8_t slave_addr)
+{
+  const struct modbus_demux_slave* s = &d->slaves[slave_addr];
+
+  if (slave_addr == 0) {
+    /* Worth parsing if some slave listens */
+    for (int i = 1; i < 256 && d->settings == NULL; i++) {
+      if (d->slaves[i].settings != NULL)
+        d->settings = &d->broadcast;
+    }
+    if (d->settings == NULL)
+      return 0;
+  } else {
+    if (s->settings == NULL)
+      return 0;
+    d->settings = s->settings;
+    d->parser.arg = s->arg;
+  }
+
+  modbus_parser_init(&d->parser, d->type);
+  return 1;
+}
+
+size_t
+modbus_demux_execute(struct modbus_demux* d, const uint8_t* data, size_t len)
+{
+  size_t completed = 0;
+  size_t pos = 0;
+  size_t n;
+  int frame_len;
+
+  while (pos < len) {
+    /* Rest of a skipped frame */
+    if (d->skip > 0) {
+      n = len - pos < d->skip ? len - pos : d->skip;
+      d->skip -= n;
+      d->skipped_bytes += n;
+      pos += n;
+      continue;
+    }
+
+    /* Frame of a slave in the table */
+    if (d->settings != NULL) {
+      n = modbus_parser_execute(&d->parser, d->settings, data + pos, len - pos);
+      pos += n;
+      if (d->parser.state != s_complete && d->parser.errno == 0)
+        continue;
+
+      d->settings = NULL;
+      if (unknown_function(d)) {
+        /* Same as a skipped slave: the address byte is a resync, the
+         * function byte the parser stopped at may start a frame
+         */
+        d->resyncs++;
+        pos--;
+        continue;
+      }
+
+      if (d->parser.slave_addr == 0)
+        d->broadcasts++;
+      else
+        d->frames++;
+      completed++;
+      if (n == 0)
+        pos++; /* Parser refused the byte, don't stick on it */
+      continue;
+    }
+
+    /* Start of a frame to skip, split by the end of previous data. Its
+     * head is collected byte by byte until the length is known.
+     */
+    if (d->head_len > 0) {
+      d->head[d->head_len++] = data[pos++];
+      frame_len = modbus_frame_len(d->type, d->head, d->head_len);
+      if (frame_len > 0) {
+        d->skip = frame_len - d->head_len;
+        d->skipped_bytes += d->head_len;
+        d->skipped++;
+        d->head_len = 0;
+        completed++;
+      } else if (frame_len < 0) {
+        /* Function byte is known first, it's the one just added. It may
+         * start a frame.
+         */
+        d->head_len = 0;
+        d->resyncs++;
+        pos--;
+      }
+      continue;
+    }
+
+    if (d->type == MODBUS_RESPONSE && data[pos] == 0) {
+      d->resyncs++; /* Nobody responds to a broadcast */
+      pos++;
+      continue;
+    }
+
+    if (start_frame(d, data[pos]))
+      continue;
+
+    frame_len = modbus_frame_len(d->type, data + pos, len - pos);
+    if (frame_len > 0) {
+      d->skip = frame_len;
+      d->skipped++;
+      completed++;
+    } else if (frame_len < 0) {
+      d->resyncs++;
+      pos++;
+    } else {
+      /* Shorter than any header, fits */
+      d->head[0] = data[pos++];
+      d->head_len = 1;
+    }
+  }
+
+  return completed;
+}
@@ -0,0 +1,52 @@
+#include "modbus_gateway.h"
+
+int
+modbus_tcp_to_rtu(uint8_t* buf,
+                  size_t len,
+                  size_t sz,
+                  uint16_t* transaction_id)
+{
+  uint8_t* rtu = buf + MODBUS_TCP_HEADROOM;
+  size_t n;
+  uint16_t crc;
+
+  if (len < MODBUS_TCP_HEADROOM + 2 || sz < len + 2)
+    return -1;
+
+  /* Protocol id, length of unit id and up to 253 bytes of PDU */
+  n = buf[4] << 8 | buf[5];
+  if (buf[2] != 0 || buf[3] != 0 || n != len - MODBUS_TCP_HEADROOM || n > 254)
+    return -1;
+
+  *transaction_id = buf[0] << 8 | buf[1];
+  crc = modbus_calc_crc(rtu, n);
+  rtu[n] = crc & 0xFF;
+  rtu[n + 1] = crc >> 8;
+
+  return n + 2;
+}
+
+int
+modbus_rtu_to_tcp(uint8_t* buf, size_t len, uint16_t transaction_id)
+{
+  uint8_t* tcp = buf - MODBUS_TCP_HEADROOM;
+  size_t n;
+  uint16_t crc;
+
+  if (len < 4 || len > 256)
+    return -1;
+
+  n = len - 2;
+  crc = modbus_calc_crc(buf, n);
+  if (buf[n] != (crc & 0xFF) || buf[n + 1] != crc >> 8)
+    return -1;
+
+  tcp[0] = transaction_id >> 8;
+  tcp[1] = transaction_id & 0xFF;
+  tcp[2] = 0;
+  tcp[3] = 0;
+  tcp[4] = n >> 8;
+  tcp[5] = n & 0xFF;
+
+  return MODBUS_TCP_HEADROOM + n;
+}
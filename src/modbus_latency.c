@@ -0,0 +1,152 @@
+#include <string.h>
+
+#include "modbus_latency.h"
+
+static size_t
+bucket_index(uint64_t v)
+{
+  int e;
+
+  if (v < 16)
+    return v;
+
+  e = 63 - __builtin_clzll(v);
+  if (e > MODBUS_LATENCY_MAX_EXP)
+    return MODBUS_LATENCY_BUCKETS - 1;
+
+  /* Leading one is implicit, next three bits select the sub-bucket */
+  return 16 + (e - 4) * 8 + ((v >> (e - 3)) & 7);
+}
+
+/* Largest value which falls into bucket i */
+static uint64_t
+bucket_upper(size_t i)
+{
+  int e;
+
+  if (i < 16)
+    return i;
+
+  e = (i - 16) / 8 + 4;
+  return ((uint64_t)(8 + (i - 16) % 8 + 1) << (e - 3)) - 1;
+}
+
+void
+modbus_latency_hist_init(struct modbus_latency_hist* h)
+{
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+void
+modbus_latency_hist_record(struct modbus_latency_hist* h, uint64_t v)
+{
+  h->buckets[bucket_index(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+void
+modbus_latency_hist_merge(struct modbus_latency_hist* dst,
+                          const struct modbus_latency_hist* src)
+{
+  for (size_t i = 0; i < MODBUS_LATENCY_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+uint64_t
+modbus_latency_hist_quantile(const struct modbus_latency_hist* h, double q)
+{
+  uint64_t rank;
+  uint64_t n = 0;
+  uint64_t v;
+
+  if (h->count == 0)
+    return 0;
+
+  if (q <= 0)
+    return h->min;
+
+  rank = q * h->count;
+  if (rank < q * h->count)
+    rank++;
+  if (rank > h->count)
+    rank = h->count;
+
+  for (size_t i = 0; i < MODBUS_LATENCY_BUCKETS; i++) {
+    n += h->buckets[i];
+    if (n >= rank) {
+      if (i == MODBUS_LATENCY_BUCKETS - 1)
+        return h->max; /* Overflow bucket has no upper bound */
+      v = bucket_upper(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+void
+modbus_latency_init(struct modbus_latency* l,
+                    struct modbus_latency_hist* slaves,
+                    struct modbus_latency_hist* funcs)
+{
+  memset(l, 0, sizeof(*l));
+  l->slaves = slaves;
+  l->funcs = funcs;
+
+  if (slaves != NULL) {
+    for (size_t i = 0; i < MODBUS_LATENCY_SLAVES; i++)
+      modbus_latency_hist_init(&slaves[i]);
+  }
+
+  if (funcs != NULL) {
+    for (size_t i = 0; i < MODBUS_LATENCY_FUNCS; i++)
+      modbus_latency_hist_init(&funcs[i]);
+  }
+}
+
+void
+modbus_latency_query(struct modbus_latency* l,
+                     uint8_t slave,
+                     uint8_t function,
+                     uint64_t ts)
+{
+  l->sent_ts[slave] = ts;
+  l->sent_func[slave] = function;
+  l->pending[slave / 8] |= 1 << (slave % 8);
+}
+
+int64_t
+modbus_latency_response(struct modbus_latency* l,
+                        const modbus_parser* parser,
+                        uint64_t ts)
+{
+  uint8_t slave = parser->slave_addr;
+  uint8_t function = parser->function & 0x7F; /* Exception bit */
+  uint64_t v;
+
+  if (!(l->pending[slave / 8] & (1 << (slave % 8))) ||
+      l->sent_func[slave] != function)
+    return -1;
+
+  l->pending[slave / 8] &= ~(1 << (slave % 8));
+  v = ts >= l->sent_ts[slave] ? ts - l->sent_ts[slave] : 0;
+
+  if (l->slaves != NULL)
+    modbus_latency_hist_record(&l->slaves[slave], v);
+  if (l->funcs != NULL)
+    modbus_latency_hist_record(&l->funcs[function], v);
+
+  return v;
+}
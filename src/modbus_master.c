@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "modbus_master.h"
+
+/* Completion is checked after execute, no callbacks are needed */
+static const modbus_parser_settings no_callbacks;
+
+void
+modbus_master_init(struct modbus_master* m,
+                   struct modbus_master_line* lines,
+                   size_t nlines,
+                   uint32_t timeout,
+                   uint32_t gap)
+{
+  memset(m, 0, sizeof(*m));
+  memset(lines, 0, nlines * sizeof(*lines));
+  m->lines = lines;
+  m->nlines = nlines;
+  m->timeout = timeout;
+  m->gap = gap;
+  m->turnaround = timeout;
+
+  for (size_t i = 0; i < nlines; i++)
+    modbus_parser_init(&lines[i].parser, MODBUS_RESPONSE);
+}
+
+/* Return time when line has a query to send */
+static uint64_t
+line_due(const struct modbus_master_line* l)
+{
+  uint64_t due = UINT64_MAX;
+  uint64_t t;
+
+  if (l->deferred != NULL)
+    return 0;
+  if (l->poll != NULL)
+    due = modbus_poll_next_due(l->poll);
+  if (l->writeq != NULL && (t = modbus_writeq_next_due(l->writeq)) < due)
+    due = t;
+  return due;
+}
+
+/* Encode the next query of line into l->tx */
+static int
+next_query(struct modbus_master_line* l, uint64_t now)
+{
+  struct modbus_poll_request* req = l->deferred;
+  int n = 0;
+
+  l->deferred = NULL;
+  if (req == NULL && l->poll != NULL)
+    req = modbus_poll_next(l->poll, now);
+
+  if (l->writeq != NULL) {
+    n = modbus_writeq_flush(l->writeq,
+                            now,
+                            req != NULL ? &req->query : NULL,
+                            &l->query,
+                            l->tx,
+                            sizeof(l->tx));
+    if (n != 0) {
+      /* Write went alone, read is the next one */
+      if (req != NULL && l->query.function != MODBUS_FUNC_READ_WRITE_REGS)
+        l->deferred = req;
+      return n;
+    }
+  }
+
+  if (req == NULL)
+    return 0;
+
+  l->query = req->query;
+  return modbus_gen_query(&l->query, l->tx, sizeof(l->tx));
+}
+
+int
+modbus_master_tx(struct modbus_master* m,
+                 size_t line,
+                 uint64_t now,
+                 const uint8_t** buf)
+{
+  struct modbus_master_line* l = &m->lines[line];
+  int n;
+
+  if (l->state == MODBUS_MASTER_TURNAROUND && now >= l->deadline)
+    l->state = MODBUS_MASTER_IDLE;
+  if (l->state != MODBUS_MASTER_IDLE)
+    return 0;
+
+  n = next_query(l, now);
+  if (n <= 0)
+    return n;
+
+  modbus_parser_init(&l->parser, MODBUS_RESPONSE);
+  if (l->query.slave_addr == 0) {
+    /* Broadcast, there is no response */
+    l->state = MODBUS_MASTER_TURNAROUND;
+    l->deadline = now + m->turnaround;
+  } else {
+    l->state = MODBUS_MASTER_WAIT;
+    l->deadline = now + m->timeout;
+  }
+
+  *buf = l->tx;
+  return n;
+}
+
+void
+modbus_master_sent(struct modbus_master* m, size_t line, uint64_t now)
+{
+  struct modbus_master_line* l = &m->lines[line];
+
+  if (l->state == MODBUS_MASTER_WAIT)
+    l->deadline = now + m->timeout;
+  else if (l->state == MODBUS_MASTER_TURNAROUND && l->query.slave_addr == 0)
+    l->deadline = now + m->turnaround;
+}
+
+int
+modbus_master_rx(struct modbus_master* m,
+                 size_t line,
+                 const uint8_t* data,
+                 size_t len,
+                 uint64_t now)
+{
+  struct modbus_master_line* l = &m->lines[line];
+  modbus_parser* parser = &l->parser;
+  size_t n;
+
+  if (l->state != MODBUS_MASTER_WAIT)
+    return 0;
+
+  while (len > 0) {
+    n = modbus_parser_execute(parser, &no_callbacks, data, len);
+    data += n;
+    len -= n;
+
+    if (parser->errno == 0 && parser->state != s_complete)
+      continue;
+
+    /* Late response of a query which timed out has another function */
+    if (parser->slave_addr != l->query.slave_addr ||
+        (parser->function & ~MODBUS_EXCEPTION_BIT) != l->query.function) {
+      /* Not ours, keep waiting */
+      modbus_parser_init(parser, MODBUS_RESPONSE);
+      continue;
+    }
+
+    l->state = MODBUS_MASTER_TURNAROUND;
+    l->deadline = now + m->gap;
+    if (m->on_done != NULL)
+      m->on_done(m, line, parser);
+    return 1;
+  }
+
+  return 0;
+}
+
+uint64_t
+modbus_master_timer(struct modbus_master* m, uint64_t now)
+{
+  struct modbus_master_line* l;
+  uint64_t next = UINT64_MAX;
+  uint64_t t;
+
+  for (size_t i = 0; i < m->nlines; i++) {
+    l = &m->lines[i];
+
+    if (l->state == MODBUS_MASTER_WAIT && now >= l->deadline) {
+      l->state = MODBUS_MASTER_TURNAROUND;
+      l->deadline = now + m->gap;
+      if (m->on_done != NULL)
+        m->on_done(m, i, NULL);
+    }
+
+    switch (l->state) {
+      case MODBUS_MASTER_WAIT:
+        t = l->deadline;
+        break;
+      case MODBUS_MASTER_TURNAROUND:
+        t = line_due(l);
+        t = t > l->deadline ? t : l->deadline;
+        break;
+      default:
+        t = line_due(l);
+        break;
+    }
+    if (t < next)
+      next = t;
+  }
+
+  return next;
+}
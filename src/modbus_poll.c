@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus_poll.h"
+
+/* Largest quantity of a read query, 0 for other functions */
+static uint32_t
+read_limit(enum modbus_func f)
+{
+  switch (f) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      return MODBUS_MAX_READ_BITS;
+
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+      return MODBUS_MAX_READ_REGS;
+
+    default:
+      return 0;
+  }
+}
+
+static int
+point_cmp(const void* a, const void* b)
+{
+  const struct modbus_poll_point* x = a;
+  const struct modbus_poll_point* y = b;
+
+  if (x->slave_addr != y->slave_addr)
+    return x->slave_addr < y->slave_addr ? -1 : 1;
+  if (x->function != y->function)
+    return x->function < y->function ? -1 : 1;
+  if (x->period != y->period)
+    return x->period < y->period ? -1 : 1;
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  return 0;
+}
+
+static int
+emit(struct modbus_poll_request* out,
+     size_t cap,
+     size_t* n,
+     const struct modbus_poll_point* p,
+     uint32_t start,
+     uint32_t end)
+{
+  struct modbus_poll_request* r;
+
+  if (*n == cap)
+    return -1;
+
+  r = &out[(*n)++];
+  memset(r, 0, sizeof(*r));
+  r->query.slave_addr = p->slave_addr;
+  r->query.function = p->function;
+  r->query.addr = start;
+  r->query.qty = end - start;
+  r->period = p->period;
+  return 0;
+}
+
+int
+modbus_poll_plan(struct modbus_poll_point* points,
+                 size_t n,
+                 uint16_t gap,
+                 struct modbus_poll_request* out,
+                 size_t cap)
+{
+  const struct modbus_poll_point* p;
+  const struct modbus_poll_point* first = NULL;
+  uint32_t start = 0;
+  uint32_t end = 0;
+  uint32_t limit;
+  uint32_t pend;
+  size_t nreq = 0;
+
+  /* Range must end within address space, period 0 would be always due */
+  for (size_t i = 0; i < n; i++) {
+    if (read_limit(points[i].function) == 0 || points[i].count == 0 ||
+        (uint32_t)points[i].addr + points[i].count > 0x10000 ||
+        points[i].period == 0)
+      return -1;
+  }
+
+  qsort(points, n, sizeof(*points), point_cmp);
+
+  for (size_t i = 0; i < n; i++) {
+    p = &points[i];
+    limit = read_limit(p->function);
+    pend = (uint32_t)p->addr + p->count;
+
+    /* Extend current request if it's the same kind, close enough and
+     * stays within limit
+     */
+    if (first != NULL && first->slave_addr == p->slave_addr &&
+        first->function == p->function && first->period == p->period &&
+        p->addr <= end + gap && (pend > end ? pend : end) - start <= limit) {
+      if (pend > end)
+        end = pend;
+      continue;
+    }
+
+    if (first != NULL && emit(out, cap, &nreq, first, start, end) != 0)
+      return -1;
+
+    /* Split points larger than a single query */
+    start = p->addr;
+    while (pend - start > limit) {
+      if (emit(out, cap, &nreq, p, start, start + limit) != 0)
+        return -1;
+      start += limit;
+    }
+    first = p;
+    end = pend;
+  }
+
+  if (first != NULL && emit(out, cap, &nreq, first, start, end) != 0)
+    return -1;
+
+  return nreq;
+}
+
+void
+modbus_poll_sched_init(struct modbus_poll_sched* s,
+                       struct modbus_poll_request* reqs,
+                       size_t n,
+                       uint64_t now)
+{
+  s->reqs = reqs;
+  s->n = n;
+  for (size_t i = 0; i < n; i++)
+    reqs[i].next_due = now;
+}
+
+struct modbus_poll_request*
+modbus_poll_next(struct modbus_poll_sched* s, uint64_t now)
+{
+  struct modbus_poll_request* r = NULL;
+
+  for (size_t i = 0; i < s->n; i++) {
+    if (s->reqs[i].next_due <= now &&
+        (r == NULL || s->reqs[i].next_due < r->next_due))
+      r = &s->reqs[i];
+  }
+
+  if (r == NULL)
+    return NULL;
+
+  r->next_due += r->period;
+  if (r->next_due <= now)
+    r->next_due = now + r->period; /* Fell behind, don't burst */
+
+  return r;
+}
+
+uint64_t
+modbus_poll_next_due(const struct modbus_poll_sched* s)
+{
+  uint64_t due = UINT64_MAX;
+
+  for (size_t i = 0; i < s->n; i++) {
+    if (s->reqs[i].next_due < due)
+      due = s->reqs[i].next_due;
+  }
+  return due;
+}
@@ -0,0 +1,170 @@
+#include <string.h>
+
+#include "modbus_queue.h"
+
+/* Size of record up to the used part of data */
+#define FRAME_SIZE(len) (offsetof(struct modbus_queue_frame, data) + (len))
+
+int
+modbus_queue_init(struct modbus_queue* q,
+                  struct modbus_queue_cell* cells,
+                  size_t size)
+{
+  if (size < 2 || (size & (size - 1)) != 0)
+    return -1;
+
+  memset(q, 0, sizeof(*q));
+  q->cells = cells;
+  q->mask = size - 1;
+
+  /* Cell i is free for the producer at position i */
+  for (size_t i = 0; i < size; i++)
+    __atomic_store_n(&cells[i].seq, i, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Claim the cell at the next producer position, NULL if queue is full */
+static struct modbus_queue_cell*
+reserve(struct modbus_queue* q)
+{
+  struct modbus_queue_cell* cell;
+  size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+  size_t seq;
+  intptr_t diff;
+
+  for (;;) {
+    cell = &q->cells[pos & q->mask];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->enqueue_pos,
+                                      &pos,
+                                      pos + 1,
+                                      true,
+                                      __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        return cell;
+      /* pos is reloaded by failed exchange */
+    } else if (diff < 0) {
+      return NULL; /* Consumer hasn't freed the cell yet */
+    } else {
+      pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Hand filled cell over to consumers */
+static void
+publish(struct modbus_queue_cell* cell)
+{
+  size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&cell->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+modbus_queue_push(struct modbus_queue* q,
+                  const struct modbus_queue_frame* frame)
+{
+  struct modbus_queue_cell* cell;
+
+  if (frame->data_len > MODBUS_QUEUE_MAX_DATA)
+    return -1;
+
+  cell = reserve(q);
+  if (cell == NULL)
+    return -1;
+
+  memcpy(&cell->frame, frame, FRAME_SIZE(frame->data_len));
+  publish(cell);
+  return 0;
+}
+
+int
+modbus_queue_push_parser(struct modbus_queue* q, const modbus_parser* parser)
+{
+  struct modbus_queue_cell* cell;
+  struct modbus_queue_frame* f;
+  size_t len = 0;
+  size_t head;
+
+  if (parser->data != NULL)
+    len = parser->data_len;
+  if (len > MODBUS_QUEUE_MAX_DATA)
+    return -1;
+
+  cell = reserve(q);
+  if (cell == NULL)
+    return -1;
+
+  f = &cell->frame;
+  f->slave_addr = parser->slave_addr;
+  f->function = parser->function;
+  f->addr = parser->addr;
+  f->qty = parser->qty;
+  f->data_len = len;
+
+  if (len > 0) {
+    head = len - parser->data_wrap_len;
+    memcpy(f->data, parser->data, head);
+    if (parser->data_wrap != NULL)
+      memcpy(f->data + head, parser->data_wrap, parser->data_wrap_len);
+  }
+
+  publish(cell);
+  return 0;
+}
+
+size_t
+modbus_queue_pop(struct modbus_queue* q,
+                 struct modbus_queue_frame* out,
+                 size_t max)
+{
+  struct modbus_queue_cell* cell;
+  size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+  size_t seq;
+  size_t n;
+  intptr_t diff = 0;
+
+  if (max == 0)
+    return 0;
+  if (max > q->mask + 1)
+    max = q->mask + 1;
+
+  for (;;) {
+    /* Count consecutive published cells from pos */
+    for (n = 0; n < max; n++) {
+      cell = &q->cells[(pos + n) & q->mask];
+      seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+      diff = (intptr_t)seq - (intptr_t)(pos + n + 1);
+      if (diff != 0)
+        break;
+    }
+
+    if (n == 0) {
+      if (diff < 0)
+        return 0; /* Empty */
+      pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+      continue; /* Taken by another consumer */
+    }
+
+    /* Claim all of them at once */
+    if (__atomic_compare_exchange_n(&q->dequeue_pos,
+                                    &pos,
+                                    pos + n,
+                                    true,
+                                    __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED))
+      break;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    cell = &q->cells[(pos + i) & q->mask];
+    memcpy(&out[i], &cell->frame, FRAME_SIZE(cell->frame.data_len));
+    /* Free for the producer one lap later */
+    __atomic_store_n(&cell->seq, pos + i + q->mask + 1, __ATOMIC_RELEASE);
+  }
+
+  return n;
+}
@@ -0,0 +1,330 @@
+#include <string.h>
+
+#include "modbus_regcache.h"
+
+/* Range of changed items which is not reported yet */
+struct run
+{
+  uint32_t start;
+  uint32_t len;
+};
+
+static size_t
+bucket_of(uint8_t slave_addr, enum modbus_table table)
+{
+  return (slave_addr * 4 + table) % MODBUS_REGCACHE_BUCKETS;
+}
+
+static int
+is_bits(enum modbus_table table)
+{
+  return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_IN;
+}
+
+void
+modbus_regcache_init(struct modbus_regcache* c)
+{
+  memset(c, 0, sizeof(*c));
+}
+
+void
+modbus_regcache_block_init(struct modbus_regcache_block* b,
+                           uint8_t slave_addr,
+                           enum modbus_table table,
+                           uint16_t addr,
+                           uint16_t count,
+                           uint8_t* data,
+                           uint64_t* dirty)
+{
+  memset(b, 0, sizeof(*b));
+  b->slave_addr = slave_addr;
+  b->table = table;
+  b->addr = addr;
+  b->count = count;
+  b->data = data;
+  b->dirty = dirty;
+
+  memset(data, 0, MODBUS_TABLE_DATA_SIZE(table, count));
+  memset(dirty, 0, MODBUS_REGCACHE_DIRTY_WORDS(count) * sizeof(uint64_t));
+  for (uint32_t i = 0; i < count; i++)
+    dirty[i / 64] |= 1ull << (i % 64);
+}
+
+/* Return block which contains addr. If there is none, *next is set to
+ * start of the following block, or to 0x10000.
+ */
+static struct modbus_regcache_block*
+lookup(struct modbus_regcache* c,
+       uint8_t slave_addr,
+       enum modbus_table table,
+       uint32_t addr,
+       uint32_t* next)
+{
+  struct modbus_regcache_block* b = c->buckets[bucket_of(slave_addr, table)];
+
+  *next = 0x10000;
+  for (; b != NULL; b = b->next) {
+    if (b->slave_addr != slave_addr || b->table != table)
+      continue;
+    if (addr >= b->addr && addr < (uint32_t)b->addr + b->count)
+      return b;
+    if (b->addr > addr && b->addr < *next)
+      *next = b->addr;
+  }
+  return NULL;
+}
+
+int
+modbus_regcache_add(struct modbus_regcache* c, struct modbus_regcache_block* b)
+{
+  struct modbus_regcache_block** head =
+    &c->buckets[bucket_of(b->slave_addr, b->table)];
+  uint32_t next;
+
+  if (b->count == 0 ||
+      lookup(c, b->slave_addr, b->table, b->addr, &next) != NULL ||
+      next < (uint32_t)b->addr + b->count)
+    return -1;
+
+  b->next = *head;
+  *head = b;
+  return 0;
+}
+
+struct modbus_regcache_block*
+modbus_regcache_find(struct modbus_regcache* c,
+                     uint8_t slave_addr,
+                     enum modbus_table table,
+                     uint16_t addr)
+{
+  uint32_t next;
+
+  return lookup(c, slave_addr, table, addr, &next);
+}
+
+static void
+run_flush(struct modbus_regcache* c,
+          const struct modbus_regcache_block* b,
+          struct run* run)
+{
+  if (run->len > 0 && c->on_change != NULL)
+    c->on_change(c->arg, b, b->addr + run->start, run->len);
+  run->len = 0;
+}
+
+/* Item i of block has changed */
+static void
+mark(struct modbus_regcache* c,
+     struct modbus_regcache_block* b,
+     struct run* run,
+     uint32_t i)
+{
+  b->dirty[i / 64] |= 1ull << (i % 64);
+
+  if (run->len > 0 && run->start + run->len == i) {
+    run->len++;
+  } else {
+    run_flush(c, b, run);
+    run->start = i;
+    run->len = 1;
+  }
+}
+
+/* Bit per 16-bit lane of x which is non-zero, in lane order of memory */
+static unsigned
+lanes_nonzero(uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#endif
+  /* Fold every lane into its lowest bit */
+  x |= x >> 8;
+  x |= x >> 4;
+  x |= x >> 2;
+  x |= x >> 1;
+  return (x & 1) | (x >> 15 & 2) | (x >> 30 & 4) | (x >> 45 & 8);
+}
+
+static int
+update_regs(struct modbus_regcache* c,
+            struct modbus_regcache_block* b,
+            uint32_t first,
+            const uint8_t* src,
+            uint32_t n)
+{
+  uint8_t* dst = b->data + first * 2;
+  struct run run = { 0 };
+  uint64_t mask;
+  uint64_t x, y;
+  uint32_t m;
+  int changed = 0;
+  int j;
+
+  for (uint32_t i = 0; i < n; i += 64) {
+    m = n - i < 64 ? n - i : 64;
+
+    /* Most of registers are static, skip them at memcmp speed */
+    if (memcmp(dst + i * 2, src + i * 2, m * 2) == 0) {
+      run_flush(c, b, &run);
+      continue;
+    }
+
+    mask = 0;
+    for (uint32_t k = 0; k < m; k += 4) {
+      x = y = 0;
+      memcpy(&x, dst + (i + k) * 2, (m - k < 4 ? m - k : 4) * 2);
+      memcpy(&y, src + (i + k) * 2, (m - k < 4 ? m - k : 4) * 2);
+      mask |= (uint64_t)lanes_nonzero(x ^ y) << k;
+    }
+
+    while (mask) {
+      j = __builtin_ctzll(mask);
+      mask &= mask - 1;
+      memcpy(dst + (i + j) * 2, src + (i + j) * 2, 2);
+      mark(c, b, &run, first + i + j);
+      changed++;
+    }
+  }
+
+  run_flush(c, b, &run);
+  return changed;
+}
+
+/* Load n (1 - 64) bits starting at bit offset pos */
+static uint64_t
+load_bits(const uint8_t* p, uint32_t pos, uint32_t n)
+{
+  const uint8_t* q = p + pos / 8;
+  uint32_t shift = pos % 8;
+  uint32_t nbytes = (shift + n + 7) / 8;
+  uint64_t v = 0;
+
+  for (uint32_t k = 0; k < nbytes && k < 8; k++)
+    v |= (uint64_t)q[k] << (k * 8);
+  v >>= shift;
+  if (nbytes == 9)
+    v |= (uint64_t)q[8] << (64 - shift);
+
+  return n == 64 ? v : v & ((1ull << n) - 1);
+}
+
+static int
+update_bits(struct modbus_regcache* c,
+            struct modbus_regcache_block* b,
+            uint32_t first,
+            const uint8_t* src,
+            uint32_t src_pos,
+            uint32_t n)
+{
+  struct run run = { 0 };
+  uint64_t mask;
+  uint32_t m;
+  uint32_t at;
+  int changed = 0;
+
+  for (uint32_t i = 0; i < n; i += 64) {
+    m = n - i < 64 ? n - i : 64;
+    mask = load_bits(b->data, first + i, m) ^ load_bits(src, src_pos + i, m);
+    if (mask == 0) {
+      run_flush(c, b, &run);
+      continue;
+    }
+
+    while (mask) {
+      at = first + i + __builtin_ctzll(mask);
+      mask &= mask - 1;
+      b->data[at / 8] ^= 1 << (at % 8);
+      mark(c, b, &run, at);
+      changed++;
+    }
+  }
+
+  run_flush(c, b, &run);
+  return changed;
+}
+
+int
+modbus_regcache_update(struct modbus_regcache* c,
+                       uint8_t slave_addr,
+                       enum modbus_table table,
+                       uint16_t addr,
+                       const uint8_t* data,
+                       uint16_t count)
+{
+  struct modbus_regcache_block* b;
+  uint32_t end = (uint32_t)addr + count;
+  uint32_t a = addr;
+  uint32_t next;
+  uint32_t n;
+  int changed = 0;
+
+  while (a < end) {
+    b = lookup(c, slave_addr, table, a, &next);
+    if (b == NULL) {
+      a = next; /* Skip items which are not cached */
+      continue;
+    }
+
+    n = (uint32_t)b->addr + b->count;
+    n = (n < end ? n : end) - a;
+
+    if (is_bits(table))
+      changed += update_bits(c, b, a - b->addr, data, a - addr, n);
+    else
+      changed += update_regs(c, b, a - b->addr, data + (a - addr) * 2, n);
+    a += n;
+  }
+
+  return changed;
+}
+
+int
+modbus_regcache_update_response(struct modbus_regcache* c,
+                                const modbus_parser* parser,
+                                const struct modbus_query* q)
+{
+  struct modbus_response_items items;
+  int rc;
+
+  rc = modbus_response_items(parser, q, &items);
+  if (rc <= 0)
+    return rc;
+  return modbus_regcache_update(c,
+                                parser->slave_addr,
+                                items.table,
+                                items.addr,
+                                items.data,
+                                items.count);
+}
+
+int
+modbus_regcache_next_dirty(struct modbus_regcache_block* b,
+                           uint16_t* addr,
+                           uint16_t* count)
+{
+  uint32_t i = *addr > b->addr ? *addr - b->addr : 0;
+  uint32_t start;
+  uint64_t w;
+
+  /* Find first dirty item, a word at a time */
+  for (; i < b->count; i = (i / 64 + 1) * 64) {
+    w = b->dirty[i / 64] >> (i % 64);
+    if (w != 0) {
+      i += __builtin_ctzll(w);
+      break;
+    }
+  }
+  if (i >= b->count)
+    return 0;
+
+  /* Clear it up to the first clean one */
+  start = i;
+  while (i < b->count && (b->dirty[i / 64] & (1ull << (i % 64)))) {
+    b->dirty[i / 64] &= ~(1ull << (i % 64));
+    i++;
+  }
+
+  *addr = b->addr + start;
+  *count = i - start;
+  return 1;
+}
@@ -0,0 +1,270 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "modbus_replay.h"
+
+struct replay_worker
+{
+  pthread_t thread;
+  const uint8_t* data;
+  size_t len;
+  int index;
+  int nworkers;
+  const modbus_parser_settings* settings;
+  void* arg;
+  struct modbus_replay_stats stats;
+};
+
+void
+modbus_replay_stats_init(struct modbus_replay_stats* stats)
+{
+  memset(stats, 0, sizeof(*stats));
+}
+
+void
+modbus_replay_stats_merge(struct modbus_replay_stats* dst,
+                          const struct modbus_replay_stats* src)
+{
+  dst->frames += src->frames;
+  dst->bytes += src->bytes;
+  dst->crc_errors += src->crc_errors;
+  dst->aborted += src->aborted;
+  dst->skipped += src->skipped;
+  dst->resyncs += src->resyncs;
+
+  for (int i = 0; i < 256; i++) {
+    dst->func[i] += src->func[i];
+    dst->slave[i].frames += src->slave[i].frames;
+    dst->slave[i].bytes += src->slave[i].bytes;
+    dst->slave[i].crc_errors += src->slave[i].crc_errors;
+  }
+}
+
+/* Return length of frame at data[pos] if its CRC is valid, otherwise 0 */
+static size_t
+valid_frame(const uint8_t* data, size_t len, size_t pos)
+{
+  int n = modbus_frame_len(MODBUS_RESPONSE, data + pos, len - pos);
+  uint16_t crc;
+
+  if (n <= 0 || n > len - pos)
+    return 0;
+
+  crc = modbus_calc_crc(data + pos, n - 2);
+  if (data[pos + n - 2] != (crc & 0x00FF) || data[pos + n - 1] != (crc >> 8))
+    return 0;
+
+  return n;
+}
+
+size_t
+modbus_replay_sync(const uint8_t* data, size_t len, size_t from)
+{
+  size_t n;
+
+  for (; from < len; from++) {
+    n = valid_frame(data, len, from);
+    if (n == 0)
+      continue;
+
+    /* A single matching CRC may be a coincidence, next frame must
+     * match too.
+     */
+    if (from + n == len || valid_frame(data, len, from + n) > 0)
+      return from;
+  }
+
+  return len;
+}
+
+void
+modbus_replay_parse(const uint8_t* data,
+                    size_t len,
+                    size_t start,
+                    size_t end,
+                    const modbus_parser_settings* settings,
+                    void* arg,
+                    struct modbus_replay_stats* stats)
+{
+  static const modbus_parser_settings no_settings;
+  modbus_parser parser = { 0 };
+  size_t pos = start;
+  size_t next;
+  int n;
+
+  if (settings == NULL)
+    settings = &no_settings;
+  parser.arg = arg;
+
+  while (pos < end) {
+    n = modbus_frame_len(MODBUS_RESPONSE, data + pos, len - pos);
+    if (n == 0 || (n > 0 && n > len - pos)) {
+      /* Truncated frame at end of capture */
+      stats->skipped += end - pos;
+      break;
+    }
+
+    if (n > 0) {
+      modbus_parser_init(&parser, MODBUS_RESPONSE);
+      modbus_parser_execute(&parser, settings, data + pos, n);
+
+      if (parser.state == s_complete && parser.frame_crc == parser.calc_crc) {
+        stats->frames++;
+        stats->bytes += n;
+        stats->func[data[pos + 1]]++;
+        stats->slave[data[pos]].frames++;
+        stats->slave[data[pos]].bytes += n;
+        pos += n;
+        continue;
+      }
+
+      /* Aborted by a callback before its CRC, it's still a frame if the
+       * CRC is valid
+       */
+      if (parser.state != s_complete && valid_frame(data, len, pos) == n) {
+        stats->aborted++;
+        stats->bytes += n;
+        pos += n;
+        continue;
+      }
+
+      stats->crc_errors++;
+      stats->slave[data[pos]].crc_errors++;
+    }
+
+    /* Unknown function or bad CRC, we are out of sync */
+    next = modbus_replay_sync(data, len, pos + 1);
+    if (next > end)
+      next = end;
+    stats->skipped += next - pos;
+    stats->resyncs++;
+    pos = next;
+  }
+}
+
+/* Nominal split points are moved forward to next frame boundary. Both
+ * neighbours compute the same boundary, so each worker finds its own
+ * chunk and searching is done in parallel too.
+ */
+static size_t
+chunk_boundary(const uint8_t* data, size_t len, int i, int n)
+{
+  if (i == 0)
+    return 0;
+  if (i == n)
+    return len;
+  return modbus_replay_sync(data, len, len / n * i);
+}
+
+static void*
+replay_worker_run(void* p)
+{
+  struct replay_worker* w = p;
+  size_t start = chunk_boundary(w->data, w->len, w->index, w->nworkers);
+  size_t end = chunk_boundary(w->data, w->len, w->index + 1, w->nworkers);
+
+  if (start < end)
+    modbus_replay_parse(
+      w->data, w->len, start, end, w->settings, w->arg, &w->stats);
+  return NULL;
+}
+
+int
+modbus_replay_buffer(const uint8_t* data,
+                     size_t len,
+                     int nthreads,
+                     const modbus_parser_settings* settings,
+                     void* arg,
+                     struct modbus_replay_stats* stats)
+{
+  struct replay_worker* workers;
+  int nstarted;
+  int rc = 0;
+
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  workers = calloc(nthreads, sizeof(*workers));
+  if (workers == NULL)
+    return -1;
+
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].data = data;
+    workers[i].len = len;
+    workers[i].index = i;
+    workers[i].nworkers = nthreads;
+    workers[i].settings = settings;
+    workers[i].arg = arg;
+  }
+
+  /* Worker 0 runs on calling thread */
+  for (nstarted = 1; nstarted < nthreads; nstarted++) {
+    if (pthread_create(&workers[nstarted].thread,
+                       NULL,
+                       replay_worker_run,
+                       &workers[nstarted]) != 0) {
+      rc = -1;
+      break;
+    }
+  }
+
+  if (rc == 0)
+    replay_worker_run(&workers[0]);
+
+  for (int i = 1; i < nstarted; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  if (rc == 0) {
+    for (int i = 0; i < nthreads; i++)
+      modbus_replay_stats_merge(stats, &workers[i].stats);
+  }
+
+  free(workers);
+  return rc;
+}
+
+int
+modbus_replay_file(const char* path,
+                   int nthreads,
+                   const modbus_parser_settings* settings,
+                   void* arg,
+                   struct modbus_replay_stats* stats)
+{
+  struct stat st;
+  void* map;
+  int fd;
+  int rc;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  rc = modbus_replay_buffer(map, st.st_size, nthreads, settings, arg, stats);
+
+  munmap(map, st.st_size);
+  return rc;
+}
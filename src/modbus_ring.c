@@ -0,0 +1,113 @@
+#include <string.h>
+
+#include "modbus_ring.h"
+
+int
+modbus_ring_init(struct modbus_ring* r, uint8_t* buf, size_t size)
+{
+  if (size == 0 || (size & (size - 1)) != 0)
+    return -1;
+
+  memset(r, 0, sizeof(*r));
+  r->buf = buf;
+  r->mask = size - 1;
+  return 0;
+}
+
+size_t
+modbus_ring_write_span(struct modbus_ring* r, uint8_t** p)
+{
+  size_t head = r->head;
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  size_t off = head & r->mask;
+  size_t n = r->mask + 1 - (head - tail);
+
+  /* Stop at end of buffer */
+  if (n > r->mask + 1 - off)
+    n = r->mask + 1 - off;
+
+  *p = r->buf + off;
+  return n;
+}
+
+void
+modbus_ring_commit(struct modbus_ring* r, size_t n)
+{
+  __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+
+size_t
+modbus_ring_write(struct modbus_ring* r, const uint8_t* data, size_t len)
+{
+  size_t total = 0;
+  size_t n;
+  uint8_t* p;
+
+  /* At most two spans, before and after the wrap */
+  for (int i = 0; i < 2 && total < len; i++) {
+    n = modbus_ring_write_span(r, &p);
+    if (n > len - total)
+      n = len - total;
+    memcpy(p, data + total, n);
+    modbus_ring_commit(r, n);
+    total += n;
+  }
+
+  return total;
+}
+
+size_t
+modbus_ring_pending(struct modbus_ring* r)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->read;
+}
+
+/* Position of the first byte which is still referenced by the parser */
+static size_t
+held_from(const struct modbus_ring* r, const modbus_parser* parser)
+{
+  uintptr_t at = (uintptr_t)parser->data;
+  uintptr_t buf = (uintptr_t)r->buf;
+
+  /* ASCII data is decoded into the parser, RTU and TCP data point into
+   * the ring. Re-initialization clears data, so it's held only for a
+   * frame with data field, until the next frame starts.
+   */
+  if (parser->framing == MODBUS_FRAMING_ASCII || at < buf ||
+      at > buf + r->mask)
+    return r->read;
+
+  return r->read - ((r->read - (at - buf)) & r->mask);
+}
+
+size_t
+modbus_ring_execute(struct modbus_ring* r,
+                    modbus_parser* parser,
+                    const modbus_parser_settings* settings)
+{
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  size_t total = 0;
+  size_t off;
+  size_t len;
+  size_t n;
+
+  while (r->read != head) {
+    if (parser->errno != 0 || parser->state == s_complete)
+      break;
+
+    off = r->read & r->mask;
+    len = head - r->read;
+    if (len > r->mask + 1 - off)
+      len = r->mask + 1 - off;
+
+    n = modbus_parser_execute(parser, settings, r->buf + off, len);
+    r->read += n;
+    total += n;
+    if (n < len)
+      break;
+  }
+
+  __atomic_store_n(&r->tail, held_from(r, parser), __ATOMIC_RELEASE);
+
+  return total;
+}
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE /* memfd_create */
+/* Before errno.h, parser has a field of that name */
+#include "modbus_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(struct modbus_shm_header) == 64, "header size");
+_Static_assert(sizeof(struct modbus_shm_block) == 64, "block size");
+
+#define ALIGN64(n) (((n) + 63) & ~(size_t)63)
+
+static uint32_t
+key_of(uint8_t slave_addr, enum modbus_table table, uint16_t addr)
+{
+  return (uint32_t)slave_addr << 24 | (uint32_t)table << 16 | addr;
+}
+
+static uint32_t
+block_key(const struct modbus_shm_block* b)
+{
+  return key_of(b->slave_addr, b->table, b->addr);
+}
+
+/* Return index of block which contains addr, blocks are sorted. If there
+ * is none, return -1 and set *next to start of the following block of
+ * the same table, or to 0x10000.
+ */
+static int
+lookup(const struct modbus_shm* shm,
+       uint8_t slave_addr,
+       enum modbus_table table,
+       uint32_t addr,
+       uint32_t* next)
+{
+  const struct modbus_shm_block* b;
+  uint32_t key = key_of(slave_addr, table, addr);
+  uint32_t lo = 0;
+  uint32_t hi = shm->nblocks;
+  uint32_t mid;
+
+  /* First block starting after addr */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (block_key(&shm->blocks[mid]) <= key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *next = 0x10000;
+  if (lo < shm->nblocks) {
+    b = &shm->blocks[lo];
+    if (b->slave_addr == slave_addr && b->table == table)
+      *next = b->addr;
+  }
+  if (lo > 0) {
+    b = &shm->blocks[lo - 1];
+    if (b->slave_addr == slave_addr && b->table == table &&
+        addr < (uint32_t)b->addr + b->count)
+      return lo - 1;
+  }
+  return -1;
+}
+
+/* b may follow a in an image */
+static int
+in_order(const struct modbus_shm_def* a, const struct modbus_shm_def* b)
+{
+  if (a->slave_addr != b->slave_addr || a->table != b->table)
+    return key_of(a->slave_addr, a->table, 0) <
+           key_of(b->slave_addr, b->table, 0);
+  return (uint32_t)a->addr + a->count <= b->addr;
+}
+
+static int
+map(struct modbus_shm* shm, int fd, size_t size, int prot)
+{
+  shm->base = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (shm->base == MAP_FAILED) {
+    shm->base = NULL;
+    return -1;
+  }
+
+  shm->size = size;
+  shm->fd = fd;
+  shm->blocks =
+    (struct modbus_shm_block*)(shm->base + sizeof(struct modbus_shm_header));
+  return 0;
+}
+
+int
+modbus_shm_create(struct modbus_shm* shm,
+                  const char* name,
+                  const struct modbus_shm_def* defs,
+                  size_t n)
+{
+  struct modbus_shm_header* h;
+  struct modbus_shm_block* b;
+  size_t head = ALIGN64(sizeof(*h) + n * sizeof(*b));
+  size_t size = head;
+  int fd;
+
+  memset(shm, 0, sizeof(*shm));
+  shm->fd = -1;
+
+  for (size_t i = 0; i < n; i++) {
+    if (defs[i].count == 0 || defs[i].table > MODBUS_TABLE_IN_REG ||
+        (uint32_t)defs[i].addr + defs[i].count > 0x10000 ||
+        (i > 0 && !in_order(&defs[i - 1], &defs[i]))) {
+      errno = EINVAL;
+      return -1;
+    }
+    size += ALIGN64(MODBUS_TABLE_DATA_SIZE(defs[i].table, defs[i].count));
+  }
+
+  fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+  /* Readers can't shrink it under the writer */
+  if (ftruncate(fd, size) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0 ||
+      map(shm, fd, size, PROT_READ | PROT_WRITE) < 0) {
+    close(fd);
+    shm->fd = -1;
+    return -1;
+  }
+
+  /* memfd is zero filled */
+  h = (struct modbus_shm_header*)shm->base;
+  memcpy(h->magic, "MBSH", 4);
+  h->version = MODBUS_SHM_VERSION;
+  h->nblocks = n;
+  h->size = size;
+  shm->nblocks = n;
+
+  for (size_t i = 0; i < n; i++) {
+    b = &shm->blocks[i];
+    b->offset = head;
+    b->slave_addr = defs[i].slave_addr;
+    b->table = defs[i].table;
+    b->addr = defs[i].addr;
+    b->count = defs[i].count;
+    head += ALIGN64(MODBUS_TABLE_DATA_SIZE(defs[i].table, defs[i].count));
+  }
+
+  return 0;
+}
+
+int
+modbus_shm_open(struct modbus_shm* shm, int fd)
+{
+  const struct modbus_shm_header* h;
+  const struct modbus_shm_block* b;
+  struct stat st;
+
+  memset(shm, 0, sizeof(*shm));
+  shm->fd = fd;
+
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*h) ||
+      map(shm, fd, st.st_size, PROT_READ) < 0) {
+    shm->fd = -1;
+    return -1;
+  }
+
+  h = (const struct modbus_shm_header*)shm->base;
+  if (memcmp(h->magic, "MBSH", 4) != 0 || h->version != MODBUS_SHM_VERSION ||
+      h->size != shm->size ||
+      sizeof(*h) + (size_t)h->nblocks * sizeof(*b) > shm->size)
+    goto bad;
+
+  /* Don't trust offsets of another process */
+  for (uint32_t i = 0; i < h->nblocks; i++) {
+    b = &shm->blocks[i];
+    if (b->table > MODBUS_TABLE_IN_REG || b->offset % 64 ||
+        b->offset + MODBUS_TABLE_DATA_SIZE(b->table, (size_t)b->count) >
+          shm->size)
+      goto bad;
+  }
+  shm->nblocks = h->nblocks;
+  return 0;
+
+bad:
+  munmap(shm->base, shm->size);
+  shm->base = NULL;
+  shm->fd = -1;
+  errno = EINVAL;
+  return -1;
+}
+
+void
+modbus_shm_close(struct modbus_shm* shm)
+{
+  if (shm->base != NULL)
+    munmap(shm->base, shm->size);
+  if (shm->fd >= 0)
+    close(shm->fd);
+  memset(shm, 0, sizeof(*shm));
+  shm->fd = -1;
+}
+
+int
+modbus_shm_find(const struct modbus_shm* shm,
+                uint8_t slave_addr,
+                enum modbus_table table,
+                uint16_t addr)
+{
+  uint32_t next;
+
+  return lookup(shm, slave_addr, table, addr, &next);
+}
+
+/* Copy n bits from bit src_pos of src to bit pos of dst */
+static void
+copy_bits(uint8_t* dst,
+          uint32_t pos,
+          const uint8_t* src,
+          uint32_t src_pos,
+          uint32_t n)
+{
+  uint32_t s;
+  uint32_t d;
+
+  for (uint32_t i = 0; i < n; i++) {
+    s = src_pos + i;
+    d = pos + i;
+    if (src[s / 8] & (1 << (s % 8)))
+      dst[d / 8] |= 1 << (d % 8);
+    else
+      dst[d / 8] &= ~(1 << (d % 8));
+  }
+}
+
+int
+modbus_shm_update(struct modbus_shm* shm,
+                  uint8_t slave_addr,
+                  enum modbus_table table,
+                  uint16_t addr,
+                  const uint8_t* data,
+                  uint16_t count)
+{
+  struct modbus_shm_block* b;
+  uint8_t* dst;
+  uint32_t end = (uint32_t)addr + count;
+  uint32_t a = addr;
+  uint32_t next;
+  uint32_t n;
+  int written = 0;
+  int i;
+
+  while (a < end) {
+    i = lookup(shm, slave_addr, table, a, &next);
+    if (i < 0) {
+      a = next; /* Skip items which are not in the image */
+      continue;
+    }
+
+    b = &shm->blocks[i];
+    dst = shm->base + b->offset;
+    n = (uint32_t)b->addr + b->count;
+    n = (n < end ? n : end) - a;
+
+    /* Same protocol as parser counters, see modbus_parser_stats_snapshot */
+    __atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (table <= MODBUS_TABLE_DISCRETE_IN)
+      copy_bits(dst, a - b->addr, data, a - addr, n);
+    else
+      memcpy(dst + (a - b->addr) * 2, data + (a - addr) * 2, n * 2);
+    b->updates++;
+    __atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+
+    written += n;
+    a += n;
+  }
+
+  return written;
+}
+
+int
+modbus_shm_update_response(struct modbus_shm* shm,
+                           const modbus_parser* parser,
+                           const struct modbus_query* q)
+{
+  struct modbus_response_items items;
+  int rc;
+
+  rc = modbus_response_items(parser, q, &items);
+  if (rc <= 0)
+    return rc;
+  return modbus_shm_update(shm,
+                           parser->slave_addr,
+                           items.table,
+                           items.addr,
+                           items.data,
+                           items.count);
+}
+
+uint32_t
+modbus_shm_seq(const struct modbus_shm* shm, int index)
+{
+  return __atomic_load_n(&shm->blocks[index].seq, __ATOMIC_ACQUIRE);
+}
+
+uint32_t
+modbus_shm_read(const struct modbus_shm* shm, int index, uint8_t* out)
+{
+  const struct modbus_shm_block* b = &shm->blocks[index];
+  size_t len = MODBUS_TABLE_DATA_SIZE(b->table, (size_t)b->count);
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, shm->base + b->offset, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&b->seq, __ATOMIC_RELAXED));
+
+  return seq;
+}
@@ -0,0 +1,296 @@
+#include <string.h>
+
+#include "modbus_slave.h"
+
+/* Copy qty bits starting at bit addr of src to out, packed from bit 0 */
+static void
+read_bits(const uint8_t* src, uint32_t addr, uint16_t qty, uint8_t* out)
+{
+  uint32_t end = addr + qty;
+  uint32_t nbytes = (qty + 7) / 8;
+  uint32_t bit;
+  uint8_t b;
+
+  for (uint32_t i = 0; i < nbytes; i++) {
+    bit = addr + 8 * i;
+    b = src[bit >> 3] >> (bit & 7);
+    /* Rest of the byte comes from the next one, if it's in range */
+    if ((bit & 7) && ((bit >> 3) + 1) * 8 < end)
+      b |= src[(bit >> 3) + 1] << (8 - (bit & 7));
+    out[i] = b;
+  }
+  if (qty % 8)
+    out[nbytes - 1] &= (1u << (qty % 8)) - 1;
+}
+
+static void
+write_bits(uint8_t* dst, uint32_t addr, uint16_t qty, const uint8_t* data)
+{
+  uint32_t bit;
+
+  for (uint32_t i = 0; i < qty; i++) {
+    bit = addr + i;
+    if (data[i / 8] & (1u << (i % 8)))
+      dst[bit >> 3] |= 1u << (bit & 7);
+    else
+      dst[bit >> 3] &= ~(1u << (bit & 7));
+  }
+}
+
+/* Check items addr .. addr + qty - 1 of table, return exception code */
+static uint8_t
+check_range(const struct modbus_slave_store* st,
+            enum modbus_table table,
+            uint32_t addr,
+            uint32_t qty,
+            uint32_t max_qty)
+{
+  if (st->data[table] == NULL)
+    return MODBUS_EXC_ILLEGAL_FUNCTION;
+  if (qty == 0 || qty > max_qty)
+    return MODBUS_EXC_ILLEGAL_DATA_VALUE;
+  if (addr + qty > st->count[table])
+    return MODBUS_EXC_ILLEGAL_DATA_ADDRESS;
+  return 0;
+}
+
+/* Execute query on store, data is the contiguous data of the query.
+ * Reply data after function code goes to out of cap bytes. Return its
+ * length, -1 if it doesn't fit, or set *exc.
+ */
+static int
+execute(const struct modbus_slave_store* st,
+        const modbus_parser* parser,
+        const uint8_t* data,
+        uint8_t* out,
+        size_t cap,
+        uint8_t* exc)
+{
+  enum modbus_table table;
+  uint16_t addr = parser->addr;
+  uint16_t qty = parser->qty;
+  uint16_t wqty;
+  uint16_t value;
+  uint8_t bit;
+  size_t n;
+
+  switch (parser->function) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      table = modbus_func_table(parser->function);
+      *exc = check_range(st, table, addr, qty, MODBUS_MAX_READ_BITS);
+      if (*exc)
+        return 0;
+      n = MODBUS_COILS_BYTE_LEN(qty);
+      if (1 + n > cap)
+        return -1;
+      out[0] = n;
+      read_bits(st->data[table], addr, qty, out + 1);
+      return 1 + n;
+
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+      table = modbus_func_table(parser->function);
+      *exc = check_range(st, table, addr, qty, MODBUS_MAX_READ_REGS);
+      if (*exc)
+        return 0;
+      if (1 + qty * 2 > cap)
+        return -1;
+      out[0] = qty * 2;
+      memcpy(out + 1, st->data[table] + addr * 2, qty * 2);
+      return 1 + qty * 2;
+
+    case MODBUS_FUNC_WRITE_COIL:
+      value = data[0] << 8 | data[1];
+      if (st->data[MODBUS_TABLE_COILS] != NULL &&
+          value != MODBUS_COIL_HIGH && value != MODBUS_COIL_LOW) {
+        *exc = MODBUS_EXC_ILLEGAL_DATA_VALUE;
+        return 0;
+      }
+      *exc = check_range(st, MODBUS_TABLE_COILS, addr, 1, 1);
+      if (*exc)
+        return 0;
+      if (cap < 4)
+        return -1;
+      bit = value == MODBUS_COIL_HIGH;
+      write_bits(st->data[MODBUS_TABLE_COILS], addr, 1, &bit);
+      modbus_put_word(out, addr);
+      memcpy(out + 2, data, 2);
+      return 4;
+
+    case MODBUS_FUNC_WRITE_REG:
+      *exc = check_range(st, MODBUS_TABLE_HOLD_REG, addr, 1, 1);
+      if (*exc)
+        return 0;
+      if (cap < 4)
+        return -1;
+      memcpy(st->data[MODBUS_TABLE_HOLD_REG] + addr * 2, data, 2);
+      modbus_put_word(out, addr);
+      memcpy(out + 2, data, 2);
+      return 4;
+
+    case MODBUS_FUNC_WRITE_COILS:
+    case MODBUS_FUNC_WRITE_REGS:
+      if (parser->function == MODBUS_FUNC_WRITE_COILS) {
+        table = MODBUS_TABLE_COILS;
+        *exc = check_range(st, table, addr, qty, MODBUS_MAX_WRITE_BITS);
+        n = MODBUS_COILS_BYTE_LEN(qty);
+      } else {
+        table = MODBUS_TABLE_HOLD_REG;
+        *exc = check_range(st, table, addr, qty, MODBUS_MAX_WRITE_REGS);
+        n = qty * 2;
+      }
+      /* Byte count must agree with quantity */
+      if (*exc != MODBUS_EXC_ILLEGAL_FUNCTION && parser->data_len != n)
+        *exc = MODBUS_EXC_ILLEGAL_DATA_VALUE;
+      if (*exc)
+        return 0;
+      if (cap < 4)
+        return -1;
+      if (table == MODBUS_TABLE_COILS)
+        write_bits(st->data[table], addr, qty, data);
+      else
+        memcpy(st->data[table] + addr * 2, data, n);
+      modbus_put_word(modbus_put_word(out, addr), qty);
+      return 4;
+
+    case MODBUS_FUNC_READ_WRITE_REGS:
+      table = MODBUS_TABLE_HOLD_REG;
+      wqty = parser->data_len / 2;
+      *exc = check_range(st, table, addr, qty, MODBUS_MAX_READ_REGS);
+      if (*exc != MODBUS_EXC_ILLEGAL_FUNCTION &&
+          (parser->data_len % 2 || wqty == 0 ||
+           wqty > MODBUS_MAX_RW_WRITE_REGS))
+        *exc = MODBUS_EXC_ILLEGAL_DATA_VALUE;
+      else if (!*exc)
+        *exc = check_range(
+          st, table, parser->write_addr, wqty, MODBUS_MAX_RW_WRITE_REGS);
+      if (*exc)
+        return 0;
+      if (1 + qty * 2 > cap)
+        return -1;
+      /* Write goes first */
+      memcpy(st->data[table] + parser->write_addr * 2, data, wqty * 2);
+      out[0] = qty * 2;
+      memcpy(out + 1, st->data[table] + addr * 2, qty * 2);
+      return 1 + qty * 2;
+
+    default:
+      *exc = MODBUS_EXC_ILLEGAL_FUNCTION;
+      return 0;
+  }
+}
+
+void
+modbus_slave_store_init(struct modbus_slave_store* store)
+{
+  memset(store, 0, sizeof(*store));
+}
+
+void
+modbus_slave_store_table(struct modbus_slave_store* store,
+                         enum modbus_table table,
+                         uint8_t* data,
+                         uint32_t count)
+{
+  store->data[table] = data;
+  store->count[table] = count;
+}
+
+void
+modbus_slave_init(struct modbus_slave* slave)
+{
+  memset(slave, 0, sizeof(*slave));
+}
+
+void
+modbus_slave_attach(struct modbus_slave* slave,
+                    uint8_t slave_addr,
+                    struct modbus_slave_store* store)
+{
+  slave->stores[slave_addr] = store;
+}
+
+int
+modbus_slave_exception(const modbus_parser* parser,
+                       enum modbus_exception code,
+                       uint8_t* buf,
+                       size_t sz)
+{
+  uint8_t* pdu = buf + (parser->framing == MODBUS_FRAMING_TCP ? 6 : 0);
+
+  if (pdu + 3 > buf + sz)
+    return -1;
+
+  pdu[0] = parser->slave_addr;
+  pdu[1] = parser->function | MODBUS_EXCEPTION_BIT;
+  pdu[2] = code;
+  return modbus_frame_seal(
+    parser->framing, parser->transaction_id, buf, 3, sz);
+}
+
+int
+modbus_slave_reply(struct modbus_slave* slave,
+                   const modbus_parser* parser,
+                   uint8_t* buf,
+                   size_t sz)
+{
+  const struct modbus_slave_store* st;
+  const struct modbus_slave_store* prev = NULL;
+  uint8_t scratch[MODBUS_MAX_DATA_LEN + 1];
+  uint8_t joined[MODBUS_MAX_DATA_LEN + 1];
+  const uint8_t* data = parser->data;
+  uint8_t* pdu = buf + (parser->framing == MODBUS_FRAMING_TCP ? 6 : 0);
+  size_t head;
+  uint8_t exc = 0;
+  int n;
+
+  if (parser->type != MODBUS_QUERY || parser->state != s_complete ||
+      parser->errno != 0)
+    return -1;
+
+  /* Data split by the end of a ring buffer */
+  if (parser->data_wrap != NULL) {
+    head = parser->data_len - parser->data_wrap_len;
+    memcpy(joined, parser->data, head);
+    memcpy(joined + head, parser->data_wrap, parser->data_wrap_len);
+    data = joined;
+  }
+
+  if (parser->slave_addr == 0 && parser->framing != MODBUS_FRAMING_TCP) {
+    /* Broadcast, stores shared by adjacent addresses are written once */
+    for (int i = 1; i < 256; i++) {
+      st = slave->stores[i];
+      if (st == NULL || st == prev)
+        continue;
+      prev = st;
+      if (parser->function != MODBUS_FUNC_WRITE_COIL &&
+          parser->function != MODBUS_FUNC_WRITE_REG &&
+          parser->function != MODBUS_FUNC_WRITE_COILS &&
+          parser->function != MODBUS_FUNC_WRITE_REGS)
+        break;
+      execute(st, parser, data, scratch, sizeof(scratch), &exc);
+    }
+    return 0;
+  }
+
+  st = slave->stores[parser->slave_addr];
+  if (st == NULL)
+    return 0;
+
+  slave->requests++;
+  if (pdu + 2 > buf + sz)
+    return -1;
+  n = execute(st, parser, data, pdu + 2, buf + sz - pdu - 2, &exc);
+  if (n < 0)
+    return -1;
+  if (exc) {
+    slave->exceptions++;
+    return modbus_slave_exception(parser, exc, buf, sz);
+  }
+
+  pdu[0] = parser->slave_addr;
+  pdu[1] = parser->function;
+  return modbus_frame_seal(
+    parser->framing, parser->transaction_id, buf, 2 + n, sz);
+}
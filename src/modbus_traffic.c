@@ -0,0 +1,294 @@
+#include <string.h>
+
+#include "modbus_traffic.h"
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/* Polling master: mostly register reads */
+static const uint16_t default_weight[MODBUS_FUNC_READ_WRITE_REGS + 1] = {
+  [MODBUS_FUNC_READ_COILS] = 8,       [MODBUS_FUNC_READ_DISCRETE_IN] = 6,
+  [MODBUS_FUNC_READ_HOLD_REG] = 50,   [MODBUS_FUNC_READ_IN_REG] = 20,
+  [MODBUS_FUNC_WRITE_COIL] = 2,       [MODBUS_FUNC_WRITE_REG] = 6,
+  [MODBUS_FUNC_WRITE_COILS] = 2,      [MODBUS_FUNC_WRITE_REGS] = 5,
+  [MODBUS_FUNC_READ_WRITE_REGS] = 1,
+};
+
+static uint32_t
+next_rand(struct modbus_traffic* t)
+{
+  /* xorshift32 */
+  t->rng ^= t->rng << 13;
+  t->rng ^= t->rng >> 17;
+  t->rng ^= t->rng << 5;
+  return t->rng;
+}
+
+/* Random number in 1 .. max */
+static uint16_t
+rand_qty(struct modbus_traffic* t, uint32_t max)
+{
+  return 1 + next_rand(t) % max;
+}
+
+static int
+chance(struct modbus_traffic* t, uint32_t ppm)
+{
+  return ppm > 0 && next_rand(t) % 1000000 < ppm;
+}
+
+static uint32_t
+min_u32(uint32_t a, uint32_t b)
+{
+  return a < b ? a : b;
+}
+
+static enum modbus_func
+pick_function(struct modbus_traffic* t)
+{
+  uint32_t w = next_rand(t) % t->total_weight;
+  int f = 0;
+
+  while (w >= t->config.weight[f])
+    w -= t->config.weight[f++];
+  return f;
+}
+
+/* Address of qty items, within the address space */
+static uint16_t
+rand_addr(struct modbus_traffic* t, uint16_t qty)
+{
+  return next_rand(t) % (0x10000 - qty + 1);
+}
+
+/* Binary query (slave address and PDU) to buf, return its length */
+static int
+gen_query(struct modbus_traffic* t, enum modbus_func f, uint8_t* buf)
+{
+  uint16_t data[MODBUS_MAX_WRITE_REGS];
+  uint16_t max = t->config.max_qty;
+  struct modbus_query q;
+  int n;
+
+  modbus_query_init(&q);
+  q.slave_addr = 1 + next_rand(t) % t->config.nslaves;
+  q.function = f;
+  q.data = data;
+
+  switch (f) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      q.qty = rand_qty(t, min_u32(max * 16, MODBUS_MAX_READ_BITS));
+      break;
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+      q.qty = rand_qty(t, min_u32(max, MODBUS_MAX_READ_REGS));
+      break;
+    case MODBUS_FUNC_WRITE_COIL:
+      q.qty = 1;
+      q.data_len = 1;
+      data[0] = next_rand(t) & 1 ? MODBUS_COIL_HIGH : MODBUS_COIL_LOW;
+      break;
+    case MODBUS_FUNC_WRITE_REG:
+      q.qty = 1;
+      q.data_len = 1;
+      data[0] = next_rand(t);
+      break;
+    case MODBUS_FUNC_WRITE_COILS:
+      q.qty = rand_qty(t, min_u32(max * 16, MODBUS_MAX_WRITE_BITS));
+      q.data_len = (q.qty + 15) / 16;
+      break;
+    case MODBUS_FUNC_WRITE_REGS:
+      q.data_len = rand_qty(t, min_u32(max, MODBUS_MAX_WRITE_REGS));
+      q.qty = q.data_len;
+      break;
+    case MODBUS_FUNC_READ_WRITE_REGS:
+      q.qty = rand_qty(t, min_u32(max, MODBUS_MAX_READ_REGS));
+      q.data_len = rand_qty(t, min_u32(max, MODBUS_MAX_RW_WRITE_REGS));
+      q.write_addr = rand_addr(t, q.data_len);
+      break;
+    default:
+      return -1;
+  }
+
+  q.addr = rand_addr(t, q.qty);
+  if (f != MODBUS_FUNC_WRITE_COIL && f != MODBUS_FUNC_WRITE_REG) {
+    for (int i = 0; i < q.data_len; i++)
+      data[i] = next_rand(t);
+  }
+
+  n = modbus_gen_query(&q, buf, MODBUS_TRAFFIC_MAX_FRAME - 6);
+  return n < 0 ? n : n - 2; /* Without CRC */
+}
+
+/* Binary response to buf, return its length */
+static int
+gen_response(struct modbus_traffic* t, enum modbus_func f, uint8_t* buf)
+{
+  uint16_t max = t->config.max_qty;
+  uint16_t qty;
+  uint16_t value;
+  int n = 0;
+
+  buf[n++] = 1 + next_rand(t) % t->config.nslaves;
+  buf[n++] = f;
+
+  if (chance(t, t->config.exception_ppm)) {
+    buf[1] |= MODBUS_EXCEPTION_BIT;
+    buf[n++] = MODBUS_EXC_ILLEGAL_FUNCTION + next_rand(t) % 4;
+    t->exceptions++;
+    return n;
+  }
+
+  switch (f) {
+    case MODBUS_FUNC_READ_COILS:
+    case MODBUS_FUNC_READ_DISCRETE_IN:
+      qty = rand_qty(t, min_u32(max * 16, MODBUS_MAX_READ_BITS));
+      buf[n++] = MODBUS_COILS_BYTE_LEN(qty);
+      for (int i = 0; i < MODBUS_COILS_BYTE_LEN(qty); i++)
+        buf[n++] = next_rand(t);
+      /* Padding bits are zero */
+      if (qty % 8)
+        buf[n - 1] &= (1 << (qty % 8)) - 1;
+      break;
+
+    case MODBUS_FUNC_READ_HOLD_REG:
+    case MODBUS_FUNC_READ_IN_REG:
+    case MODBUS_FUNC_READ_WRITE_REGS:
+      qty = rand_qty(t, min_u32(max, MODBUS_MAX_READ_REGS));
+      buf[n++] = qty * 2;
+      for (int i = 0; i < qty * 2; i++)
+        buf[n++] = next_rand(t);
+      break;
+
+    case MODBUS_FUNC_WRITE_COIL:
+    case MODBUS_FUNC_WRITE_REG:
+      value = next_rand(t);
+      if (f == MODBUS_FUNC_WRITE_COIL)
+        value = value & 1 ? MODBUS_COIL_HIGH : MODBUS_COIL_LOW;
+      modbus_put_word(modbus_put_word(buf + n, rand_addr(t, 1)), value);
+      n += 4;
+      break;
+
+    case MODBUS_FUNC_WRITE_COILS:
+    case MODBUS_FUNC_WRITE_REGS:
+      qty = f == MODBUS_FUNC_WRITE_COILS
+              ? rand_qty(t, min_u32(max * 16, MODBUS_MAX_WRITE_BITS))
+              : rand_qty(t, min_u32(max, MODBUS_MAX_WRITE_REGS));
+      modbus_put_word(modbus_put_word(buf + n, rand_addr(t, qty)), qty);
+      n += 4;
+      break;
+
+    default:
+      return -1;
+  }
+
+  return n;
+}
+
+/* Noise of the line on frame of n bytes, return its new length */
+static int
+impair(struct modbus_traffic* t, uint8_t* buf, int n)
+{
+  uint8_t* digit;
+  int i;
+
+  if (t->config.framing != MODBUS_FRAMING_TCP &&
+      chance(t, t->config.crc_error_ppm)) {
+    if (t->config.framing == MODBUS_FRAMING_ASCII) {
+      /* Another hex digit of LRC, before CR LF */
+      digit = &buf[n - 4 + (next_rand(t) & 1)];
+      i = *digit <= '9' ? *digit - '0' : *digit - 'A' + 10;
+      *digit = hex_digits[(i + 1 + next_rand(t) % 15) % 16];
+    } else {
+      buf[n - 2 + (next_rand(t) & 1)] ^= 1 << (next_rand(t) % 8);
+    }
+    t->crc_errors++;
+  }
+
+  /* TCP doesn't lose bytes, a drop would desynchronize MBAP for good */
+  if (t->config.framing != MODBUS_FRAMING_TCP &&
+      chance(t, t->config.drop_ppm)) {
+    i = next_rand(t) % n;
+    memmove(buf + i, buf + i + 1, n - i - 1);
+    n--;
+    t->drops++;
+  }
+
+  return n;
+}
+
+void
+modbus_traffic_config_init(struct modbus_traffic_config* config)
+{
+  memset(config, 0, sizeof(*config));
+  config->type = MODBUS_RESPONSE;
+  config->framing = MODBUS_FRAMING_RTU;
+  config->seed = 1;
+  memcpy(config->weight, default_weight, sizeof(default_weight));
+  config->nslaves = 16;
+  config->max_qty = 32;
+}
+
+int
+modbus_traffic_init(struct modbus_traffic* t,
+                    const struct modbus_traffic_config* config)
+{
+  memset(t, 0, sizeof(*t));
+  t->config = *config;
+  t->rng = config->seed != 0 ? config->seed : 1;
+
+  for (int f = 0; f <= MODBUS_FUNC_READ_WRITE_REGS; f++) {
+    /* Only functions the generator knows */
+    if (config->weight[f] != 0 && default_weight[f] == 0)
+      return -1;
+    t->total_weight += config->weight[f];
+  }
+  if (t->total_weight == 0)
+    return -1;
+
+  if (t->config.nslaves == 0)
+    t->config.nslaves = 1;
+  if (t->config.max_qty == 0)
+    t->config.max_qty = 1;
+  return 0;
+}
+
+int
+modbus_traffic_next(struct modbus_traffic* t, uint8_t* buf, size_t sz)
+{
+  enum modbus_framing framing = t->config.framing;
+  uint8_t* frame = t->pending + (framing == MODBUS_FRAMING_TCP ? 6 : 0);
+  enum modbus_func f;
+  int n;
+
+  if (t->pending_len == 0) {
+    f = pick_function(t);
+    n = t->config.type == MODBUS_QUERY ? gen_query(t, f, frame)
+                                       : gen_response(t, f, frame);
+    n = modbus_frame_seal(
+      framing, t->transaction_id++, t->pending, n, sizeof(t->pending));
+    n = impair(t, t->pending, n);
+    t->pending_len = n;
+    t->frames++;
+    t->bytes += n;
+  }
+
+  if (t->pending_len > sz)
+    return -1;
+
+  n = t->pending_len;
+  memcpy(buf, t->pending, n);
+  t->pending_len = 0;
+  return n;
+}
+
+size_t
+modbus_traffic_fill(struct modbus_traffic* t, uint8_t* buf, size_t sz)
+{
+  size_t len = 0;
+  int n;
+
+  while ((n = modbus_traffic_next(t, buf + len, sz - len)) >= 0)
+    len += n;
+  return len;
+}
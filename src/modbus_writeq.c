@@ -0,0 +1,276 @@
+#include <string.h>
+
+#include "modbus_writeq.h"
+
+static uint32_t
+limit_of(enum modbus_table table)
+{
+  return table == MODBUS_TABLE_COILS ? MODBUS_MAX_WRITE_BITS
+                                     : MODBUS_MAX_WRITE_REGS;
+}
+
+static uint16_t
+get_item(const struct modbus_writeq_slot* s, uint32_t i)
+{
+  if (s->table == MODBUS_TABLE_COILS)
+    return (s->bits[i / 8] >> (i % 8)) & 1;
+  return s->regs[i];
+}
+
+static void
+set_item(struct modbus_writeq_slot* s, uint32_t i, uint16_t v)
+{
+  if (s->table == MODBUS_TABLE_COILS) {
+    s->bits[i / 8] &= ~(1 << (i % 8));
+    s->bits[i / 8] |= (v & 1) << (i % 8);
+  } else {
+    s->regs[i] = v;
+  }
+}
+
+static bool
+same_target(const struct modbus_writeq_slot* s,
+            uint8_t slave_addr,
+            enum modbus_table table)
+{
+  return s->used && s->slave_addr == slave_addr && s->table == table;
+}
+
+/* Join neighbours of s which became adjacent to it */
+static void
+join(struct modbus_writeq* w, struct modbus_writeq_slot* s)
+{
+  struct modbus_writeq_slot* lo;
+  struct modbus_writeq_slot* hi;
+  uint32_t limit = limit_of(s->table);
+
+  for (size_t i = 0; i < w->nslots; i++) {
+    if (&w->slots[i] == s || !same_target(&w->slots[i], s->slave_addr, s->table))
+      continue;
+
+    lo = s->addr < w->slots[i].addr ? s : &w->slots[i];
+    hi = lo == s ? &w->slots[i] : s;
+    if ((uint32_t)lo->addr + lo->count != hi->addr ||
+        lo->count + hi->count > limit)
+      continue;
+
+    for (uint32_t k = 0; k < hi->count; k++)
+      set_item(lo, lo->count + k, get_item(hi, k));
+    lo->count += hi->count;
+    if (hi->deadline < lo->deadline)
+      lo->deadline = hi->deadline;
+    hi->used = false;
+
+    /* The other side may be adjacent too */
+    s = lo;
+    i = -1;
+  }
+}
+
+static int
+queue_write(struct modbus_writeq* w,
+            uint8_t slave_addr,
+            enum modbus_table table,
+            uint16_t addr,
+            uint16_t value,
+            uint64_t deadline)
+{
+  struct modbus_writeq_slot* s = NULL;
+  struct modbus_writeq_slot* t;
+  uint32_t limit = limit_of(table);
+
+  /* Overwrite pending value of the same address */
+  for (size_t i = 0; i < w->nslots && s == NULL; i++) {
+    t = &w->slots[i];
+    if (same_target(t, slave_addr, table) && addr >= t->addr &&
+        addr < (uint32_t)t->addr + t->count) {
+      set_item(t, addr - t->addr, value);
+      s = t;
+    }
+  }
+
+  /* Extend adjacent write */
+  for (size_t i = 0; i < w->nslots && s == NULL; i++) {
+    t = &w->slots[i];
+    if (!same_target(t, slave_addr, table) || t->count == limit)
+      continue;
+
+    if (addr == (uint32_t)t->addr + t->count) {
+      set_item(t, t->count++, value);
+      s = t;
+    } else if ((uint32_t)addr + 1 == t->addr) {
+      for (uint32_t k = t->count; k > 0; k--)
+        set_item(t, k, get_item(t, k - 1));
+      set_item(t, 0, value);
+      t->addr--;
+      t->count++;
+      s = t;
+    }
+  }
+
+  if (s != NULL) {
+    if (deadline < s->deadline)
+      s->deadline = deadline;
+    join(w, s);
+    return 0;
+  }
+
+  /* New write */
+  for (size_t i = 0; i < w->nslots; i++) {
+    s = &w->slots[i];
+    if (s->used)
+      continue;
+
+    memset(s, 0, sizeof(*s));
+    s->used = true;
+    s->slave_addr = slave_addr;
+    s->table = table;
+    s->addr = addr;
+    s->count = 1;
+    s->deadline = deadline;
+    set_item(s, 0, value);
+    return 0;
+  }
+
+  return -1;
+}
+
+void
+modbus_writeq_init(struct modbus_writeq* w,
+                   struct modbus_writeq_slot* slots,
+                   size_t nslots)
+{
+  memset(w, 0, sizeof(*w));
+  memset(slots, 0, nslots * sizeof(*slots));
+  w->slots = slots;
+  w->nslots = nslots;
+}
+
+int
+modbus_writeq_reg(struct modbus_writeq* w,
+                  uint8_t slave_addr,
+                  uint16_t addr,
+                  uint16_t value,
+                  uint64_t deadline)
+{
+  return queue_write(
+    w, slave_addr, MODBUS_TABLE_HOLD_REG, addr, value, deadline);
+}
+
+int
+modbus_writeq_coil(struct modbus_writeq* w,
+                   uint8_t slave_addr,
+                   uint16_t addr,
+                   bool value,
+                   uint64_t deadline)
+{
+  return queue_write(w, slave_addr, MODBUS_TABLE_COILS, addr, value, deadline);
+}
+
+/* Fill q with the write of slot s */
+static void
+make_query(struct modbus_writeq* w,
+           const struct modbus_writeq_slot* s,
+           struct modbus_query* q)
+{
+  uint32_t nbytes;
+
+  modbus_query_init(q);
+  q->slave_addr = s->slave_addr;
+  q->addr = s->addr;
+  q->data = w->out;
+
+  if (s->table == MODBUS_TABLE_HOLD_REG) {
+    memcpy(w->out, s->regs, s->count * sizeof(uint16_t));
+    q->function =
+      s->count == 1 ? MODBUS_FUNC_WRITE_REG : MODBUS_FUNC_WRITE_REGS;
+    q->qty = s->count;
+    q->data_len = s->count;
+    return;
+  }
+
+  if (s->count == 1) {
+    w->out[0] = (s->bits[0] & 1) ? MODBUS_COIL_HIGH : MODBUS_COIL_LOW;
+    q->function = MODBUS_FUNC_WRITE_COIL;
+    q->data_len = 1;
+    return;
+  }
+
+  /* modbus_gen_query takes coil bytes in pairs, high byte first, and
+   * odd last byte alone
+   */
+  nbytes = (s->count + 7) / 8;
+  for (uint32_t i = 0; i < nbytes; i += 2) {
+    w->out[i / 2] = i + 1 < nbytes ? s->bits[i] << 8 | s->bits[i + 1]
+                                   : s->bits[i];
+  }
+  q->function = MODBUS_FUNC_WRITE_COILS;
+  q->qty = s->count;
+  q->data_len = (nbytes + 1) / 2;
+}
+
+int
+modbus_writeq_flush(struct modbus_writeq* w,
+                    uint64_t now,
+                    const struct modbus_query* read,
+                    struct modbus_query* q,
+                    uint8_t* buf,
+                    size_t sz)
+{
+  struct modbus_writeq_slot* s = NULL;
+  struct modbus_writeq_slot* t;
+  bool combine = false;
+  int n;
+
+  /* Register write which can go along with read, due or not */
+  if (read != NULL && read->function == MODBUS_FUNC_READ_HOLD_REG &&
+      read->qty <= MODBUS_MAX_READ_REGS) {
+    for (size_t i = 0; i < w->nslots; i++) {
+      t = &w->slots[i];
+      if (same_target(t, read->slave_addr, MODBUS_TABLE_HOLD_REG) &&
+          t->count <= MODBUS_MAX_RW_WRITE_REGS &&
+          (s == NULL || t->deadline < s->deadline))
+        s = t;
+    }
+    combine = s != NULL;
+  }
+
+  if (s == NULL) {
+    for (size_t i = 0; i < w->nslots; i++) {
+      t = &w->slots[i];
+      if (t->used && t->deadline <= now &&
+          (s == NULL || t->deadline < s->deadline))
+        s = t;
+    }
+  }
+
+  if (s == NULL)
+    return 0;
+
+  make_query(w, s, q);
+  if (combine) {
+    q->function = MODBUS_FUNC_READ_WRITE_REGS;
+    q->write_addr = s->addr;
+    q->addr = read->addr;
+    q->qty = read->qty;
+  }
+
+  n = modbus_gen_query(q, buf, sz);
+  if (n < 0)
+    return n;
+
+  s->used = false;
+  return n;
+}
+
+uint64_t
+modbus_writeq_next_due(const struct modbus_writeq* w)
+{
+  uint64_t due = UINT64_MAX;
+
+  for (size_t i = 0; i < w->nslots; i++) {
+    if (w->slots[i].used && w->slots[i].deadline < due)
+      due = w->slots[i].deadline;
+  }
+  return due;
+}
@@ -1,7 +1,28 @@
 #include "modbus.h"
+#include "modbus_archive.h"
+#include "modbus_capture.h"
+#include "modbus_convert.h"
+#include "modbus_demux.h"
+#include "modbus_gateway.h"
+#include "modbus_latency.h"
+#include "modbus_master.h"
+#include "modbus_poll.h"
+#include "modbus_queue.h"
+#include "modbus_regcache.h"
+#include "modbus_replay.h"
+#include "modbus_ring.h"
+#ifdef MODBUS_BUILD_SHM
+#include "modbus_shm.h"
+#endif
+#include "modbus_slave.h"
+#include "modbus_traffic.h"
+#include "modbus_writeq.h"
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #define TEST_START() printf("<< %s STARTED >>\n", __func__)
 #define TEST_SUCCESS() printf("** %s SUCCESS **\n\n", __func__)
@@ -45,6 +66,19 @@
     assert(buf[len - 1] == (crc >> 8));                                        \
   } while (0)
 
+/* Encode binary frame (without checksum) in ASCII framing */
+size_t
+ascii_encode(const uint8_t* bin, size_t n, uint8_t* out)
+{
+  size_t len = 0;
+
+  len += sprintf((char*)out, ":");
+  for (int i = 0; i < n; i++)
+    len += sprintf((char*)out + len, "%02X", bin[i]);
+  len += sprintf((char*)out + len, "%02X\r\n", modbus_calc_lrc(bin, n));
+  return len;
+}
+
 int
 on_slave_addr(struct modbus_parser* p)
 {
@@ -90,12 +124,14 @@ on_data_start(struct modbus_parser* p)
 int
 on_data_end(struct modbus_parser* p)
 {
+  int head = p->data_len - p->data_wrap_len;
   int n = 0;
 
   printf("Data:\n");
 
+  /* Second span if the data wraps around a ring */
   for (int i = 0; i < p->data_len; i++) {
-    n += printf("%02X ", *(p->data + i));
+    n += printf("%02X ", i < head ? p->data[i] : p->data_wrap[i - head]);
     if (n > 70) {
       n = 0;
       printf("\n");
@@ -337,6 +373,68 @@ test_crc_error(struct modbus_parser* parser,
   TEST_SUCCESS();
 }
 
+void
+test_exception(struct modbus_parser* parser,
+               struct modbus_parser_settings* settings)
+{
+  /* Illegal data address */
+  uint8_t res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG | MODBUS_EXCEPTION_BIT,
+                    0x02, 0x00, 0x00 };
+  uint8_t unknown[] = { 0x11, 0x7F, 0x00, 0x00 };
+  uint8_t empty[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x00, 0x00, 0x00 };
+  struct modbus_query q;
+  uint8_t buf[16];
+  size_t n;
+
+  TEST_START();
+
+  ADD_CRC(res);
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  n = modbus_parser_execute(parser, settings, res, sizeof(res));
+
+  assert(n == sizeof(res));
+  assert(parser->errno == 0);
+  assert(parser->state == s_complete);
+  assert(parser->function ==
+         (MODBUS_FUNC_READ_HOLD_REG | MODBUS_EXCEPTION_BIT));
+  assert(parser->data_len == 1);
+  assert(parser->data[0] == 0x02);
+  assert(modbus_frame_len(MODBUS_RESPONSE, res, 2) == sizeof(res));
+
+  /* Not in a query */
+  modbus_parser_init(parser, MODBUS_QUERY);
+  n = modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(n == 2);
+  assert(parser->errno != 0);
+  assert(modbus_frame_len(MODBUS_QUERY, res, 2) == -1);
+
+  /* Unknown function fails at function code */
+  ADD_CRC(unknown);
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  n = modbus_parser_execute(parser, settings, unknown, sizeof(unknown));
+  assert(n == 2);
+  assert(parser->errno != 0);
+  assert(parser->function == 0x7F);
+  assert(modbus_frame_len(MODBUS_RESPONSE, unknown, 2) == -1);
+
+  /* So does byte count of 0, there is no empty data field */
+  ADD_CRC(empty);
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  n = modbus_parser_execute(parser, settings, empty, sizeof(empty));
+  assert(n == 3);
+  assert(parser->errno != 0);
+  assert(modbus_frame_len(MODBUS_RESPONSE, empty, 3) == -1);
+
+  /* Neither is generated */
+  modbus_query_init(&q);
+  q.function = 0x7F;
+  assert(modbus_gen_query(&q, buf, sizeof(buf)) == -1);
+  q.function = MODBUS_FUNC_READ_HOLD_REG | MODBUS_EXCEPTION_BIT;
+  assert(modbus_gen_query(&q, buf, sizeof(buf)) == -1);
+
+  TEST_SUCCESS();
+}
+
 void
 test_bad_len(struct modbus_parser* parser,
              struct modbus_parser_settings* settings)
@@ -368,283 +466,2527 @@ test_bad_len(struct modbus_parser* parser,
 }
 
 void
-test_gen_read_coils(void)
+test_split_data(struct modbus_parser* parser,
+                struct modbus_parser_settings* settings)
 {
-  struct modbus_query q = {.slave_addr = 0x12,
-                           .function = MODBUS_FUNC_READ_COILS,
-                           .addr = 0x11,
-                           .qty = 5 };
-  uint8_t buf[10];
-  int n;
-  // uint16_t crc;
+  uint8_t res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG,
+                    0x06, 0x02,
+                    0x2B, 0x00,
+                    0x00, 0x00,
+                    0x64, 0x00,
+                    0x00 };
+  size_t n = 0;
 
   TEST_START();
 
-  /* Check buffer size error. length of output stream is 8 bytes,
-   * but we gave 7 bytes.
-   */
-  n = modbus_gen_query(&q, buf, 7);
-  assert(n == -1);
+  ADD_CRC(res);
 
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+  /* One byte per call, like UART interrupts */
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  for (int i = 0; i < sizeof(res); i++)
+    n += modbus_parser_execute(parser, settings, res + i, 1);
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+  assert(n == sizeof(res));
+  assert(parser->errno == 0);
+  assert(parser->state == s_complete);
+  assert(parser->data == res + 3);
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_WORD(&buf[4], q.qty);
-  ASSERT_QUERY_CRC(buf, n);
+  /* Data split between calls, remaining data is consumed in one step */
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  n = modbus_parser_execute(parser, settings, res, 5);
+  assert(n == 5);
+  assert(parser->state == s_data);
+  n += modbus_parser_execute(parser, settings, res + 5, sizeof(res) - 5);
+
+  assert(n == sizeof(res));
+  assert(parser->errno == 0);
+  assert(parser->state == s_complete);
+  assert(parser->data == res + 3);
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_discrete_input(void)
+test_ascii_read_hold_reg(struct modbus_parser* parser,
+                         struct modbus_parser_settings* settings)
 {
-  struct modbus_query q = {.slave_addr = 0x12,
-                           .function = MODBUS_FUNC_READ_DISCRETE_IN,
-                           .addr = 0x11,
-                           .qty = 5 };
-  uint8_t buf[10];
-  int n;
+  uint8_t bin[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x06, 0x02, 0x2B,
+                    0x00, 0x00, 0x00, 0x64 };
+  uint8_t res[64];
+  size_t len;
+  size_t n;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
-
-  n = modbus_gen_query(&q, buf, sizeof(buf));
-
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
-
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_WORD(&buf[4], q.qty);
-  ASSERT_QUERY_CRC(buf, n);
+  /* Garbage before start of frame must be skipped */
+  res[0] = 0x00;
+  res[1] = '\n';
+  len = 2 + ascii_encode(bin, sizeof(bin), res + 2);
+
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_ASCII);
+  n = modbus_parser_execute(parser, settings, res, len);
+
+  assert(n == len);
+  assert(parser->errno == 0);
+  assert(parser->state == s_complete);
+  assert(parser->slave_addr == bin[0]);
+  assert(parser->function == bin[1]);
+  assert(parser->data_len == bin[2]);
+  assert(memcmp(parser->data, bin + 3, bin[2]) == 0);
+
+  /* Same stream, one character at a time */
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_ASCII);
+  n = 0;
+  for (int i = 0; i < len; i++)
+    n += modbus_parser_execute(parser, settings, res + i, 1);
+
+  assert(n == len);
+  assert(parser->errno == 0);
+  assert(parser->state == s_complete);
+  assert(memcmp(parser->data, bin + 3, bin[2]) == 0);
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_read_hold_reg(void)
+test_ascii_write_multiple_reg(struct modbus_parser* parser,
+                              struct modbus_parser_settings* settings)
 {
-  struct modbus_query q = {.slave_addr = 0x23,
-                           .function = MODBUS_FUNC_READ_HOLD_REG,
-                           .addr = 0x45,
-                           .qty = 0x1234 };
-  uint8_t buf[10];
-  int n;
+  uint8_t bin[] = { 0x11, MODBUS_FUNC_WRITE_REGS, 0x00, 0x01, 0x01, 0x02 };
+  uint8_t res[64];
+  size_t len;
+  size_t n;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
-
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+  len = ascii_encode(bin, sizeof(bin), res);
+  /* Lower-case digits are accepted as well */
+  for (int i = 0; i < len; i++)
+    if (res[i] >= 'A' && res[i] <= 'F')
+      res[i] += 'a' - 'A';
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_ASCII);
+  n = modbus_parser_execute(parser, settings, res, len);
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_WORD(&buf[4], q.qty);
-  ASSERT_QUERY_CRC(buf, n);
+  assert(n == len);
+  assert(parser->errno == 0);
+  assert(parser->addr == UINT16(bin[2]));
+  assert(parser->qty == UINT16(bin[4]));
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_read_input_reg(void)
+test_ascii_lrc_error(struct modbus_parser* parser,
+                     struct modbus_parser_settings* settings)
 {
-  struct modbus_query q = {.slave_addr = 0x45,
-                           .function = MODBUS_FUNC_READ_IN_REG,
-                           .addr = 0x56,
-                           .qty = 0x78 };
-  uint8_t buf[10];
-  int n;
+  uint8_t bin[] = { 0x11, MODBUS_FUNC_WRITE_REG, 0x00, 0x01, 0x00, 0x03 };
+  uint8_t res[64];
+  size_t len;
+  size_t n;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
+  len = ascii_encode(bin, sizeof(bin), res);
+  res[len - 3]++; /* Corrupt LRC */
 
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_ASCII);
+  n = modbus_parser_execute(parser, settings, res, len);
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+  assert(n == len);
+  assert(parser->errno != 0);
+  assert(parser->addr == UINT16(bin[2]));
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_WORD(&buf[4], q.qty);
-  ASSERT_QUERY_CRC(buf, n);
+  /* Bad hex digit stops the parser */
+  len = ascii_encode(bin, sizeof(bin), res);
+  res[5] = 'G';
+
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_ASCII);
+  n = modbus_parser_execute(parser, settings, res, len);
+
+  assert(n == 5);
+  assert(parser->errno != 0);
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_write_single_coil(void)
+test_query(struct modbus_parser* parser,
+           struct modbus_parser_settings* settings)
 {
-  uint16_t data = MODBUS_COIL_HIGH;
-
-  struct modbus_query q = {.slave_addr = 0x45,
-                           .function = MODBUS_FUNC_WRITE_COIL,
-                           .addr = 0x78,
-                           .data = &data,
-                           .data_len = 1 };
-  uint8_t buf[10];
-  int n;
+  uint16_t regs[] = { 0x0102, 0x0304 };
+  struct modbus_query q = {.slave_addr = 0x11,
+                           .function = MODBUS_FUNC_READ_HOLD_REG,
+                           .addr = 0x006B,
+                           .qty = 3 };
+  /* Positional initializers of older code keep their meaning */
+  struct modbus_query old = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x006B, 3 };
+  uint8_t buf[64];
+  int len;
+  size_t n;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
-
-  n = modbus_gen_query(&q, buf, sizeof(buf));
-
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
-
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_QUERY_CRC(buf, n);
+  assert(old.addr == 0x006B && old.qty == 3 && old.write_addr == 0);
+
+  len = modbus_gen_query(&q, buf, sizeof(buf));
+  modbus_parser_init(parser, MODBUS_QUERY);
+  n = modbus_parser_execute(parser, settings, buf, len);
+  assert(n == len);
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->function == MODBUS_FUNC_READ_HOLD_REG);
+  assert(parser->addr == 0x006B && parser->qty == 3);
+
+  q.function = MODBUS_FUNC_WRITE_REGS;
+  q.qty = 2;
+  q.data = regs;
+  q.data_len = 2;
+  len = modbus_gen_query(&q, buf, sizeof(buf));
+  modbus_parser_init(parser, MODBUS_QUERY);
+  n = 0;
+  for (int i = 0; i < len; i++)
+    n += modbus_parser_execute(parser, settings, buf + i, 1);
+  assert(n == len);
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->addr == 0x006B && parser->qty == 2);
+  assert(parser->data_len == 4);
+  ASSERT_WORD(&parser->data[2], 0x0304);
+
+  q.function = MODBUS_FUNC_READ_WRITE_REGS;
+  q.write_addr = 0x0200;
+  len = modbus_gen_query(&q, buf, sizeof(buf));
+  modbus_parser_init(parser, MODBUS_QUERY);
+  n = modbus_parser_execute(parser, settings, buf, len);
+  assert(n == len);
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->addr == 0x006B && parser->qty == 2);
+  assert(parser->write_addr == 0x0200 && parser->data_len == 4);
+
+  /* Same query in ASCII framing */
+  len = modbus_gen_query_ascii(&q, buf, sizeof(buf));
+  modbus_parser_init_framing(parser, MODBUS_QUERY, MODBUS_FRAMING_ASCII);
+  n = modbus_parser_execute(parser, settings, buf, len);
+  assert(n == len);
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->write_addr == 0x0200);
+  ASSERT_WORD(&parser->data[0], 0x0102);
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_write_single_reg(void)
+test_tcp(struct modbus_parser* parser, struct modbus_parser_settings* settings)
 {
-  uint16_t data = 0xABCD;
-
-  struct modbus_query q = {.slave_addr = 0x45,
-                           .function = MODBUS_FUNC_WRITE_COIL,
-                           .addr = 0x78,
-                           .data = &data,
+  uint16_t reg = 0x1234;
+  struct modbus_query q = {.slave_addr = 0xFF,
+                           .function = MODBUS_FUNC_WRITE_REGS,
+                           .addr = 0x0010,
+                           .qty = 1,
+                           .data = &reg,
                            .data_len = 1 };
-  uint8_t buf[10];
-  int n;
+  uint8_t res[] = { 0x00, 0x07, 0x00, 0x00, 0x00, 0x07, 0x01,
+                    MODBUS_FUNC_READ_IN_REG, 0x04, 0xAA, 0xBB, 0xCC, 0xDD };
+  uint8_t buf[32];
+  int len;
+  size_t n;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
+  assert(modbus_gen_query_tcp(&q, 0xBEEF, buf, 14) == -1);
+  len = modbus_gen_query_tcp(&q, 0xBEEF, buf, sizeof(buf));
+  assert(len == 6 + 9);
+  assert(buf[0] == 0xBE && buf[1] == 0xEF && buf[5] == 9 && buf[6] == 0xFF);
+
+  /* Query, one byte at a time */
+  modbus_parser_init_framing(parser, MODBUS_QUERY, MODBUS_FRAMING_TCP);
+  n = 0;
+  for (int i = 0; i < len; i++)
+    n += modbus_parser_execute(parser, settings, buf + i, 1);
+  assert(n == len);
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->transaction_id == 0xBEEF && parser->slave_addr == 0xFF);
+  assert(parser->addr == 0x0010 && parser->data_len == 2);
+
+  /* Response, followed by the next frame */
+  memcpy(buf, res, sizeof(res));
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  n = modbus_parser_execute(parser, settings, buf, sizeof(buf));
+  assert(n == sizeof(res));
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->transaction_id == 7 && parser->data_len == 4);
+  ASSERT_WORD(&parser->data[2], 0xCCDD);
 
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+  /* Length of MBAP header doesn't match layout */
+  res[5] = 6;
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  n = modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(n == sizeof(res) - 1 && parser->errno != 0);
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+  res[5] = 8;
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(parser->errno != 0);
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_QUERY_CRC(buf, n);
+  /* Other protocol */
+  res[5] = 7;
+  res[2] = 1;
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  n = modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(n == 3 && parser->errno != 0);
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_write_multiple_coil(void)
+test_gateway(struct modbus_parser* parser,
+             struct modbus_parser_settings* settings)
 {
-  uint16_t data = 0b0101010100001111;
-
-  struct modbus_query q = {.slave_addr = 0x45,
-                           .function = MODBUS_FUNC_WRITE_COILS,
-                           .addr = 0x78,
-                           .qty = 16,
-                           .data = &data,
-                           .data_len = 1 };
-  uint8_t buf[15];
+  struct modbus_query q = {.slave_addr = 0x11,
+                           .function = MODBUS_FUNC_READ_HOLD_REG,
+                           .addr = 0x006B,
+                           .qty = 3 };
+  uint8_t rtu[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x06, 0x02, 0x2B,
+                    0x00, 0x00, 0x00, 0x64, 0x00, 0x00 };
+  uint8_t expect[16];
+  uint8_t buf[32];
+  uint16_t tid;
+  int len;
   int n;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
+  /* Query: TCP in, RTU out, the same as generated directly */
+  len = modbus_gen_query_tcp(&q, 0x0102, buf, sizeof(buf));
+  assert(modbus_tcp_to_rtu(buf, len, len + 1, &tid) == -1);
+  n = modbus_tcp_to_rtu(buf, len, sizeof(buf), &tid);
+  assert(n == 8 && tid == 0x0102);
+  assert(modbus_gen_query(&q, expect, sizeof(expect)) == n);
+  assert(memcmp(buf + MODBUS_TCP_HEADROOM, expect, n) == 0);
+
+  /* Response: RTU in, TCP out */
+  ADD_CRC(rtu);
+  memcpy(buf + MODBUS_TCP_HEADROOM, rtu, sizeof(rtu));
+  n = modbus_rtu_to_tcp(buf + MODBUS_TCP_HEADROOM, sizeof(rtu), tid);
+  assert(n == MODBUS_TCP_HEADROOM + sizeof(rtu) - 2);
+
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  assert(modbus_parser_execute(parser, settings, buf, n) == n);
+  assert(parser->errno == 0 && parser->state == s_complete);
+  assert(parser->transaction_id == 0x0102 && parser->data_len == 6);
+
+  /* Back to RTU, CRC is the same */
+  assert(modbus_tcp_to_rtu(buf, n, sizeof(buf), &tid) == sizeof(rtu));
+  assert(memcmp(buf + MODBUS_TCP_HEADROOM, rtu, sizeof(rtu)) == 0);
+
+  /* Broken frames */
+  buf[MODBUS_TCP_HEADROOM + 3]++;
+  assert(modbus_rtu_to_tcp(buf + MODBUS_TCP_HEADROOM, sizeof(rtu), 0) == -1);
+  buf[2] = 1;
+  assert(modbus_tcp_to_rtu(buf, n, sizeof(buf), &tid) == -1);
+  buf[2] = 0;
+  assert(modbus_tcp_to_rtu(buf, n - 1, sizeof(buf), &tid) == -1);
 
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+  TEST_SUCCESS();
+}
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+void
+test_frame_len(void)
+{
+  uint8_t read_res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x04 };
+  uint8_t write_query[] = { 0x11, MODBUS_FUNC_WRITE_REGS, 0x00, 0x01,
+                            0x00, 0x02, 0x04 };
+  uint8_t rw_res[] = { 0x11, MODBUS_FUNC_READ_WRITE_REGS, 0x04 };
+  uint8_t bad[] = { 0x11, 0x7F };
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_WORD(&buf[4], q.qty);
-  assert(buf[6] == 2);
-  ASSERT_QUERY_CRC(buf, n);
+  TEST_START();
+
+  assert(modbus_frame_len(MODBUS_RESPONSE, read_res, 2) == 0);
+  assert(modbus_frame_len(MODBUS_RESPONSE, read_res, 3) == 9);
+  assert(modbus_frame_len(MODBUS_QUERY, read_res, 2) == 8);
+  assert(modbus_frame_len(MODBUS_RESPONSE, write_query, 2) == 8);
+  assert(modbus_frame_len(MODBUS_QUERY, write_query, 6) == 0);
+  assert(modbus_frame_len(MODBUS_QUERY, write_query, 7) == 13);
+  assert(modbus_frame_len(MODBUS_RESPONSE, bad, 2) == -1);
+  assert(modbus_frame_len(MODBUS_RESPONSE, rw_res, 3) == 9);
 
   TEST_SUCCESS();
 }
 
 void
-test_gen_write_multiple_coil_2(void)
+test_crc_batch(void)
 {
-  uint16_t data[] = { 0b1111000011110000, 0b0000000001110000 };
-
-  struct modbus_query q = {.slave_addr = 0x45,
-                           .function = MODBUS_FUNC_WRITE_COILS,
-                           .addr = 0x78,
-                           .qty = 23,
-                           .data = data,
-                           .data_len = 2 };
-  uint8_t buf[15];
-  int n;
+  static uint8_t buf[11][40];
+  const uint8_t* data[11];
+  size_t sz[11];
+  uint16_t crc[11];
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
-
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+  /* Not a multiple of lanes, different lengths inside a group of four */
+  for (int i = 0; i < 11; i++) {
+    for (int k = 0; k < 38; k++)
+      buf[i][k] = i * 31 + k * 7;
+    data[i] = buf[i];
+    sz[i] = (i * 13) % 38;
+  }
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+  modbus_calc_crc_batch(data, sz, crc, 11);
+  for (int i = 0; i < 11; i++)
+    assert(crc[i] == modbus_calc_crc(data[i], sz[i]));
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_WORD(&buf[4], q.qty);
-  assert(buf[6] == 3);
-  ASSERT_QUERY_CRC(buf, n);
+  /* Frames with CRC appended check to 0 */
+  for (int i = 0; i < 11; i++) {
+    buf[i][sz[i]] = crc[i] & 0xFF;
+    buf[i][sz[i] + 1] = crc[i] >> 8;
+    sz[i] += 2;
+  }
+  modbus_calc_crc_batch(data, sz, crc, 11);
+  for (int i = 0; i < 11; i++)
+    assert(crc[i] == 0);
 
   TEST_SUCCESS();
 }
 
-void
-test_gen_write_multiple_reg(void)
+/* Append response frame with CRC to stream */
+size_t
+append_frame(uint8_t* buf, const uint8_t* frame, size_t n)
 {
-  uint16_t data[] = { 0xAB, 0xCD, 0xEF };
+  uint16_t crc = modbus_calc_crc(frame, n);
 
-  struct modbus_query q = {.slave_addr = 0x45,
-                           .function = MODBUS_FUNC_WRITE_REGS,
-                           .addr = 0x78,
-                           .data = data,
-                           .data_len = 3 };
-  uint8_t buf[20];
-  int n;
+  memcpy(buf, frame, n);
+  buf[n] = crc & 0x00FF;
+  buf[n + 1] = crc >> 8;
+  return n + 2;
+}
+
+int
+abort_write_reg(struct modbus_parser* p)
+{
+  return p->function == MODBUS_FUNC_WRITE_REG;
+}
+
+void
+test_replay(void)
+{
+  static uint8_t stream[8192];
+  static struct modbus_replay_stats stats1, stats4;
+  uint8_t read_res[] = { 0x00, MODBUS_FUNC_READ_HOLD_REG, 0x04, 0x12, 0x34,
+                         0x56, 0x78 };
+  uint8_t write_res[] = { 0x00, MODBUS_FUNC_WRITE_REG, 0x00, 0x10, 0xAB,
+                          0xCD };
+  uint8_t empty_res[] = { 0x02, MODBUS_FUNC_READ_HOLD_REG, 0x00 };
+  modbus_parser_settings settings;
+  size_t len = 0;
+  size_t bad_start = 0;
+  int nframes = 0;
+  int nwrites = 0;
 
   TEST_START();
 
-  memset(buf, 0, sizeof(buf));
+  for (int i = 0; i < 600; i++) {
+    if (i == 100) {
+      /* Garbage */
+      memset(stream + len, 0xFF, 5);
+      len += 5;
+    }
+    if (i == 200) {
+      /* Byte count of 0 is no frame, not one of 5 bytes */
+      memcpy(stream + len, empty_res, sizeof(empty_res));
+      len += sizeof(empty_res);
+    }
 
-  n = modbus_gen_query(&q, buf, sizeof(buf));
+    read_res[0] = write_res[0] = 1 + i % 5;
+    if (i == 300)
+      bad_start = len;
+    if (i % 3 == 0) {
+      len += append_frame(stream + len, write_res, sizeof(write_res));
+      nwrites++;
+    } else
+      len += append_frame(stream + len, read_res, sizeof(read_res));
+    nframes++;
+  }
+  /* Corrupt CRC of one frame */
+  stream[bad_start + 5] ^= 0x01;
+  nframes--;
+
+  assert(modbus_replay_sync(stream, len, 0) == 0);
+  assert(modbus_replay_sync(stream, len, 1) == sizeof(write_res) + 2);
+
+  modbus_replay_stats_init(&stats1);
+  assert(modbus_replay_buffer(stream, len, 1, NULL, NULL, &stats1) == 0);
+  modbus_replay_stats_init(&stats4);
+  assert(modbus_replay_buffer(stream, len, 4, NULL, NULL, &stats4) == 0);
+
+  printf("frames: %d, skipped: %d, crc errors: %d\n",
+         (int)stats1.frames,
+         (int)stats1.skipped,
+         (int)stats1.crc_errors);
+
+  assert(stats1.frames == nframes);
+  assert(stats1.crc_errors == 1);
+  assert(stats1.skipped == 5 + sizeof(empty_res) + sizeof(write_res) + 2);
+  assert(stats1.bytes + stats1.skipped == len);
+  assert(memcmp(&stats1, &stats4, sizeof(stats1)) == 0);
+
+  /* Frames aborted by a callback are counted apart, corrupted one is
+   * still a CRC error
+   */
+  modbus_parser_settings_init(&settings);
+  settings.on_function = abort_write_reg;
+  modbus_replay_stats_init(&stats4);
+  assert(modbus_replay_buffer(stream, len, 4, &settings, NULL, &stats4) == 0);
+  assert(stats4.aborted == nwrites - 1);
+  assert(stats4.frames == nframes - stats4.aborted);
+  assert(stats4.crc_errors == 1);
+  assert(stats4.bytes + stats4.skipped == len);
 
-  printf("Query:\n");
-  VAR_DUMP(buf, n);
+  TEST_SUCCESS();
+}
 
-  assert(n > 0);
-  assert(buf[0] == q.slave_addr);
-  assert(buf[1] == q.function);
-  ASSERT_WORD(&buf[2], q.addr);
-  ASSERT_QUERY_CRC(buf, n);
+struct mem_file
+{
+  uint8_t buf[16384];
+  size_t len;
+};
+
+int
+mem_write(void* arg, const void* buf, size_t len)
+{
+  struct mem_file* f = arg;
+
+  if (f->len + len > sizeof(f->buf))
+    return -1;
+  memcpy(f->buf + f->len, buf, len);
+  f->len += len;
+  return 0;
+}
+
+int
+mem_read(void* arg, uint64_t offset, void* buf, size_t len)
+{
+  struct mem_file* f = arg;
+
+  if (offset + len > f->len)
+    return -1;
+  memcpy(buf, f->buf + offset, len);
+  return 0;
+}
+
+/* Values of sample k of archive test series */
+uint16_t
+archive_reg(int k, int i)
+{
+  return i < 4 ? 1000 + i * 10 + k / 50 - (k % 7 == 0) : 0x1234;
+}
+
+uint8_t
+archive_coils(int k, int byte)
+{
+  return byte == 0 ? (k / 100) & 0xFF : 0x0A;
+}
+
+struct archive_check
+{
+  int samples[2];
+};
+
+int
+archive_on_sample(void* arg, const struct modbus_archive_series* s, uint64_t ts)
+{
+  struct archive_check* c = arg;
+  int id = s->slave_addr - 1;
+  int k = c->samples[id]++;
+
+  assert(ts == 1000000 + k * 100000 + (k % 10 == 3) * 17);
+  if (s->table == MODBUS_TABLE_HOLD_REG) {
+    assert(s->addr == 0x0100 && s->count == 10);
+    for (int i = 0; i < 10; i++)
+      assert((s->data[2 * i] << 8 | s->data[2 * i + 1]) == archive_reg(k, i));
+  } else {
+    assert(s->table == MODBUS_TABLE_COILS && s->count == 20);
+    assert(s->data[0] == archive_coils(k, 0));
+    assert(s->data[1] == archive_coils(k, 1));
+    assert(s->data[2] == 0x05); /* Padding bits are dropped */
+  }
+  return 0;
+}
+
+void
+test_archive(struct modbus_parser* parser,
+             struct modbus_parser_settings* settings)
+{
+  static struct mem_file f;
+  static uint8_t block[512];
+  static struct modbus_archive_series series[2];
+  static struct modbus_archive_series state[2];
+  struct modbus_archive_writer w;
+  struct archive_check check = { { 0, 0 } };
+  struct modbus_parser_settings quiet;
+  struct modbus_query q;
+  uint8_t res[3 + 20 + 2] = { 0x01, MODBUS_FUNC_READ_HOLD_REG, 20 };
+  uint8_t coils[3];
+  uint64_t ts;
+  int nsamples = 0;
+  int n;
+
+  TEST_START();
+
+  assert(modbus_archive_series_init(
+           &series[0], 0x01, MODBUS_TABLE_HOLD_REG, 0x0100, 10) == 0);
+  assert(modbus_archive_series_init(
+           &series[1], 0x02, MODBUS_TABLE_COILS, 0x0000, 20) == 0);
+  assert(modbus_archive_series_init(
+           &state[0], 0x01, MODBUS_TABLE_HOLD_REG, 0x0000, 126) == -1);
+  assert(modbus_archive_writer_init(
+           &w, mem_write, &f, series, 2, block, 256) == -1);
+  assert(modbus_archive_writer_init(
+           &w, mem_write, &f, series, 2, block, sizeof(block)) == 0);
+
+  modbus_parser_settings_init(&quiet);
+  modbus_query_init(&q);
+  q.slave_addr = 0x01;
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 0x0100;
+  q.qty = 10;
+
+  for (int k = 0; k < 1000; k++) {
+    /* Regular period with some jitter */
+    ts = 1000000 + k * 100000 + (k % 10 == 3) * 17;
+
+    for (int i = 0; i < 10; i++) {
+      res[3 + 2 * i] = archive_reg(k, i) >> 8;
+      res[4 + 2 * i] = archive_reg(k, i) & 0xFF;
+    }
+    ADD_CRC(res);
+    modbus_parser_init(parser, MODBUS_RESPONSE);
+    modbus_parser_execute(parser, &quiet, res, sizeof(res));
+    assert(parser->state == s_complete);
+    assert(modbus_archive_write_response(&w, ts, parser, &q) == 0);
+
+    coils[0] = archive_coils(k, 0);
+    coils[1] = archive_coils(k, 1);
+    coils[2] = 0xF5; /* Only low 4 bits are coils */
+    assert(modbus_archive_write(&w, 1, ts, coils) == 0);
+  }
+
+  /* No series of this query */
+  q.addr = 0x0101;
+  assert(modbus_archive_write_response(&w, ts, parser, &q) == -1);
+
+  assert(modbus_archive_flush(&w) == 0);
+  assert(f.len % sizeof(block) == 0);
+  printf("raw %d bytes, archive %d bytes\n", (int)w.raw_bytes, (int)f.len);
+  assert(w.out_bytes == f.len);
+  assert(w.raw_bytes > 5 * f.len);
+
+  for (size_t off = 0; off < f.len; off += sizeof(block)) {
+    n = modbus_archive_decode(
+      f.buf + off, sizeof(block), state, 2, archive_on_sample, &check);
+    assert(n > 0);
+    nsamples += n;
+  }
+  assert(nsamples == 2000);
+  assert(check.samples[0] == 1000 && check.samples[1] == 1000);
+
+  /* Corrupted header, too few series */
+  f.buf[0] = 'X';
+  assert(modbus_archive_decode(f.buf, sizeof(block), state, 2, NULL, NULL) ==
+         -1);
+  assert(modbus_archive_decode(
+           f.buf + sizeof(block), sizeof(block), state, 1, NULL, NULL) == -1);
+
+  TEST_SUCCESS();
+}
+
+void
+test_capture(struct modbus_parser* parser,
+             struct modbus_parser_settings* settings)
+{
+  static struct mem_file f;
+  struct modbus_capture_index_entry index[4];
+  struct modbus_capture_writer w;
+  struct modbus_capture_reader r;
+  struct modbus_capture_frame frame;
+  uint8_t res[] = { 0x00, MODBUS_FUNC_READ_HOLD_REG, 0x02, 0x00, 0x00, 0x00,
+                    0x00 };
+  int n;
+
+  TEST_START();
+
+  f.len = 0;
+  assert(modbus_capture_writer_init(&w, mem_write, &f, index, 4, 2) == 0);
+
+  /* 100 frames, 10 ms apart, slave 1..5. Frames are split between calls
+   * of parser.
+   */
+  for (int i = 0; i < 100; i++) {
+    res[0] = 1 + i % 5;
+    res[4] = i;
+    ADD_CRC(res);
+    if (i == 50)
+      res[6] ^= 0xFF;
+
+    modbus_parser_init(parser, MODBUS_RESPONSE);
+    n = modbus_capture_execute(&w, parser, settings, i * 10000, res, 4);
+    n += modbus_capture_execute(
+      &w, parser, settings, i * 10000, res + 4, sizeof(res) - 4);
+    assert(n == sizeof(res));
+  }
+  assert(modbus_capture_writer_close(&w) == 0);
+
+  printf("Capture size: %d bytes, index: %d entries of %d frames\n",
+         (int)f.len,
+         (int)w.index_len,
+         (int)w.segment_frames);
+  assert(w.index_len <= 4);
+
+  /* Read everything back */
+  assert(modbus_capture_reader_open(&r, mem_read, &f, f.len, index, 4) == 0);
+  for (int i = 0; i < 100; i++) {
+    assert(modbus_capture_next(&r, &frame) == 1);
+    assert(frame.ts == i * 10000);
+    assert(frame.len == sizeof(res));
+    assert(frame.data[0] == 1 + i % 5);
+    assert(frame.data[4] == i);
+    assert(frame.tag == (i == 50 ? MODBUS_CAPTURE_FRAME_CRC_ERROR
+                                 : MODBUS_CAPTURE_FRAME));
+  }
+  assert(modbus_capture_next(&r, &frame) == 0);
+
+  /* Time range and slave */
+  assert(modbus_capture_seek(&r, 0, UINT64_MAX, 256) == -1);
+  assert(modbus_capture_seek(&r, 0, UINT64_MAX, -2) == -1);
+  assert(modbus_capture_seek(&r, 700000, 800000, 3) == 0);
+  for (int i = 72; i <= 80; i += 5) {
+    assert(modbus_capture_next(&r, &frame) == 1);
+    assert(frame.ts == i * 10000);
+    assert(frame.data[0] == 3);
+  }
+  assert(modbus_capture_next(&r, &frame) == 0);
+
+  /* Seeking jumps over segments before the range */
+  modbus_capture_seek(&r, 990000, UINT64_MAX, -1);
+  assert(r.pos > f.len / 2);
+  assert(modbus_capture_next(&r, &frame) == 1);
+  assert(frame.ts == 990000);
+  assert(modbus_capture_next(&r, &frame) == 0);
+
+  /* Without index, e.g. writer wasn't closed */
+  f.len -= w.index_len * MODBUS_CAPTURE_ENTRY_SIZE + 16;
+  assert(modbus_capture_reader_open(&r, mem_read, &f, f.len, index, 4) == 0);
+  modbus_capture_seek(&r, 500000, 500000, -1);
+  assert(modbus_capture_next(&r, &frame) == 1);
+  assert(frame.ts == 500000);
+  assert(modbus_capture_next(&r, &frame) == 0);
+
+  TEST_SUCCESS();
+}
+
+#ifdef MODBUS_PARSER_STATS
+void
+test_stats(struct modbus_parser* parser,
+           struct modbus_parser_settings* settings)
+{
+  struct modbus_parser_stats stats = { 0 };
+  struct modbus_parser_stats snap;
+  uint8_t res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x02, 0x00, 0x0A, 0x00,
+                    0x00 };
+  uint8_t ascii[32];
+  size_t len;
+
+  TEST_START();
+
+  ADD_CRC(res);
+  parser->stats = &stats;
+
+  /* Split frame is a carryover, counters survive re-initialization */
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, res, 3);
+  modbus_parser_execute(parser, settings, res + 3, sizeof(res) - 3);
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, res, sizeof(res));
+
+  /* CRC error */
+  res[sizeof(res) - 1] ^= 0xFF;
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, res, sizeof(res));
+
+  /* ASCII with garbage before the frame */
+  ascii[0] = '?';
+  len = 1 + ascii_encode(res, 5, ascii + 1);
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_ASCII);
+  modbus_parser_execute(parser, settings, ascii, len);
+
+  modbus_parser_stats_snapshot(&stats, &snap);
+  parser->stats = NULL;
+
+  assert(snap.seq % 2 == 0);
+  assert(snap.bytes == 3 * sizeof(res) + len);
+  assert(snap.frames[MODBUS_FUNC_READ_HOLD_REG] == 4);
+  assert(snap.crc_errors == 1);
+  assert(snap.resyncs == 1);
+  assert(snap.carryovers == 1);
+  assert(snap.callback_aborts == 0);
+
+  TEST_SUCCESS();
+}
+#endif
+
+#ifdef MODBUS_PARSER_PROFILE
+static int
+profile_on_function(modbus_parser* parser)
+{
+  return 0;
+}
+
+/* Callback which takes its time */
+static int
+profile_on_complete(modbus_parser* parser)
+{
+  volatile int x = 0;
+
+  for (int i = 0; i < 2000; i++)
+    x += i;
+  return 0;
+}
+
+void
+test_profile(void)
+{
+  static uint8_t stream[1 << 17];
+  struct modbus_parser_profile profile;
+  struct modbus_parser_profile snap;
+  struct modbus_parser_settings settings;
+  struct modbus_traffic_config config;
+  struct modbus_parser parser = { 0 };
+  struct modbus_traffic t;
+  uint64_t calls = 0;
+  uint64_t samples = 0;
+  uint64_t func_samples = 0;
+  uint64_t callbacks = 0;
+  uint64_t execute = 0;
+  size_t len = 0;
+  int executes = 0;
+
+  TEST_START();
+
+  modbus_traffic_config_init(&config);
+  modbus_traffic_init(&t, &config);
+  for (int i = 0; i < 1000; i++)
+    len += modbus_traffic_next(&t, stream + len, sizeof(stream) - len);
+
+  modbus_parser_settings_init(&settings);
+  settings.on_function = profile_on_function;
+  settings.on_complete = profile_on_complete;
+  modbus_parser_profile_init(&profile, 4);
+  parser.profile = &profile;
+
+  for (size_t pos = 0; pos < len; executes++) {
+    modbus_parser_init(&parser, MODBUS_RESPONSE);
+    pos += modbus_parser_execute(&parser, &settings, stream + pos, len - pos);
+  }
+  modbus_parser_profile_snapshot(&profile, &snap);
+
+  assert(snap.executes == executes);
+  assert(snap.execute_samples > 0);
+  execute = snap.execute_cycles * snap.executes / snap.execute_samples;
+  assert(snap.calls[MODBUS_CB_COMPLETE] == t.frames);
+  assert(snap.calls[MODBUS_CB_FUNCTION] == t.frames);
+  for (int i = 0; i < MODBUS_CB_COUNT; i++) {
+    calls += snap.calls[i];
+    samples += snap.samples[i];
+    if (snap.samples[i] > 0)
+      callbacks += snap.cycles[i] * snap.calls[i] / snap.samples[i];
+  }
+  for (int i = 0; i < 256; i++)
+    func_samples += snap.func_samples[i];
+  assert(snap.seq == 2 * (samples + snap.execute_samples));
+  calls += snap.executes;
+  samples += snap.execute_samples;
+  assert(samples > calls / 8 && samples < calls / 2);
+  assert(func_samples + snap.execute_samples == samples);
+
+  printf("execute %llu, callbacks %llu, on_complete %llu, on_function %llu "
+         "per call\n",
+         (unsigned long long)execute,
+         (unsigned long long)callbacks,
+         (unsigned long long)(snap.cycles[MODBUS_CB_COMPLETE] /
+                              snap.samples[MODBUS_CB_COMPLETE]),
+         (unsigned long long)(snap.cycles[MODBUS_CB_FUNCTION] /
+                              snap.samples[MODBUS_CB_FUNCTION]));
+  assert(snap.cycles[MODBUS_CB_COMPLETE] / snap.samples[MODBUS_CB_COMPLETE] >
+         snap.cycles[MODBUS_CB_FUNCTION] / snap.samples[MODBUS_CB_FUNCTION]);
+  assert(callbacks < execute * 2);
+
+  TEST_SUCCESS();
+}
+#endif
+
+void
+test_latency(struct modbus_parser* parser,
+             struct modbus_parser_settings* settings)
+{
+  static struct modbus_latency_hist slaves[MODBUS_LATENCY_SLAVES];
+  static struct modbus_latency_hist funcs[MODBUS_LATENCY_FUNCS];
+  static struct modbus_latency l;
+  struct modbus_latency_hist h;
+  uint8_t res[] = { 0x11, MODBUS_FUNC_WRITE_REG, 0x00, 0x01, 0x00, 0x03, 0x00,
+                    0x00 };
+  uint64_t v;
+
+  TEST_START();
+
+  modbus_latency_hist_init(&h);
+  assert(modbus_latency_hist_quantile(&h, 0.5) == 0);
+
+  for (int i = 1; i <= 1000; i++)
+    modbus_latency_hist_record(&h, i);
+
+  v = modbus_latency_hist_quantile(&h, 0.5);
+  printf("p50: %d, p99: %d\n",
+         (int)v,
+         (int)modbus_latency_hist_quantile(&h, 0.99));
+  assert(v >= 500 && v <= 500 * 1.125);
+  v = modbus_latency_hist_quantile(&h, 0.99);
+  assert(v >= 990 && v <= 1000);
+  assert(modbus_latency_hist_quantile(&h, 1.0) == 1000);
+  assert(modbus_latency_hist_quantile(&h, 0.0) == 1);
+
+  /* Small values are exact, huge ones are clamped to max */
+  modbus_latency_hist_init(&h);
+  modbus_latency_hist_record(&h, 7);
+  modbus_latency_hist_record(&h, UINT64_MAX);
+  assert(modbus_latency_hist_quantile(&h, 0.5) == 7);
+  assert(modbus_latency_hist_quantile(&h, 1.0) == UINT64_MAX);
+
+  /* Top bucket below the overflow keeps its bound */
+  modbus_latency_hist_init(&h);
+  modbus_latency_hist_record(&h, 0xF0000000);
+  modbus_latency_hist_record(&h, UINT64_MAX);
+  assert(modbus_latency_hist_quantile(&h, 0.5) == 0xFFFFFFFF);
+
+  /* Round trip of a parsed response */
+  ADD_CRC(res);
+  modbus_latency_init(&l, slaves, funcs);
+  modbus_latency_query(&l, 0x11, MODBUS_FUNC_WRITE_REG, 1000);
+
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(modbus_latency_response(&l, parser, 1250) == 250);
+  /* No outstanding query anymore */
+  assert(modbus_latency_response(&l, parser, 1300) == -1);
+
+  /* Function mismatch */
+  modbus_latency_query(&l, 0x11, MODBUS_FUNC_READ_HOLD_REG, 2000);
+  assert(modbus_latency_response(&l, parser, 2100) == -1);
+
+  assert(slaves[0x11].count == 1);
+  assert(funcs[MODBUS_FUNC_WRITE_REG].count == 1);
+  assert(modbus_latency_hist_quantile(&slaves[0x11], 0.5) == 250);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_read_coils(void)
+{
+  struct modbus_query q = {.slave_addr = 0x12,
+                           .function = MODBUS_FUNC_READ_COILS,
+                           .addr = 0x11,
+                           .qty = 5 };
+  uint8_t buf[10];
+  int n;
+  // uint16_t crc;
+
+  TEST_START();
+
+  /* Check buffer size error. length of output stream is 8 bytes,
+   * but we gave 7 bytes.
+   */
+  n = modbus_gen_query(&q, buf, 7);
+  assert(n == -1);
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_WORD(&buf[4], q.qty);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_discrete_input(void)
+{
+  struct modbus_query q = {.slave_addr = 0x12,
+                           .function = MODBUS_FUNC_READ_DISCRETE_IN,
+                           .addr = 0x11,
+                           .qty = 5 };
+  uint8_t buf[10];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_WORD(&buf[4], q.qty);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_read_hold_reg(void)
+{
+  struct modbus_query q = {.slave_addr = 0x23,
+                           .function = MODBUS_FUNC_READ_HOLD_REG,
+                           .addr = 0x45,
+                           .qty = 0x1234 };
+  uint8_t buf[10];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_WORD(&buf[4], q.qty);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_read_input_reg(void)
+{
+  struct modbus_query q = {.slave_addr = 0x45,
+                           .function = MODBUS_FUNC_READ_IN_REG,
+                           .addr = 0x56,
+                           .qty = 0x78 };
+  uint8_t buf[10];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_WORD(&buf[4], q.qty);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_write_single_coil(void)
+{
+  uint16_t data = MODBUS_COIL_HIGH;
+
+  struct modbus_query q = {.slave_addr = 0x45,
+                           .function = MODBUS_FUNC_WRITE_COIL,
+                           .addr = 0x78,
+                           .data = &data,
+                           .data_len = 1 };
+  uint8_t buf[10];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_write_single_reg(void)
+{
+  uint16_t data = 0xABCD;
+
+  struct modbus_query q = {.slave_addr = 0x45,
+                           .function = MODBUS_FUNC_WRITE_COIL,
+                           .addr = 0x78,
+                           .data = &data,
+                           .data_len = 1 };
+  uint8_t buf[10];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_write_multiple_coil(void)
+{
+  uint16_t data = 0b0101010100001111;
+
+  struct modbus_query q = {.slave_addr = 0x45,
+                           .function = MODBUS_FUNC_WRITE_COILS,
+                           .addr = 0x78,
+                           .qty = 16,
+                           .data = &data,
+                           .data_len = 1 };
+  uint8_t buf[15];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_WORD(&buf[4], q.qty);
+  assert(buf[6] == 2);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_write_multiple_coil_2(void)
+{
+  uint16_t data[] = { 0b1111000011110000, 0b0000000001110000 };
+
+  struct modbus_query q = {.slave_addr = 0x45,
+                           .function = MODBUS_FUNC_WRITE_COILS,
+                           .addr = 0x78,
+                           .qty = 23,
+                           .data = data,
+                           .data_len = 2 };
+  uint8_t buf[15];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_WORD(&buf[4], q.qty);
+  assert(buf[6] == 3);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_ascii(void)
+{
+  /* Example from Modbus serial line specification */
+  struct modbus_query q = {.slave_addr = 0x11,
+                           .function = MODBUS_FUNC_READ_HOLD_REG,
+                           .addr = 0x006B,
+                           .qty = 3 };
+  const char* expect = ":1103006B00037E\r\n";
+  uint8_t buf[20];
+  int n;
+
+  TEST_START();
+
+  n = modbus_gen_query_ascii(&q, buf, 16);
+  assert(n == -1);
+
+  n = modbus_gen_query_ascii(&q, buf, sizeof(buf));
+
+  printf("Query: %.*s\n", n - 2, buf);
+
+  assert(n == strlen(expect));
+  assert(memcmp(buf, expect, n) == 0);
+
+  TEST_SUCCESS();
+}
+
+void
+test_gen_write_multiple_reg(void)
+{
+  uint16_t data[] = { 0xAB, 0xCD, 0xEF };
+
+  struct modbus_query q = {.slave_addr = 0x45,
+                           .function = MODBUS_FUNC_WRITE_REGS,
+                           .addr = 0x78,
+                           .data = data,
+                           .data_len = 3 };
+  uint8_t buf[20];
+  int n;
+
+  TEST_START();
+
+  memset(buf, 0, sizeof(buf));
+
+  n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  printf("Query:\n");
+  VAR_DUMP(buf, n);
+
+  assert(n > 0);
+  assert(buf[0] == q.slave_addr);
+  assert(buf[1] == q.function);
+  ASSERT_WORD(&buf[2], q.addr);
+  ASSERT_QUERY_CRC(buf, n);
+
+  TEST_SUCCESS();
+}
+
+void
+test_ring(struct modbus_parser* parser, struct modbus_parser_settings* settings)
+{
+  static uint8_t buf[16];
+  struct modbus_ring r;
+  uint8_t write_res[] = { 0x11, MODBUS_FUNC_WRITE_REG, 0x00, 0x01, 0x00, 0x03,
+                          0x00, 0x00 };
+  uint8_t read_res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG,
+                         0x06, 0x02,
+                         0x2B, 0x00,
+                         0x00, 0x00,
+                         0x64, 0x00,
+                         0x00 };
+  uint8_t tcp_res[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x11,
+                        MODBUS_FUNC_READ_HOLD_REG, 0x02, 0x12, 0x34 };
+  uint8_t fill[16] = { 0 };
+  uint8_t* p;
+  size_t n;
+
+  TEST_START();
+
+  ADD_CRC(write_res);
+  ADD_CRC(read_res);
+
+  assert(modbus_ring_init(&r, buf, 12) != 0);
+  assert(modbus_ring_init(&r, buf, sizeof(buf)) == 0);
+
+  /* First frame fills half of the ring */
+  assert(modbus_ring_write(&r, write_res, sizeof(write_res)) ==
+         sizeof(write_res));
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  assert(modbus_ring_execute(&r, parser, settings) == sizeof(write_res));
+  assert(parser->state == s_complete);
+  assert(parser->data == buf + 4);
+
+  /* Data field of second frame crosses end of the ring, deliver it in
+   * two parts, like DMA half/full interrupts
+   */
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  assert(modbus_ring_write(&r, read_res, 6) == 6);
+  assert(modbus_ring_execute(&r, parser, settings) == 6);
+  assert(parser->state == s_data);
+
+  /* Data is held, rest of the ring is free */
+  n = modbus_ring_write_span(&r, &p);
+  assert(p == buf + 14);
+  assert(n == 2);
+  assert(modbus_ring_write(&r, read_res + 6, sizeof(read_res) - 6) ==
+         sizeof(read_res) - 6);
+  assert(modbus_ring_pending(&r) == sizeof(read_res) - 6);
+  assert(modbus_ring_execute(&r, parser, settings) == sizeof(read_res) - 6);
+
+  assert(parser->errno == 0);
+  assert(parser->state == s_complete);
+  assert(parser->data == buf + 11);
+  assert(parser->data_wrap == buf);
+  assert(parser->data_wrap_len == 1);
+  assert(memcmp(parser->data, read_res + 3, 5) == 0);
+  assert(memcmp(parser->data_wrap, read_res + 8, 1) == 0);
+
+  /* Data isn't released until parser is re-initialized */
+  n = modbus_ring_write_span(&r, &p);
+  assert(p == buf + 3);
+  assert(n == 8);
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  assert(modbus_ring_execute(&r, parser, settings) == 0);
+  assert(modbus_ring_write_span(&r, &p) == 13);
+
+  /* TCP data points into the ring too, it's held the same way */
+  modbus_parser_init_framing(parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  assert(modbus_ring_write(&r, tcp_res, sizeof(tcp_res)) == sizeof(tcp_res));
+  assert(modbus_ring_execute(&r, parser, settings) == sizeof(tcp_res));
+  assert(parser->state == s_complete);
+  assert(parser->data == buf + 12);
+  assert(modbus_ring_write(&r, fill, sizeof(fill)) == sizeof(fill) - 2);
+  assert(memcmp(parser->data, tcp_res + 9, 2) == 0);
+
+  TEST_SUCCESS();
+}
+
+#define QUEUE_PRODUCERS 2
+#define QUEUE_FRAMES 20000
+
+static struct modbus_queue queue;
+
+static void*
+queue_producer(void* arg)
+{
+  struct modbus_queue_frame f = { 0 };
+
+  f.slave_addr = (uintptr_t)arg;
+  f.data_len = 2;
+  for (int i = 0; i < QUEUE_FRAMES; i++) {
+    f.addr = i;
+    f.data[0] = i;
+    f.data[1] = i >> 8;
+    while (modbus_queue_push(&queue, &f) != 0)
+      sched_yield();
+  }
+  return NULL;
+}
+
+void
+test_queue(struct modbus_parser* parser,
+           struct modbus_parser_settings* settings)
+{
+  static struct modbus_queue_cell cells[8];
+  static struct modbus_queue_frame out[8];
+  pthread_t threads[QUEUE_PRODUCERS];
+  int next[QUEUE_PRODUCERS] = { 0 };
+  struct modbus_queue_frame f = { 0 };
+  uint8_t read_res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG,
+                         0x04, 0x02,
+                         0x2B, 0x00,
+                         0x64, 0x00,
+                         0x00 };
+  size_t n;
+  int total = 0;
+
+  TEST_START();
+
+  ADD_CRC(read_res);
+
+  assert(modbus_queue_init(&queue, cells, 6) != 0);
+  assert(modbus_queue_init(&queue, cells, 8) == 0);
+  assert(modbus_queue_pop(&queue, out, 8) == 0);
+
+  /* Frame straight from the parser */
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, read_res, sizeof(read_res));
+  assert(modbus_queue_push_parser(&queue, parser) == 0);
+
+  /* Fill the queue */
+  for (int i = 1; i < 8; i++) {
+    f.addr = i;
+    assert(modbus_queue_push(&queue, &f) == 0);
+  }
+  assert(modbus_queue_push(&queue, &f) != 0);
+  f.data_len = MODBUS_QUEUE_MAX_DATA + 1;
+  assert(modbus_queue_push(&queue, &f) != 0);
+
+  assert(modbus_queue_pop(&queue, out, 3) == 3);
+  assert(out[0].slave_addr == 0x11);
+  assert(out[0].function == MODBUS_FUNC_READ_HOLD_REG);
+  assert(out[0].data_len == 4);
+  assert(memcmp(out[0].data, read_res + 3, 4) == 0);
+  assert(out[1].addr == 1 && out[2].addr == 2);
+  assert(modbus_queue_pop(&queue, out, 8) == 5);
+  assert(out[4].addr == 7);
+  assert(modbus_queue_pop(&queue, out, 8) == 0);
+
+  /* Producers race each other, frames of each of them stay in order */
+  for (int i = 0; i < QUEUE_PRODUCERS; i++)
+    pthread_create(&threads[i], NULL, queue_producer, (void*)(uintptr_t)i);
+
+  while (total < QUEUE_PRODUCERS * QUEUE_FRAMES) {
+    n = modbus_queue_pop(&queue, out, 4);
+    if (n == 0)
+      sched_yield();
+    for (size_t i = 0; i < n; i++) {
+      assert(out[i].addr == next[out[i].slave_addr]);
+      assert((out[i].data[0] | out[i].data[1] << 8) == out[i].addr);
+      next[out[i].slave_addr]++;
+    }
+    total += n;
+  }
+
+  for (int i = 0; i < QUEUE_PRODUCERS; i++)
+    pthread_join(threads[i], NULL);
+  assert(modbus_queue_pop(&queue, out, 8) == 0);
+
+  TEST_SUCCESS();
+}
+
+struct changes
+{
+  int n;
+  uint16_t addr[8];
+  uint16_t count[8];
+};
+
+static void
+on_regcache_change(void* arg,
+                   const struct modbus_regcache_block* b,
+                   uint16_t addr,
+                   uint16_t count)
+{
+  struct changes* ch = arg;
+
+  assert(ch->n < 8);
+  ch->addr[ch->n] = addr;
+  ch->count[ch->n] = count;
+  ch->n++;
+}
+
+void
+test_regcache(struct modbus_parser* parser,
+              struct modbus_parser_settings* settings)
+{
+  static struct modbus_regcache c;
+  static struct modbus_regcache_block regs, coils, other;
+  static uint8_t regs_data[MODBUS_TABLE_DATA_SIZE(MODBUS_TABLE_HOLD_REG, 100)];
+  static uint8_t coils_data[MODBUS_TABLE_DATA_SIZE(MODBUS_TABLE_COILS, 20)];
+  static uint64_t regs_dirty[MODBUS_REGCACHE_DIRTY_WORDS(100)];
+  static uint64_t coils_dirty[MODBUS_REGCACHE_DIRTY_WORDS(20)];
+  static uint64_t other_dirty[1];
+  struct changes ch = { 0 };
+  struct modbus_parser wrapped;
+  struct modbus_query q;
+  uint8_t res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG,
+                    0x06, 0x00,
+                    0x00, 0x12,
+                    0x34, 0x00,
+                    0x00, 0x00,
+                    0x00 };
+  uint8_t values[200] = { 0 };
+  uint8_t bits[] = { 0x81, 0x01 };
+  uint16_t addr, count;
+
+  TEST_START();
+
+  assert(modbus_func_table(MODBUS_FUNC_WRITE_COILS) == MODBUS_TABLE_COILS);
+  assert(modbus_func_table(MODBUS_FUNC_READ_IN_REG) == MODBUS_TABLE_IN_REG);
+  assert(modbus_func_table(MODBUS_FUNC_READ_WRITE_REGS) ==
+         MODBUS_TABLE_HOLD_REG);
+  assert(modbus_func_table(7) == -1);
+
+  ADD_CRC(res);
+  modbus_regcache_init(&c);
+  c.on_change = on_regcache_change;
+  c.arg = &ch;
+
+  modbus_regcache_block_init(
+    &regs, 0x11, MODBUS_TABLE_HOLD_REG, 100, 100, regs_data, regs_dirty);
+  modbus_regcache_block_init(
+    &coils, 0x11, MODBUS_TABLE_COILS, 0, 20, coils_data, coils_dirty);
+  assert(modbus_regcache_add(&c, &regs) == 0);
+  assert(modbus_regcache_add(&c, &coils) == 0);
+
+  modbus_regcache_block_init(
+    &other, 0x11, MODBUS_TABLE_HOLD_REG, 90, 11, values, other_dirty);
+  assert(modbus_regcache_add(&c, &other) != 0);
+  assert(modbus_regcache_find(&c, 0x11, MODBUS_TABLE_HOLD_REG, 199) == &regs);
+  assert(modbus_regcache_find(&c, 0x11, MODBUS_TABLE_HOLD_REG, 200) == NULL);
+  assert(modbus_regcache_find(&c, 0x11, MODBUS_TABLE_IN_REG, 100) == NULL);
+
+  /* Initially everything is dirty */
+  addr = 0;
+  assert(modbus_regcache_next_dirty(&regs, &addr, &count) == 1);
+  assert(addr == 100 && count == 100);
+  assert(modbus_regcache_next_dirty(&regs, &addr, &count) == 0);
+
+  /* Response to query of 3 registers at 100, second one changes */
+  modbus_query_init(&q);
+  q.slave_addr = 0x11;
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 100;
+  q.qty = 3;
+
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(modbus_regcache_update_response(&c, parser, &q) == 1);
+  assert(ch.n == 1 && ch.addr[0] == 101 && ch.count[0] == 1);
+  assert(regs_data[2] == 0x12 && regs_data[3] == 0x34);
+
+  /* Same values again */
+  ch.n = 0;
+  assert(modbus_regcache_update_response(&c, parser, &q) == 0);
+  assert(ch.n == 0);
+
+  q.qty = 4;
+  assert(modbus_regcache_update_response(&c, parser, &q) == -1);
+
+  /* Data split by end of a ring, register 101 is in both parts */
+  q.qty = 3;
+  wrapped = *parser;
+  wrapped.data = values;
+  wrapped.data_wrap = values + 100;
+  wrapped.data_wrap_len = 3;
+  values[2] = 0x56;
+  values[100] = 0x78;
+  assert(modbus_regcache_update_response(&c, &wrapped, &q) == 1);
+  assert(ch.n == 1 && ch.addr[0] == 101 && ch.count[0] == 1);
+  assert(regs_data[2] == 0x56 && regs_data[3] == 0x78);
+  values[2] = 0;
+  values[100] = 0;
+  ch.n = 0;
+
+  /* Runs across 4-register lanes and 64-register windows, items before
+   * the block are ignored. Register 101 goes back to 0.
+   */
+  for (int i = 60; i < 140; i++)
+    values[i] = 1;
+  values[190] = 1;
+  assert(modbus_regcache_update(
+           &c, 0x11, MODBUS_TABLE_HOLD_REG, 90, values, 100) == 42);
+  assert(ch.n == 3);
+  assert(ch.addr[0] == 101 && ch.count[0] == 1);
+  assert(ch.addr[1] == 120 && ch.count[1] == 40);
+  assert(ch.addr[2] == 185 && ch.count[2] == 1);
+
+  addr = 0;
+  assert(modbus_regcache_next_dirty(&regs, &addr, &count) == 1);
+  assert(addr == 101 && count == 1);
+  addr += count;
+  assert(modbus_regcache_next_dirty(&regs, &addr, &count) == 1);
+  assert(addr == 120 && count == 40);
+  addr += count;
+  assert(modbus_regcache_next_dirty(&regs, &addr, &count) == 1);
+  assert(addr == 185 && count == 1);
+  addr += count;
+  assert(modbus_regcache_next_dirty(&regs, &addr, &count) == 0);
+
+  /* Coils, not aligned to bytes */
+  addr = 0;
+  while (modbus_regcache_next_dirty(&coils, &addr, &count))
+    ;
+  ch.n = 0;
+  assert(modbus_regcache_update(&c, 0x11, MODBUS_TABLE_COILS, 3, bits, 9) ==
+         3);
+  assert(ch.n == 2);
+  assert(ch.addr[0] == 3 && ch.count[0] == 1);
+  assert(ch.addr[1] == 10 && ch.count[1] == 2);
+  assert(coils_data[0] == 0x08 && coils_data[1] == 0x0C);
+
+  TEST_SUCCESS();
+}
+
+void
+test_poll(void)
+{
+  struct modbus_poll_point points[] = {
+    { 1, MODBUS_FUNC_READ_HOLD_REG, 200, 1, 100 },
+    { 1, MODBUS_FUNC_READ_HOLD_REG, 2, 1, 100 },
+    { 1, MODBUS_FUNC_READ_HOLD_REG, 10, 2, 100 },
+    { 1, MODBUS_FUNC_READ_HOLD_REG, 0, 1, 100 },
+    { 1, MODBUS_FUNC_READ_HOLD_REG, 1, 1, 1000 },
+    { 2, MODBUS_FUNC_READ_IN_REG, 0, 300, 1000 },
+    { 2, MODBUS_FUNC_READ_COILS, 1999, 1, 100 },
+    { 2, MODBUS_FUNC_READ_COILS, 0, 1, 100 },
+  };
+  struct modbus_poll_point bad = { 1, MODBUS_FUNC_WRITE_REG, 0, 1, 100 };
+  struct modbus_poll_request reqs[16];
+  struct modbus_poll_request* r;
+  struct modbus_poll_sched s;
+  int n;
+
+  TEST_START();
+
+  assert(modbus_poll_plan(&bad, 1, 0, reqs, 16) == -1);
+  bad.function = MODBUS_FUNC_READ_HOLD_REG;
+  bad.addr = 0xFFFF;
+  bad.count = 2; /* Past the last address */
+  assert(modbus_poll_plan(&bad, 1, 0, reqs, 16) == -1);
+  bad.count = 1;
+  assert(modbus_poll_plan(&bad, 1, 0, reqs, 16) == 1);
+  bad.period = 0;
+  assert(modbus_poll_plan(&bad, 1, 0, reqs, 16) == -1);
+  assert(modbus_poll_plan(points, 8, 5, reqs, 4) == -1);
+
+  n = modbus_poll_plan(points, 8, 5, reqs, 16);
+  assert(n == 9);
+
+  /* Sorted by slave, function, period and address */
+  assert(reqs[0].query.function == MODBUS_FUNC_READ_HOLD_REG);
+  assert(reqs[0].query.addr == 0 && reqs[0].query.qty == 3);
+  assert(reqs[1].query.addr == 10 && reqs[1].query.qty == 2);
+  assert(reqs[2].query.addr == 200 && reqs[2].query.qty == 1);
+  assert(reqs[3].query.addr == 1 && reqs[3].period == 1000);
+  assert(reqs[4].query.function == MODBUS_FUNC_READ_COILS);
+  assert(reqs[4].query.addr == 0 && reqs[4].query.qty == 1);
+  assert(reqs[5].query.addr == 1999 && reqs[5].query.qty == 1);
+
+  /* Split at protocol limit */
+  assert(reqs[6].query.function == MODBUS_FUNC_READ_IN_REG);
+  assert(reqs[6].query.addr == 0 && reqs[6].query.qty == 125);
+  assert(reqs[7].query.addr == 125 && reqs[7].query.qty == 125);
+  assert(reqs[8].query.addr == 250 && reqs[8].query.qty == 50);
+
+  /* Large gap, registers merge up to 125 and coils up to 2000 */
+  n = modbus_poll_plan(points, 8, 2000, reqs, 16);
+  assert(n == 7);
+  assert(reqs[0].query.addr == 0 && reqs[0].query.qty == 12);
+  assert(reqs[1].query.addr == 200 && reqs[1].query.qty == 1);
+  assert(reqs[3].query.function == MODBUS_FUNC_READ_COILS);
+  assert(reqs[3].query.addr == 0 && reqs[3].query.qty == 2000);
+
+  /* Schedule */
+  modbus_poll_plan(points, 8, 5, reqs, 16);
+  modbus_poll_sched_init(&s, reqs, 3, 0);
+  assert(modbus_poll_next(&s, 0) == &reqs[0]);
+  assert(modbus_poll_next(&s, 0) == &reqs[1]);
+  assert(modbus_poll_next(&s, 0) == &reqs[2]);
+  assert(modbus_poll_next(&s, 0) == NULL);
+  assert(modbus_poll_next_due(&s) == 100);
+
+  /* Late by more than a period, polled once */
+  r = modbus_poll_next(&s, 350);
+  assert(r == &reqs[0] && r->next_due == 450);
+
+  TEST_SUCCESS();
+}
+
+void
+test_writeq(void)
+{
+  static struct modbus_writeq w;
+  struct modbus_writeq_slot slots[2];
+  struct modbus_query read = {.slave_addr = 0x11,
+                              .function = MODBUS_FUNC_READ_HOLD_REG,
+                              .addr = 0x100,
+                              .qty = 4 };
+  struct modbus_query q;
+  uint8_t buf[64];
+  int n;
+
+  TEST_START();
+
+  modbus_writeq_init(&w, slots, 2);
+  assert(modbus_writeq_next_due(&w) == UINT64_MAX);
+
+  /* Burst of single writes, in any order */
+  assert(modbus_writeq_reg(&w, 0x11, 11, 0x0B, 100) == 0);
+  assert(modbus_writeq_reg(&w, 0x11, 10, 0x0A, 200) == 0);
+  assert(modbus_writeq_reg(&w, 0x11, 14, 0x0E, 300) == 0);
+  assert(modbus_writeq_reg(&w, 0x11, 12, 0xFF, 300) == 0);
+  assert(modbus_writeq_reg(&w, 0x11, 12, 0x0C, 300) == 0);
+  assert(modbus_writeq_reg(&w, 0x12, 0, 1, 300) == -1); /* No slot */
+
+  /* Fills the gap, both slots are joined */
+  assert(modbus_writeq_reg(&w, 0x11, 13, 0x0D, 300) == 0);
+  assert(modbus_writeq_next_due(&w) == 100);
+
+  assert(modbus_writeq_flush(&w, 99, NULL, &q, buf, sizeof(buf)) == 0);
+  n = modbus_writeq_flush(&w, 100, NULL, &q, buf, sizeof(buf));
+  assert(n == 9 + 5 * 2);
+  assert(q.function == MODBUS_FUNC_WRITE_REGS);
+  assert(buf[1] == MODBUS_FUNC_WRITE_REGS);
+  ASSERT_WORD(&buf[2], 10);
+  ASSERT_WORD(&buf[4], 5);
+  assert(buf[6] == 10);
+  for (int i = 0; i < 5; i++)
+    ASSERT_WORD(&buf[7 + i * 2], (10 + i));
+  ASSERT_QUERY_CRC(buf, n);
+  assert(modbus_writeq_flush(&w, UINT64_MAX, NULL, &q, buf, sizeof(buf)) == 0);
+
+  /* Single write */
+  assert(modbus_writeq_reg(&w, 0x11, 7, 0x1234, 100) == 0);
+  n = modbus_writeq_flush(&w, 100, NULL, &q, buf, sizeof(buf));
+  assert(n == 8 && buf[1] == MODBUS_FUNC_WRITE_REG);
+  ASSERT_WORD(&buf[4], 0x1234);
+
+  /* Coils */
+  assert(modbus_writeq_coil(&w, 0x11, 4, false, 100) == 0);
+  assert(modbus_writeq_coil(&w, 0x11, 3, true, 100) == 0);
+  assert(modbus_writeq_coil(&w, 0x11, 5, true, 100) == 0);
+  n = modbus_writeq_flush(&w, 100, NULL, &q, buf, sizeof(buf));
+  assert(n == 10 && buf[1] == MODBUS_FUNC_WRITE_COILS);
+  ASSERT_WORD(&buf[2], 3);
+  ASSERT_WORD(&buf[4], 3);
+  assert(buf[6] == 1 && buf[7] == 0x05);
+  ASSERT_QUERY_CRC(buf, n);
+
+  assert(modbus_writeq_coil(&w, 0x11, 3, true, 100) == 0);
+  n = modbus_writeq_flush(&w, 100, NULL, &q, buf, sizeof(buf));
+  assert(n == 8 && buf[1] == MODBUS_FUNC_WRITE_COIL);
+  ASSERT_WORD(&buf[4], MODBUS_COIL_HIGH);
+
+  /* Write which is not due rides along with read */
+  assert(modbus_writeq_reg(&w, 0x11, 0x20, 0xABCD, 1000) == 0);
+  n = modbus_writeq_flush(&w, 0, &read, &q, buf, sizeof(buf));
+  assert(n == 13 + 2);
+  assert(q.function == MODBUS_FUNC_READ_WRITE_REGS);
+  assert(buf[1] == MODBUS_FUNC_READ_WRITE_REGS);
+  ASSERT_WORD(&buf[2], 0x100);
+  ASSERT_WORD(&buf[4], 4);
+  ASSERT_WORD(&buf[6], 0x20);
+  ASSERT_WORD(&buf[8], 1);
+  assert(buf[10] == 2);
+  ASSERT_WORD(&buf[11], 0xABCD);
+  ASSERT_QUERY_CRC(buf, n);
+  assert(modbus_frame_len(MODBUS_QUERY, buf, n) == n);
+  assert(modbus_writeq_flush(&w, 0, &read, &q, buf, sizeof(buf)) == 0);
+
+  TEST_SUCCESS();
+}
+
+/* Parse query of n bytes in framing f and reply to it */
+static int
+slave_serve(struct modbus_slave* slave,
+            enum modbus_framing f,
+            const uint8_t* query,
+            size_t n,
+            uint8_t* reply,
+            size_t sz)
+{
+  struct modbus_parser_settings quiet;
+  struct modbus_parser parser = { 0 };
+
+  modbus_parser_settings_init(&quiet);
+  modbus_parser_init_framing(&parser, MODBUS_QUERY, f);
+  assert(modbus_parser_execute(&parser, &quiet, query, n) == n);
+  assert(parser.state == s_complete);
+  return modbus_slave_reply(slave, &parser, reply, sz);
+}
+
+/* Generate RTU query and reply to it */
+static int
+slave_query(struct modbus_slave* slave,
+            struct modbus_query* q,
+            uint8_t* reply,
+            size_t sz)
+{
+  uint8_t buf[MODBUS_MAX_DATA_LEN + 16];
+  int n = modbus_gen_query(q, buf, sizeof(buf));
+
+  assert(n > 0);
+  return slave_serve(slave, MODBUS_FRAMING_RTU, buf, n, reply, sz);
+}
+
+/* Check that reply parses as response without errors */
+static void
+slave_check_reply(enum modbus_framing f, const uint8_t* reply, int n)
+{
+  struct modbus_parser_settings quiet;
+  struct modbus_parser parser = { 0 };
+
+  assert(n > 0);
+  modbus_parser_settings_init(&quiet);
+  modbus_parser_init_framing(&parser, MODBUS_RESPONSE, f);
+  assert(modbus_parser_execute(&parser, &quiet, reply, n) == (size_t)n);
+  assert(parser.state == s_complete && parser.errno == 0);
+}
+
+void
+test_slave(void)
+{
+  static uint8_t hold[2 * 100];
+  static uint8_t in[2 * 10];
+  static uint8_t coils[MODBUS_TABLE_DATA_SIZE(MODBUS_TABLE_COILS, 20)];
+  struct modbus_slave_store store;
+  struct modbus_slave slave;
+  struct modbus_query q;
+  uint16_t data[4] = { 0x1234, 0xABCD, 0x0001, 0x0002 };
+  uint16_t coil = MODBUS_COIL_HIGH;
+  uint8_t reply[MODBUS_SLAVE_REPLY_SIZE];
+  uint8_t buf[64];
+  int n;
+
+  TEST_START();
+
+  for (int i = 0; i < 100; i++) {
+    hold[2 * i] = i >> 8;
+    hold[2 * i + 1] = i & 0xFF;
+  }
+  coils[0] = 0xA5;
+  coils[1] = 0x0F;
+
+  modbus_slave_store_init(&store);
+  modbus_slave_store_table(&store, MODBUS_TABLE_HOLD_REG, hold, 100);
+  modbus_slave_store_table(&store, MODBUS_TABLE_IN_REG, in, 10);
+  modbus_slave_store_table(&store, MODBUS_TABLE_COILS, coils, 20);
+  modbus_slave_init(&slave);
+  modbus_slave_attach(&slave, 0x11, &store);
+  modbus_slave_attach(&slave, 0x12, &store);
+
+  /* Read registers */
+  modbus_query_init(&q);
+  q.slave_addr = 0x11;
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 0x0010;
+  q.qty = 3;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 3 + 6 + 2);
+  assert(reply[0] == 0x11 && reply[1] == q.function && reply[2] == 6);
+  assert(UINT16(reply[3]) == 0x10 && UINT16(reply[7]) == 0x12);
+  slave_check_reply(MODBUS_FRAMING_RTU, reply, n);
+
+  /* Coils at unaligned address */
+  q.slave_addr = 0x12;
+  q.function = MODBUS_FUNC_READ_COILS;
+  q.addr = 3;
+  q.qty = 10;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 3 + 2 + 2 && reply[0] == 0x12 && reply[2] == 2);
+  assert(reply[3] == 0xF4 && reply[4] == 0x01);
+  slave_check_reply(MODBUS_FRAMING_RTU, reply, n);
+
+  /* Writes, shared by both addresses */
+  q.function = MODBUS_FUNC_WRITE_REGS;
+  q.addr = 98;
+  q.qty = 2;
+  q.data = data;
+  q.data_len = 2;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 8 && UINT16(reply[2]) == 98 && UINT16(reply[4]) == 2);
+  assert(hold[196] == 0x12 && hold[199] == 0xCD);
+
+  q.function = MODBUS_FUNC_WRITE_COIL;
+  q.addr = 19;
+  q.data = &coil;
+  q.data_len = 1;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 8 && UINT16(reply[4]) == MODBUS_COIL_HIGH);
+  assert(coils[2] == 0x08);
+
+  q.slave_addr = 0x11;
+  q.function = MODBUS_FUNC_READ_WRITE_REGS;
+  q.addr = 0;
+  q.qty = 2;
+  q.write_addr = 1;
+  q.data = &data[2];
+  q.data_len = 2;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 3 + 4 + 2 && UINT16(reply[3]) == 0 && UINT16(reply[5]) == 1);
+  assert(hold[3] == 0x01 && hold[5] == 0x02);
+  slave_check_reply(MODBUS_FRAMING_RTU, reply, n);
+
+  /* Exceptions */
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 99;
+  q.qty = 2;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 5 && reply[1] == (q.function | MODBUS_EXCEPTION_BIT));
+  assert(reply[2] == MODBUS_EXC_ILLEGAL_DATA_ADDRESS);
+  slave_check_reply(MODBUS_FRAMING_RTU, reply, n);
+
+  q.addr = 0;
+  q.qty = 126;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 5 && reply[2] == MODBUS_EXC_ILLEGAL_DATA_VALUE);
+
+  q.function = MODBUS_FUNC_READ_DISCRETE_IN;
+  q.qty = 1;
+  n = slave_query(&slave, &q, reply, sizeof(reply));
+  assert(n == 5 && reply[2] == MODBUS_EXC_ILLEGAL_FUNCTION);
+  assert(slave.requests == 8 && slave.exceptions == 3);
+
+  /* Buffer too small */
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.qty = 10;
+  assert(slave_query(&slave, &q, reply, 10) == -1);
+
+  /* Unknown slave and broadcast */
+  q.slave_addr = 0x13;
+  assert(slave_query(&slave, &q, reply, sizeof(reply)) == 0);
+  q.slave_addr = 0;
+  q.function = MODBUS_FUNC_WRITE_REG;
+  q.addr = 50;
+  q.data = data;
+  q.data_len = 1;
+  assert(slave_query(&slave, &q, reply, sizeof(reply)) == 0);
+  assert(hold[100] == 0x12 && hold[101] == 0x34);
+
+  /* TCP keeps transaction id, unit id 0 is not broadcast */
+  modbus_slave_attach(&slave, 0, &store);
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 50;
+  q.qty = 1;
+  n = modbus_gen_query_tcp(&q, 0x0102, buf, sizeof(buf));
+  n = slave_serve(&slave, MODBUS_FRAMING_TCP, buf, n, reply, sizeof(reply));
+  assert(n == 6 + 5 && UINT16(reply[0]) == 0x0102 && UINT16(reply[4]) == 5);
+  assert(UINT16(reply[9]) == 0x1234);
+  slave_check_reply(MODBUS_FRAMING_TCP, reply, n);
+
+  q.slave_addr = 0x11;
+  n = modbus_gen_query_ascii(&q, buf, sizeof(buf));
+  n = slave_serve(&slave, MODBUS_FRAMING_ASCII, buf, n, reply, sizeof(reply));
+  assert(n == 1 + 2 * 6 + 2 && reply[0] == ':');
+  slave_check_reply(MODBUS_FRAMING_ASCII, reply, n);
+
+  TEST_SUCCESS();
+}
+
+#ifdef MODBUS_BUILD_SHM
+#define SHM_UPDATES 50000
+
+/* Writes all 10 registers of block at 200 with the same value */
+static void*
+shm_writer(void* arg)
+{
+  struct modbus_shm* shm = arg;
+  uint8_t regs[20];
+
+  for (int k = 1; k <= SHM_UPDATES; k++) {
+    for (int i = 0; i < 10; i++) {
+      regs[2 * i] = k >> 8;
+      regs[2 * i + 1] = k & 0xFF;
+    }
+    modbus_shm_update(shm, 0x11, MODBUS_TABLE_HOLD_REG, 200, regs, 10);
+  }
+  return NULL;
+}
+
+void
+test_shm(void)
+{
+  static const struct modbus_shm_def defs[] = {
+    { 0x11, MODBUS_TABLE_COILS, 0, 20 },
+    { 0x11, MODBUS_TABLE_HOLD_REG, 0, 100 },
+    { 0x11, MODBUS_TABLE_HOLD_REG, 200, 10 },
+    { 0x12, MODBUS_TABLE_IN_REG, 0, 4 },
+  };
+  static const struct modbus_shm_def overlap[] = {
+    { 0x11, MODBUS_TABLE_HOLD_REG, 0, 100 },
+    { 0x11, MODBUS_TABLE_HOLD_REG, 99, 10 },
+  };
+  struct modbus_parser_settings quiet;
+  struct modbus_parser parser = { 0 };
+  struct modbus_parser wrapped;
+  struct modbus_shm shm, reader;
+  struct modbus_query q;
+  pthread_t thread;
+  uint8_t res[] = { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0x06, 0x12, 0x34,
+                    0xAB, 0xCD, 0x00, 0x01, 0x00, 0x00 };
+  uint8_t split[] = { 0x56, 0x78, 0x9A, 0xFF, 0xFF, 0xFF };
+  uint8_t tail[] = { 0xBC, 0xDE, 0xF0 };
+  uint8_t bits[] = { 0x05 };
+  uint8_t out[200];
+  uint32_t seq, prev;
+  int pipe_fd[2];
+  int snapshots = 0;
+
+  TEST_START();
+
+  assert(modbus_shm_create(&shm, "test", overlap, 2) == -1);
+  assert(modbus_shm_create(&shm, "test", defs + 1, 3) == 0);
+  modbus_shm_close(&shm);
+  assert(modbus_shm_create(&shm, "test", defs, 4) == 0);
+
+  /* Another mapping of the same memory, as in a reader process */
+  assert(modbus_shm_open(&reader, dup(shm.fd)) == 0);
+  assert(reader.nblocks == 4);
+  assert(modbus_shm_find(&reader, 0x11, MODBUS_TABLE_HOLD_REG, 99) == 1);
+  assert(modbus_shm_find(&reader, 0x11, MODBUS_TABLE_HOLD_REG, 100) == -1);
+  assert(modbus_shm_find(&reader, 0x11, MODBUS_TABLE_HOLD_REG, 209) == 2);
+  assert(modbus_shm_find(&reader, 0x12, MODBUS_TABLE_IN_REG, 0) == 3);
+  assert(modbus_shm_find(&reader, 0x12, MODBUS_TABLE_HOLD_REG, 0) == -1);
+
+  /* Response overlapping the end of a block */
+  ADD_CRC(res);
+  modbus_parser_settings_init(&quiet);
+  modbus_parser_init(&parser, MODBUS_RESPONSE);
+  modbus_parser_execute(&parser, &quiet, res, sizeof(res));
+  modbus_query_init(&q);
+  q.slave_addr = 0x11;
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 98;
+  q.qty = 3;
+  prev = modbus_shm_seq(&reader, 1);
+  assert(modbus_shm_update_response(&shm, &parser, &q) == 2);
+  seq = modbus_shm_read(&reader, 1, out);
+  assert(seq == prev + 2 && reader.blocks[1].updates == 1);
+  assert(memcmp(out + 196, res + 3, 4) == 0 && out[0] == 0);
+  q.qty = 4;
+  assert(modbus_shm_update_response(&shm, &parser, &q) == -1);
+
+  /* Data split by end of a ring, register 99 is in both parts */
+  q.qty = 3;
+  wrapped = parser;
+  wrapped.data = split;
+  wrapped.data_wrap = tail;
+  wrapped.data_wrap_len = 3;
+  assert(modbus_shm_update_response(&shm, &wrapped, &q) == 2);
+  modbus_shm_read(&reader, 1, out);
+  assert(memcmp(out + 196, split, 3) == 0 && out[199] == 0xBC);
+
+  /* Bits at an offset */
+  assert(modbus_shm_update(&shm, 0x11, MODBUS_TABLE_COILS, 9, bits, 3) == 3);
+  modbus_shm_read(&reader, 0, out);
+  assert(out[0] == 0x00 && out[1] == 0x0A && out[2] == 0x00);
+
+  /* Snapshots taken during updates are never torn */
+  pthread_create(&thread, NULL, shm_writer, &shm);
+  do {
+    seq = modbus_shm_read(&reader, 2, out);
+    for (int i = 1; i < 10; i++)
+      assert(out[2 * i] == out[0] && out[2 * i + 1] == out[1]);
+    snapshots++;
+  } while ((out[0] << 8 | out[1]) != SHM_UPDATES);
+  pthread_join(thread, NULL);
+  printf("%d snapshots during %d updates\n", snapshots, SHM_UPDATES);
+  assert(seq == 2 * SHM_UPDATES);
+
+  /* Not an image */
+  assert(pipe(pipe_fd) == 0);
+  assert(modbus_shm_open(&reader, pipe_fd[0]) == -1);
+  close(pipe_fd[0]);
+  close(pipe_fd[1]);
+
+  modbus_shm_close(&reader);
+  modbus_shm_close(&shm);
+
+  TEST_SUCCESS();
+}
+#endif
+
+struct traffic_counts
+{
+  int complete;
+  int exceptions;
+  int crc_errors;
+};
+
+static int
+traffic_on_complete(modbus_parser* parser)
+{
+  struct traffic_counts* c = parser->arg;
+
+  c->complete++;
+  c->exceptions += (parser->function & MODBUS_EXCEPTION_BIT) != 0;
+  return 0;
+}
+
+static int
+traffic_on_crc_error(modbus_parser* parser)
+{
+  ((struct traffic_counts*)parser->arg)->crc_errors++;
+  return 0;
+}
+
+/* Parse frames of config, return what the parser saw */
+static struct traffic_counts
+traffic_parse(const struct modbus_traffic_config* config,
+              int frames,
+              struct modbus_traffic* t)
+{
+  static uint8_t stream[1 << 20];
+  struct traffic_counts c = { 0 };
+  struct modbus_parser_settings settings;
+  struct modbus_parser parser = { 0 };
+  size_t len = 0;
+  int n;
+
+  assert(modbus_traffic_init(t, config) == 0);
+  for (int i = 0; i < frames; i++) {
+    n = modbus_traffic_next(t, stream + len, sizeof(stream) - len);
+    assert(n > 0);
+    len += n;
+  }
+
+  modbus_parser_settings_init(&settings);
+  settings.on_complete = traffic_on_complete;
+  settings.on_crc_error = traffic_on_crc_error;
+  parser.arg = &c;
+  for (size_t pos = 0; pos < len;) {
+    modbus_parser_init_framing(&parser, config->type, config->framing);
+    pos += modbus_parser_execute(&parser, &settings, stream + pos, len - pos);
+  }
+  return c;
+}
+
+void
+test_traffic(void)
+{
+  static uint8_t a[1 << 16];
+  static uint8_t b[1 << 16];
+  static const enum modbus_framing framings[] = {
+    MODBUS_FRAMING_RTU, MODBUS_FRAMING_TCP, MODBUS_FRAMING_ASCII
+  };
+  struct modbus_traffic_config config;
+  struct modbus_traffic t;
+  struct traffic_counts c;
+  size_t chunk;
+  size_t len = 0;
+  size_t n;
+
+  TEST_START();
+
+  modbus_traffic_config_init(&config);
+  config.weight[7] = 1; /* No generator for FC 7 */
+  assert(modbus_traffic_init(&t, &config) == -1);
+  memset(config.weight, 0, sizeof(config.weight));
+  assert(modbus_traffic_init(&t, &config) == -1);
+
+  /* Same stream whatever the buffer sizes are */
+  modbus_traffic_config_init(&config);
+  config.seed = 1234;
+  config.exception_ppm = 100000;
+  config.crc_error_ppm = 50000;
+  config.drop_ppm = 10000;
+  assert(modbus_traffic_init(&t, &config) == 0);
+  n = modbus_traffic_fill(&t, a, sizeof(a));
+  assert(n > sizeof(a) - MODBUS_TRAFFIC_MAX_FRAME && t.bytes > n);
+  assert(modbus_traffic_init(&t, &config) == 0);
+  while (len < n) {
+    chunk = MODBUS_TRAFFIC_MAX_FRAME + len % 700;
+    if (chunk > sizeof(b) - len)
+      chunk = sizeof(b) - len;
+    len += modbus_traffic_fill(&t, b + len, chunk);
+  }
+  assert(len == n && memcmp(a, b, n) == 0);
+
+  config.seed = 1235;
+  assert(modbus_traffic_init(&t, &config) == 0);
+  modbus_traffic_fill(&t, b, sizeof(b));
+  assert(memcmp(a, b, 64) != 0);
+
+  /* Parser sees exactly what was generated, frames with CRC error are
+   * complete too
+   */
+  config.drop_ppm = 0;
+  for (int i = 0; i < 3; i++) {
+    config.framing = framings[i];
+    config.type = MODBUS_RESPONSE;
+    c = traffic_parse(&config, 5000, &t);
+    printf("framing %d: %d complete, %d exceptions, %d CRC errors\n",
+           config.framing,
+           c.complete,
+           c.exceptions,
+           c.crc_errors);
+    assert(c.complete == t.frames && c.crc_errors == t.crc_errors);
+    assert(t.exceptions > 0 && c.exceptions == t.exceptions);
+    assert((config.framing == MODBUS_FRAMING_TCP) == (t.crc_errors == 0));
+
+    config.type = MODBUS_QUERY;
+    c = traffic_parse(&config, 5000, &t);
+    assert(c.complete == t.frames && c.crc_errors == t.crc_errors);
+    assert(t.exceptions == 0);
+  }
+
+  /* Dropped bytes cost a few frames each to resync */
+  config.framing = MODBUS_FRAMING_RTU;
+  config.type = MODBUS_RESPONSE;
+  config.crc_error_ppm = 0;
+  config.drop_ppm = 20000;
+  c = traffic_parse(&config, 5000, &t);
+  printf("%d drops: %d complete\n", (int)t.drops, c.complete);
+  assert(t.drops > 0 && c.complete < t.frames);
+  assert(c.complete > t.frames - 4 * t.drops);
+
+  /* TCP framing never drops bytes */
+  config.framing = MODBUS_FRAMING_TCP;
+  c = traffic_parse(&config, 5000, &t);
+  assert(t.drops == 0 && c.complete == t.frames);
+
+  TEST_SUCCESS();
+}
+
+struct demux_counts
+{
+  uint8_t slave_addr; /* Of frames the slave gets, 0 = broadcast */
+  int complete;
+  int wrong;
+};
+
+static int
+demux_on_complete(modbus_parser* parser)
+{
+  struct demux_counts* c = parser->arg;
+
+  c->complete++;
+  if (parser->slave_addr != c->slave_addr)
+    c->wrong++;
+  return 0;
+}
+
+void
+test_demux(void)
+{
+  static uint8_t stream[1 << 16];
+  static const uint8_t garbage[] = { 0x00, 0x05, 0x00 };
+  uint8_t write_reg[] = { 0x00, 0x06, 0x00, 0x10, 0x12, 0x34, HEX(0) };
+  uint8_t read_regs[] = { 0x07, 0x03, 0x00, 0x10, 0x00, 0x02, HEX(0) };
+  uint8_t other[] = { 0x09, 0x03, 0x00, 0x10, 0x00, 0x02, HEX(0) };
+  struct modbus_traffic_config config;
+  struct modbus_traffic t;
+  struct modbus_parser_settings settings;
+  struct modbus_demux d;
+  struct demux_counts c[2];
+  int expected[2] = { 0 };
+  int skipped = 0;
+  size_t completed;
+  size_t chunk;
+  size_t len;
+  int n;
+
+  TEST_START();
+
+  modbus_parser_settings_init(&settings);
+  settings.on_complete = demux_on_complete;
+
+  /* Responses of 16 slaves, 3 and 7 are watched */
+  modbus_traffic_config_init(&config);
+  config.seed = 4321;
+  config.exception_ppm = 100000;
+  assert(modbus_traffic_init(&t, &config) == 0);
+  memcpy(stream, garbage, sizeof(garbage));
+  len = sizeof(garbage) + modbus_traffic_fill(&t, stream + sizeof(garbage),
+                                              sizeof(stream) - sizeof(garbage));
+  for (size_t pos = sizeof(garbage); pos < len; pos += n) {
+    n = modbus_frame_len(MODBUS_RESPONSE, stream + pos, len - pos);
+    assert(n > 0);
+    if (stream[pos] == 3)
+      expected[0]++;
+    else if (stream[pos] == 7)
+      expected[1]++;
+    else
+      skipped++;
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    memset(c, 0, sizeof(c));
+    c[0].slave_addr = 3;
+    c[1].slave_addr = 7;
+    modbus_demux_init(&d, MODBUS_RESPONSE);
+    modbus_demux_attach(&d, 3, &settings, &c[0]);
+    modbus_demux_attach(&d, 7, &settings, &c[1]);
+
+    /* Whole stream, then in chunks splitting frames and garbage */
+    completed = 0;
+    for (size_t pos = 0; pos < len; pos += chunk) {
+      chunk = pass == 0 ? len : 1 + pos % 37;
+      if (chunk > len - pos)
+        chunk = len - pos;
+      completed += modbus_demux_execute(&d, stream + pos, chunk);
+    }
+
+    assert(c[0].complete == expected[0] && c[1].complete == expected[1]);
+    assert(c[0].wrong == 0 && c[1].wrong == 0);
+    assert(d.frames == (uint64_t)(expected[0] + expected[1]));
+    assert(d.skipped == (uint64_t)skipped && d.broadcasts == 0);
+    assert(completed == (size_t)(expected[0] + expected[1] + skipped));
+    assert(d.resyncs == sizeof(garbage));
+  }
+  printf("%d + %d frames parsed, %d skipped\n", expected[0], expected[1],
+         skipped);
+
+  /* Broadcast query reaches every slave with its arg */
+  ADD_CRC(write_reg);
+  ADD_CRC(read_regs);
+  ADD_CRC(other);
+  memcpy(stream, write_reg, sizeof(write_reg));
+  memcpy(stream + 8, read_regs, sizeof(read_regs));
+  memcpy(stream + 16, other, sizeof(other));
+
+  memset(c, 0, sizeof(c));
+  modbus_demux_init(&d, MODBUS_QUERY);
+  modbus_demux_attach(&d, 3, &settings, &c[0]);
+  modbus_demux_attach(&d, 7, &settings, &c[1]);
+  assert(modbus_demux_execute(&d, stream, 24) == 3);
+  assert(c[0].complete == 1 && c[0].wrong == 0);
+  assert(c[1].complete == 2 && c[1].wrong == 1); /* Broadcast is to 0 */
+  assert(d.broadcasts == 1 && d.frames == 1 && d.skipped == 1);
+
+  /* Not parsed if nobody listens */
+  modbus_demux_attach(&d, 3, NULL, NULL);
+  modbus_demux_attach(&d, 7, NULL, NULL);
+  assert(modbus_demux_execute(&d, stream, 24) == 3);
+  assert(d.broadcasts == 1 && d.skipped == 4 && d.skipped_bytes == 32);
+
+  /* Watched address followed by unknown function is a resync, like for
+   * other slaves. Function byte 7 starts the next frame, whole or split.
+   */
+  stream[0] = 3;
+  memcpy(stream + 1, read_regs, sizeof(read_regs));
+  for (int pass = 0; pass < 2; pass++) {
+    memset(c, 0, sizeof(c));
+    c[0].slave_addr = 3;
+    c[1].slave_addr = 7;
+    modbus_demux_init(&d, MODBUS_QUERY);
+    modbus_demux_attach(&d, 3, &settings, &c[0]);
+    modbus_demux_attach(&d, 7, &settings, &c[1]);
+    completed = 0;
+    for (size_t pos = 0; pos < 9; pos += chunk) {
+      chunk = pass == 0 ? 9 : 1;
+      completed += modbus_demux_execute(&d, stream + pos, chunk);
+    }
+    assert(completed == 1 && d.frames == 1 && d.resyncs == 1);
+    assert(c[0].complete == 0 && c[1].complete == 1 && c[1].wrong == 0);
+  }
+
+  TEST_SUCCESS();
+}
+
+void
+test_convert(struct modbus_parser* parser,
+             struct modbus_parser_settings* settings)
+{
+  const struct modbus_conv_desc desc[] = {
+    { MODBUS_CONV_I16, MODBUS_ORDER_ABCD, 2, 0.1f, 0 },
+    { MODBUS_CONV_U16, MODBUS_ORDER_DCBA, 1, 1, -1 },
+    { MODBUS_CONV_SKIP, MODBUS_ORDER_ABCD, 1, 1, 0 },
+    { MODBUS_CONV_F32, MODBUS_ORDER_CDAB, 1, 1, 0 },
+    { MODBUS_CONV_I32, MODBUS_ORDER_DCBA, 1, 1, 0 },
+    { MODBUS_CONV_U32, MODBUS_ORDER_BADC, 1, 1, 0 },
+    { MODBUS_CONV_I64, MODBUS_ORDER_ABCD, 1, 1, 0 },
+    { MODBUS_CONV_F64, MODBUS_ORDER_CDAB, 1, 2, 0 },
+    { MODBUS_CONV_U16, MODBUS_ORDER_ABCD, 10, 1, 0 },
+  };
+  /* Same payload to fixed point */
+  const struct modbus_conv_fixed fixed[] = {
+    { MODBUS_CONV_I16, MODBUS_ORDER_ABCD, 1, 2, 1, 0 },
+    { MODBUS_CONV_U16, MODBUS_ORDER_DCBA, 0, 1, 1, -1 },
+    { MODBUS_CONV_SKIP, MODBUS_ORDER_ABCD, 0, 1, 1, 0 },
+    { MODBUS_CONV_F32, MODBUS_ORDER_CDAB, 0, 1, 10, 0 },
+    { MODBUS_CONV_I32, MODBUS_ORDER_DCBA, 4, 1, 3, 0 },
+    { MODBUS_CONV_U32, MODBUS_ORDER_BADC, 0, 1, 1, 0 },
+    { MODBUS_CONV_I64, MODBUS_ORDER_ABCD, 0, 1, 1, 5 },
+    { MODBUS_CONV_F64, MODBUS_ORDER_CDAB, 0, 1, 2, 0 },
+    { MODBUS_CONV_U16, MODBUS_ORDER_ABCD, 0, 10, 65536, 0 },
+  };
+  /* 64-bit values which double can't hold */
+  const struct modbus_conv_fixed wide[] = {
+    { MODBUS_CONV_U64, MODBUS_ORDER_ABCD, 0, 1, 1, 0 },
+    { MODBUS_CONV_I64, MODBUS_ORDER_DCBA, 0, 1, 1, 0 },
+  };
+  const uint8_t wide_data[] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFD, /* UINT64_MAX - 2 */
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, /* 2^53 + 1, LE */
+  };
+  /* Floats which don't fit int64_t */
+  const struct modbus_conv_fixed special[] = {
+    { MODBUS_CONV_F32, MODBUS_ORDER_ABCD, 0, 3, 1, 0 },
+    { MODBUS_CONV_F64, MODBUS_ORDER_ABCD, 0, 1, 1, 0 },
+  };
+  const uint8_t special_data[] = {
+    0x7F, 0xC0, 0x00, 0x00,                         /* NaN */
+    0xFF, 0x80, 0x00, 0x00,                         /* -Inf */
+    0x5F, 0x00, 0x00, 0x00,                         /* 2^63 */
+    0x44, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 2^65 */
+  };
+  struct modbus_conv_fixed bad_shift = { MODBUS_CONV_U16, 0, 64, 1, 1, 0 };
+  int64_t fout[16];
+  uint8_t res[] = {
+    0x11, MODBUS_FUNC_READ_HOLD_REG, 39,
+    0xFF, 0xFE,                                     /* -2 */
+    0x00, 0x0A,                                     /* 10 */
+    0xF4, 0x01,                                     /* 500, little-endian */
+    0xDE, 0xAD,                                     /* skipped */
+    0x00, 0x00, 0x3F, 0xC0,                         /* 1.5f, word swapped */
+    0x60, 0x79, 0xFE, 0xFF,                         /* -100000, LE */
+    0x34, 0x12, 0x78, 0x56,                         /* 0x12345678, byte swapped */
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, /* -2 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x09, /* 3.125, word swapped */
+    0x00, 0x07,                                     /* 7 */
+    0x00,                                           /* Not a whole value */
+    0x00, 0x00
+  };
+  double out[16];
+  size_t n;
+
+  TEST_START();
+
+  ADD_CRC(res);
+  modbus_parser_init(parser, MODBUS_RESPONSE);
+  modbus_parser_execute(parser, settings, res, sizeof(res));
+  assert(parser->errno == 0);
+
+  n = modbus_convert_response(desc, 9, parser, out);
+  assert(n == 9);
+  assert(out[0] > -0.2001 && out[0] < -0.1999);
+  assert(out[1] > 0.9999 && out[1] < 1.0001);
+  assert(out[2] == 499);
+  assert(out[3] == 1.5);
+  assert(out[4] == -100000);
+  assert(out[5] == 0x12345678);
+  assert(out[6] == -2);
+  assert(out[7] == 6.25);
+  assert(out[8] == 7);
+
+  assert(modbus_convert(desc, 9, res + 3, 4, out) == 2);
+  assert(modbus_conv_width(MODBUS_CONV_F64) == 4);
+
+  n = modbus_convert_fixed_response(fixed, 9, parser, fout);
+  assert(n == 9);
+  assert(fout[0] == -1 && fout[1] == 5); /* Shift rounds down */
+  assert(fout[2] == 499);
+  assert(fout[3] == 15);
+  assert(fout[4] == -18750); /* -100000 * 3 / 16 */
+  assert(fout[5] == 0x12345678);
+  assert(fout[6] == 3);
+  assert(fout[7] == 6);
+  assert(fout[8] == 7 * 65536);
+
+  assert(modbus_convert_fixed(wide, 2, wide_data, sizeof(wide_data), fout) ==
+         2);
+  assert((uint64_t)fout[0] == UINT64_MAX - 2);
+  assert(fout[1] == (1ll << 53) + 1);
+
+  assert(modbus_convert_fixed(
+           special, 2, special_data, sizeof(special_data), fout) == 4);
+  assert(fout[0] == INT64_MIN && fout[1] == INT64_MIN);
+  assert(fout[2] == INT64_MAX && fout[3] == INT64_MAX);
+
+  assert(modbus_conv_fixed_check(fixed, 9) == 0);
+  assert(modbus_conv_fixed_check(&bad_shift, 1) == -1);
+
+  TEST_SUCCESS();
+}
+
+static size_t master_done_line;
+static int master_done_cnt;
+static int master_timeouts;
+
+static void
+on_master_done(struct modbus_master* m,
+               size_t line,
+               const modbus_parser* parser)
+{
+  master_done_line = line;
+  master_done_cnt++;
+  if (parser == NULL)
+    master_timeouts++;
+  else
+    assert(parser->errno == 0 && parser->slave_addr == 0x11);
+}
+
+void
+test_master(void)
+{
+  static struct modbus_master m;
+  static struct modbus_master_line lines[2];
+  static struct modbus_writeq w;
+  struct modbus_writeq_slot slots[1];
+  struct modbus_poll_point points[2] = {
+    { 0x11, MODBUS_FUNC_READ_HOLD_REG, 0, 2, 1000 },
+    { 0x22, MODBUS_FUNC_READ_IN_REG, 0, 1, 1000 },
+  };
+  struct modbus_poll_request reqs[2];
+  struct modbus_poll_sched sched[2];
+  uint8_t res[] = {
+    0x12, MODBUS_FUNC_READ_WRITE_REGS, 2, 0x00, 0x00, 0x00, 0x00, /* Other */
+    0x11, MODBUS_FUNC_READ_WRITE_REGS, 4, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00
+  };
+  uint8_t coil_res[] = { 0x11, MODBUS_FUNC_WRITE_COIL, 0x00, 0x01,
+                         0xFF, 0x00, 0x00, 0x00 };
+  uint16_t crc;
+  const uint8_t* q;
+  int n;
+
+  TEST_START();
+
+  crc = modbus_calc_crc(res, 5);
+  res[5] = crc & 0xFF;
+  res[6] = crc >> 8;
+  crc = modbus_calc_crc(res + 7, 7);
+  res[14] = crc & 0xFF;
+  res[15] = crc >> 8;
+  ADD_CRC(coil_res);
+
+  assert(modbus_poll_plan(points, 1, 0, &reqs[0], 1) == 1);
+  assert(modbus_poll_plan(points + 1, 1, 0, &reqs[1], 1) == 1);
+  modbus_poll_sched_init(&sched[0], &reqs[0], 1, 0);
+  modbus_poll_sched_init(&sched[1], &reqs[1], 1, 0);
+  modbus_writeq_init(&w, slots, 1);
+
+  modbus_master_init(&m, lines, 2, 100, 5);
+  m.on_done = on_master_done;
+  lines[0].poll = &sched[0];
+  lines[0].writeq = &w;
+  lines[1].poll = &sched[1];
+  assert(modbus_master_timer(&m, 0) == 0);
+
+  /* Write which is not due goes along with the read */
+  assert(modbus_writeq_reg(&w, 0x11, 5, 0x55, 500) == 0);
+  n = modbus_master_tx(&m, 0, 0, &q);
+  assert(n == 15 && q[1] == MODBUS_FUNC_READ_WRITE_REGS);
+  ASSERT_QUERY_CRC(q, n);
+  assert(modbus_master_tx(&m, 0, 0, &q) == 0); /* Busy */
+
+  n = modbus_master_tx(&m, 1, 0, &q);
+  assert(n == 8 && q[0] == 0x22 && q[1] == MODBUS_FUNC_READ_IN_REG);
+
+  /* Response of another slave is dropped, then ours in pieces */
+  assert(modbus_master_rx(&m, 0, res, 10, 1) == 0);
+  assert(master_done_cnt == 0);
+  assert(modbus_master_rx(&m, 0, res + 10, sizeof(res) - 10, 2) == 1);
+  assert(master_done_cnt == 1 && master_done_line == 0);
+  assert(modbus_master_rx(&m, 0, res, sizeof(res), 2) == 0); /* Late */
+
+  /* Line 0 is idle until next period, line 1 waits for response */
+  assert(modbus_master_tx(&m, 0, 2, &q) == 0);
+  assert(modbus_master_timer(&m, 2) == 100);
+  modbus_master_sent(&m, 1, 10);
+  assert(modbus_master_timer(&m, 100) == 110);
+  assert(modbus_master_timer(&m, 110) == 1000);
+  assert(master_done_cnt == 2 && master_done_line == 1);
+  assert(master_timeouts == 1);
+
+  /* Due coil write goes first, the read right after */
+  assert(modbus_writeq_coil(&w, 0x11, 1, true, 1000) == 0);
+  n = modbus_master_tx(&m, 0, 1000, &q);
+  assert(n == 8 && q[1] == MODBUS_FUNC_WRITE_COIL);
+  assert(modbus_master_rx(&m, 0, res + 7, 9, 1001) == 0); /* Not FC 5 */
+  assert(modbus_master_rx(&m, 0, coil_res, sizeof(coil_res), 1001) == 1);
+  assert(modbus_master_timer(&m, 1001) == 1000); /* Line 1 is due */
+  assert(modbus_master_tx(&m, 0, 1005, &q) == 0); /* Gap */
+  n = modbus_master_tx(&m, 0, 1006, &q);
+  assert(n == 8 && q[1] == MODBUS_FUNC_READ_HOLD_REG);
+  ASSERT_QUERY_CRC(q, n);
 
   TEST_SUCCESS();
 }
@@ -652,7 +2994,7 @@ test_gen_write_multiple_reg(void)
 int
 main(void)
 {
-  struct modbus_parser parser;
+  struct modbus_parser parser = { 0 };
   struct modbus_parser_settings settings;
 
   /* Initialization */
@@ -679,7 +3021,21 @@ main(void)
   test_write_multiple_coil(&parser, &settings);
   test_write_multiple_reg(&parser, &settings);
   test_crc_error(&parser, &settings);
+  test_exception(&parser, &settings);
   test_bad_len(&parser, &settings);
+  test_split_data(&parser, &settings);
+#ifdef MODBUS_PARSER_STATS
+  test_stats(&parser, &settings);
+#endif
+#ifdef MODBUS_PARSER_PROFILE
+  test_profile();
+#endif
+  test_ascii_read_hold_reg(&parser, &settings);
+  test_ascii_write_multiple_reg(&parser, &settings);
+  test_ascii_lrc_error(&parser, &settings);
+  test_query(&parser, &settings);
+  test_tcp(&parser, &settings);
+  test_gateway(&parser, &settings);
 
   /* Test generator */
   test_gen_read_coils();
@@ -691,5 +3047,27 @@ main(void)
   test_gen_write_multiple_coil();
   test_gen_write_multiple_coil_2();
   test_gen_write_multiple_reg();
+  test_gen_ascii();
+
+  /* Test helpers */
+  test_frame_len();
+  test_crc_batch();
+  test_replay();
+  test_poll();
+  test_writeq();
+  test_master();
+  test_capture(&parser, &settings);
+  test_archive(&parser, &settings);
+  test_latency(&parser, &settings);
+  test_ring(&parser, &settings);
+  test_queue(&parser, &settings);
+  test_regcache(&parser, &settings);
+  test_slave();
+  test_traffic();
+  test_demux();
+#ifdef MODBUS_BUILD_SHM
+  test_shm();
+#endif
+  test_convert(&parser, &settings);
   return 0;
 }
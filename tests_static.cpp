@@ -0,0 +1,96 @@
+#include "modbus_static.hpp"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_START() printf("<< %s STARTED >>\n", __func__)
+#define TEST_SUCCESS() printf("** %s SUCCESS **\n\n", __func__)
+
+/* Example from Modbus serial line specification, encoded by compiler */
+static constexpr auto read_hold_reg =
+  modbus::read_query(0x11, MODBUS_FUNC_READ_HOLD_REG, 0x006B, 3);
+static_assert(read_hold_reg.size() == 8, "size");
+static_assert(read_hold_reg.bytes[6] == 0x76 && read_hold_reg.bytes[7] == 0x87,
+              "CRC");
+
+static constexpr uint16_t regs[] = { 0x000A, 0x0102 };
+static constexpr bool coils[] = { 1, 0, 1, 1, 0, 0, 1, 1, 1, 0 };
+
+/* Usable from C as extern const uint8_t poll_frame[8] */
+extern "C" const modbus::frame<8> poll_frame =
+  modbus::read_query(0x01, MODBUS_FUNC_READ_COILS, 0x0013, 0x0025);
+
+/* Compare with the runtime generator */
+static void
+check(const uint8_t* frame, size_t len, struct modbus_query q)
+{
+  uint8_t buf[64];
+  int n = modbus_gen_query(&q, buf, sizeof(buf));
+
+  assert(n == (int)len);
+  assert(memcmp(buf, frame, len) == 0);
+}
+
+static void
+test_static_queries(void)
+{
+  uint16_t value = 0x0003;
+  uint16_t data[] = { 0x000A, 0x0102 };
+  uint16_t coil = MODBUS_COIL_HIGH;
+  struct modbus_query q;
+
+  TEST_START();
+
+  modbus_query_init(&q);
+  q.slave_addr = 0x11;
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.addr = 0x006B;
+  q.qty = 3;
+  check(read_hold_reg.bytes, read_hold_reg.size(), q);
+
+  q.slave_addr = 0x01;
+  q.function = MODBUS_FUNC_READ_COILS;
+  q.addr = 0x0013;
+  q.qty = 0x0025;
+  check(poll_frame.bytes, poll_frame.size(), q);
+
+  constexpr auto w = modbus::write_reg_query(0x11, 0x0001, 0x0003);
+  modbus_query_init(&q);
+  q.slave_addr = 0x11;
+  q.function = MODBUS_FUNC_WRITE_REG;
+  q.addr = 0x0001;
+  q.data = &value;
+  q.data_len = 1;
+  check(w.bytes, w.size(), q);
+
+  constexpr auto c = modbus::write_coil_query(0x11, 0x00AC, true);
+  q.function = MODBUS_FUNC_WRITE_COIL;
+  q.addr = 0x00AC;
+  q.data = &coil;
+  check(c.bytes, c.size(), q);
+
+  constexpr auto ws = modbus::write_regs_query(0x11, 0x0001, regs);
+  q.function = MODBUS_FUNC_WRITE_REGS;
+  q.addr = 0x0001;
+  q.qty = 2;
+  q.data = data;
+  q.data_len = 2;
+  check(ws.bytes, ws.size(), q);
+
+  /* Example from Modbus application protocol specification */
+  constexpr auto cs = modbus::write_coils_query(0x11, 0x0013, coils);
+  static_assert(cs.size() == 11, "size");
+  assert(cs.bytes[4] == 0x00 && cs.bytes[5] == 0x0A && cs.bytes[6] == 2);
+  assert(cs.bytes[7] == 0xCD && cs.bytes[8] == 0x01);
+  assert(modbus::crc16(cs.bytes, cs.size()) == 0);
+  assert(modbus_calc_crc(cs.bytes, 9) == modbus::crc16(cs.bytes, 9));
+
+  TEST_SUCCESS();
+}
+
+int
+main(void)
+{
+  test_static_queries();
+  return 0;
+}
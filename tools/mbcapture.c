@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "modbus_capture.h"
+#include "modbus_replay.h"
+
+#define INDEX_CAP 4096
+
+static struct modbus_capture_index_entry index_buf[INDEX_CAP];
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr,
+          "Usage: %s -c [-b baud] raw-dump capture-file\n"
+          "       %s -d [-f from] [-t to] [-s slave] capture-file\n"
+          "\n"
+          "  -c  Convert raw dump of RTU responses to capture file.\n"
+          "      Timestamps (us) are derived from byte offsets at given\n"
+          "      baud rate, 9600 by default.\n"
+          "  -d  Dump frames of capture file in given time range (us)\n"
+          "      and of given slave.\n",
+          prog,
+          prog);
+}
+
+static int
+file_write(void* arg, const void* buf, size_t len)
+{
+  return fwrite(buf, 1, len, arg) == len ? 0 : -1;
+}
+
+static int
+file_read(void* arg, uint64_t offset, void* buf, size_t len)
+{
+  return pread(*(int*)arg, buf, len, offset) == len ? 0 : -1;
+}
+
+static int
+convert(const char* in, const char* out, long baud)
+{
+  struct modbus_capture_writer w;
+  modbus_parser_settings settings;
+  modbus_parser parser = { 0 };
+  const uint8_t* data;
+  struct stat st;
+  size_t pos = 0;
+  FILE* f;
+  int fd;
+  int n;
+
+  fd = open(in, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(in);
+    return 1;
+  }
+
+  data = st.st_size > 0
+           ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+           : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(in);
+    return 1;
+  }
+
+  f = fopen(out, "wb");
+  if (f == NULL) {
+    perror(out);
+    return 1;
+  }
+
+  modbus_parser_settings_init(&settings);
+  modbus_capture_writer_init(&w, file_write, f, index_buf, INDEX_CAP, 256);
+
+  while (pos < st.st_size) {
+    n = modbus_frame_len(MODBUS_RESPONSE, data + pos, st.st_size - pos);
+    if (n < 0) {
+      pos = modbus_replay_sync(data, st.st_size, pos + 1);
+      continue;
+    }
+    if (n == 0 || n > st.st_size - pos)
+      break;
+
+    /* 11 bits per character */
+    modbus_parser_init(&parser, MODBUS_RESPONSE);
+    modbus_capture_execute(
+      &w, &parser, &settings, pos * 11000000ull / baud, data + pos, n);
+    pos += n;
+  }
+
+  if (modbus_capture_writer_close(&w) != 0 || fclose(f) != 0) {
+    perror(out);
+    return 1;
+  }
+
+  if (data != NULL)
+    munmap((void*)data, st.st_size);
+  return 0;
+}
+
+static int
+dump(const char* path, uint64_t from, uint64_t to, int slave)
+{
+  struct modbus_capture_reader r;
+  struct modbus_capture_frame frame;
+  struct stat st;
+  int fd;
+  int rc;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  if (modbus_capture_reader_open(
+        &r, file_read, &fd, st.st_size, index_buf, INDEX_CAP) != 0) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    close(fd);
+    return 1;
+  }
+
+  if (modbus_capture_seek(&r, from, to, slave) != 0) {
+    fprintf(stderr, "%d: not a slave address\n", slave);
+    close(fd);
+    return 1;
+  }
+  while ((rc = modbus_capture_next(&r, &frame)) > 0) {
+    printf("%llu %s",
+           (unsigned long long)frame.ts,
+           frame.tag == MODBUS_CAPTURE_FRAME_CRC_ERROR ? "CRC-ERROR " : "");
+    for (int i = 0; i < frame.len; i++)
+      printf("%02X ", frame.data[i]);
+    printf("\n");
+  }
+
+  close(fd);
+  if (rc < 0) {
+    fprintf(stderr, "%s: corrupted capture file\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  uint64_t from = 0;
+  uint64_t to = UINT64_MAX;
+  long baud = 9600;
+  int slave = -1;
+  int mode = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "cdb:f:t:s:h")) != -1) {
+    switch (opt) {
+      case 'c':
+      case 'd':
+        mode = opt;
+        break;
+      case 'b':
+        baud = atol(optarg);
+        break;
+      case 'f':
+        from = strtoull(optarg, NULL, 0);
+        break;
+      case 't':
+        to = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        slave = atoi(optarg);
+        if (slave < 0 || slave > 255) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (mode == 'c' && optind == argc - 2 && baud > 0)
+    return convert(argv[optind], argv[optind + 1], baud);
+  if (mode == 'd' && optind == argc - 1)
+    return dump(argv[optind], from, to, slave);
+
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modbus_replay.h"
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr, "Usage: %s [-j threads] capture-file\n", prog);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct modbus_replay_stats* stats;
+  struct timespec t0, t1;
+  double elapsed;
+  int nthreads = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:h")) != -1) {
+    switch (opt) {
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  stats = malloc(sizeof(*stats));
+  if (stats == NULL)
+    return 1;
+  modbus_replay_stats_init(stats);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (modbus_replay_file(argv[optind], nthreads, NULL, NULL, stats) != 0) {
+    perror(argv[optind]);
+    free(stats);
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  printf("frames: %llu, bytes: %llu, crc errors: %llu, aborted: %llu, "
+         "skipped: %llu bytes in %llu resyncs\n",
+         (unsigned long long)stats->frames,
+         (unsigned long long)stats->bytes,
+         (unsigned long long)stats->crc_errors,
+         (unsigned long long)stats->aborted,
+         (unsigned long long)stats->skipped,
+         (unsigned long long)stats->resyncs);
+  printf("elapsed: %.3f s, %.1f MB/s\n",
+         elapsed,
+         elapsed > 0 ? (stats->bytes + stats->skipped) / elapsed / 1e6 : 0);
+
+  printf("\nslave   frames        bytes         crc errors\n");
+  for (int i = 0; i < 256; i++) {
+    if (stats->slave[i].frames == 0 && stats->slave[i].crc_errors == 0)
+      continue;
+    printf("%-7d %-13llu %-13llu %llu\n",
+           i,
+           (unsigned long long)stats->slave[i].frames,
+           (unsigned long long)stats->slave[i].bytes,
+           (unsigned long long)stats->slave[i].crc_errors);
+  }
+
+  printf("\nfunction  frames\n");
+  for (int i = 0; i < 256; i++) {
+    if (stats->func[i] == 0)
+      continue;
+    printf("%-9d %llu (%s)\n",
+           i,
+           (unsigned long long)stats->func[i],
+           modbus_func_str(i));
+  }
+
+  free(stats);
+  return 0;
+}
@@ -0,0 +1,660 @@
+/* Modbus TCP server on io_uring, an example of driving the parser from
+ * a completion based event loop.
+ *
+ * Every worker thread has its own ring and listening socket
+ * (SO_REUSEPORT). Connections are accepted with multishot accept and
+ * read with multishot recv into a provided buffer ring, so there is no
+ * receive buffer per connection and no syscall per read. Whole frames
+ * are cut by MBAP length and parsed in place; only a frame split
+ * between two buffers is copied. Responses are appended to the output
+ * buffer of the connection and sent once per batch of completions,
+ * with all sends submitted by the same io_uring_enter that waits for
+ * the next batch.
+ *
+ * Each worker serves its own register image from a slave store
+ * (modbus_slave.h) to every unit id: holding and input registers,
+ * FC 3, 4, 6, 16 and 23.
+ */
+/* Before errno.h, parser has a field of that name */
+#include "modbus.h"
+#include "modbus_slave.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 256
+#define BUF_GROUP 0
+#define BUF_COUNT 512 /* Power of 2 */
+#define BUF_SIZE 4096
+#define MAX_FDS 4096
+#define OUT_SIZE 65536
+#define MBAP_MIN (6 + 2)   /* MBAP header, unit id and function */
+#define MBAP_MAX (6 + 254) /* MBAP header, unit id and PDU */
+
+enum op
+{
+  OP_ACCEPT = 1,
+  OP_RECV,
+  OP_SEND
+};
+
+#define USER_DATA(op, fd) ((uint64_t)(op) << 32 | (uint32_t)(fd))
+
+struct uring
+{
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local; /* Tail of prepared entries */
+  unsigned sq_submitted;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+struct conn
+{
+  int fd;
+  bool receiving; /* Multishot recv is armed */
+  bool sending;
+  bool closing;
+  bool dirty; /* In flush list */
+
+  /* Start of frame which continues in the next buffer */
+  uint8_t carry[MBAP_MAX];
+  size_t carry_len;
+
+  /* One buffer is being sent while responses go to the other */
+  uint8_t out[2][OUT_SIZE];
+  size_t out_len[2];
+  int fill;
+  size_t sent;
+};
+
+struct worker
+{
+  struct uring ring;
+  int listen_fd;
+  struct io_uring_buf_ring* bufs;
+  uint8_t* buf_mem;
+  uint16_t buf_tail;
+  struct conn* conns[MAX_FDS];
+  int flush[MAX_FDS];
+  int nflush;
+  modbus_parser parser;
+  struct modbus_slave slave;
+  struct modbus_slave_store store;
+  uint8_t regs[2][2 * 65536]; /* Holding and input registers */
+};
+
+static const modbus_parser_settings no_callbacks;
+static int port = 1502;
+
+static int
+uring_init(struct uring* u, unsigned entries)
+{
+  struct io_uring_params p;
+  size_t sq_size;
+  size_t cq_size;
+  uint8_t* sq;
+  uint8_t* cq;
+  unsigned* array;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 8;
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0)
+    return -1;
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sq = mmap(NULL,
+            sq_size > cq_size ? sq_size : cq_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            u->fd,
+            IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    return -1;
+  cq = sq;
+
+  u->sqes = mmap(NULL,
+                 p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE,
+                 u->fd,
+                 IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    return -1;
+
+  u->sq_head = (unsigned*)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_local = *u->sq_tail;
+  u->sq_submitted = u->sq_local;
+  u->cq_head = (unsigned*)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  /* Entries are used in order, the index array never changes */
+  array = (unsigned*)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    array[i] = i;
+
+  return 0;
+}
+
+/* Submit prepared entries and wait for at least wait_nr completions */
+static int
+uring_enter(struct uring* u, unsigned wait_nr)
+{
+  unsigned n = u->sq_local - u->sq_submitted;
+  int ret;
+
+  __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+  do {
+    ret = syscall(__NR_io_uring_enter,
+                  u->fd,
+                  n,
+                  wait_nr,
+                  wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                  NULL,
+                  0);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    return -1;
+  u->sq_submitted += ret;
+  return 0;
+}
+
+static struct io_uring_sqe*
+uring_sqe(struct uring* u)
+{
+  struct io_uring_sqe* sqe;
+
+  /* Ring is full, the batch goes out early */
+  while (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+         u->sq_entries) {
+    if (uring_enter(u, 0) < 0) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+  }
+
+  sqe = &u->sqes[u->sq_local++ & u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static int
+bufs_init(struct worker* w)
+{
+  struct io_uring_buf_reg reg;
+
+  w->bufs = mmap(NULL,
+                 BUF_COUNT * sizeof(struct io_uring_buf),
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1,
+                 0);
+  w->buf_mem = malloc(BUF_COUNT * BUF_SIZE);
+  if (w->bufs == MAP_FAILED || w->buf_mem == NULL)
+    return -1;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)w->bufs;
+  reg.ring_entries = BUF_COUNT;
+  reg.bgid = BUF_GROUP;
+  if (syscall(__NR_io_uring_register,
+              w->ring.fd,
+              IORING_REGISTER_PBUF_RING,
+              &reg,
+              1) < 0)
+    return -1;
+
+  w->buf_tail = 0;
+  return 0;
+}
+
+/* Give buffer back to the kernel, published by bufs_publish */
+static void
+buf_return(struct worker* w, uint16_t bid)
+{
+  struct io_uring_buf* b = &w->bufs->bufs[w->buf_tail++ & (BUF_COUNT - 1)];
+
+  b->addr = (uintptr_t)(w->buf_mem + (size_t)bid * BUF_SIZE);
+  b->len = BUF_SIZE;
+  b->bid = bid;
+}
+
+static void
+bufs_publish(struct worker* w)
+{
+  __atomic_store_n(&w->bufs->tail, w->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void
+arm_accept(struct worker* w)
+{
+  struct io_uring_sqe* sqe = uring_sqe(&w->ring);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = w->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = USER_DATA(OP_ACCEPT, w->listen_fd);
+}
+
+static void
+arm_recv(struct worker* w, struct conn* c)
+{
+  struct io_uring_sqe* sqe = uring_sqe(&w->ring);
+
+  c->receiving = true;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  sqe->user_data = USER_DATA(OP_RECV, c->fd);
+}
+
+static void
+arm_send(struct worker* w, struct conn* c, int idx)
+{
+  struct io_uring_sqe* sqe = uring_sqe(&w->ring);
+
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->fd;
+  sqe->addr = (uintptr_t)(c->out[idx] + c->sent);
+  sqe->len = c->out_len[idx] - c->sent;
+  sqe->user_data = USER_DATA(OP_SEND, c->fd);
+}
+
+static void
+conn_free(struct worker* w, struct conn* c)
+{
+  w->conns[c->fd] = NULL;
+  close(c->fd);
+  free(c);
+}
+
+/* Fd is closed only when nothing is in flight, so that completions
+ * never find a new connection which reused it
+ */
+static void
+conn_close(struct worker* w, struct conn* c)
+{
+  if (!c->closing) {
+    c->closing = true;
+    shutdown(c->fd, SHUT_RDWR); /* Terminates multishot recv */
+  }
+  if (!c->sending && !c->receiving)
+    conn_free(w, c);
+}
+
+static void
+mark_dirty(struct worker* w, struct conn* c)
+{
+  if (!c->dirty) {
+    c->dirty = true;
+    w->flush[w->nflush++] = c->fd;
+  }
+}
+
+/* Append response to query of frame to the output of c, frame has at
+ * least MBAP_MIN bytes. Return -1 if frame is broken or output is full.
+ */
+static int
+serve(struct worker* w, struct conn* c, const uint8_t* frame, size_t len)
+{
+  modbus_parser* parser = &w->parser;
+  uint8_t* out = c->out[c->fill] + c->out_len[c->fill];
+  size_t sz = OUT_SIZE - c->out_len[c->fill];
+  int n;
+
+  if (sz < MBAP_MAX)
+    return -1; /* Client doesn't read responses */
+
+  modbus_parser_init_framing(parser, MODBUS_QUERY, MODBUS_FRAMING_TCP);
+  modbus_parser_execute(parser, &no_callbacks, frame, len);
+  n = modbus_slave_reply(&w->slave, parser, out, sz);
+  if (n < 0 && modbus_frame_len(MODBUS_QUERY, frame + 6, 2) == -1)
+    n = modbus_slave_exception(parser, MODBUS_EXC_ILLEGAL_FUNCTION, out, sz);
+  if (n < 0)
+    return -1; /* Parse error, the frame is cut by its MBAP length */
+  c->out_len[c->fill] += n;
+  return 0;
+}
+
+/* Length of TCP frame starting at p, 0 if header is incomplete */
+static size_t
+frame_len(const uint8_t* p, size_t len)
+{
+  return len < 6 ? 0 : 6 + (p[4] << 8 | p[5]);
+}
+
+static int
+conn_input(struct worker* w, struct conn* c, const uint8_t* data, size_t len)
+{
+  size_t need;
+  size_t n;
+
+  /* Finish frame started in the previous buffer */
+  while (c->carry_len > 0 && len > 0) {
+    need = frame_len(c->carry, c->carry_len);
+    if (need == 0)
+      need = 6;
+    else if (need < MBAP_MIN || need > MBAP_MAX)
+      return -1;
+
+    n = need - c->carry_len < len ? need - c->carry_len : len;
+    memcpy(c->carry + c->carry_len, data, n);
+    c->carry_len += n;
+    data += n;
+    len -= n;
+
+    if (frame_len(c->carry, c->carry_len) == c->carry_len) {
+      if (serve(w, c, c->carry, c->carry_len) < 0)
+        return -1;
+      c->carry_len = 0;
+    }
+  }
+
+  /* Whole frames are parsed in place */
+  while (len > 0) {
+    need = frame_len(data, len);
+    if (need != 0 && (need < MBAP_MIN || need > MBAP_MAX))
+      return -1;
+    if (need == 0 || need > len) {
+      memcpy(c->carry, data, len);
+      c->carry_len = len;
+      break;
+    }
+
+    if (serve(w, c, data, need) < 0)
+      return -1;
+    data += need;
+    len -= need;
+  }
+
+  return 0;
+}
+
+static void
+on_accept(struct worker* w, struct io_uring_cqe* cqe)
+{
+  struct conn* c;
+  int one = 1;
+  int fd = cqe->res;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    arm_accept(w);
+  if (fd < 0)
+    return;
+
+  c = fd < MAX_FDS ? calloc(1, sizeof(*c)) : NULL;
+  if (c == NULL) {
+    close(fd);
+    return;
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  c->fd = fd;
+  w->conns[fd] = c;
+  arm_recv(w, c);
+}
+
+static void
+on_recv(struct worker* w, struct conn* c, struct io_uring_cqe* cqe)
+{
+  uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  int ret = 0;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    if (cqe->res > 0 && !c->closing)
+      ret = conn_input(w, c, w->buf_mem + (size_t)bid * BUF_SIZE, cqe->res);
+    buf_return(w, bid);
+  }
+  if (!more)
+    c->receiving = false;
+
+  if (c->closing || ret < 0 || cqe->res == 0 ||
+      (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+    conn_close(w, c);
+    return;
+  }
+
+  if (c->out_len[c->fill] > 0)
+    mark_dirty(w, c);
+  if (!more)
+    arm_recv(w, c); /* Out of buffers, they are back by now */
+}
+
+static void
+on_send(struct worker* w, struct conn* c, struct io_uring_cqe* cqe)
+{
+  int idx = c->fill ^ 1;
+
+  c->sent += cqe->res > 0 ? cqe->res : 0;
+  if (cqe->res > 0 && c->sent < c->out_len[idx] && !c->closing) {
+    arm_send(w, c, idx);
+    return;
+  }
+
+  c->sending = false;
+  c->out_len[idx] = 0;
+  if (cqe->res < 0 || c->closing)
+    conn_close(w, c);
+  else if (c->out_len[c->fill] > 0)
+    mark_dirty(w, c);
+}
+
+/* Send what was collected during the batch, one send per connection */
+static void
+flush(struct worker* w)
+{
+  struct conn* c;
+
+  for (int i = 0; i < w->nflush; i++) {
+    c = w->conns[w->flush[i]];
+    if (c == NULL)
+      continue;
+
+    c->dirty = false;
+    if (c->sending || c->closing || c->out_len[c->fill] == 0)
+      continue;
+
+    c->sending = true;
+    c->sent = 0;
+    c->fill ^= 1;
+    arm_send(w, c, c->fill ^ 1);
+  }
+  w->nflush = 0;
+}
+
+static int
+listen_socket(void)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1024) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void*
+worker_run(void* arg)
+{
+  struct worker* w = arg;
+  struct io_uring_cqe* cqe;
+  struct conn* c;
+  unsigned head;
+  unsigned tail;
+  int fd;
+
+  arm_accept(w);
+
+  for (;;) {
+    if (uring_enter(&w->ring, 1) < 0) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+
+    head = *w->ring.cq_head;
+    tail = __atomic_load_n(w->ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      cqe = &w->ring.cqes[head & w->ring.cq_mask];
+      fd = (uint32_t)cqe->user_data;
+      c = fd < MAX_FDS ? w->conns[fd] : NULL;
+
+      switch (cqe->user_data >> 32) {
+        case OP_ACCEPT:
+          on_accept(w, cqe);
+          break;
+        case OP_RECV:
+          if (c != NULL)
+            on_recv(w, c, cqe);
+          else if (cqe->flags & IORING_CQE_F_BUFFER)
+            buf_return(w, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+          break;
+        case OP_SEND:
+          if (c != NULL)
+            on_send(w, c, cqe);
+          break;
+      }
+    }
+    __atomic_store_n(w->ring.cq_head, head, __ATOMIC_RELEASE);
+
+    bufs_publish(w);
+    flush(w);
+  }
+
+  return NULL;
+}
+
+static struct worker*
+worker_new(void)
+{
+  struct worker* w = calloc(1, sizeof(*w));
+
+  if (w == NULL)
+    return NULL;
+
+  /* Recognizable values, register i holds i */
+  for (uint32_t i = 0; i < 0x10000; i++) {
+    w->regs[0][2 * i] = w->regs[1][2 * i] = i >> 8;
+    w->regs[0][2 * i + 1] = w->regs[1][2 * i + 1] = i & 0xFF;
+  }
+  modbus_slave_store_init(&w->store);
+  modbus_slave_store_table(
+    &w->store, MODBUS_TABLE_HOLD_REG, w->regs[0], 0x10000);
+  modbus_slave_store_table(&w->store, MODBUS_TABLE_IN_REG, w->regs[1], 0x10000);
+  modbus_slave_init(&w->slave);
+  for (int i = 0; i < 256; i++)
+    modbus_slave_attach(&w->slave, i, &w->store);
+
+  w->listen_fd = listen_socket();
+  if (w->listen_fd < 0 || uring_init(&w->ring, RING_ENTRIES) < 0 ||
+      bufs_init(w) < 0)
+    return NULL;
+
+  for (uint16_t i = 0; i < BUF_COUNT; i++)
+    buf_return(w, i);
+  bufs_publish(w);
+
+  return w;
+}
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-p port] [-t threads]\n"
+          "\n"
+          "  Modbus TCP server on 127.0.0.1, port 1502 by default, with\n"
+          "  one io_uring worker per thread.\n",
+          prog);
+}
+
+int
+main(int argc, char** argv)
+{
+  pthread_t threads[64];
+  struct worker* w;
+  int nthreads = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:t:h")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (nthreads < 1 || nthreads > 64) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    w = worker_new();
+    if (w == NULL) {
+      perror("worker");
+      return 1;
+    }
+    pthread_create(&threads[i], NULL, worker_run, w);
+  }
+
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  return 0;
+}
@@ -0,0 +1,242 @@
+/* Load generator for Modbus TCP servers, mbtcpd in particular.
+ *
+ * Keeps a fixed number of pipelined read queries in flight on every
+ * connection and measures round trip of each one by its transaction id.
+ * Responses are parsed with the TCP framing of the parser, so the
+ * client side has the parser in the loop too.
+ */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modbus.h"
+#include "modbus_latency.h"
+
+#define MAX_CONNS 1024
+#define MAX_DEPTH 256 /* Power of 2 */
+
+struct client
+{
+  int fd;
+  modbus_parser parser;
+  uint16_t next_tid;
+  int inflight;
+  uint64_t sent_ts[MAX_DEPTH];
+};
+
+static const modbus_parser_settings no_callbacks;
+static struct client clients[MAX_CONNS];
+static struct modbus_latency_hist hist;
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+connect_to(int port)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+/* Top up queries in flight to depth, with a single write */
+static int
+refill(struct client* c, int depth, uint16_t qty)
+{
+  uint8_t buf[MAX_DEPTH * 12];
+  struct modbus_query q;
+  uint64_t ts = now_ns();
+  size_t len = 0;
+  int n;
+
+  modbus_query_init(&q);
+  q.slave_addr = 1;
+  q.function = MODBUS_FUNC_READ_HOLD_REG;
+  q.qty = qty;
+
+  for (; c->inflight < depth; c->inflight++) {
+    q.addr = c->next_tid * 7 % (0x10000 - qty);
+    n = modbus_gen_query_tcp(&q, c->next_tid, buf + len, sizeof(buf) - len);
+    if (n < 0)
+      return -1;
+    c->sent_ts[c->next_tid % MAX_DEPTH] = ts;
+    c->next_tid++;
+    len += n;
+  }
+
+  if (len > 0 && write(c->fd, buf, len) != len)
+    return -1;
+  return 0;
+}
+
+static int
+on_readable(struct client* c)
+{
+  uint8_t buf[65536];
+  const uint8_t* p = buf;
+  ssize_t len;
+  size_t n;
+
+  len = read(c->fd, buf, sizeof(buf));
+  if (len <= 0)
+    return -1;
+
+  while (len > 0) {
+    n = modbus_parser_execute(&c->parser, &no_callbacks, p, len);
+    p += n;
+    len -= n;
+
+    if (c->parser.errno != 0)
+      return -1;
+    if (c->parser.state != s_complete)
+      break;
+
+    modbus_latency_hist_record(
+      &hist, now_ns() - c->sent_ts[c->parser.transaction_id % MAX_DEPTH]);
+    c->inflight--;
+    modbus_parser_init_framing(&c->parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+  }
+
+  return 0;
+}
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-p port] [-c conns] [-d depth] [-q qty] [-t seconds]\n"
+          "\n"
+          "  Reads qty holding registers (10) over conns connections (1)\n"
+          "  to 127.0.0.1:port (1502), depth queries in flight on each\n"
+          "  (16), for given time (5 s). Prints rate and latency.\n",
+          prog);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct epoll_event ev[64];
+  struct client* c;
+  uint64_t start;
+  uint64_t end;
+  int port = 1502;
+  int nconns = 1;
+  int depth = 16;
+  int qty = 10;
+  int seconds = 5;
+  int epfd;
+  int opt;
+  int n;
+
+  while ((opt = getopt(argc, argv, "p:c:d:q:t:h")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        nconns = atoi(optarg);
+        break;
+      case 'd':
+        depth = atoi(optarg);
+        break;
+      case 'q':
+        qty = atoi(optarg);
+        break;
+      case 't':
+        seconds = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (nconns < 1 || nconns > MAX_CONNS || depth < 1 || depth > MAX_DEPTH ||
+      qty < 1 || qty > MODBUS_MAX_READ_REGS || seconds < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  modbus_latency_hist_init(&hist);
+  epfd = epoll_create1(0);
+
+  for (int i = 0; i < nconns; i++) {
+    c = &clients[i];
+    c->fd = connect_to(port);
+    if (c->fd < 0) {
+      perror("connect");
+      return 1;
+    }
+    modbus_parser_init_framing(&c->parser, MODBUS_RESPONSE, MODBUS_FRAMING_TCP);
+    ev[0].events = EPOLLIN;
+    ev[0].data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev[0]);
+  }
+
+  start = now_ns();
+  end = start + (uint64_t)seconds * 1000000000;
+
+  for (int i = 0; i < nconns; i++) {
+    if (refill(&clients[i], depth, qty) < 0) {
+      perror("write");
+      return 1;
+    }
+  }
+
+  while (now_ns() < end) {
+    n = epoll_wait(epfd, ev, 64, 100);
+    if (n < 0) {
+      perror("epoll_wait");
+      return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      c = ev[i].data.ptr;
+      if (on_readable(c) < 0 || refill(c, depth, qty) < 0) {
+        fprintf(stderr, "connection %d failed\n", (int)(c - clients));
+        return 1;
+      }
+    }
+  }
+
+  end = now_ns();
+  printf("%llu requests in %.2f s: %.0f req/s\n",
+         (unsigned long long)hist.count,
+         (end - start) / 1e9,
+         hist.count / ((end - start) / 1e9));
+  printf("latency us: p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+         modbus_latency_hist_quantile(&hist, 0.5) / 1e3,
+         modbus_latency_hist_quantile(&hist, 0.99) / 1e3,
+         modbus_latency_hist_quantile(&hist, 0.999) / 1e3,
+         hist.max / 1e3);
+
+  return 0;
+}
@@ -0,0 +1,146 @@
+/* Writes a synthetic Modbus traffic corpus, see modbus_traffic.h.
+ *
+ * The same options give the same file, so benchmarks of the parser,
+ * resync and CRC can share a corpus or regenerate it anywhere.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "modbus_traffic.h"
+
+static uint8_t buf[1 << 16];
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-q] [-f rtu|tcp|ascii] [-n frames] [-s seed]\n"
+          "       [-S slaves] [-m qty] [-e %%] [-c %%] [-d %%] [file]\n"
+          "\n"
+          "  Writes frames (100000) to file or stdout: responses, or\n"
+          "  queries with -q, of slaves 1 .. slaves (16) with up to qty\n"
+          "  registers (32). -e, -c and -d give percentage of exception\n"
+          "  responses, frames with CRC error and frames with a dropped\n"
+          "  byte, the last two not in TCP. Prints counts of generated\n"
+          "  frames to stderr.\n",
+          prog);
+}
+
+static int
+parse_framing(const char* s, enum modbus_framing* f)
+{
+  if (strcmp(s, "rtu") == 0)
+    *f = MODBUS_FRAMING_RTU;
+  else if (strcmp(s, "tcp") == 0)
+    *f = MODBUS_FRAMING_TCP;
+  else if (strcmp(s, "ascii") == 0)
+    *f = MODBUS_FRAMING_ASCII;
+  else
+    return -1;
+  return 0;
+}
+
+static uint32_t
+ppm(const char* percent)
+{
+  double p = atof(percent);
+
+  return p <= 0 ? 0 : p >= 100 ? 1000000 : (uint32_t)(p * 10000);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct modbus_traffic_config config;
+  struct modbus_traffic t;
+  long frames = 100000;
+  size_t len = 0;
+  FILE* out = stdout;
+  int opt;
+  int n;
+
+  modbus_traffic_config_init(&config);
+
+  while ((opt = getopt(argc, argv, "qf:n:s:S:m:e:c:d:h")) != -1) {
+    switch (opt) {
+      case 'q':
+        config.type = MODBUS_QUERY;
+        break;
+      case 'f':
+        if (parse_framing(optarg, &config.framing) != 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'n':
+        frames = atol(optarg);
+        break;
+      case 's':
+        config.seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'S':
+        config.nslaves = atoi(optarg);
+        break;
+      case 'm':
+        config.max_qty = atoi(optarg);
+        break;
+      case 'e':
+        config.exception_ppm = ppm(optarg);
+        break;
+      case 'c':
+        config.crc_error_ppm = ppm(optarg);
+        break;
+      case 'd':
+        config.drop_ppm = ppm(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind < argc - 1 || frames < 0 ||
+      modbus_traffic_init(&t, &config) != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (optind == argc - 1) {
+    out = fopen(argv[optind], "wb");
+    if (out == NULL) {
+      perror(argv[optind]);
+      return 1;
+    }
+  }
+
+  for (long i = 0; i < frames; i++) {
+    n = modbus_traffic_next(&t, buf + len, sizeof(buf) - len);
+    if (n < 0) {
+      if (fwrite(buf, 1, len, out) != len)
+        break;
+      len = 0;
+      i--;
+      continue;
+    }
+    len += n;
+  }
+
+  if (fwrite(buf, 1, len, out) != len || fflush(out) != 0) {
+    perror("write");
+    return 1;
+  }
+  if (out != stdout)
+    fclose(out);
+
+  fprintf(stderr,
+          "%llu frames, %llu bytes, %llu exceptions, %llu CRC errors, "
+          "%llu drops\n",
+          (unsigned long long)t.frames,
+          (unsigned long long)t.bytes,
+          (unsigned long long)t.exceptions,
+          (unsigned long long)t.crc_errors,
+          (unsigned long long)t.drops);
+  return 0;
+}